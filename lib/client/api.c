@@ -108,7 +108,10 @@
 #include "client.h"
 #include "buffered_writer.h"
 
-static void omlc_ms_process(OmlMStream* ms);
+static void omlc_ms_process(OmlMStream* ms, const struct timeval* tv);
+static int omlc_ms_input_batch(OmlMStream* ms, OmlValueU* rows, int nrows, const struct timeval* tv);
+static void omlc_instr_check(OmlMP* mp);
+static void omlc_release_borrowed(OmlMP* mp, OmlValueU* values, int nrows);
 static int omlc_inject_client_instr(uint32_t measurements_injected, uint32_t measurements_dropped, uint64_t bytes_allocated, uint64_t bytes_freed, uint64_t bytes_in_use, uint64_t bytes_max);
 
 extern OmlMP* schema0;
@@ -138,22 +141,42 @@ omlc_process(OmlMP *mp, OmlValueU *values)
  * be output on that MS.
  *
  * The content of values is deep-copied into the MSs' storage, so values can be
- * directly freed/reused when inject returns.
+ * directly freed/reused when inject returns. Filters are handed views of the
+ * values, and only copy what they need to keep.
  *
  * This function might call omlc_inject_client_instr which in turns calls
  * omlc_inject. We make sure not to loop.
  *
- * \see omlc_add_mp, omlc_ms_process, oml_value_set, omlc_inject_client_instr
+ * MSs with per-thread staging enabled have the sample input into filters
+ * private to the calling thread, without locking the MP. The MP lock is only
+ * taken if an MS without staging needs the sample, or when a new sample has to
+ * be output. The count of samples on such MSs is only approximate, as a
+ * concurrent injection might be accounted in the next window.
+ *
+ * MSs which report every sample unfiltered (e.g., the default MS with no
+ * --oml-samples nor --oml-interval) have the values serialised directly from
+ * the values array, without copying them into their filters.
+ *
+ * Blobs and vectors lent with omlc_set_blob_borrowed or
+ * omlc_set_vector_borrowed are never copied. The reference held by values is
+ * dropped, and the values reset, before returning, even on error; the data
+ * is released then, unless filters or writers still refer to it.
+ *
+ * \see omlc_add_mp, omlc_ms_process, oml_value_set_view, omlc_inject_client_instr
+ * \see ms_staging_inject, filter_passthrough, omlc_release_borrowed
  */
 int
 omlc_inject(OmlMP *mp, OmlValueU *values)
 {
   OmlMStream* ms;
   OmlValue v;
-  int i;
+  int locked = 0;
 
   if (NULL == omlc_instance || omlc_instance->start_time <= 0) {
     logerror("Cannot inject samples prior to calling omlc_init and omlc_start\n");
+    if (mp && values) {
+      omlc_release_borrowed(mp, values, 1);
+    }
     return -1;
   }
   if (mp == NULL || values == NULL) {
@@ -163,46 +186,210 @@ omlc_inject(OmlMP *mp, OmlValueU *values)
   LOGDEBUG("Injecting data into MP '%s'\n", mp->name);
 
   oml_value_init(&v);
-  if (mp_lock(mp) == -1) {
-    logwarn("Cannot lock MP '%s' for injection\n", mp->name);
-    return -1;
-  }
 
-  uint64_t written = 0;
-  uint64_t dropped = 0;
   for (ms = mp->streams; ms; ms = ms->next) {
+    int staged = ms->staging && !ms_staging_inject(ms, values, &v);
+    if (staged) {
+      if (ms->sample_thres <= 0 ||
+          __sync_add_and_fetch(&ms->sample_size, 1) < ms->sample_thres) {
+        continue;
+      }
+    }
+
+    if (!locked) {
+      if (mp_lock(mp) == -1) {
+        logwarn("Cannot lock MP '%s' for injection\n", mp->name);
+        oml_value_reset(&v);
+        omlc_release_borrowed(mp, values, 1);
+        return -1;
+      }
+      locked = 1;
+    }
+
+    if (ms->passthrough) {
+      filter_passthrough(ms, values, NULL);
+      continue;
+    }
+
+    if (staged) {
+      /* Another thread might have output the sample while we were waiting */
+      if (ms->sample_size >= ms->sample_thres) {
+        LOGDEBUG("Generating new sample for MS '%s'\n", ms->table_name);
+        filter_process(ms);
+      }
+      continue;
+    }
+
     LOGDEBUG("Filtering MP '%s' data into MS '%s'\n", mp->name, ms->table_name);
     OmlFilter* f = ms->filters;
     for (; f != NULL; f = f->next) {
 
       /* FIXME:  Should validate this indexing */
-      oml_value_set(&v, &values[f->index], mp->param_defs[f->index].param_types);
+      /* Filters only read their input, and copy what they keep */
+      oml_value_set_view(&v, &values[f->index], mp->param_defs[f->index].param_types);
 
       f->input(f, &v);
     }
-    omlc_ms_process(ms);
-    written += ms->written;
-    dropped += ms->dropped;
-    for (i=0; i<ms->nwriters; i++) {
-      dropped += bw_nlost_reset(ms->writers[i]->bufferedWriter);
-    }
+    omlc_ms_process(ms, NULL);
+  }
+  if (locked) {
+    mp_unlock(mp);
   }
-  mp_unlock(mp);
   oml_value_reset(&v);
+  omlc_release_borrowed(mp, values, 1);
 
-  /* do we need to send client instrumentation? */
-  if(mp != omlc_instance->client_instr && omlc_instance->instr_interval) {
-    time_t now;
-    time(&now);
-    if(omlc_instance->instr_time + omlc_instance->instr_interval <= now) {
-      omlc_instance->instr_time = now; /* Make sure we don't loop */
-      omlc_inject_client_instr(written, dropped, xmemnew(), xmemfreed(), xmembytes(), xmaxbytes());
+  omlc_instr_check(mp);
+
+  return 0;
+}
+
+/** Find the next BufferedWriter of an MS, in increasing order of addresses.
+ *
+ * Iterating over the writers of MSs in this fixed global order, rather than
+ * that of each MS, makes sure batches lock shared writers in the same order.
+ *
+ * \param ms OmlMStream whose writers to iterate over
+ * \param prev BufferedWriter returned by the previous call, or NULL to start
+ * \return the BufferedWriter of ms with the lowest address above prev, or NULL if none is left
+ * \see omlc_inject_batch, bw_batch_begin
+ */
+static BufferedWriter*
+ms_next_writer(OmlMStream *ms, BufferedWriter *prev)
+{
+  BufferedWriter *bw, *next = NULL;
+  int i;
+
+  for (i = 0; i < ms->nwriters; i++) {
+    if (ms->writers[i] && (bw = ms->writers[i]->bufferedWriter) &&
+        (uintptr_t)bw > (uintptr_t)prev &&
+        (!next || (uintptr_t)bw < (uintptr_t)next)) {
+      next = bw;
+    }
+  }
+
+  return next;
+}
+
+/** Inject a batch of measurement samples into a Measurement Point.
+ *
+ * \param mp pointer to OmlMP into which the new samples are being injected
+ * \param rows an array of nrows * mp->param_count OmlValueU, one sample after the other
+ * \param nrows number of samples in rows
+ * \return 0 on success, <0 otherwise
+ *
+ * This is equivalent to calling omlc_inject for each sample in turn, but the
+ * MP lock is only taken once, the time is only read once, and the samples
+ * output by each MS on each of its writers are serialised under a single
+ * bw_get_write_buf. All output samples are therefore timestamped with the
+ * same time.
+ *
+ * The writers are only held for the output of one MS at a time, and are
+ * taken in increasing order of their addresses, so threads batching into MSs
+ * which share writers cannot deadlock.
+ *
+ * If all the filters of an MS can process batches of samples, the whole
+ * batch is given to them at once, up to the MS's sample threshold.
+ *
+ * Lent blobs and vectors are handled as in omlc_inject.
+ *
+ * \see omlc_inject, bw_batch_begin, ms_next_writer, filter_process_at, omlc_ms_input_batch
+ */
+int
+omlc_inject_batch(OmlMP *mp, OmlValueU *rows, int nrows)
+{
+  OmlMStream* ms;
+  OmlFilter* f;
+  OmlValueU* values;
+  OmlValue v;
+  BufferedWriter* bw;
+  struct timeval tv;
+  int r;
+
+  if (NULL == omlc_instance || omlc_instance->start_time <= 0) {
+    logerror("Cannot inject samples prior to calling omlc_init and omlc_start\n");
+    if (mp && rows && nrows > 0) {
+      omlc_release_borrowed(mp, rows, nrows);
+    }
+    return -1;
+  }
+  if (mp == NULL || rows == NULL || nrows < 0) {
+    return -1;
+  }
+
+  LOGDEBUG("Injecting %d samples into MP '%s'\n", nrows, mp->name);
+
+  oml_value_init(&v);
+  if (mp_lock(mp) == -1) {
+    logwarn("Cannot lock MP '%s' for injection\n", mp->name);
+    omlc_release_borrowed(mp, rows, nrows);
+    return -1;
+  }
+  gettimeofday(&tv, NULL);
+
+  for (ms = mp->streams; ms; ms = ms->next) {
+    LOGDEBUG("Filtering MP '%s' data into MS '%s'\n", mp->name, ms->table_name);
+    for (bw = ms_next_writer(ms, NULL); bw; bw = ms_next_writer(ms, bw)) {
+      bw_batch_begin(bw);
+    }
+
+    if (ms->passthrough) {
+      for (r = 0, values = rows; r < nrows; r++, values += mp->param_count) {
+        filter_passthrough(ms, values, &tv);
+      }
+    } else if (omlc_ms_input_batch(ms, rows, nrows, &tv)) {
+      for (r = 0, values = rows; r < nrows; r++, values += mp->param_count) {
+        for (f = ms->filters; f != NULL; f = f->next) {
+          oml_value_set_view(&v, &values[f->index], mp->param_defs[f->index].param_types);
+          f->input(f, &v);
+        }
+        omlc_ms_process(ms, &tv);
+      }
+    }
+
+    for (bw = ms_next_writer(ms, NULL); bw; bw = ms_next_writer(ms, bw)) {
+      bw_batch_end(bw);
     }
   }
 
+  mp_unlock(mp);
+  oml_value_reset(&v);
+  omlc_release_borrowed(mp, rows, nrows);
+
+  omlc_instr_check(mp);
+
   return 0;
 }
 
+/** Drop the references held by injected values on data lent by the application.
+ *
+ * The blobs and vectors holding such a reference are reset; other values are
+ * left untouched.
+ *
+ * \param mp OmlMP the values were injected into
+ * \param values array of nrows * mp->param_count OmlValueU
+ * \param nrows number of samples in values
+ * \see omlc_set_blob_borrowed, omlc_set_vector_borrowed, oml_value_ref_release
+ */
+static void
+omlc_release_borrowed(OmlMP* mp, OmlValueU* values, int nrows)
+{
+  int i, n = nrows * mp->param_count;
+
+  for (i = 0; i < n; i++) {
+    OmlValueT type = mp->param_defs[i % mp->param_count].param_types;
+
+    if (type == OML_BLOB_VALUE) {
+      if (omlc_get_blob_ref(values[i])) {
+        omlc_reset_blob(values[i]);
+      }
+    } else if (omlc_is_vector_type(type)) {
+      if (omlc_get_vector_ref(values[i])) {
+        omlc_reset_vector(values[i]);
+      }
+    }
+  }
+}
+
 /** Inject metadata (key/value) for a specific MP.
  *
  * \param mp pointer to the OmlMP to which the metadata relates
@@ -299,6 +486,93 @@ omlc_inject_client_instr(uint32_t measurements_injected, uint32_t measurements_d
   return omlc_inject(omlc_instance->client_instr, values);
 }
 
+/** Send client instrumentation, if it is due.
+ *
+ * \param mp pointer to the OmlMP into which samples have just been injected
+ * \see omlc_inject_client_instr
+ */
+static void
+omlc_instr_check(OmlMP *mp)
+{
+  OmlMStream* ms;
+  int i;
+  uint64_t written = 0;
+  uint64_t dropped = 0;
+
+  for (ms = mp->streams; ms; ms = ms->next) {
+    written += ms->written;
+    dropped += ms->dropped;
+    for (i=0; i<ms->nwriters; i++) {
+      dropped += bw_nlost_reset(ms->writers[i]->bufferedWriter);
+    }
+  }
+
+  /* do we need to send client instrumentation? */
+  if(mp != omlc_instance->client_instr && omlc_instance->instr_interval) {
+    time_t now;
+    time(&now);
+    if(omlc_instance->instr_time + omlc_instance->instr_interval <= now) {
+      omlc_instance->instr_time = now; /* Make sure we don't loop */
+      omlc_inject_client_instr(written, dropped, xmemnew(), xmemfreed(), xmembytes(), xmaxbytes());
+    }
+  }
+}
+
+/** Input a batch of samples into filters which can process them at once.
+ *
+ * The batch is split at the MS's sample threshold, so the filters output a new
+ * sample after the same number of inputs as with omlc_ms_process.
+ *
+ * A lock for the MP containing that MS must be held before calling this function.
+ *
+ * \param ms pointer to the OmlMStream to input samples into
+ * \param rows an array of nrows * ms->mp->param_count OmlValueU, as passed to omlc_inject_batch
+ * \param nrows number of samples in rows
+ * \param tv time to timestamp new samples with
+ * \return 0 on success, -1 if some filters of the MS cannot process batches
+ * \see omlc_inject_batch, oml_filter_input_batch
+ */
+static int
+omlc_ms_input_batch(OmlMStream *ms, OmlValueU* rows, int nrows, const struct timeval* tv)
+{
+  OmlFilter* f;
+  int stride = ms->mp->param_count;
+  int r, n, room, sample_size;
+
+  for (f = ms->filters; f != NULL; f = f->next) {
+    if (!f->input_batch) {
+      return -1;
+    }
+  }
+
+  for (r = 0; r < nrows; r += n) {
+    n = nrows - r;
+    if (ms->sample_thres > 0) {
+      room = ms->sample_thres - ms->sample_size;
+      if (room < 1) { room = 1; }
+      if (n > room) { n = room; }
+    }
+
+    for (f = ms->filters; f != NULL; f = f->next) {
+      f->input_batch(f, &rows[r * stride + f->index], n, stride);
+    }
+
+    if (ms->sample_thres > 0) {
+      if (ms->staging) {
+        sample_size = __sync_add_and_fetch(&ms->sample_size, n);
+      } else {
+        sample_size = (ms->sample_size += n);
+      }
+      if (sample_size >= ms->sample_thres) {
+        LOGDEBUG("Generating new sample for MS '%s'\n", ms->table_name);
+        filter_process_at(ms, tv);
+      }
+    }
+  }
+
+  return 0;
+}
+
 /** Called when the particular MS has been filled.
  *
  * Determine whether a new sample must be issued (in per-sample reporting), and
@@ -307,17 +581,31 @@ omlc_inject_client_instr(uint32_t measurements_injected, uint32_t measurements_d
  * A lock for the MP containing that MS must be held before calling this function.
  *
  * \param ms pointer to the OmlMStream to process
- * \see filter_process
+ * \param tv time to timestamp the new sample with, or NULL to use the current time
+ * \see filter_process, filter_process_at
  */
 static void
-omlc_ms_process(OmlMStream *ms)
+omlc_ms_process(OmlMStream *ms, const struct timeval* tv)
 {
-  if (ms == NULL) return;
+  int sample_size;
+
+  if (ms == NULL || ms->sample_thres <= 0) return;
 
-  if (ms->sample_thres > 0 && ++ms->sample_size >= ms->sample_thres) {
+  if (ms->staging) {
+    /* Threads staging samples update the count without the MP lock */
+    sample_size = __sync_add_and_fetch(&ms->sample_size, 1);
+  } else {
+    sample_size = ++ms->sample_size;
+  }
+
+  if (sample_size >= ms->sample_thres) {
     LOGDEBUG("Generating new sample for MS '%s'\n", ms->table_name);
     // sample based filters fire
-    filter_process(ms);
+    if (tv) {
+      filter_process_at(ms, tv);
+    } else {
+      filter_process(ms);
+    }
   }
 
 }
@@ -9,12 +9,27 @@
  */
 /** \file bin_writer.c
  * \brief An implementation of the OmlWriter interface functions (see oml2/oml_writer.h) that writes messages using the OML binary protocol \ref omspbin.
+ *
+ * Samples are sent as compact messages (\ref omspbincompact), without type
+ * information, as the server knows the schemas from the headers.
+ *
+ * With --oml-block-rows, samples of each stream (but schema 0) are instead
+ * accumulated, and sent in block messages (\ref omspbinblock), when enough of
+ * them have been gathered, or when the writer is closed.
+ *
+ * With --oml-dict-size, the strings of samples (but those of schema 0) are
+ * sent in full only once per connection, and by identifier afterwards (\ref
+ * omspbindict). Their definitions are kept with the headers, to be replayed
+ * when reconnecting. The dictionary is forgotten when some queued data is
+ * dropped, as it may have contained definitions. It is not used over UDP, nor
+ * with the ring queue, where samples can be lost or reordered.
  */
 
 #include <stdlib.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "oml2/omlc.h"
 #include "oml2/oml_writer.h"
@@ -24,8 +39,31 @@
 #include "client.h"
 #include "marshal.h"
 #include "mbuf.h"
+#include "mem.h"
+#include "oml_value.h"
+#include "oml_utils.h"
 #include "buffered_writer.h"
 
+/** Samples of a stream waiting to be sent in a single block message
+ * \see marshal_block
+ */
+typedef struct OmlBinBlock {
+  /** Index of the stream */
+  int stream;
+  /** Number of samples in the block */
+  int nrows;
+  /** Number of values in each sample */
+  int nfields;
+  /** Number of OmlValue allocated in values */
+  int capacity;
+  /** Values of the samples, one after the other */
+  OmlValue* values;
+  /** Sequence numbers of the samples */
+  int32_t* seqnos;
+  /** Timestamps of the samples */
+  double* timestamps;
+} OmlBinBlock;
+
 /** An OmlWriter using the binary marshalling functions \ref omspbin */
 typedef struct OmlBinWriter {
 
@@ -49,14 +87,17 @@ typedef struct OmlBinWriter {
   OmlWriter* next;
   /** \see OmlWriter::bufferedWriter */
   BufferedWriter* bufferedWriter;
+  /** \see OmlWriter::row_encode */
+  oml_writer_row_encode row_encode;
+  /** \see OmlWriter::row_push */
+  oml_writer_row_push row_push;
+  /** \see OmlWriter::protocol */
+  int protocol;
 
   /*
    * Fields specific to the OmlBinWriter
    */
 
-  /** Currently active MBuffer of the bufferedWriter chain */
-  MBuffer* mbuf;
-
   /** This used to be an 'OmlOutStream' pointer, kept like this not to risk breaking ABIs */
   void* unused;
 
@@ -66,6 +107,29 @@ typedef struct OmlBinWriter {
   /* Type of messages to generate */
   OmlBinMsgType msgtype;
 
+  /** Maximal number of samples in block messages, or 0 to send samples one by one */
+  int block_rows;
+  /** Type of block messages to generate */
+  OmlBinMsgType block_msgtype;
+  /** Blocks of samples being accumulated, by stream index */
+  OmlBinBlock** blocks;
+  /** Length of blocks */
+  int nblocks;
+  /** Block of the sample being output, between owb_row_start and owb_row_end */
+  OmlBinBlock* current;
+
+  /** Dictionary of the strings sent on the connection, or NULL to send strings in full */
+  OmlStringDict* dict;
+  /** Type of dictionary messages to generate */
+  OmlBinMsgType dict_msgtype;
+  /** MBuffer to marshal the definitions of new strings into, before adding them to the headers */
+  MBuffer* dict_buf;
+  /** Number of drops of the BufferedWriter when the dictionary was last checked */
+  int dict_drops;
+
+  /** Lock protecting the blocks and the dictionary, held between owb_row_start and owb_row_end */
+  pthread_mutex_t lock;
+
 } OmlBinWriter;
 
 static int owb_meta(OmlWriter* writer, char* str);
@@ -74,6 +138,14 @@ static int owb_header_done(OmlWriter* writer);
 static int owb_row_start(OmlWriter* writer, OmlMStream* ms, double now);
 static int owb_row_cols(OmlWriter* writer, OmlValue* values, int value_count);
 static int owb_row_end(OmlWriter* writer, OmlMStream* ms);
+static int owb_row_encode(OmlWriter* writer, MBuffer* mbuf, OmlMStream* ms, double now, OmlValue* values, int value_count);
+static int owb_row_push(OmlWriter* writer, OmlMStream* ms, MBuffer* mbuf);
+static void owb_row_commit(OmlBinWriter* self, OmlMStream* ms, MBuffer* mbuf);
+static OmlBinBlock* owb_block_get(OmlBinWriter* self, int stream);
+static int owb_block_add(OmlBinWriter* self, OmlBinBlock* block, OmlValue* values, int value_count);
+static int owb_block_flush(OmlBinWriter* self, OmlBinBlock* block, MBuffer* mbuf);
+static void owb_blocks_close(OmlBinWriter* self);
+static void owb_dict_commit(OmlBinWriter* self);
 
 static OmlWriter *owb_close(OmlWriter* writer);
 
@@ -86,23 +158,77 @@ static OmlWriter *owb_close(OmlWriter* writer);
  */
 OmlWriter*
 bin_writer_new(OmlOutStream* out_stream)
+{
+  return bin_writer_new2(out_stream, BE_Default);
+}
+
+/** Create a new OmlBinWriter using a specific queueing engine
+ * \param out_stream OmlOutStream into which the data should be written
+ * \param engine BufferEngine to queue data with
+ *
+ * \return a pointer to the new OmlBinWriter cast as an OmlWriter
+ *
+ * \see BufferedWriter, bw_create2
+ */
+OmlWriter*
+bin_writer_new2(OmlOutStream* out_stream, enum BufferEngine engine)
 {
   assert(out_stream != NULL);
 
   OmlBinWriter* self = (OmlBinWriter *)oml_malloc(sizeof(OmlBinWriter));
   memset(self, 0, sizeof(OmlBinWriter));
 
-  self->bufferedWriter = bw_create(out_stream,
-      omlc_instance->max_queue, 0);
+  self->bufferedWriter = bw_create2(out_stream,
+      omlc_instance->max_queue, 0, engine);
+  if (self->bufferedWriter && omlc_instance->spill_dir) {
+    bw_spill_enable(self->bufferedWriter, omlc_instance->spill_dir);
+  }
 
   self->meta = owb_meta;
   self->header_done = owb_header_done;
   self->row_start = owb_row_start;
   self->row_end = owb_row_end;
   self->out = owb_row_cols;
+  self->row_encode = owb_row_encode;
+  self->row_push = owb_row_push;
   self->close = owb_close;
 
-  self->msgtype = OMB_DATA_P; // Short packets.
+  self->msgtype = OMB_CDATA_P; // Short compact packets.
+  self->protocol = OMB_COMPACT_PROTOCOL_VERSION;
+
+  if (omlc_instance->block_rows > 1) {
+    /* Blocks are built across owb_row_start, owb_row_cols and owb_row_end */
+    self->row_encode = NULL;
+    self->row_push = NULL;
+    self->block_rows = omlc_instance->block_rows;
+    self->block_msgtype = OMB_BLOCK_P;
+    self->protocol = OMB_BLOCK_PROTOCOL_VERSION;
+  }
+
+  if (omlc_instance->dict_size > 0) {
+    if (BE_Ring == engine || OML_URI_UDP == oml_uri_type(out_stream->dest)) {
+      logwarn("%s: Not using a string dictionary with this queue or transport, sending strings in full\n",
+          out_stream->dest);
+
+    } else if ((self->dict = string_dict_new(omlc_instance->dict_size)) &&
+        (self->dict_buf = mbuf_create())) {
+      /* The encoding of samples depends on the dictionary of this writer */
+      self->row_encode = NULL;
+      self->row_push = NULL;
+      self->dict_msgtype = OMB_DDATA_P;
+      self->protocol = OMB_DICT_PROTOCOL_VERSION;
+      self->dict_drops = self->bufferedWriter ? bw_ndrops(self->bufferedWriter) : 0;
+
+    } else {
+      logwarn("%s: Could not create string dictionary, sending strings in full\n", out_stream->dest);
+      string_dict_destroy(self->dict);
+      self->dict = NULL;
+    }
+  }
+
+  if (self->block_rows > 1 || self->dict) {
+    pthread_mutex_init(&self->lock, NULL);
+  }
 
   return (OmlWriter*)self;
 }
@@ -139,19 +265,32 @@ owb_header_done(OmlWriter* writer)
 
 /** Function called for every result value in a measurement tuple (sample)
  * \see oml_writer_out
- * \see marshal_values
+ * \see marshal_values_compact, owb_block_add
  */
 static int
 owb_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
 {
   OmlBinWriter* self = (OmlBinWriter*)writer;
   MBuffer* mbuf;
-  if ((mbuf = self->mbuf) == NULL) {
+  if ((mbuf = bw_current_write_buf(self->bufferedWriter)) == NULL) {
     return 0; /* previous use of mbuf failed */
   }
 
-  int cnt = marshal_values(mbuf, values, value_count);
-  return cnt == value_count;
+  if (self->current) {
+    return owb_block_add(self, self->current, values, value_count) == 0;
+  }
+
+  if (self->dict && marshal_msgtype_is_dict(marshal_get_msgtype(mbuf))) {
+    if (marshal_values_dict(mbuf, values, value_count, self->dict) != 1) {
+      /* Definitions of new strings may have been lost with the message */
+      string_dict_forget(self->dict);
+      return 0;
+    }
+    return 1;
+  }
+
+  int cnt = marshal_values_compact(mbuf, values, value_count);
+  return cnt == 1;
 }
 
 /** Function called after all items in a tuple have been sent
@@ -162,6 +301,10 @@ owb_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
  *
  * This acquires a lock on the BufferedWriter MBuffer via bw_get_write_buf()
  *
+ * When samples are sent in blocks, or with a dictionary, this also acquires
+ * the lock on them. In the former case, unless for schema 0, only the sequence
+ * number and timestamp of the sample are recorded in the block of its stream.
+ *
  * \see BufferedWriter, bw_get_write_buf, marshal_init, marshal_measurements
  * \see gettimeofday(3)
  */
@@ -169,14 +312,45 @@ static int
 owb_row_start(OmlWriter* writer, OmlMStream* ms, double now)
 {
   OmlBinWriter* self = (OmlBinWriter*)writer;
+  OmlBinBlock* block;
+  int drops;
   assert(self->bufferedWriter != NULL);
 
   MBuffer* mbuf;
-  if ((mbuf = self->mbuf = bw_get_write_buf(self->bufferedWriter)) == NULL) {
+  if ((mbuf = bw_get_write_buf(self->bufferedWriter)) == NULL) {
     return 0;
   }
 
-  marshal_init (mbuf, self->msgtype);
+  if (self->block_rows > 1 || self->dict) {
+    /* Always taken after the MBuffer, which is held across samples in batches */
+    oml_lock(&self->lock, __FUNCTION__);
+    self->current = NULL;
+  }
+
+  if (self->block_rows > 1 && ms->index > 0) {
+    if (!(block = owb_block_get(self, ms->index))) {
+      oml_unlock(&self->lock, __FUNCTION__);
+      bw_release_write_buf(self->bufferedWriter);
+      return 0;
+    }
+    block->seqnos[block->nrows] = ms->seq_no;
+    block->timestamps[block->nrows] = now;
+    self->current = block;
+    return 1;
+  }
+
+  if (self->dict && ms->index > 0) {
+    drops = bw_ndrops(self->bufferedWriter);
+    if (drops != self->dict_drops) {
+      logdebug("Queued data was dropped, defining the strings of the dictionary again\n");
+      string_dict_forget(self->dict);
+      self->dict_drops = drops;
+    }
+    marshal_init (mbuf, self->dict_msgtype);
+
+  } else {
+    marshal_init (mbuf, self->msgtype);
+  }
   marshal_measurements(mbuf, ms->index, ms->seq_no, now);
   return 1;
 }
@@ -184,22 +358,112 @@ owb_row_start(OmlWriter* writer, OmlMStream* ms, double now)
 /** Function called after all items in a tuple have been sent
  * \see oml_writer_row_end
  *
- * This releases the lock on the BufferedWriter MBuffer.
+ * This releases the lock on the BufferedWriter MBuffer, and that on the
+ * blocks and dictionary, if any. Blocks which are full are sent, and the
+ * definitions of new strings are added to the headers.
  *
- * \see BufferedWriter, bw_release_write_buf, marshal_finalize
+ * \see BufferedWriter, bw_release_write_buf, marshal_finalize, owb_block_flush, owb_dict_commit
  */
 static int
 owb_row_end(OmlWriter* writer, OmlMStream* ms) {
   (void)ms;
   OmlBinWriter* self = (OmlBinWriter*)writer;
+  OmlBinBlock* block;
+  int res = 1;
   MBuffer* mbuf;
-  if ((mbuf = self->mbuf) == NULL) {
+  if ((mbuf = bw_current_write_buf(self->bufferedWriter)) == NULL) {
+    bw_release_write_buf(self->bufferedWriter);
     return 0; /* previous use of mbuf failed */
   }
 
-  marshal_finalize(self->mbuf);
-  if (marshal_get_msgtype (self->mbuf) == OMB_LDATA_P) {
-    self->msgtype = OMB_LDATA_P; // Generate long packets from now on.
+  if (self->block_rows > 1 && (block = self->current)) {
+    self->current = NULL;
+    if (block->nrows >= self->block_rows) {
+      res = owb_block_flush(self, block, mbuf);
+    }
+    oml_unlock(&self->lock, __FUNCTION__);
+    bw_release_write_buf(self->bufferedWriter);
+    return res;
+  }
+
+  marshal_finalize(mbuf);
+  owb_row_commit(self, ms, mbuf);
+
+  if (self->dict && ms->index > 0) {
+    owb_dict_commit(self);
+  }
+  if (self->block_rows > 1 || self->dict) {
+    oml_unlock(&self->lock, __FUNCTION__);
+  }
+
+  bw_msgcount_add(self->bufferedWriter, 1);
+  bw_release_write_buf(self->bufferedWriter);
+  return 1;
+}
+
+/** Function called to serialise a complete sample into an MBuffer
+ * \see oml_writer_row_encode
+ */
+static int
+owb_row_encode(OmlWriter* writer, MBuffer* mbuf, OmlMStream* ms, double now, OmlValue* values, int value_count)
+{
+  OmlBinWriter* self = (OmlBinWriter*)writer;
+
+  if (marshal_init (mbuf, self->msgtype) ||
+      marshal_measurements(mbuf, ms->index, ms->seq_no, now) != 1 ||
+      marshal_values_compact(mbuf, values, value_count) != 1) {
+    mbuf_reset_write(mbuf);
+    return 0;
+  }
+
+  marshal_finalize(mbuf);
+  if (marshal_get_msgtype (mbuf) == OMB_LCDATA_P) {
+    self->msgtype = OMB_LCDATA_P; // Generate long packets from now on.
+  }
+  return 1;
+}
+
+/** Function called to output a sample serialised by owb_row_encode
+ * \see oml_writer_row_push
+ */
+static int
+owb_row_push(OmlWriter* writer, OmlMStream* ms, MBuffer* row)
+{
+  OmlBinWriter* self = (OmlBinWriter*)writer;
+  assert(self->bufferedWriter != NULL);
+
+  MBuffer* mbuf;
+  if ((mbuf = bw_get_write_buf(self->bufferedWriter)) == NULL) {
+    return 0;
+  }
+
+  int res;
+  mbuf_begin_write(mbuf);
+  if ((res = mbuf_write(mbuf, mbuf_message(row), mbuf_message_length(row))) != 0) {
+    mbuf_reset_write(mbuf);
+
+  } else {
+    owb_row_commit(self, ms, mbuf);
+  }
+
+  bw_msgcount_add(self->bufferedWriter, 1);
+  bw_release_write_buf(self->bufferedWriter);
+  return res == 0;
+}
+
+/** Lock in a complete, finalised, sample in the current message of the writer's MBuffer
+ * \param self OmlBinWriter holding the write buffer
+ * \param ms OmlMStream for which the sample is
+ * \param mbuf MBuffer containing the sample as its current message
+ * \see owb_row_end, owb_row_push
+ */
+static void
+owb_row_commit(OmlBinWriter* self, OmlMStream* ms, MBuffer* mbuf)
+{
+  if (marshal_get_msgtype (mbuf) == OMB_LCDATA_P) {
+    self->msgtype = OMB_LCDATA_P; // Generate long packets from now on.
+  } else if (marshal_get_msgtype (mbuf) == OMB_LDDATA_P) {
+    self->dict_msgtype = OMB_LDDATA_P;
   }
 
   if (0 == ms->index) {
@@ -219,16 +483,188 @@ owb_row_end(OmlWriter* writer, OmlMStream* ms) {
      * OmlOutStream (oml_outs_write_f), this require a much bigger refactoring.
      * It is also duplicated with the OmlTextWriter (see #1101).
      */
-    _bw_push_meta(self->bufferedWriter,
-        mbuf_message(self->mbuf), mbuf_message_length(self->mbuf));
+    bw_push_meta(self->bufferedWriter,
+        mbuf_message(mbuf), mbuf_message_length(mbuf));
   }
 
   mbuf_begin_write(mbuf);
+}
 
-  self->mbuf = NULL;
-  bw_msgcount_add(self->bufferedWriter, 1);
-  bw_release_write_buf(self->bufferedWriter);
-  return 1;
+/** Get the block of samples of a stream, creating it if needed.
+ *
+ * \warning The lock on the blocks should be held when calling this function.
+ *
+ * \param self OmlBinWriter accumulating the blocks
+ * \param stream index of the stream
+ * \return the OmlBinBlock of the stream, or NULL on error
+ */
+static OmlBinBlock*
+owb_block_get(OmlBinWriter* self, int stream)
+{
+  OmlBinBlock** blocks;
+  OmlBinBlock* block;
+
+  if (stream >= self->nblocks) {
+    if (!(blocks = oml_realloc(self->blocks, (stream + 1) * sizeof(OmlBinBlock*)))) {
+      return NULL;
+    }
+    memset(&blocks[self->nblocks], 0, (stream + 1 - self->nblocks) * sizeof(OmlBinBlock*));
+    self->blocks = blocks;
+    self->nblocks = stream + 1;
+  }
+
+  if (!(block = self->blocks[stream])) {
+    if (!(block = oml_malloc(sizeof(OmlBinBlock) +
+            self->block_rows * (sizeof(int32_t) + sizeof(double))))) {
+      logerror("Could not allocate block of %d samples for stream %d\n",
+          self->block_rows, stream);
+      return NULL;
+    }
+    memset(block, 0, sizeof(OmlBinBlock));
+    block->stream = stream;
+    block->timestamps = (double*)&block[1];
+    block->seqnos = (int32_t*)&block->timestamps[self->block_rows];
+    self->blocks[stream] = block;
+  }
+
+  return block;
+}
+
+/** Add a sample to a block, after the sequence number and timestamp recorded by owb_row_start.
+ *
+ * \param self OmlBinWriter accumulating the blocks
+ * \param block OmlBinBlock to add the sample to
+ * \param values array of OmlValue of length value_count, copied into the block
+ * \param value_count length of the values array
+ * \return 0 on success, -1 otherwise
+ */
+static int
+owb_block_add(OmlBinWriter* self, OmlBinBlock* block, OmlValue* values, int value_count)
+{
+  OmlValue* v;
+  int i, n = self->block_rows * value_count;
+
+  if (block->nrows == 0 && n > block->capacity) {
+    if (!(v = oml_realloc(block->values, n * sizeof(OmlValue)))) {
+      logerror("Could not allocate %d values for block of stream %d\n", n, block->stream);
+      return -1;
+    }
+    oml_value_array_init(&v[block->capacity], n - block->capacity);
+    block->values = v;
+    block->capacity = n;
+  }
+  if (block->nrows == 0) {
+    block->nfields = value_count;
+
+  } else if (value_count != block->nfields) {
+    logwarn("Dropping sample of %d values in block of %d-value samples for stream %d\n",
+        value_count, block->nfields, block->stream);
+    return -1;
+  }
+
+  v = &block->values[block->nrows * block->nfields];
+  for (i = 0; i < value_count; i++) {
+    if (oml_value_duplicate(&v[i], &values[i])) {
+      oml_value_array_reset(v, i);
+      return -1;
+    }
+  }
+  block->nrows++;
+
+  return 0;
+}
+
+/** Marshal the samples of a block into a block message, and reset it.
+ *
+ * \warning The lock on the blocks should be held when calling this function.
+ *
+ * \param self OmlBinWriter accumulating the blocks
+ * \param block OmlBinBlock to send
+ * \param mbuf MBuffer obtained from bw_get_write_buf, to write the message into
+ * \return 1 on success, 0 otherwise
+ * \see marshal_block
+ */
+static int
+owb_block_flush(OmlBinWriter* self, OmlBinBlock* block, MBuffer* mbuf)
+{
+  int res;
+
+  res = marshal_block(mbuf, self->block_msgtype, block->stream, block->nrows,
+      block->seqnos, block->timestamps, block->values, block->nfields);
+  if (res == 1) {
+    if (marshal_get_msgtype (mbuf) == OMB_LBLOCK_P) {
+      self->block_msgtype = OMB_LBLOCK_P; // Generate long packets from now on.
+    }
+    mbuf_begin_write(mbuf);
+  }
+
+  bw_msgcount_add(self->bufferedWriter, block->nrows);
+  oml_value_array_reset(block->values, block->nrows * block->nfields);
+  block->nrows = 0;
+
+  return res == 1;
+}
+
+/** Send all the samples left in blocks, and free them.
+ *
+ * \param self OmlBinWriter accumulating the blocks
+ * \see owb_block_flush
+ */
+static void
+owb_blocks_close(OmlBinWriter* self)
+{
+  MBuffer* mbuf = bw_get_write_buf(self->bufferedWriter);
+  OmlBinBlock* block;
+  int i;
+
+  oml_lock(&self->lock, __FUNCTION__);
+  for (i = 0; i < self->nblocks; i++) {
+    if (!(block = self->blocks[i])) {
+      continue;
+    }
+    if (block->nrows > 0) {
+      if (mbuf) {
+        owb_block_flush(self, block, mbuf);
+      } else {
+        logwarn("Dropping %d samples of stream %d accumulated in block\n", block->nrows, i);
+      }
+    }
+    oml_value_array_reset(block->values, block->capacity);
+    oml_free(block->values);
+    oml_free(block);
+  }
+  oml_free(self->blocks);
+  self->blocks = NULL;
+  self->nblocks = 0;
+  oml_unlock(&self->lock, __FUNCTION__);
+
+  if (mbuf) {
+    bw_release_write_buf(self->bufferedWriter);
+  }
+}
+
+/** Add the definitions of the strings entered into the dictionary by the last sample to the headers.
+ *
+ * They are sent again with the headers if the connection is reopened, so the
+ * server knows the strings of the samples which are still queued.
+ *
+ * \warning The lock on the dictionary should be held when calling this function.
+ *
+ * \param self OmlBinWriter whose dictionary to commit
+ * \see marshal_dict, bw_push_meta
+ */
+static void
+owb_dict_commit(OmlBinWriter* self)
+{
+  int n;
+
+  mbuf_clear2(self->dict_buf, 0);
+  if ((n = marshal_dict(self->dict_buf, self->dict)) < 0 ||
+      (n > 0 && !bw_push_meta(self->bufferedWriter,
+                              mbuf_rdptr(self->dict_buf), mbuf_fill(self->dict_buf)))) {
+    logwarn("Could not record new strings of the dictionary in the headers, defining them again\n");
+    string_dict_forget(self->dict);
+  }
 }
 
 /** Function called to close the writer and free its allocated objects.
@@ -247,8 +683,19 @@ owb_close(OmlWriter* writer)
 
   next = self->next;
 
+  if (self->block_rows > 1) {
+    owb_blocks_close(self);
+  }
+  if (self->block_rows > 1 || self->dict) {
+    pthread_mutex_destroy(&self->lock);
+  }
+
   // Blocks until the buffered writer drains
   bw_close (self->bufferedWriter);
+  string_dict_destroy(self->dict);
+  if (self->dict_buf) {
+    mbuf_destroy(self->dict_buf);
+  }
   oml_free(self);
 
   return next;
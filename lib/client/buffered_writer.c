@@ -14,21 +14,36 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <assert.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/mman.h>
 
 #include "oml2/omlc.h"
 #include "ocomm/o_log.h"
 #include "ocomm/o_socket.h"
 
+#include "mem.h"
 #include "client.h"
 #include "buffered_writer.h"
 
 /** Default target size in each MBuffer of the chunk */
 #define DEF_CHAIN_BUFFER_SIZE 1024
 
+/** Default size of the byte ring of the BE_Ring engine */
+#define DEF_RING_SIZE 65536
+/** Size of the header preceding each record in the ring; also its alignment */
+#define RING_HEADER_SIZE 8
+/** Space taken in the ring by a record of len bytes */
+#define RING_RECORD_SIZE(len) (RING_HEADER_SIZE + (((len) + RING_HEADER_SIZE - 1) & ~(size_t)(RING_HEADER_SIZE - 1)))
+
+/** Default size of the segment files in which full chunks are spilled */
+#define DEF_SPILL_SEGMENT_SIZE (1024 * 1024)
+
 /** A chunk of data to be put in a circular chain */
 typedef struct BufferChunk {
 
@@ -43,7 +58,36 @@ typedef struct BufferChunk {
 
 } BufferChunk;
 
-/** A writer reading from a chain of BufferChunks */
+/** A memory-mapped file holding chunks spilled to disk */
+typedef struct SpillSegment {
+
+  struct SpillSegment* next;	/**< Link to the next (newer) segment */
+
+  uint8_t* base;		/**< Start of the mapping */
+  size_t size;			/**< Size of the mapping */
+  size_t wr;			/**< Offset up to which data has been spilled */
+  size_t rd;			/**< Offset up to which data has been sent */
+
+} SpillSegment;
+
+/** Per-thread state of a producer writing into a BufferedWriter */
+typedef struct WriteSlot {
+
+  struct WriteSlot* next;	/**< Link to the next slot allocated for the same BufferedWriter */
+  BufferedWriter* owner;	/**< BufferedWriter this slot was allocated for */
+
+  MBuffer* current;		/**< MBuffer handed out by bw_get_write_buf, NULL if none or aborted */
+  int held;			/**< Set to !0 between bw_get_write_buf and bw_release_write_buf, or bw_batch_end */
+  int batch;			/**< Nesting depth of bw_batch_begin calls */
+
+  BufferChunk* chunk;		/**< BufferChunk locked by bw_get_write_buf (BE_Chain only) */
+
+  MBuffer* staging;		/**< Private MBuffer in which samples are serialised (BE_Ring only) */
+  int nmessages;		/**< Number of messages contained in the staging MBuffer (BE_Ring only) */
+
+} WriteSlot;
+
+/** A writer reading from a chain of BufferChunks, or from a byte ring */
 struct BufferedWriter {
   int  active;			/**< Set to !0 if buffer is active; 0 kills the thread */
 
@@ -53,11 +97,11 @@ struct BufferedWriter {
   OmlOutStream*    outStream;	/**< Opaque handler to  the output stream*/
 
   BufferChunk* writerChunk;	/**< Chunk where the data gets stored until it's pushed out */
-  BufferChunk* nextReaderChunk;	/**< Chunk where to read the data next */
+  BufferChunk* nextReaderChunk;	/**< Chunk where to read the data next; writers only reuse it after dropping (or spilling) its data */
   BufferChunk* firstChunk;	/**< Immutable entry into the chain */
 
   MBuffer*     meta_buf;	/**< Buffer holding protocol headers */
-  MBuffer*     read_buf;	/**< Read buffer used to double-buffer reading */
+  MBuffer*     read_buf;	/**< Read buffer used to double-buffer reading (BE_Ring only) */
 
   pthread_mutex_t lock;		/**< Mutex protecting the chain structure */
   pthread_mutex_t meta_lock;	/**< Mutex protecting the headers buffer */
@@ -71,6 +115,50 @@ struct BufferedWriter {
   int retval;			/**< Return status from the thread */
 
   int nlost;			/**< Number of lost messages since last query */
+  int ndrops;			/**< Number of times queued data has been dropped, never reset */
+
+  enum BufferEngine engine;	/**< Queueing engine in use */
+
+  pthread_key_t slot_key;	/**< Key to the WriteSlot of the calling thread */
+  WriteSlot* slots;		/**< All WriteSlots allocated for this writer, protected by lock */
+
+  /* The fields below are only used by the BE_Ring engine.
+   *
+   * Producers reserve records by advancing ring_head with a CAS, copy their
+   * data in, and commit the record by writing its (non-zero) length in its
+   * header last. The reader thread consumes committed records in order,
+   * zeroes them out, then advances ring_tail.
+   */
+  uint8_t* ring;		/**< Byte ring storing the records */
+  size_t ring_size;		/**< Size of the ring, a power of two */
+  volatile size_t ring_head;	/**< Number of bytes reserved by producers since creation */
+  volatile size_t ring_tail;	/**< Number of bytes released by the reader since creation */
+  volatile int sleeping;	/**< Set to !0 while the reader thread waits on the semaphore */
+  volatile int ring_full;	/**< Set to !0 once data has been dropped, until the reader frees space */
+
+  /* The fields below are only used by the BE_Chain engine.
+   *
+   * The reader thread swaps the MBuffers of all the chunks with data ready
+   * for spare ones, then sends them all with a single vectored write.
+   */
+  MBuffer** read_bufs;		/**< MBuffers taken from the chunks, with data to send */
+  int nread_bufs;		/**< Number of MBuffers in read_bufs */
+  MBuffer** spare_bufs;		/**< Empty MBuffers to swap into the chunks, allocated with read_bufs */
+  int nspare_bufs;		/**< Number of MBuffers in spare_bufs */
+  int max_read_bufs;		/**< Capacity of read_bufs and spare_bufs */
+  int reader_moved;		/**< Set to !0 when a writer moved nextReaderChunk, until the reader thread follows */
+
+  /* The fields below are only used when spilling to disk (BE_Chain only).
+   *
+   * Rather than being dropped when the chain is full, the unread data of the
+   * oldest chunk is appended to memory-mapped segment files. The reader
+   * thread sends it all, then resumes from the oldest chunk left.
+   */
+  char* spill_dir;		/**< Directory in which to create segment files, NULL if not spilling */
+  pthread_mutex_t spill_lock;	/**< Mutex protecting the segments; taken after lock if both are needed */
+  SpillSegment* spill_head;	/**< Oldest segment, being read */
+  SpillSegment* spill_tail;	/**< Newest segment, being written */
+  size_t spill_size;		/**< Amount of spilled data not sent yet */
 
 };
 #define REATTEMP_INTERVAL 5    //! Seconds to open the stream again
@@ -80,7 +168,23 @@ static BufferChunk* getNextReadChunk(BufferedWriter* self);
 static BufferChunk* createBufferChunk(BufferedWriter* self);
 static int destroyBufferChain(BufferedWriter* self);
 static void* bufferedWriterThread(void* handle);
-static int processChunk(BufferedWriter* self, BufferChunk* chunk);
+static int processChain(BufferedWriter* self, BufferChunk** chunk);
+static int gatherChunk(BufferedWriter* self, BufferChunk* chunk);
+static int writeReadBufs(BufferedWriter* self, MBuffer** bufs, int nbufs);
+static WriteSlot* getWriteSlot(BufferedWriter* self);
+static void releaseWriteSlot(BufferedWriter* self, WriteSlot* slot);
+static void ringFlushSlot(BufferedWriter* self, WriteSlot* slot);
+static void destroyWriteSlot(void* value);
+static int ringPut(BufferedWriter* self, const uint8_t* data, size_t size, int nmessages);
+static size_t ringGet(BufferedWriter* self, MBuffer* mbuf, size_t max);
+static int ringEmpty(BufferedWriter* self);
+static void* ringWriterThread(void* handle);
+static int processRing(BufferedWriter* self);
+static int spillChunk(BufferedWriter* self, BufferChunk* chunk);
+static int spillReplay(BufferedWriter* self);
+static int backingOff(BufferedWriter* self, time_t now);
+static void writeSucceeded(BufferedWriter* self);
+static void writeFailed(BufferedWriter* self, time_t now);
 
 /** Create a BufferedWriter instance
  *
@@ -89,12 +193,35 @@ static int processChunk(BufferedWriter* self, BufferChunk* chunk);
  * \param chunkSize size [B] of buffer space allocated at a time, set to 0 for default (DEF_CHAIN_BUFFER_SIZE)
  * \return an instance pointer if successful, NULL otherwise
  *
- * \see DEF_CHAIN_BUFFER_SIZE
+ * \see bw_create2, DEF_CHAIN_BUFFER_SIZE
  */
 BufferedWriter*
 bw_create(OmlOutStream* outStream, long  queueCapacity, long chunkSize)
+{
+  return bw_create2(outStream, queueCapacity, chunkSize, BE_Default);
+}
+
+/** Create a BufferedWriter instance using a specific queueing engine
+ *
+ * With BE_Ring, the queue is a single ring of queueCapacity bytes (rounded up
+ * to a power of two, DEF_RING_SIZE if 0) shared without locks by all producer
+ * threads; each of them serialises its samples in a private MBuffer before
+ * copying them into the ring. When the ring is full, new samples are dropped
+ * (and accounted for in nlost) rather than the oldest chunk.
+ *
+ * \param outStream opaque OmlOutStream handler
+ * \param queueCapacity maximal size [B] of the internal queue queueCapaity/chunkSize will be used (at least 2)
+ * \param chunkSize size [B] of buffer space allocated at a time, set to 0 for default (DEF_CHAIN_BUFFER_SIZE)
+ * \param engine BufferEngine to use, BE_Default selecting BE_Chain
+ * \return an instance pointer if successful, NULL otherwise
+ *
+ * \see DEF_CHAIN_BUFFER_SIZE, DEF_RING_SIZE
+ */
+BufferedWriter*
+bw_create2(OmlOutStream* outStream, long  queueCapacity, long chunkSize, enum BufferEngine engine)
 {
   long nchunks;
+  size_t ring_size;
   BufferedWriter* self = NULL;
 
   assert(outStream>=0);
@@ -108,26 +235,62 @@ bw_create(OmlOutStream* outStream, long  queueCapacity, long chunkSize)
     /* This forces a 'connected' INFO message upon first connection */
     self->backoff = 1;
 
+    self->engine = (BE_Default == engine) ? BE_Chain : engine;
     self->bufSize = chunkSize > 0 ? chunkSize : DEF_CHAIN_BUFFER_SIZE;
 
-    nchunks = queueCapacity / self->bufSize;
-    self->unallocatedBuffers = (nchunks > 2) ? nchunks : 2; /* at least two chunks */
+    if (BE_Ring == self->engine) {
+      ring_size = queueCapacity > 0 ? queueCapacity : DEF_RING_SIZE;
+      if (ring_size < 2 * self->bufSize) {
+        ring_size = 2 * self->bufSize;
+      }
+      for (self->ring_size = RING_HEADER_SIZE; self->ring_size < ring_size; self->ring_size <<= 1);
 
-    logdebug ("%s: Buffer size %dB (%d chunks of %dB)\n",
-        self->outStream->dest,
-        self->unallocatedBuffers*self->bufSize,
-        self->unallocatedBuffers, self->bufSize);
+      logdebug ("%s: Buffer size %dB (lock-free ring)\n",
+          self->outStream->dest, self->ring_size);
 
-    if(NULL == (self->writerChunk = self->nextReaderChunk = self->firstChunk = createBufferChunk(self))) {
+      /* The ring has to be zeroed for uncommitted records to be recognised */
+      if(NULL == (self->ring = (uint8_t*)oml_malloc(self->ring_size))) {
+        oml_free(self);
+        return NULL;
+      }
+      memset(self->ring, 0, self->ring_size);
+
+    } else {
+      nchunks = queueCapacity / self->bufSize;
+      self->unallocatedBuffers = (nchunks > 2) ? nchunks : 2; /* at least two chunks */
+      self->max_read_bufs = (self->unallocatedBuffers < OML_OUTS_IOV_MAX) ?
+        self->unallocatedBuffers : OML_OUTS_IOV_MAX;
+
+      logdebug ("%s: Buffer size %dB (%d chunks of %dB)\n",
+          self->outStream->dest,
+          self->unallocatedBuffers*self->bufSize,
+          self->unallocatedBuffers, self->bufSize);
+
+      if(NULL == (self->writerChunk = self->nextReaderChunk = self->firstChunk = createBufferChunk(self))) {
+        oml_free(self);
+        return NULL;
+      }
+    }
+
+    if(NULL == (self->meta_buf = mbuf_create())) {
+      destroyBufferChain(self);
       oml_free(self);
       self = NULL;
 
-    } else if(NULL == (self->meta_buf = mbuf_create())) {
+    } else if(BE_Ring == self->engine && NULL == (self->read_buf = mbuf_create())) {
       destroyBufferChain(self);
       oml_free(self);
       self = NULL;
 
-    } else if(NULL == (self->read_buf = mbuf_create())) {
+    } else if(BE_Chain == self->engine &&
+        NULL == (self->read_bufs = (MBuffer**)oml_malloc(2 * self->max_read_bufs * sizeof(MBuffer*)))) {
+      destroyBufferChain(self);
+      oml_free(self);
+      self = NULL;
+
+    } else if(pthread_key_create(&self->slot_key, destroyWriteSlot)) {
+      logerror ("%s: Cannot create thread-specific key: %s\n",
+          self->outStream->dest, strerror(errno));
       destroyBufferChain(self);
       oml_free(self);
       self = NULL;
@@ -139,13 +302,18 @@ bw_create(OmlOutStream* outStream, long  queueCapacity, long chunkSize)
       logdebug3("%s: initialised mutex %p\n", self->outStream->dest, &self->lock);
       pthread_mutex_init(&self->meta_lock, NULL);
       logdebug3("%s: initialised mutex %p\n", self->outStream->dest, &self->meta_lock);
+      pthread_mutex_init(&self->spill_lock, NULL);
+
+      if (self->read_bufs) { self->spare_bufs = self->read_bufs + self->max_read_bufs; }
 
       /* Initialize and set thread detached attribute */
       pthread_attr_t tattr;
       pthread_attr_init(&tattr);
       pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_JOINABLE);
       self->active = 1;
-      pthread_create(&self->readerThread, &tattr, bufferedWriterThread, (void*)self);
+      pthread_create(&self->readerThread, &tattr,
+          (BE_Ring == self->engine) ? ringWriterThread : bufferedWriterThread,
+          (void*)self);
     }
   }
 
@@ -186,11 +354,57 @@ bw_close(BufferedWriter* instance)
   }
 
   self->outStream->close(self->outStream);
+  pthread_key_delete(self->slot_key);
   destroyBufferChain(self);
   oml_free(self);
 }
 
+/** Spill full chunks to disk instead of dropping them
+ *
+ * When the queue is full, the unread data of the oldest chunk is appended to
+ * segment files created (and immediately unlinked) in dir, and mapped in
+ * memory. After reconnecting, the reader thread sends the spilled data first,
+ * in order, before that still in the queue. Samples are only dropped if the
+ * segment files cannot be created, e.g., if the disk is full.
+ *
+ * This is only supported by the BE_Chain engine.
+ *
+ * \param instance BufferedWriter handle
+ * \param dir directory in which to create the segment files
+ * \return 0 on success, -1 otherwise
+ */
+int
+bw_spill_enable(BufferedWriter* instance, const char* dir)
+{
+  BufferedWriter* self = (BufferedWriter*)instance;
+  int ret = -1;
+
+  if (!self || !dir) { return -1; }
+
+  if (BE_Chain != self->engine) {
+    logwarn("%s: Spilling to disk is not supported by this queue, samples will be dropped when full\n",
+        self->outStream->dest);
+    return -1;
+  }
+  if (access(dir, W_OK | X_OK)) {
+    logerror("%s: Cannot spill to '%s': %s\n", self->outStream->dest, dir, strerror(errno));
+    return -1;
+  }
+
+  oml_lock(&self->spill_lock, __FUNCTION__);
+  if (!self->spill_dir && (self->spill_dir = oml_strndup(dir, strlen(dir)))) {
+    logdebug("%s: Spilling full chunks to '%s'\n", self->outStream->dest, dir);
+    ret = 0;
+  }
+  oml_unlock(&self->spill_lock, __FUNCTION__);
+
+  return ret;
+}
+
 /** Add some data to the end of the queue (lock must be held).
+ *
+ * The data is added as a complete message. The writer moves on to the next
+ * chunk when there is not enough space left in the current one.
  *
  * \param instance BufferedWriter handle
  * \param data Pointer to data to add
@@ -198,26 +412,38 @@ bw_close(BufferedWriter* instance)
  * \return 1 if success, 0 otherwise
  *
  * \warning This function is the same assumes that the
- * lock on the writer chunk is already acquired.
+ * lock on the writer chunk is already acquired, e.g., with bw_batch_begin.
  *
- * \see bw_push, bw_get_write_buf, bw_release_write_buf
+ * \see bw_push, bw_get_write_buf, bw_release_write_buf, bw_batch_begin
  */
 int
 bw_push(BufferedWriter* instance, uint8_t* data, size_t size)
 {
   BufferedWriter* self = (BufferedWriter*)instance;
+  WriteSlot* slot;
   if (!self->active) { return 0; }
 
-  BufferChunk* chunk = self->writerChunk;
+  if (BE_Ring == self->engine) {
+    return ringPut(self, data, size, 0);
+  }
+
+  /* Use the chunk this thread holds, so it is not released twice */
+  slot = (WriteSlot*)pthread_getspecific(self->slot_key);
+  BufferChunk* chunk = (slot && slot->held) ? slot->chunk : self->writerChunk;
   if (chunk == NULL) { return 0; }
 
   if (mbuf_wr_remaining(chunk->mbuf) < size) {
     chunk = getNextWriteChunk(self, chunk);
+    if (slot && slot->held) {
+      slot->chunk = chunk;
+      if (slot->current) { slot->current = chunk->mbuf; }
+    }
   }
 
   if (mbuf_write(chunk->mbuf, data, size) < 0) {
     return 0;
   }
+  mbuf_begin_write(chunk->mbuf);
   pthread_cond_signal(&self->semaphore);
 
   return 1;
@@ -265,7 +491,7 @@ _bw_push_meta(BufferedWriter* instance, uint8_t* data, size_t size)
 
   if (!self->active) { return 0; }
 
-  if (mbuf_write(self->meta_buf, data, size) > 0) {
+  if (mbuf_write(self->meta_buf, data, size) == 0) {
     result = 1;
     /* XXX: There is no point in signalling the semaphore as the
      * writer will not be able to do anything with the new data.
@@ -277,6 +503,9 @@ _bw_push_meta(BufferedWriter* instance, uint8_t* data, size_t size)
 }
 
 /** Count the addition (or deletion) of a full message in the current BufferChunk.
+ *
+ * With the BE_Ring engine, messages are counted in the staging MBuffer of the
+ * calling thread instead.
  *
  * \param instance BufferedWriter handle
  * \param nmessages number of messages to count (can be negative)
@@ -287,6 +516,18 @@ _bw_push_meta(BufferedWriter* instance, uint8_t* data, size_t size)
  */
 int
 bw_msgcount_add(BufferedWriter* instance, int nmessages) {
+  WriteSlot* slot;
+  if (BE_Ring == instance->engine) {
+    if (NULL == (slot = getWriteSlot(instance))) { return 0; }
+    slot->nmessages += nmessages;
+    return slot->nmessages;
+  }
+  slot = (WriteSlot*)pthread_getspecific(instance->slot_key);
+  if (slot && slot->held) {
+    /* Another thread may have moved writerChunk since we locked ours */
+    slot->chunk->nmessages += nmessages;
+    return slot->chunk->nmessages;
+  }
   instance->writerChunk->nmessages += nmessages;
   return instance->writerChunk->nmessages;
 }
@@ -301,7 +542,15 @@ bw_msgcount_add(BufferedWriter* instance, int nmessages) {
  */
 int
 bw_msgcount_reset(BufferedWriter* instance) {
-  int n = instance->writerChunk->nmessages;
+  int n;
+  WriteSlot* slot;
+  if (BE_Ring == instance->engine) {
+    if (NULL == (slot = getWriteSlot(instance))) { return 0; }
+    n = slot->nmessages;
+    slot->nmessages = 0;
+    return n;
+  }
+  n = instance->writerChunk->nmessages;
   instance->writerChunk->nmessages = 0;
   return n;
 }
@@ -316,47 +565,187 @@ bw_msgcount_reset(BufferedWriter* instance) {
  */
 int
 bw_nlost_reset(BufferedWriter* instance) {
-  int n = instance->nlost;
-  instance->nlost = 0;
-  return n;
+  return __sync_fetch_and_and(&instance->nlost, 0);
+}
+
+/** Return the number of times queued data has been dropped by the BufferedWriter.
+ *
+ * Unlike the number of lost messages, this is never reset, so writers can
+ * find out whether some of their messages may never be sent.
+ *
+ * \param instance BufferedWriter handle
+ *
+ * \return the number of times data has been dropped since the creation of the BufferedWriter
+ *
+ * \see bw_nlost_reset
+ */
+int
+bw_ndrops(BufferedWriter* instance) {
+  return __sync_fetch_and_add(&instance->ndrops, 0);
 }
+
 /** Return an MBuffer with exclusive access
+ *
+ * With the BE_Chain engine, this locks the current writer BufferChunk. With
+ * the BE_Ring engine, this returns the staging MBuffer of the calling thread,
+ * without taking any lock.
  *
  * \param instance BufferedWriter handle
  *
  * \return an MBuffer instance if success to write in, NULL otherwise
- * \see bw_release_write_buf
+ * \see bw_current_write_buf, bw_release_write_buf
  */
 MBuffer*
 bw_get_write_buf(BufferedWriter* instance)
 {
   BufferedWriter* self = (BufferedWriter*)instance;
+  WriteSlot* slot;
+  MBuffer* mbuf;
   if (!self->active) { return 0; }
 
-  BufferChunk* chunk = self->writerChunk;
-  if (chunk == NULL) { return 0; }
-  oml_lock(&chunk->lock, __FUNCTION__);
+  if (NULL == (slot = getWriteSlot(self))) { return 0; }
 
-  MBuffer* mbuf = chunk->mbuf;
-  if (mbuf_write_offset(mbuf) >= chunk->targetBufSize) {
-    chunk = getNextWriteChunk(self, chunk);
+  if (BE_Ring == self->engine) {
+    mbuf = slot->staging;
+
+  } else if (slot->held) {
+    /* Still holding the chunk from a previous message of the same batch */
+    BufferChunk* chunk = slot->chunk;
     mbuf = chunk->mbuf;
+    if (mbuf_write_offset(mbuf) >= chunk->targetBufSize) {
+      chunk = getNextWriteChunk(self, chunk);
+      mbuf = chunk->mbuf;
+    }
+    slot->chunk = chunk;
+
+  } else {
+    BufferChunk* chunk = self->writerChunk;
+    if (chunk == NULL) { return 0; }
+    oml_lock(&chunk->lock, __FUNCTION__);
+
+    mbuf = chunk->mbuf;
+    if (mbuf_write_offset(mbuf) >= chunk->targetBufSize) {
+      chunk = getNextWriteChunk(self, chunk);
+      mbuf = chunk->mbuf;
+    }
+    slot->chunk = chunk;
   }
+
+  slot->held = 1;
+  slot->current = mbuf;
   return mbuf;
 }
 
+/** Return the MBuffer last obtained by the calling thread through bw_get_write_buf
+ *
+ * \param instance BufferedWriter handle
+ *
+ * \return the MBuffer, or NULL if it has since been released or aborted, or could not be obtained
+ * \see bw_get_write_buf, bw_abort_write_buf
+ */
+MBuffer*
+bw_current_write_buf(BufferedWriter* instance)
+{
+  WriteSlot* slot = (WriteSlot*)pthread_getspecific(instance->slot_key);
+  return slot ? slot->current : NULL;
+}
+
+/** Discard the message being written in the current MBuffer
+ *
+ * The message is rolled back, and bw_current_write_buf returns NULL until
+ * the next call to bw_get_write_buf. The MBuffer must still be released with
+ * bw_release_write_buf.
+ *
+ * \param instance BufferedWriter handle for which a buffer was previously obtained through bw_get_write_buf
+ * \see bw_get_write_buf, bw_release_write_buf
+ */
+void
+bw_abort_write_buf(BufferedWriter* instance)
+{
+  WriteSlot* slot = (WriteSlot*)pthread_getspecific(instance->slot_key);
+  if (slot && slot->current) {
+    mbuf_reset_write(slot->current);
+    slot->current = NULL;
+  }
+}
 
 /** Return and unlock MBuffer
+ *
+ * With the BE_Ring engine, the complete messages of the staging MBuffer are
+ * copied into the ring, or dropped if it is full.
+ *
+ * Within a batch, the MBuffer is only unlocked by the last bw_batch_end.
+ *
  * \param instance BufferedWriter handle for which a buffer was previously obtained through bw_get_write_buf
  *
- * \see bw_get_write_buf
+ * \see bw_get_write_buf, bw_batch_begin
  */
 void
 bw_release_write_buf(BufferedWriter* instance)
 {
   BufferedWriter* self = (BufferedWriter*)instance;
-  pthread_cond_signal(&self->semaphore); /* assume we locked for a reason */
-  oml_unlock(&self->writerChunk->lock, __FUNCTION__);
+  WriteSlot* slot = (WriteSlot*)pthread_getspecific(self->slot_key);
+
+  if (NULL == slot || !slot->held) { return; }
+  slot->current = NULL;
+
+  if (slot->batch > 0) {
+    /* Don't let the staging MBuffer grow beyond what the ring can take */
+    if (BE_Ring == self->engine &&
+        mbuf_message_offset(slot->staging) - mbuf_read_offset(slot->staging) >= self->ring_size / 8) {
+      ringFlushSlot(self, slot);
+    }
+    return;
+  }
+
+  releaseWriteSlot(self, slot);
+}
+
+/** Start a batch of messages written by the calling thread
+ *
+ * Until the matching bw_batch_end, bw_release_write_buf does not unlock the
+ * MBuffer, so a sequence of messages can be written with a single lock of
+ * the writer BufferChunk (BE_Chain) or a single copy into the ring (BE_Ring).
+ *
+ * With the BE_Chain engine, the writer BufferChunk is locked straight away,
+ * so callers batching on several BufferedWriters at once control the order in
+ * which they are locked, and must always use the same one to avoid deadlocks.
+ *
+ * Batches can be nested. Other producers are blocked for the duration of the
+ * batch with the BE_Chain engine, so batches should be kept short.
+ *
+ * \param instance BufferedWriter handle
+ * \return 0 on success, -1 otherwise
+ * \see bw_batch_end, bw_get_write_buf, bw_release_write_buf
+ */
+int
+bw_batch_begin(BufferedWriter* instance)
+{
+  WriteSlot* slot;
+
+  if (NULL == (slot = getWriteSlot(instance))) { return -1; }
+  if (slot->batch++ == 0 && BE_Chain == instance->engine && !slot->held &&
+      bw_get_write_buf(instance)) {
+    /* Only hold the lock; no message is being written yet */
+    slot->current = NULL;
+  }
+  return 0;
+}
+
+/** End a batch of messages, and release the MBuffer if still held
+ *
+ * \param instance BufferedWriter handle for which bw_batch_begin was called
+ * \see bw_batch_begin
+ */
+void
+bw_batch_end(BufferedWriter* instance)
+{
+  WriteSlot* slot = (WriteSlot*)pthread_getspecific(instance->slot_key);
+
+  if (NULL == slot || slot->batch <= 0) { return; }
+  if (--slot->batch == 0 && slot->held) {
+    releaseWriteSlot(instance, slot);
+  }
 }
 
 /** Find the next empty write chunk, sets self->writerChunk to it and returns * it.
@@ -376,7 +765,7 @@ bw_release_write_buf(BufferedWriter* instance)
  */
 BufferChunk*
 getNextWriteChunk(BufferedWriter* self, BufferChunk* current) {
-  int nlost;
+  int nlost, spilling = 0;
   BufferChunk* nextBuffer;
 
   assert(current != NULL);
@@ -402,17 +791,34 @@ getNextWriteChunk(BufferedWriter* self, BufferChunk* current) {
 
     } else {
       /* The next buffer is the next to be read, and we cannot allocate more,
-       * use it, dropping unread data, and advance the read pointer */
+       * use it, dropping (or spilling) unread data, and advance the read pointer */
       self->nextReaderChunk = nextBuffer->next;
+      self->reader_moved = 1;
+
+      /* Hold the spill lock until the data is spilled, so the reader does not
+       * send newer data before it */
+      oml_lock(&self->spill_lock, __FUNCTION__);
+      if (self->spill_dir) {
+        spilling = 1;
+      } else {
+        oml_unlock(&self->spill_lock, __FUNCTION__);
+      }
     }
   }
 
   self->writerChunk = nextBuffer;
   nlost = bw_msgcount_reset(self);
-  self->nlost += nlost;
   oml_unlock(&self->lock, __FUNCTION__);
   oml_lock(&nextBuffer->lock, __FUNCTION__);
+  if (spilling) {
+    if (0 == spillChunk(self, nextBuffer)) {
+      nlost = 0;
+    }
+    oml_unlock(&self->spill_lock, __FUNCTION__);
+  }
   if (nlost) {
+    __sync_fetch_and_add(&self->nlost, nlost);
+    __sync_fetch_and_add(&self->ndrops, 1);
     logwarn("%s: Dropping %d samples (%dB)\n", self->outStream->dest, nlost, mbuf_fill(nextBuffer->mbuf));
   }
   mbuf_clear2(nextBuffer->mbuf, 0);
@@ -427,23 +833,21 @@ getNextWriteChunk(BufferedWriter* self, BufferChunk* current) {
   return nextBuffer;
 }
 
-/** Get the next available reader chunck (even if there is nothing to read)
+/** Move the reader to the next chunk (even if there is nothing to read)
  *
- * This function acquires the lock on the BufferedWriter on its own.
+ * The reader stays on nextReaderChunk until it has gathered its data, so
+ * writers wrapping around do not reuse it without accounting for that data.
  *
  * \warning A lock on the BufferedWriter should be held prior to calling
- * this function. It will be released, and the returned writerChunk will be
- * similarly locked.
+ * this function.
  *
  * \param self BufferedWriter pointer
  * \return a BufferChunk frome which data can next be read
  */
 static BufferChunk*
 getNextReadChunk(BufferedWriter* self) {
-  BufferChunk* chunk;
-  chunk = self->nextReaderChunk;
-  self->nextReaderChunk = chunk->next;
-  return chunk;
+  self->nextReaderChunk = self->nextReaderChunk->next;
+  return self->nextReaderChunk;
 }
 
 /** Initialise a BufferChunk for a BufferedWriter.
@@ -491,6 +895,8 @@ createBufferChunk(BufferedWriter* self)
 int
 destroyBufferChain(BufferedWriter* self) {
   BufferChunk *chunk, *start;
+  WriteSlot *slot;
+  SpillSegment *segment;
 
   if (!self) {
     return -1;
@@ -507,11 +913,29 @@ destroyBufferChain(BufferedWriter* self) {
     oml_free(chunk);
   }
 
+  while ((slot = self->slots)) {
+    self->slots = slot->next;
+    if (slot->staging) { mbuf_destroy(slot->staging); }
+    oml_free(slot);
+  }
+  if (self->ring) { oml_free(self->ring); }
+
+  while ((segment = self->spill_head)) {
+    self->spill_head = segment->next;
+    munmap(segment->base, segment->size);
+    oml_free(segment);
+  }
+  if (self->spill_dir) { oml_free(self->spill_dir); }
+
   mbuf_destroy(self->meta_buf);
   mbuf_destroy(self->read_buf);
+  while (self->nread_bufs > 0) { mbuf_destroy(self->read_bufs[--self->nread_bufs]); }
+  while (self->nspare_bufs > 0) { mbuf_destroy(self->spare_bufs[--self->nspare_bufs]); }
+  if (self->read_bufs) { oml_free(self->read_bufs); }
 
   pthread_cond_destroy(&self->semaphore);
   pthread_mutex_destroy(&self->meta_lock);
+  pthread_mutex_destroy(&self->spill_lock);
   pthread_mutex_destroy(&self->lock);
 
   return 0;
@@ -536,125 +960,684 @@ bufferedWriterThread(void* handle)
     // Process all chunks which have data in them
     do {
       oml_unlock(&self->lock, __FUNCTION__);
-      allsent = processChunk(self, chunk);
-
+      allsent = processChain(self, &chunk);
       oml_lock(&self->lock, __FUNCTION__);
-      /* Stop if we caught up to the writer... */
-      if (chunk == self->writerChunk) { break; }
-      /* ...otherwise, move on to the next chunk */
-      if (allsent>0) {
-        chunk = getNextReadChunk(self);
-      }
-    } while(allsent > 0);
+    } while(0 == allsent);
     oml_unlock(&self->lock, __FUNCTION__);
   }
   /* Drain this writer before terminating */
   /* XXX: “Backing-off for ...” messages might confuse the user as
    * we don't actually wait after a failure when draining at the end */
-  while ((allsent=processChunk(self, chunk))>=-1) {
-    if(allsent>0) {
-      if (chunk == self->writerChunk) { break; };
-
-      oml_lock(&self->lock, __FUNCTION__);
-      chunk = getNextReadChunk(self);
-      oml_unlock(&self->lock, __FUNCTION__);
-    }
-  };
+  while ((allsent=processChain(self, &chunk))>=-1 && allsent != 1);
   self->retval = allsent;
   pthread_exit(&(self->retval));
 }
 
-/** Send data contained in one chunk.
+/** Send the data contained in all the chunks ready to be read.
  *
- * \warning This function acquires the lock on the BufferedWriter for the time
- * it takes to check the double-buffer.
+ * The MBuffers of the chunks holding data are swapped for empty spare ones,
+ * from the current chunk up to the writer chunk, or until OML_OUTS_IOV_MAX
+ * MBuffers have been gathered. They are then sent together with a single
+ * vectored write.
+ *
+ * Data left over by a previous failed attempt is sent first, before
+ * gathering more. Then comes any data spilled to disk, after which reading
+ * resumes from the oldest chunk left.
  *
- * \warning This function acquires the lock on the chunk being processed for
- * the time it takes to check it and swap the double buffer.
+ * \warning This function acquires the lock on the BufferedWriter for the time
+ * it takes to move to the next chunk.
  *
- * \bug The meta buffer should also be protected.
+ * \warning This function acquires the lock on the chunks being processed for
+ * the time it takes to check them and swap their MBuffer.
  *
  * \param self BufferedWriter to process
- * \param chunk link of the chunk to process
+ * \param[in,out] chunk link of the chunk to process, updated to the next one to process
  *
- * \return 1 if chunk has been fully sent, 0 if not, -1 on continuing back-off, -2 otherwise
- * \see oml_outs_write_f
+ * \return 1 if all data up to the writer chunk has been sent, 0 if there are more chunks to process, -1 on continuing back-off, -2 otherwise
+ * \see gatherChunk, writeReadBufs, spillReplay
  */
 static int
-processChunk(BufferedWriter* self, BufferChunk* chunk)
+processChain(BufferedWriter* self, BufferChunk** chunk)
 {
-  time_t now;
-  int ret = -2;
-  ssize_t cnt = 0;
-  MBuffer *read_buf = NULL;
+  int i, ret, caught_up = 0, moved = 0;
   assert(self);
   assert(self->meta_buf);
-  assert(self->read_buf);
-  assert(chunk);
+  assert(self->read_bufs);
+  assert(chunk && *chunk);
+
+  if (0 == self->nread_bufs) {
+    /* Writers may have taken over chunks since, and moved us on */
+    oml_lock(&self->lock, __FUNCTION__);
+    self->reader_moved = 0;
+    *chunk = self->nextReaderChunk;
+    oml_unlock(&self->lock, __FUNCTION__);
+
+    if (self->spill_dir && (ret = spillReplay(self)) < 1) {
+      return ret;
+    }
+
+    while (gatherChunk(self, *chunk) >= 0) {
+      oml_lock(&self->lock, __FUNCTION__);
+      /* Stop if a writer took over the next chunks, possibly spilling their
+       * data, which should be sent before any newer one... */
+      if (self->reader_moved) {
+        moved = 1;
+      /* ...or if we caught up to the writer... */
+      } else if (*chunk == self->writerChunk) {
+        caught_up = 1;
+      } else {
+        /* ...otherwise, move on to the next chunk */
+        *chunk = getNextReadChunk(self);
+      }
+      oml_unlock(&self->lock, __FUNCTION__);
+      if (caught_up || moved) { break; }
+    }
+  }
+
+  if (self->nread_bufs > 0) {
+    if ((ret = writeReadBufs(self, self->read_bufs, self->nread_bufs)) < 0) {
+      return ret;
+    }
+    /* Recycle the sent MBuffers as spares */
+    for (i = 0; i < self->nread_bufs; i++) {
+      mbuf_clear2(self->read_bufs[i], 0);
+      self->spare_bufs[self->nspare_bufs++] = self->read_bufs[i];
+    }
+    self->nread_bufs = 0;
+  }
+
+  return caught_up;
+}
+
+/** Swap the MBuffer of a chunk for a spare one if it holds data to send.
+ *
+ * The swapped-out MBuffer is appended to the read_bufs of the BufferedWriter.
+ *
+ * \param self BufferedWriter to process
+ * \param chunk link of the chunk to process
+ *
+ * \return 1 if data has been taken from the chunk, 0 if it had none, -1 if no more MBuffers can be gathered, or the reader has been moved on
+ */
+static int
+gatherChunk(BufferedWriter* self, BufferChunk* chunk)
+{
+  MBuffer* spare;
+  int taken = 0;
   assert(chunk->mbuf);
 
-  oml_lock(&self->lock, __FUNCTION__);
-  if (mbuf_message(self->read_buf) > mbuf_rdptr(self->read_buf)) {
-    /* There is unread data in the double buffer */
-    read_buf = self->read_buf;
+  if (self->nread_bufs >= self->max_read_bufs) {
+    return -1;
+  }
+
+  if (self->nspare_bufs > 0) {
+    spare = self->spare_bufs[--self->nspare_bufs];
+  } else if (NULL == (spare = mbuf_create2(self->bufSize, (size_t)(0.1 * self->bufSize)))) {
+    logerror("%s: Cannot allocate MBuffer to read chunk\n", self->outStream->dest);
+    return -1;
   }
-  oml_unlock(&self->lock, __FUNCTION__);
 
   oml_lock(&chunk->lock, __FUNCTION__);
-  if ((NULL == read_buf) && (mbuf_message(chunk->mbuf) >= mbuf_rdptr(chunk->mbuf))) {
-    /* There is unread data in the read buffer, swap MBuffers */
-    read_buf = chunk->mbuf;
-    chunk->mbuf = self->read_buf;
+  if (self->reader_moved) {
+    /* A writer has taken over this chunk, after dropping or spilling its data */
+    taken = -1;
+  } else if (mbuf_message(chunk->mbuf) > mbuf_rdptr(chunk->mbuf)) {
+    /* There is unread data in the chunk, swap MBuffers */
+    self->read_bufs[self->nread_bufs++] = chunk->mbuf;
+    chunk->mbuf = spare;
+    /* These messages are not at risk of being dropped anymore */
+    chunk->nmessages = 0;
+    taken = 1;
   }
   oml_unlock(&chunk->lock, __FUNCTION__);
 
-  oml_lock(&self->lock, __FUNCTION__);
-  self->read_buf = read_buf;
-  oml_unlock(&self->lock, __FUNCTION__);
-
-  if (NULL == read_buf) {
-    /* The current message is not after the read pointer,
-     * we must be on the writer chunk */
-    ret = 1;
-    goto processChunk_cleanup;
+  if (taken <= 0) {
+    self->spare_bufs[self->nspare_bufs++] = spare;
   }
+  return taken;
+}
+
+/** Send the unread data of some read buffers to the OmlOutStream.
+ *
+ * All buffers are sent with as few vectored writes as possible. The headers
+ * are passed along so the OmlOutStream can replay them when it (re)connects.
+ *
+ * \param self BufferedWriter to process
+ * \param bufs array of MBuffers to send data from, in order
+ * \param nbufs number of MBuffers in bufs, at most OML_OUTS_IOV_MAX
+ *
+ * \return 1 if all bufs have been fully sent, -1 on continuing back-off, -2 otherwise
+ * \see out_stream_writev, oml_outs_writev_f
+ */
+static int
+writeReadBufs(BufferedWriter* self, MBuffer** bufs, int nbufs)
+{
+  struct iovec iov[OML_OUTS_IOV_MAX];
+  time_t now;
+  ssize_t cnt = 0;
+  size_t len;
+  int i, n, first = 0;
 
   time(&now);
-  if (difftime(now, self->last_failure_time) < self->backoff) {
-    logdebug("%s: Still in back-off period (%ds)\n", self->outStream->dest, self->backoff);
-    ret = -1;
-    goto processChunk_cleanup;
+  if (backingOff(self, now)) {
+    return -1;
   }
 
-  while (mbuf_write_offset(read_buf) > mbuf_read_offset(read_buf)) {
+  while (first < nbufs) {
+    for (i = first, n = 0; i < nbufs; i++) {
+      if ((len = mbuf_message_offset(bufs[i]) - mbuf_read_offset(bufs[i])) > 0) {
+        iov[n].iov_base = mbuf_rdptr(bufs[i]);
+        iov[n].iov_len = len;
+        n++;
+      }
+    }
+    if (0 == n) {
+      break;
+    }
+
     oml_lock(&self->meta_lock, __FUNCTION__);
-    cnt = self->outStream->write(self->outStream,
-        mbuf_rdptr(read_buf), mbuf_message_offset(read_buf) - mbuf_read_offset(read_buf),
+    cnt = out_stream_writev(self->outStream, iov, n,
         mbuf_rdptr(self->meta_buf), mbuf_fill(self->meta_buf));
     oml_unlock(&self->meta_lock, __FUNCTION__);
 
     if (cnt > 0) {
-      mbuf_read_skip(read_buf, cnt);
-      if (self->backoff) {
-        self->backoff = 0;
-        loginfo("%s: Connected\n", self->outStream->dest);
+      /* Advance through the buffers which have been (partially) sent */
+      for (; first < nbufs && cnt > 0; first++) {
+        len = mbuf_message_offset(bufs[first]) - mbuf_read_offset(bufs[first]);
+        if ((size_t)cnt < len) {
+          mbuf_read_skip(bufs[first], cnt);
+          break;
+        }
+        mbuf_read_skip(bufs[first], len);
+        cnt -= len;
       }
+      writeSucceeded(self);
+
+    } else {
+      writeFailed(self, now);
+      return -2;
+    }
+  }
+  return 1;
+}
+
+/** Check whether the BufferedWriter should wait before trying to write again.
+ *
+ * \param self BufferedWriter pointer
+ * \param now current time
+ * \return !0 if still in the back-off period, 0 otherwise
+ * \see writeFailed
+ */
+static int
+backingOff(BufferedWriter* self, time_t now)
+{
+  if (difftime(now, self->last_failure_time) < self->backoff) {
+    logdebug("%s: Still in back-off period (%ds)\n", self->outStream->dest, self->backoff);
+    return 1;
+  }
+  return 0;
+}
+
+/** Reset the back-off after a successful write.
+ *
+ * \param self BufferedWriter pointer
+ * \see writeFailed
+ */
+static void
+writeSucceeded(BufferedWriter* self)
+{
+  if (self->backoff) {
+    self->backoff = 0;
+    loginfo("%s: Connected\n", self->outStream->dest);
+  }
+}
+
+/** Record a failed write, and double the back-off period.
+ *
+ * \param self BufferedWriter pointer
+ * \param now current time
+ * \see backingOff, writeSucceeded
+ */
+static void
+writeFailed(BufferedWriter* self, time_t now)
+{
+  self->last_failure_time = now;
+  if (!self->backoff) {
+    self->backoff = 1;
+  } else if (self->backoff < UINT8_MAX) {
+    self->backoff *= 2;
+  }
+  logwarn("%s: Error sending, backing off for %ds\n", self->outStream->dest, self->backoff);
+}
+
+/** Append the unread data of a chunk to the spill segments.
+ *
+ * A new segment file is created when the current one is full. Its space is
+ * allocated upfront, so running out of disk is detected here rather than
+ * when writing into the mapping.
+ *
+ * \warning The spill lock and the lock on the chunk should be held.
+ *
+ * \param self BufferedWriter pointer
+ * \param chunk BufferChunk to spill
+ * \return 0 on success (or if there was nothing to spill), -1 otherwise
+ * \see spillReplay
+ */
+static int
+spillChunk(BufferedWriter* self, BufferChunk* chunk)
+{
+  SpillSegment* segment = self->spill_tail;
+  size_t len = mbuf_message(chunk->mbuf) - mbuf_rdptr(chunk->mbuf);
+  size_t size = (len > DEF_SPILL_SEGMENT_SIZE) ? len : DEF_SPILL_SEGMENT_SIZE;
+  char fn[PATH_MAX];
+  int fd, err;
+
+  if (0 == len) { return 0; }
+
+  if (NULL == segment || segment->size - segment->wr < len) {
+    snprintf(fn, sizeof(fn), "%s/oml-spill-XXXXXX", self->spill_dir);
+    if ((fd = mkstemp(fn)) < 0) {
+      logerror("%s: Cannot create spill file in '%s': %s\n", self->outStream->dest, self->spill_dir, strerror(errno));
+      return -1;
+    }
+    /* The data only needs to live as long as the mapping */
+    unlink(fn);
+    if ((err = posix_fallocate(fd, 0, size))) {
+      logerror("%s: Cannot allocate %dB spill file in '%s': %s\n", self->outStream->dest, size, self->spill_dir, strerror(err));
+      close(fd);
+      return -1;
+    }
+    if (NULL == (segment = (SpillSegment*)oml_malloc(sizeof(SpillSegment)))) {
+      close(fd);
+      return -1;
+    }
+    memset(segment, 0, sizeof(SpillSegment));
+    segment->size = size;
+    segment->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == segment->base) {
+      logerror("%s: Cannot map spill file: %s\n", self->outStream->dest, strerror(errno));
+      oml_free(segment);
+      return -1;
+    }
 
+    if (self->spill_tail) {
+      self->spill_tail->next = segment;
     } else {
-      self->last_failure_time = now;
-      if (!self->backoff) {
-        self->backoff = 1;
-      } else if (self->backoff < UINT8_MAX) {
-        self->backoff *= 2;
+      self->spill_head = segment;
+    }
+    self->spill_tail = segment;
+  }
+
+  if (0 == self->spill_size) {
+    logwarn("%s: Queue full, spilling samples to '%s'\n", self->outStream->dest, self->spill_dir);
+  }
+  memcpy(segment->base + segment->wr, mbuf_rdptr(chunk->mbuf), len);
+  segment->wr += len;
+  self->spill_size += len;
+  logdebug("%s: Spilled %dB (%dB pending)\n", self->outStream->dest, len, self->spill_size);
+
+  return 0;
+}
+
+/** Send the data spilled to disk, oldest first.
+ *
+ * Segments are unmapped once fully sent. The spill lock is not held while
+ * writing, as producers only ever append after the data being sent.
+ *
+ * \param self BufferedWriter pointer
+ * \return 1 if all spilled data has been sent, -1 on continuing back-off, -2 otherwise
+ * \see spillChunk
+ */
+static int
+spillReplay(BufferedWriter* self)
+{
+  SpillSegment* segment;
+  struct iovec iov;
+  time_t now;
+  ssize_t cnt;
+
+  while (1) {
+    oml_lock(&self->spill_lock, __FUNCTION__);
+    segment = self->spill_head;
+    if (segment) {
+      iov.iov_base = segment->base + segment->rd;
+      iov.iov_len = segment->wr - segment->rd;
+    }
+    oml_unlock(&self->spill_lock, __FUNCTION__);
+
+    if (NULL == segment) {
+      return 1;
+    }
+
+    if (iov.iov_len > 0) {
+      time(&now);
+      if (backingOff(self, now)) {
+        return -1;
+      }
+      oml_lock(&self->meta_lock, __FUNCTION__);
+      cnt = out_stream_writev(self->outStream, &iov, 1,
+          mbuf_rdptr(self->meta_buf), mbuf_fill(self->meta_buf));
+      oml_unlock(&self->meta_lock, __FUNCTION__);
+      if (cnt <= 0) {
+        writeFailed(self, now);
+        return -2;
+      }
+      writeSucceeded(self);
+    } else {
+      cnt = 0;
+    }
+
+    oml_lock(&self->spill_lock, __FUNCTION__);
+    segment->rd += cnt;
+    self->spill_size -= cnt;
+    if (segment->rd == segment->wr) {
+      if (segment == self->spill_tail) {
+        /* Drop the last segment too, so disk space is returned */
+        self->spill_tail = NULL;
+      }
+      self->spill_head = segment->next;
+      munmap(segment->base, segment->size);
+      oml_free(segment);
+      if (NULL == self->spill_head) {
+        loginfo("%s: All spilled samples sent\n", self->outStream->dest);
       }
-      logwarn("%s: Error sending, backing off for %ds\n", self->outStream->dest, self->backoff);
-      goto processChunk_cleanup;
     }
+    oml_unlock(&self->spill_lock, __FUNCTION__);
   }
-  ret = 1;
+}
 
-processChunk_cleanup:
-  return ret;
+/** Unlock the MBuffer held by a WriteSlot, or push its messages into the ring.
+ *
+ * \param self BufferedWriter pointer
+ * \param slot WriteSlot of the calling thread, holding an MBuffer
+ * \see bw_release_write_buf, bw_batch_end
+ */
+static void
+releaseWriteSlot(BufferedWriter* self, WriteSlot* slot)
+{
+  slot->held = 0;
+  slot->current = NULL;
+
+  if (BE_Ring == self->engine) {
+    ringFlushSlot(self, slot);
+
+  } else {
+    pthread_cond_signal(&self->semaphore); /* assume we locked for a reason */
+    oml_unlock(&slot->chunk->lock, __FUNCTION__);
+    slot->chunk = NULL;
+  }
+}
+
+/** Copy the complete messages of a WriteSlot's staging MBuffer into the ring.
+ *
+ * \param self BufferedWriter pointer
+ * \param slot WriteSlot of the calling thread
+ * \see ringPut
+ */
+static void
+ringFlushSlot(BufferedWriter* self, WriteSlot* slot)
+{
+  size_t size = mbuf_message_offset(slot->staging) - mbuf_read_offset(slot->staging);
+
+  if (size > 0) {
+    ringPut(self, mbuf_rdptr(slot->staging), size, slot->nmessages);
+  }
+  slot->nmessages = 0;
+  mbuf_clear2(slot->staging, 0);
+}
+
+/** Get the WriteSlot of the calling thread, creating it if needed.
+ *
+ * \param self BufferedWriter pointer
+ * \return the WriteSlot of the calling thread, or NULL on error
+ */
+static WriteSlot*
+getWriteSlot(BufferedWriter* self)
+{
+  WriteSlot* slot = (WriteSlot*)pthread_getspecific(self->slot_key);
+  if (slot) { return slot; }
+
+  if (NULL == (slot = (WriteSlot*)oml_malloc(sizeof(WriteSlot)))) {
+    return NULL;
+  }
+  memset(slot, 0, sizeof(WriteSlot));
+  slot->owner = self;
+
+  if (BE_Ring == self->engine && NULL == (slot->staging = mbuf_create())) {
+    oml_free(slot);
+    return NULL;
+  }
+
+  oml_lock(&self->lock, __FUNCTION__);
+  slot->next = self->slots;
+  self->slots = slot;
+  oml_unlock(&self->lock, __FUNCTION__);
+
+  pthread_setspecific(self->slot_key, slot);
+  return slot;
+}
+
+/** Destroy the WriteSlot of a thread when it exits.
+ *
+ * Any MBuffer still held, e.g., in an unfinished batch, is released, so the
+ * messages it contains are queued and, with the BE_Chain engine, the writer
+ * BufferChunk is unlocked. The slot is then removed from its BufferedWriter.
+ *
+ * \param value WriteSlot of the exiting thread
+ * \see getWriteSlot, pthread_key_create(3)
+ */
+static void
+destroyWriteSlot(void* value)
+{
+  WriteSlot* slot = (WriteSlot*)value;
+  BufferedWriter* self = slot->owner;
+  WriteSlot** prev;
+
+  if (slot->held) {
+    releaseWriteSlot(self, slot);
+  } else if (BE_Ring == self->engine) {
+    ringFlushSlot(self, slot);
+  }
+
+  oml_lock(&self->lock, __FUNCTION__);
+  for (prev = &self->slots; *prev; prev = &(*prev)->next) {
+    if (*prev == slot) {
+      *prev = slot->next;
+      break;
+    }
+  }
+  oml_unlock(&self->lock, __FUNCTION__);
+
+  if (slot->staging) { mbuf_destroy(slot->staging); }
+  oml_free(slot);
+}
+
+/** Copy a record into the ring, without locking.
+ *
+ * Space is reserved by atomically advancing the ring head, then the data is
+ * copied in, and the record is committed by writing its length in its header.
+ * If the ring is full, the data is dropped and accounted for in nlost.
+ *
+ * \param self BufferedWriter pointer
+ * \param data pointer to the data to add
+ * \param size size of data
+ * \param nmessages number of messages contained in data
+ * \return 1 if success, 0 otherwise
+ */
+static int
+ringPut(BufferedWriter* self, const uint8_t* data, size_t size, int nmessages)
+{
+  size_t head, tail, first;
+  size_t need = RING_RECORD_SIZE(size);
+  size_t mask = self->ring_size - 1;
+  size_t off;
+
+  if (0 == size) { return 1; }
+
+  do {
+    /* Read the tail first, so head - tail never underflows */
+    tail = self->ring_tail;
+    __sync_synchronize();
+    head = self->ring_head;
+    if (need > self->ring_size || head + need - tail > self->ring_size || size > UINT32_MAX) {
+      __sync_fetch_and_add(&self->nlost, nmessages);
+      __sync_fetch_and_add(&self->ndrops, 1);
+      if (!__sync_lock_test_and_set(&self->ring_full, 1)) {
+        logwarn("%s: Queue full, dropping samples\n", self->outStream->dest);
+      }
+      return 0;
+    }
+  } while (!__sync_bool_compare_and_swap(&self->ring_head, head, head + need));
+
+  off = (head + RING_HEADER_SIZE) & mask;
+  first = self->ring_size - off;
+  if (first >= size) {
+    memcpy(self->ring + off, data, size);
+  } else {
+    memcpy(self->ring + off, data, first);
+    memcpy(self->ring, data + first, size - first);
+  }
+
+  /* Commit */
+  __sync_synchronize();
+  *(volatile uint32_t*)(self->ring + (head & mask)) = (uint32_t)size;
+  __sync_synchronize();
+
+  if (self->sleeping) {
+    oml_lock(&self->lock, __FUNCTION__);
+    pthread_cond_signal(&self->semaphore);
+    oml_unlock(&self->lock, __FUNCTION__);
+  }
+  return 1;
+}
+
+/** Move committed records from the ring into an MBuffer.
+ *
+ * Only the reader thread should call this function.
+ *
+ * \param self BufferedWriter pointer
+ * \param mbuf MBuffer to copy the records into
+ * \param max number of bytes after which to stop copying records
+ * \return the number of bytes copied
+ */
+static size_t
+ringGet(BufferedWriter* self, MBuffer* mbuf, size_t max)
+{
+  size_t tail = self->ring_tail;
+  size_t mask = self->ring_size - 1;
+  size_t got = 0, off, first, need;
+  uint32_t len;
+
+  while (got < max) {
+    off = tail & mask;
+    if (0 == (len = *(volatile uint32_t*)(self->ring + off))) {
+      break; /* Not committed yet */
+    }
+    __sync_synchronize();
+    need = RING_RECORD_SIZE(len);
+
+    off = (off + RING_HEADER_SIZE) & mask;
+    first = self->ring_size - off;
+    if (first >= len) {
+      mbuf_write(mbuf, self->ring + off, len);
+    } else {
+      mbuf_write(mbuf, self->ring + off, first);
+      mbuf_write(mbuf, self->ring, len - first);
+    }
+
+    /* Clear the whole record, so stale data is not mistaken for a header */
+    off = tail & mask;
+    first = self->ring_size - off;
+    if (first >= need) {
+      memset(self->ring + off, 0, need);
+    } else {
+      memset(self->ring + off, 0, first);
+      memset(self->ring, 0, need - first);
+    }
+
+    tail += need;
+    got += len;
+  }
+
+  if (got > 0) {
+    mbuf_begin_write(mbuf);
+    __sync_synchronize();
+    self->ring_tail = tail;
+    self->ring_full = 0;
+  }
+  return got;
+}
+
+/** Check whether a committed record is waiting at the tail of the ring.
+ *
+ * \param self BufferedWriter pointer
+ * \return !0 if there is nothing to read, 0 otherwise
+ */
+static int
+ringEmpty(BufferedWriter* self)
+{
+  return 0 == *(volatile uint32_t*)(self->ring + (self->ring_tail & (self->ring_size - 1)));
+}
+
+/** Writing thread for the BE_Ring engine.
+ *
+ * \param handle the BufferedWriter to drain
+ * \return 1 if all the ring has been processed, <1 otherwise
+ */
+static void*
+ringWriterThread(void* handle)
+{
+  int allsent = 1;
+  BufferedWriter* self = (BufferedWriter*)handle;
+  struct timeval tv;
+  struct timespec ts;
+
+  while (self->active) {
+    oml_lock(&self->lock, __FUNCTION__);
+    self->sleeping = 1;
+    /* Pairs with the barrier between commit and sleeping check in ringPut */
+    __sync_synchronize();
+    if (self->active && (allsent < 1 || ringEmpty(self))) {
+      /* Also wake up regularly to retry after a back-off */
+      gettimeofday(&tv, NULL);
+      ts.tv_sec = tv.tv_sec + 1;
+      ts.tv_nsec = tv.tv_usec * 1000;
+      pthread_cond_timedwait(&self->semaphore, &self->lock, &ts);
+    }
+    self->sleeping = 0;
+    oml_unlock(&self->lock, __FUNCTION__);
+
+    while ((allsent = processRing(self)) > 0 && !ringEmpty(self));
+  }
+  /* Drain this writer before terminating */
+  while ((allsent = processRing(self)) >= -1) {
+    if (allsent > 0 && ringEmpty(self)) { break; }
+  }
+  self->retval = allsent;
+  pthread_exit(&(self->retval));
+}
+
+/** Send data available in the ring.
+ *
+ * The double buffer is refilled from the ring once all its data has been sent.
+ *
+ * \param self BufferedWriter to process
+ * \return 1 if all data read has been sent, -1 on continuing back-off, -2 otherwise
+ * \see writeReadBufs
+ */
+static int
+processRing(BufferedWriter* self)
+{
+  MBuffer *read_buf = self->read_buf;
+
+  if (mbuf_message(read_buf) <= mbuf_rdptr(read_buf)) {
+    mbuf_clear2(read_buf, 0);
+    if (0 == ringGet(self, read_buf, self->ring_size / 4)) {
+      return 1;
+    }
+  }
+
+  return writeReadBufs(self, &read_buf, 1);
 }
 
 /*
@@ -19,9 +19,12 @@
 #include "mbuf.h"
 
 BufferedWriter* bw_create(OmlOutStream* outStream, long queueCapacity, long chainSize);
+BufferedWriter* bw_create2(OmlOutStream* outStream, long queueCapacity, long chainSize, enum BufferEngine engine);
 
 void bw_close(BufferedWriter* instance);
 
+int bw_spill_enable(BufferedWriter* instance, const char* dir);
+
 int bw_push(BufferedWriter* instance, uint8_t* data, size_t size);
 int _bw_push(BufferedWriter* instance, uint8_t* data, size_t size);
 int bw_push_meta(BufferedWriter* instance, uint8_t* data, size_t size);
@@ -30,11 +33,17 @@ int _bw_push_meta(BufferedWriter* instance, uint8_t* data, size_t size);
 int bw_msgcount_add(BufferedWriter* instance, int nmessages);
 int bw_msgcount_reset(BufferedWriter* instance);
 int bw_nlost_reset(BufferedWriter* instance);
+int bw_ndrops(BufferedWriter* instance);
 
 MBuffer* bw_get_write_buf(BufferedWriter* instance);
+MBuffer* bw_current_write_buf(BufferedWriter* instance);
+void bw_abort_write_buf(BufferedWriter* instance);
 
 void bw_release_write_buf(BufferedWriter* instance);
 
+int bw_batch_begin(BufferedWriter* instance);
+void bw_batch_end(BufferedWriter* instance);
+
 #endif // OML_BUFFERED_WRITER_H_
 
 /*
@@ -16,6 +16,7 @@
 
 #include <stdio.h>
 #include <time.h>
+#include <sys/time.h>
 #include <oml2/omlc.h>
 #include <oml2/oml_filter.h>
 #include <oml2/oml_writer.h>
@@ -80,6 +81,18 @@ typedef struct OmlClient {
   /** Minimum period between client instrumentation reports [s] (0 == disabled) */
   uint32_t instr_interval;
 
+  /** Stage injected samples per thread, on MSs where all filters can merge them */
+  int thread_staging;
+
+  /** Directory in which writers spill their queue when full, or NULL to drop samples */
+  const char* spill_dir;
+
+  /** Number of samples binary writers accumulate per stream and send in a single block, or 0 */
+  int block_rows;
+
+  /** Number of strings binary writers send once per connection, and refer to by an identifier afterwards, or 0 */
+  int dict_size;
+
 } OmlClient;
 
 /** Global OmlClient instance */
@@ -108,7 +121,20 @@ OmlFilter* create_default_filter(OmlMPDef* def, OmlMStream* ms, int index);
 /* from filter.c */
 
 void filter_engine_start(OmlMStream* mp);
+void filter_engine_stop(OmlMStream* ms);
+void filter_engine_shutdown(void);
 extern int filter_process(OmlMStream* mp);
+int filter_process_at(OmlMStream* ms, const struct timeval* tv);
+int filter_passthrough_enable(OmlMStream* ms);
+int filter_passthrough(OmlMStream* ms, OmlValueU* values, const struct timeval* tv);
+void filter_fanout_destroy(OmlMStream* ms);
+
+/* from staging.c */
+
+int ms_staging_enable(OmlMStream* ms);
+int ms_staging_inject(OmlMStream* ms, OmlValueU* values, OmlValue* v);
+void ms_staging_merge(OmlMStream* ms);
+void ms_staging_destroy(OmlMStream* ms);
 
 /* from misc.c */
 
@@ -26,6 +26,7 @@
 
 static ssize_t file_stream_write(OmlOutStream* hdl, uint8_t* buffer, size_t  length, uint8_t* header, size_t  header_length);
 static ssize_t file_stream_write_flush(OmlOutStream* hdl, uint8_t* buffer, size_t length, uint8_t* header, size_t header_length);
+static ssize_t file_stream_writev(OmlOutStream* hdl, const struct iovec* iov, int iovcnt, uint8_t* header, size_t header_length);
 static int file_stream_close(OmlOutStream* hdl);
 
 /** Create a new out stream for writing into a local file.
@@ -59,6 +60,7 @@ file_stream_new(const char *file)
   mstring_delete(dest);
 
   self->write = file_stream_write;
+  self->writev = file_stream_writev;
   self->close = file_stream_close;
   return (OmlOutStream*)self;
 }
@@ -126,6 +128,54 @@ file_stream_write_flush(OmlOutStream* hdl, uint8_t* buffer, size_t length, uint8
   return count;
 }
 
+/** Write several buffers to a file
+ *
+ * If the stream is unbuffered, the data is written with a single writev(2),
+ * after flushing what might still be buffered in the FILE. Otherwise, the
+ * buffers are handed over to fwrite(3) in turn, so small writes keep being
+ * coalesced.
+ *
+ * \param hdl pointer to the OmlOutStream
+ * \param iov array of buffers to write
+ * \param iovcnt number of buffers in iov
+ * \param header pointer to an optional buffer containing headers to be sent after (re)connecting
+ * \param header_length length of the header to write; must be 0 if header is NULL
+ * \return amount of data written, or -1 on error
+ * \see oml_outs_writev_f, file_stream_set_buffered
+ */
+static ssize_t
+file_stream_writev(OmlOutStream* hdl, const struct iovec* iov, int iovcnt, uint8_t* header, size_t header_length)
+{
+  OmlFileOutStream* self = (OmlFileOutStream*)hdl;
+  ssize_t count = 0;
+  size_t written;
+  int i;
+
+  /* The header can be NULL, but header_length MUST be 0 in that case */
+  assert(header || !header_length);
+
+  if (!self) return -1;
+  if (!self->f) return -1;
+
+  out_stream_write_header(hdl, _file_stream_write, header, header_length);
+
+  if (file_stream_get_buffered(hdl)) {
+    for (i = 0; i < iovcnt; i++) {
+      written = fwrite(iov[i].iov_base, 1, iov[i].iov_len, self->f);
+      count += written;
+      if (written < iov[i].iov_len) {
+        break;
+      }
+    }
+
+  } else {
+    fflush(self->f);
+    count = writev(fileno(self->f), iov, iovcnt);
+  }
+
+  return count;
+}
+
 /** * Set the buffering startegy of an OmlOutStream
  *
  * Tell whether fflush(3) should be used after each write.
@@ -31,6 +31,9 @@ typedef struct OmlFileOutStream {
   /** \see OmlOutStream::header_written */
   int   header_written;
 
+  /** \see OmlOutStream::writev, oml_outs_writev_f */
+  oml_outs_writev_f writev;
+
   /*
    * Fields specific to the OmlFileOutStream
    */
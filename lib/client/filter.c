@@ -29,63 +29,423 @@
 #include <errno.h>
 #include <sys/time.h>
 #include <time.h>
-#include <pthread.h>
-#define _XOPEN_SOURCE 500     /* Or: #define _BSD_SOURCE; for useconds_t to be defined */
-#include <unistd.h>
 
 #include "oml2/omlc.h"
 #include "oml2/oml_filter.h"
 #include "oml2/oml_writer.h"
 #include "ocomm/o_log.h"
 #include "client.h"
+#include "mem.h"
+#include "mbuf.h"
+#include "filter/factory.h"
 
-static void* thread_start(void* handle);
+static void* scheduler_start(void* handle);
+static void timeradd_interval(struct timeval* tv, double interval);
+static void sched_push(OmlMStream* ms, const struct timeval* deadline);
+static void sched_remove(int i);
+static int fanout_capture(OmlMStream* ms);
+static void filter_fanout(OmlMStream* ms, double now, OmlValue* values, int count);
 
 extern OmlClient* omlc_instance;
 
+/** An interval-based MS waiting for its next deadline */
+typedef struct ScheduledMS {
+
+  struct timeval deadline;	/**< Absolute time at which the MS is next due */
+
+  OmlMStream* ms;		/**< MS to process */
+
+} ScheduledMS;
+
+/** Timer scheduler for all interval-based MSs
+ *
+ * A single thread waits for the earliest deadline in a binary min-heap of
+ * ScheduledMSs, runs filter_process() for all the MSs due, and reschedules
+ * them one interval after their previous deadline, so reporting does not drift
+ * with processing time.
+ */
+static struct {
+
+  pthread_mutex_t lock;		/**< Protects all fields of the scheduler */
+  pthread_cond_t cond;		/**< Signalled when the heap changes, or the scheduler is stopped */
+  pthread_t thread;		/**< Scheduler thread */
+  int running;			/**< Set to !0 while the thread should run */
+
+  ScheduledMS* heap;		/**< Min-heap of ScheduledMSs, ordered by deadline */
+  int size;			/**< Number of ScheduledMSs in the heap */
+  int capacity;			/**< Allocated number of ScheduledMSs in the heap */
+
+  OmlMStream* current;		/**< MS being processed, out of the heap, or NULL */
+
+} scheduler = {
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, NULL, 0, 0, NULL
+};
+
+/** A serialised sample, shared by all the writers of an MS using the same encoding */
+typedef struct FanoutRow {
+
+  MBuffer* mbuf;	/**< Serialised sample, as the current message */
+
+  int encoded;		/**< Set to 1 if the sample has been successfully serialised */
+
+} FanoutRow;
+
+struct OmlMSFanout {
+
+  OmlValue* values;	/**< Shallow copies of the results of all the filters of the MS */
+  int count;		/**< Number of values in the current sample */
+  int length;		/**< Allocated length of values */
+
+  FanoutRow* rows;	/**< One slot per writer, only used by the first writer with each row_encode */
+  int nrows;		/**< Allocated length of rows */
+
+};
+
+/** An OmlWriter collecting the results output by filters into an OmlMSFanout */
+typedef struct FanoutCapture {
+
+  OmlWriter writer;	/**< Only out() is used; must come first */
+
+  OmlMSFanout* fanout;	/**< Fanout in which to collect the results */
+
+} FanoutCapture;
+
 /** Start the filtering engine on the given MS
+ *
+ * The MS is added to the timer scheduler, which is started if needed.
+ *
  * \param ms pointer to OmlMStream to start filtering on
+ * \see filter_engine_stop, filter_engine_shutdown
  */
 void
 filter_engine_start(OmlMStream* ms)
 {
-  logdebug ("Starting filtering thread for MS '%s'\n", ms->table_name);
-  pthread_create(&ms->filter_thread, NULL, thread_start, (void*)ms);
+  struct timeval deadline;
+
+  logdebug ("Scheduling MS '%s' every %fs\n", ms->table_name, ms->sample_interval);
+
+  gettimeofday(&deadline, NULL);
+  timeradd_interval(&deadline, ms->sample_interval);
+
+  oml_lock(&scheduler.lock, __FUNCTION__);
+  if (!scheduler.running) {
+    if (pthread_create(&scheduler.thread, NULL, scheduler_start, NULL)) {
+      logerror("Cannot start filtering thread: %s\n", strerror(errno));
+      oml_unlock(&scheduler.lock, __FUNCTION__);
+      return;
+    }
+    scheduler.running = 1;
+  }
+  sched_push(ms, &deadline);
+  pthread_cond_signal(&scheduler.cond);
+  oml_unlock(&scheduler.lock, __FUNCTION__);
 }
 
-/** Filtering thread
+/** Remove an MS from the timer scheduler
  *
- * Loops until the stream is not active anymore, or an error occurs
+ * \warning The lock of the MS's MP should be held when calling this function,
+ * so the MS is not being processed concurrently.
  *
- * \param handle pointer to OmlMStream to use the filters on (cast as void*)
+ * \param ms pointer to OmlMStream to stop filtering on
+ * \see filter_engine_start
+ */
+void
+filter_engine_stop(OmlMStream* ms)
+{
+  int i;
+
+  oml_lock(&scheduler.lock, __FUNCTION__);
+  if (scheduler.current == ms) {
+    scheduler.current = NULL;
+  }
+  for (i = 0; i < scheduler.size; i++) {
+    if (scheduler.heap[i].ms == ms) {
+      sched_remove(i);
+      break;
+    }
+  }
+  oml_unlock(&scheduler.lock, __FUNCTION__);
+}
+
+/** Stop the timer scheduler thread, and free its memory
  *
- * \return NULL, inconditionally; shouldn't return in normal operation
+ * \see filter_engine_start, omlc_close
+ */
+void
+filter_engine_shutdown(void)
+{
+  int running;
+
+  oml_lock(&scheduler.lock, __FUNCTION__);
+  running = scheduler.running;
+  scheduler.running = 0;
+  pthread_cond_signal(&scheduler.cond);
+  oml_unlock(&scheduler.lock, __FUNCTION__);
+
+  if (running) {
+    pthread_join(scheduler.thread, NULL);
+  }
+
+  oml_lock(&scheduler.lock, __FUNCTION__);
+  oml_free(scheduler.heap);
+  scheduler.heap = NULL;
+  scheduler.size = scheduler.capacity = 0;
+  scheduler.current = NULL;
+  oml_unlock(&scheduler.lock, __FUNCTION__);
+}
+
+/** Add a number of seconds to a struct timeval
+ * \param tv struct timeval to update
+ * \param interval number of seconds to add
+ */
+static void
+timeradd_interval(struct timeval* tv, double interval)
+{
+  struct timeval add;
+  add.tv_sec = (time_t)interval;
+  add.tv_usec = (suseconds_t)((interval - add.tv_sec) * 1000000);
+  timeradd(tv, &add, tv);
+}
+
+/** Swap two ScheduledMSs in the heap */
+static void
+sched_swap(int i, int j)
+{
+  ScheduledMS tmp = scheduler.heap[i];
+  scheduler.heap[i] = scheduler.heap[j];
+  scheduler.heap[j] = tmp;
+}
+
+/** Restore the heap property from position i, moving up then down */
+static void
+sched_sift(int i)
+{
+  int child;
+
+  while (i > 0 && timercmp(&scheduler.heap[i].deadline, &scheduler.heap[(i - 1) / 2].deadline, <)) {
+    sched_swap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+  while ((child = 2 * i + 1) < scheduler.size) {
+    if (child + 1 < scheduler.size &&
+        timercmp(&scheduler.heap[child + 1].deadline, &scheduler.heap[child].deadline, <)) {
+      child++;
+    }
+    if (!timercmp(&scheduler.heap[child].deadline, &scheduler.heap[i].deadline, <)) {
+      break;
+    }
+    sched_swap(i, child);
+    i = child;
+  }
+}
+
+/** Add an MS to the heap (lock must be held)
+ * \param ms OmlMStream to schedule
+ * \param deadline absolute time at which ms is due
+ */
+static void
+sched_push(OmlMStream* ms, const struct timeval* deadline)
+{
+  ScheduledMS* heap;
+  int capacity;
+
+  if (scheduler.size >= scheduler.capacity) {
+    capacity = scheduler.capacity ? 2 * scheduler.capacity : 16;
+    if (!(heap = oml_realloc(scheduler.heap, capacity * sizeof(ScheduledMS)))) {
+      logerror("Cannot schedule MS '%s'\n", ms->table_name);
+      return;
+    }
+    scheduler.heap = heap;
+    scheduler.capacity = capacity;
+  }
+  scheduler.heap[scheduler.size].ms = ms;
+  scheduler.heap[scheduler.size].deadline = *deadline;
+  sched_sift(scheduler.size++);
+}
+
+/** Remove the i-th ScheduledMS from the heap (lock must be held) */
+static void
+sched_remove(int i)
+{
+  scheduler.heap[i] = scheduler.heap[--scheduler.size];
+  if (i < scheduler.size) {
+    sched_sift(i);
+  }
+}
+
+/** Timer scheduler thread
+ *
+ * Waits for the earliest deadline, and processes the due MS, until
+ * filter_engine_shutdown() is called.
+ *
+ * \param handle unused
+ * \return NULL, inconditionally
+ * \see filter_engine_start, filter_process
  */
 static void*
-thread_start(void* handle)
+scheduler_start(void* handle)
 {
-  OmlMStream* ms = (OmlMStream*)handle;
-  OmlMP* mp = ms->mp;
-  useconds_t usec = (useconds_t)(1000000 * ms->sample_interval);
-  int status = 0;
+  (void)handle;
+  OmlMStream* ms;
+  OmlMP* mp;
+  ScheduledMS next;
+  struct timeval now;
+  struct timespec ts;
+  int due;
+
+  oml_lock(&scheduler.lock, __FUNCTION__);
+  while (scheduler.running) {
+    if (0 == scheduler.size) {
+      pthread_cond_wait(&scheduler.cond, &scheduler.lock);
+      continue;
+    }
+
+    gettimeofday(&now, NULL);
+    next = scheduler.heap[0];
+    if (timercmp(&now, &next.deadline, <)) {
+      ts.tv_sec = next.deadline.tv_sec;
+      ts.tv_nsec = next.deadline.tv_usec * 1000;
+      pthread_cond_timedwait(&scheduler.cond, &scheduler.lock, &ts);
+      continue;
+    }
+
+    sched_remove(0);
+    ms = next.ms;
+    mp = ms->mp;
+    scheduler.current = ms;
+    oml_unlock(&scheduler.lock, __FUNCTION__);
 
-  while (1) {
-    usleep(usec);
     if (!mp_lock(mp)) {
-      if (!mp->active) {
-        mp_unlock(mp);
-        return NULL;  // we are done
-      }
+      /* The MS might have been destroyed while we were waiting for the lock */
+      oml_lock(&scheduler.lock, __FUNCTION__);
+      due = (scheduler.current == ms);
+      oml_unlock(&scheduler.lock, __FUNCTION__);
 
-      status = filter_process(ms);
+      if (due && mp->active && filter_process(ms) == -1) {
+        due = 0; /* Fatal error, stop reporting this MS */
+      }
       mp_unlock(mp);
+
+      oml_lock(&scheduler.lock, __FUNCTION__);
+      if (due && scheduler.current == ms) {
+        /* Skip the deadlines we have missed, rather than catching up in a burst */
+        do {
+          timeradd_interval(&next.deadline, ms->sample_interval);
+        } while (!timercmp(&now, &next.deadline, <));
+        sched_push(ms, &next.deadline);
+      }
+    } else {
+      oml_lock(&scheduler.lock, __FUNCTION__);
     }
+    scheduler.current = NULL;
+  }
+  oml_unlock(&scheduler.lock, __FUNCTION__);
+
+  return NULL;
+}
+
+/** Maximum number of fields of an MS output without filtering */
+#define PASSTHROUGH_MAX_FIELDS 64
 
-    if (status == -1) {
-      return NULL; // Fatal error --> exit thread
+/** Enable the passthrough path on an MS, if it doesn't need any filtering.
+ *
+ * This is the case if the MS reports every sample, and all its filters only
+ * forward the latest sample, as with the default configuration.
+ *
+ * \param ms MS to examine
+ * \return 1 if passthrough has been enabled, 0 otherwise
+ * \see filter_passthrough, create_default_filters
+ */
+int
+filter_passthrough_enable(OmlMStream* ms)
+{
+  OmlFilter* f;
+  int n = 0;
+
+  ms->passthrough = 0;
+  if (ms->sample_thres != 1 || ms->sample_interval > 0 || !ms->filters) {
+    return 0;
+  }
+
+  for (f = ms->filters; f; f = f->next, n++) {
+    if (n >= PASSTHROUGH_MAX_FIELDS || f->output_count != 1 ||
+        (!filter_is_type(f, "first") && !filter_is_type(f, "last"))) {
+      return 0;
     }
+  }
+
+  logdebug("%s: Outputting samples without filtering\n", ms->table_name);
+  ms->passthrough = 1;
+  return 1;
+}
+
+/** Output an injected sample on an MS without going through its filters.
+ *
+ * The values are marshalled straight from the caller's array, in the order of
+ * the MS's filters, without being copied into the filters' results.
+ *
+ * \warning The MP lock should be held when calling this function.
+ *
+ * \param ms MS with passthrough enabled
+ * \param values array of OmlValueU, as passed to omlc_inject
+ * \param tv time to timestamp the sample with, or NULL to use the current time
+ * \return 0 if success, -1 otherwise
+ * \see filter_passthrough_enable, filter_process
+ */
+int
+filter_passthrough(OmlMStream* ms, OmlValueU* values, const struct timeval* tv)
+{
+  OmlValue row[PASSTHROUGH_MAX_FIELDS];
+  OmlMPDef* defs = ms->mp->param_defs;
+  OmlFilter* f;
+  OmlWriter* writer;
+  struct timeval tnow;
+  double now;
+  int i, n;
+
+  if (!tv) {
+    gettimeofday(&tnow, NULL);
+    tv = &tnow;
+  }
+
+  if (omlc_instance == NULL || ms->writers == NULL) {
+    logerror("Could not output sample because of null instance or writers array\n");
+    return -1;
+  }
 
+  now = tv->tv_sec - omlc_instance->start_time + 0.000001 * tv->tv_usec;
+  ms->seq_no++;
+
+  /* Shallow copies: the writers only read the values, and don't free them */
+  for (f = ms->filters, n = 0; f; f = f->next, n++) {
+    row[n].type = defs[f->index].param_types;
+    row[n].value = values[f->index];
+  }
+
+  if (ms->nwriters > 1) {
+    filter_fanout(ms, now, row, n);
+    return 0;
+  }
+
+  for (i=0; i<ms->nwriters; i++) {
+    writer = ms->writers[i];
+
+    if (writer == NULL) {
+      logwarn("%s: Sending data NULL writer (at %d)\n", ms->table_name, i);
+
+    } else {
+      /* row_end must always be called after row_start, see filter_process */
+      if(writer->row_start(writer, ms, now) == 1)
+        ms->written++;
+      else
+        ms->dropped++;
+
+      writer->out(writer, row, n);
+      writer->row_end(writer, ms);
+    }
   }
+
+  return 0;
 }
 
 /** Run filters associated to an MS.
@@ -98,49 +458,77 @@ thread_start(void* handle)
  * \return 0 if success, -1 otherwise
  *
  * \see OmlWriter, oml_writer_row_start, oml_writer_out, oml_writer_row_end
+ * \see filter_process_at
  */
 int
 filter_process(OmlMStream* ms)
 {
   struct timeval tv;
+
+  /* Get the time as soon as possible */
+  gettimeofday(&tv, NULL);
+
+  return filter_process_at(ms, &tv);
+}
+
+/** Run filters associated to an MS, timestamping the output at a given time.
+ *
+ * This allows callers generating several samples in a row to only get the
+ * time once.
+ *
+ * \param ms MS to generate output for
+ * \param tv time at which the sample is generated
+ * \return 0 if success, -1 otherwise
+ *
+ * \see filter_process, omlc_inject_batch
+ */
+int
+filter_process_at(OmlMStream* ms, const struct timeval* tv)
+{
   double now;
   int i;
   OmlFilter *f;
   OmlWriter *writer;
 
-  /* Get the time as soon as possible */
-  gettimeofday(&tv, NULL);
-
   if (ms == NULL || omlc_instance == NULL || ms->writers == NULL) {
     logerror("Could not process filters because of null measurement stream, instance or writers array\n");
     return -1;
   }
 
-  now = tv.tv_sec - omlc_instance->start_time + 0.000001 * tv.tv_usec;
+  now = tv->tv_sec - omlc_instance->start_time + 0.000001 * tv->tv_usec;
   ms->seq_no++;
 
-  for (i=0; i<ms->nwriters; i++) {
-    writer = ms->writers[i];
+  if (ms->staging) {
+    ms_staging_merge(ms);
+  }
 
-    if (writer == NULL) {
-      logwarn("%s: Sending data NULL writer (at %d)\n", ms->table_name, i);
+  if (ms->nwriters > 1 && !fanout_capture(ms)) {
+    filter_fanout(ms, now, ms->fanout->values, ms->fanout->count);
 
-    } else {
-      /* Be aware that row_start is obtaining a lock on the writer
-       * which is released in row_end. Always ensure that row_end is
-       * called, even if there is a problem somewhere along the way.
-       * \see oml_writer_row_start, oml_writer_out, oml_writer_row_end
-       */
-      if(writer->row_start(writer, ms, now) == 1)
-        ms->written++;
-      else
-        ms->dropped++;
+  } else {
+    for (i=0; i<ms->nwriters; i++) {
+      writer = ms->writers[i];
 
-      f = ms->firstFilter;
-      for (; f != NULL; f = f->next) {
-        f->output(f, writer);
+      if (writer == NULL) {
+        logwarn("%s: Sending data NULL writer (at %d)\n", ms->table_name, i);
+
+      } else {
+        /* Be aware that row_start is obtaining a lock on the writer
+         * which is released in row_end. Always ensure that row_end is
+         * called, even if there is a problem somewhere along the way.
+         * \see oml_writer_row_start, oml_writer_out, oml_writer_row_end
+         */
+        if(writer->row_start(writer, ms, now) == 1)
+          ms->written++;
+        else
+          ms->dropped++;
+
+        f = ms->firstFilter;
+        for (; f != NULL; f = f->next) {
+          f->output(f, writer);
+        }
+        writer->row_end(writer, ms);
       }
-      writer->row_end(writer, ms);
     }
   }
 
@@ -153,6 +541,174 @@ filter_process(OmlMStream* ms)
   return 0;
 }
 
+/** Get the OmlMSFanout of an MS, creating it if needed.
+ * \param ms OmlMStream
+ * \return the OmlMSFanout, or NULL on error
+ */
+static OmlMSFanout*
+fanout_get(OmlMStream* ms)
+{
+  if (!ms->fanout && (ms->fanout = oml_malloc(sizeof(OmlMSFanout)))) {
+    memset(ms->fanout, 0, sizeof(OmlMSFanout));
+  }
+  return ms->fanout;
+}
+
+/** Collect the results output by a filter.
+ * \see oml_writer_out, fanout_capture
+ */
+static int
+fanout_capture_out(OmlWriter* writer, OmlValue* values, int values_count)
+{
+  OmlMSFanout* fanout = ((FanoutCapture*)writer)->fanout;
+  OmlValue* new_values;
+  int length;
+
+  if (fanout->count + values_count > fanout->length) {
+    length = 2 * (fanout->count + values_count);
+    if (!(new_values = oml_realloc(fanout->values, length * sizeof(OmlValue)))) {
+      return 0;
+    }
+    fanout->values = new_values;
+    fanout->length = length;
+  }
+
+  /* Shallow copies: the filters' results stay valid until their newwindow() */
+  memcpy(&fanout->values[fanout->count], values, values_count * sizeof(OmlValue));
+  fanout->count += values_count;
+
+  return values_count;
+}
+
+/** Collect the results of all the filters of an MS into its OmlMSFanout.
+ *
+ * \param ms OmlMStream whose filters to output
+ * \return 0 on success, -1 otherwise (the filters should then be output separately to each writer)
+ * \see filter_fanout
+ */
+static int
+fanout_capture(OmlMStream* ms)
+{
+  FanoutCapture capture;
+  OmlFilter* f;
+  int expected = 0;
+
+  memset(&capture, 0, sizeof(capture));
+  capture.writer.out = fanout_capture_out;
+  if (!(capture.fanout = fanout_get(ms))) {
+    return -1;
+  }
+
+  ms->fanout->count = 0;
+  for (f = ms->firstFilter; f; f = f->next) {
+    f->output(f, &capture.writer);
+    expected += f->output_count;
+  }
+
+  return (ms->fanout->count == expected) ? 0 : -1;
+}
+
+/** Output a sample on all the writers of an MS, serialising it only once per encoding.
+ *
+ * Writers sharing the same oml_writer_row_encode function get the sample
+ * serialised by the first of them. Writers not supporting it have it output
+ * through their row_start/out/row_end functions, as usual.
+ *
+ * \warning The MP lock should be held when calling this function.
+ *
+ * \param ms OmlMStream to output the sample for
+ * \param now timestamp of the sample
+ * \param values array of the output values of the filters
+ * \param count number of values
+ * \see filter_process_at, filter_passthrough, oml_writer_row_encode, oml_writer_row_push
+ */
+static void
+filter_fanout(OmlMStream* ms, double now, OmlValue* values, int count)
+{
+  OmlMSFanout* fanout;
+  OmlWriter *writer, *w;
+  FanoutRow* rows;
+  int i, j, ok;
+
+  if (!(fanout = fanout_get(ms))) {
+    return;
+  }
+
+  if (fanout->nrows < ms->nwriters) {
+    if (!(rows = oml_realloc(fanout->rows, ms->nwriters * sizeof(FanoutRow)))) {
+      return;
+    }
+    memset(&rows[fanout->nrows], 0, (ms->nwriters - fanout->nrows) * sizeof(FanoutRow));
+    fanout->rows = rows;
+    fanout->nrows = ms->nwriters;
+  }
+
+  for (i=0; i<ms->nwriters; i++) {
+    writer = ms->writers[i];
+
+    if (writer == NULL) {
+      logwarn("%s: Sending data NULL writer (at %d)\n", ms->table_name, i);
+      continue;
+
+    } else if (!writer->row_encode || !writer->row_push) {
+      /* row_end must always be called after row_start, see filter_process */
+      ok = writer->row_start(writer, ms, now);
+      writer->out(writer, values, count);
+      writer->row_end(writer, ms);
+
+    } else {
+      /* Find the first writer using the same encoding */
+      for (j = 0; j < i; j++) {
+        w = ms->writers[j];
+        if (w && w->row_encode == writer->row_encode && w->row_push) {
+          break;
+        }
+      }
+
+      if (j == i) {
+        if (!fanout->rows[i].mbuf && !(fanout->rows[i].mbuf = mbuf_create())) {
+          fanout->rows[i].encoded = 0;
+        } else {
+          mbuf_clear2(fanout->rows[i].mbuf, 0);
+          fanout->rows[i].encoded =
+            writer->row_encode(writer, fanout->rows[i].mbuf, ms, now, values, count);
+        }
+      }
+
+      ok = fanout->rows[j].encoded &&
+        writer->row_push(writer, ms, fanout->rows[j].mbuf);
+    }
+
+    if (ok == 1)
+      ms->written++;
+    else
+      ms->dropped++;
+  }
+}
+
+/** Free the fan-out state of an MS.
+ *
+ * \param ms OmlMStream whose OmlMSFanout to free
+ * \see filter_fanout
+ */
+void
+filter_fanout_destroy(OmlMStream* ms)
+{
+  int i;
+
+  if (!ms || !ms->fanout) {
+    return;
+  }
+
+  for (i = 0; i < ms->fanout->nrows; i++) {
+    mbuf_destroy(ms->fanout->rows[i].mbuf);
+  }
+  oml_free(ms->fanout->rows);
+  oml_free(ms->fanout->values);
+  oml_free(ms->fanout);
+  ms->fanout = NULL;
+}
+
 /*
  Local Variables:
  mode: C
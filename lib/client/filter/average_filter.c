@@ -22,6 +22,7 @@
 #include "ocomm/o_log.h"
 #include "oml_value.h"
 #include "average_filter.h"
+#include "batch.h"
 
 #define FILTER_NAME  "avg"
 
@@ -33,9 +34,15 @@ process(OmlFilter* filter, OmlWriter* writer);
 static int
 sample(OmlFilter* f, OmlValue* value);
 
+static int
+sample_batch(OmlFilter* f, const OmlValueU* values, size_t count, size_t stride);
+
 static int
 newwindow(OmlFilter* f);
 
+static int
+merge(OmlFilter* f, OmlFilter* partial);
+
 void*
 omlf_average_new(OmlValueT type, OmlValue* result)
 {
@@ -82,6 +89,8 @@ omlf_register_filter_average (void)
                         newwindow,
                         NULL,
                         def);
+  omlf_set_filter_merge (FILTER_NAME, merge);
+  omlf_set_filter_input_batch (FILTER_NAME, sample_batch);
 }
 
 static int
@@ -107,6 +116,38 @@ sample(OmlFilter* f, OmlValue* value)
   return 0;
 }
 
+static int
+sample_batch(OmlFilter* f, const OmlValueU* values, size_t count, size_t stride)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+  double buf[OMLF_BATCH_CHUNK];
+  double sum, min, max;
+  size_t n;
+
+  while (count > 0) {
+    if (!(n = omlf_batch_to_double(values, count, stride, f->input_type, buf))) {
+      return -1;
+    }
+
+    sum = omlf_batch_sum(buf, n);
+    omlf_batch_minmax(buf, n, &min, &max);
+
+    if (isnan(self->sample_sum)) {
+      self->sample_sum = sum;
+    } else {
+      self->sample_sum += sum;
+    }
+    if (min < self->sample_min || isnan(self->sample_min)) self->sample_min = min;
+    if (max > self->sample_max || isnan(self->sample_max)) self->sample_max = max;
+    self->sample_count += n;
+
+    values += n * stride;
+    count -= n;
+  }
+
+  return 0;
+}
+
 static int
 process(OmlFilter* f, OmlWriter* writer)
 {
@@ -134,6 +175,26 @@ newwindow(OmlFilter* f)
   return 0;
 }
 
+static int
+merge(OmlFilter* f, OmlFilter* partial)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+  InstanceData* other = (InstanceData*)partial->instance_data;
+
+  if (other->sample_count > 0) {
+    if (isnan(self->sample_sum)) {
+      self->sample_sum = other->sample_sum;
+    } else {
+      self->sample_sum += other->sample_sum;
+    }
+    if (other->sample_min < self->sample_min || isnan(self->sample_min)) self->sample_min = other->sample_min;
+    if (other->sample_max > self->sample_max || isnan(self->sample_max)) self->sample_max = other->sample_max;
+    self->sample_count += other->sample_count;
+  }
+
+  return newwindow(partial);
+}
+
 /*
  Local Variables:
  mode: C
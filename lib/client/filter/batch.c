@@ -0,0 +1,291 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file batch.c
+ * \brief Kernels used by the built-in filters to process batches of samples.
+ *
+ * Samples are first converted to a contiguous array of doubles, with the type
+ * switch outside of the loop. The kernels then operate on that array with
+ * several independent accumulators, so the compiler can pipeline or vectorise
+ * the loops.
+ *
+ * The omlf_vector_* kernels similarly aggregate the elements of vector
+ * samples into arrays of per-element accumulators. Their arguments do not
+ * alias, and each iteration is independent, so the loops vectorise.
+ *
+ * \see oml_filter_input_batch
+ */
+
+#include "oml2/omlc.h"
+#include "ocomm/o_log.h"
+#include "batch.h"
+
+/** Number of samples below which omlf_batch_sum stops splitting its input */
+#define PAIRWISE_BLOCK 64
+
+/** Convert a strided array of numeric OmlValueU to doubles.
+ *
+ * At most OMLF_BATCH_CHUNK samples are converted.
+ *
+ * \param values first OmlValueU to convert
+ * \param count number of samples available in values
+ * \param stride distance, in OmlValueU, between two consecutive samples
+ * \param type OmlValueT of the samples
+ * \param[out] out array of at least OMLF_BATCH_CHUNK doubles
+ * \return the number of samples converted, or 0 if type is not numeric
+ */
+size_t
+omlf_batch_to_double(const OmlValueU* values, size_t count, size_t stride, OmlValueT type, double* out)
+{
+  size_t i, n = count < OMLF_BATCH_CHUNK ? count : OMLF_BATCH_CHUNK;
+
+  switch (type) {
+  case OML_LONG_VALUE:
+    for (i = 0; i < n; i++) { out[i] = (double)omlc_get_long(values[i * stride]); }
+    break;
+  case OML_INT32_VALUE:
+    for (i = 0; i < n; i++) { out[i] = (double)omlc_get_int32(values[i * stride]); }
+    break;
+  case OML_UINT32_VALUE:
+    for (i = 0; i < n; i++) { out[i] = (double)omlc_get_uint32(values[i * stride]); }
+    break;
+  case OML_INT64_VALUE:
+    for (i = 0; i < n; i++) { out[i] = (double)omlc_get_int64(values[i * stride]); }
+    break;
+  case OML_UINT64_VALUE:
+    for (i = 0; i < n; i++) { out[i] = (double)omlc_get_uint64(values[i * stride]); }
+    break;
+  case OML_DOUBLE_VALUE:
+    for (i = 0; i < n; i++) { out[i] = omlc_get_double(values[i * stride]); }
+    break;
+  default:
+    logerror("%s() for type '%d' not implemented'\n", __FUNCTION__, type);
+    return 0;
+  }
+
+  return n;
+}
+
+/** Sum an array of doubles, using pairwise summation.
+ *
+ * The rounding error grows with the logarithm of n, rather than linearly as
+ * with naive summation.
+ *
+ * \param v array of doubles
+ * \param n number of elements in v
+ * \return the sum of all elements of v
+ */
+double
+omlf_batch_sum(const double* v, size_t n)
+{
+  double s0 = 0., s1 = 0., s2 = 0., s3 = 0.;
+  size_t i;
+
+  if (n > PAIRWISE_BLOCK) {
+    return omlf_batch_sum(v, n / 2) + omlf_batch_sum(v + n / 2, n - n / 2);
+  }
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    s0 += v[i];
+    s1 += v[i + 1];
+    s2 += v[i + 2];
+    s3 += v[i + 3];
+  }
+  for (; i < n; i++) {
+    s0 += v[i];
+  }
+
+  return (s0 + s1) + (s2 + s3);
+}
+
+/** Find the minimum and maximum of an array of doubles.
+ *
+ * \param v array of doubles
+ * \param n number of elements in v, greater than 0
+ * \param[out] min minimum of all elements of v
+ * \param[out] max maximum of all elements of v
+ */
+void
+omlf_batch_minmax(const double* v, size_t n, double* min, double* max)
+{
+  double min0 = v[0], min1 = v[0], max0 = v[0], max1 = v[0];
+  size_t i;
+
+  for (i = 0; i + 2 <= n; i += 2) {
+    min0 = v[i] < min0 ? v[i] : min0;
+    max0 = v[i] > max0 ? v[i] : max0;
+    min1 = v[i + 1] < min1 ? v[i + 1] : min1;
+    max1 = v[i + 1] > max1 ? v[i + 1] : max1;
+  }
+  for (; i < n; i++) {
+    min0 = v[i] < min0 ? v[i] : min0;
+    max0 = v[i] > max0 ? v[i] : max0;
+  }
+
+  *min = min0 < min1 ? min0 : min1;
+  *max = max0 > max1 ? max0 : max1;
+}
+
+/** Sum the squared deviations of an array of doubles from their mean.
+ *
+ * \param v array of doubles
+ * \param n number of elements in v
+ * \param mean mean of the elements of v
+ * \return \f$\sum_i (v_i - mean)^2\f$
+ */
+double
+omlf_batch_sqdev(const double* v, size_t n, double mean)
+{
+  double s0 = 0., s1 = 0.;
+  double d0, d1;
+  size_t i;
+
+  for (i = 0; i + 2 <= n; i += 2) {
+    d0 = v[i] - mean;
+    d1 = v[i + 1] - mean;
+    s0 += d0 * d0;
+    s1 += d1 * d1;
+  }
+  for (; i < n; i++) {
+    d0 = v[i] - mean;
+    s0 += d0 * d0;
+  }
+
+  return s0 + s1;
+}
+
+/** Convert the elements of a numeric vector to doubles.
+ *
+ * \param elts elements of the vector, as returned by omlc_get_vector_ptr
+ * \param n number of elements in the vector
+ * \param type OmlValueT of the vector
+ * \param[out] out array of at least n doubles
+ * \return 0 on success, -1 if type is not a numeric vector type
+ */
+int
+omlf_vector_to_double(const void* elts, size_t n, OmlValueT type, double* out)
+{
+  size_t i;
+
+  switch (type) {
+  case OML_VECTOR_DOUBLE_VALUE:
+    for (i = 0; i < n; i++) { out[i] = ((const double*)elts)[i]; }
+    break;
+  case OML_VECTOR_INT32_VALUE:
+    for (i = 0; i < n; i++) { out[i] = (double)((const int32_t*)elts)[i]; }
+    break;
+  case OML_VECTOR_UINT32_VALUE:
+    for (i = 0; i < n; i++) { out[i] = (double)((const uint32_t*)elts)[i]; }
+    break;
+  case OML_VECTOR_INT64_VALUE:
+    for (i = 0; i < n; i++) { out[i] = (double)((const int64_t*)elts)[i]; }
+    break;
+  case OML_VECTOR_UINT64_VALUE:
+    for (i = 0; i < n; i++) { out[i] = (double)((const uint64_t*)elts)[i]; }
+    break;
+  default:
+    logerror("%s() for type '%d' not implemented'\n", __FUNCTION__, type);
+    return -1;
+  }
+
+  return 0;
+}
+
+/** Add a vector to per-element sums.
+ *
+ * \param acc array of n sums, updated in place
+ * \param v array of n doubles to add
+ * \param n number of elements
+ */
+void
+omlf_vector_add(double* restrict acc, const double* restrict v, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    acc[i] += v[i];
+  }
+}
+
+/** Update per-element minima and maxima with a vector.
+ *
+ * \param min array of n minima, updated in place
+ * \param max array of n maxima, updated in place
+ * \param v array of n doubles
+ * \param n number of elements
+ */
+void
+omlf_vector_minmax(double* restrict min, double* restrict max, const double* restrict v, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    min[i] = v[i] < min[i] ? v[i] : min[i];
+    max[i] = v[i] > max[i] ? v[i] : max[i];
+  }
+}
+
+/** Update per-element running means and sums of squares with a vector (Welford).
+ *
+ * \param m array of n running means, updated in place
+ * \param s array of n running sums of squared deviations, updated in place
+ * \param v array of n doubles
+ * \param n number of elements
+ * \param count number of samples, including v
+ * \see omlf_vector_combine
+ */
+void
+omlf_vector_welford(double* restrict m, double* restrict s, const double* restrict v, size_t n, double count)
+{
+  double inv = 1. / count;
+  double d;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    d = v[i] - m[i];
+    m[i] += d * inv;
+    s[i] += d * (v[i] - m[i]);
+  }
+}
+
+/** Combine per-element running means and sums of squares of two sets of samples (Chan et al.).
+ *
+ * \param m array of n running means of the first set, updated in place
+ * \param s array of n running sums of squared deviations of the first set, updated in place
+ * \param mb array of n running means of the second set
+ * \param sb array of n running sums of squared deviations of the second set
+ * \param n number of elements
+ * \param na number of samples in the first set
+ * \param nb number of samples in the second set
+ * \see omlf_vector_welford
+ */
+void
+omlf_vector_combine(double* restrict m, double* restrict s, const double* restrict mb, const double* restrict sb,
+    size_t n, double na, double nb)
+{
+  double wb = nb / (na + nb);
+  double wab = na * nb / (na + nb);
+  double d;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    d = mb[i] - m[i];
+    m[i] += d * wb;
+    s[i] += sb[i] + d * d * wab;
+  }
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -0,0 +1,43 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/*!\file batch.h
+  \brief Kernels used by the built-in filters to process batches of samples.
+*/
+#ifndef OML_FILTER_BATCH_H_
+#define OML_FILTER_BATCH_H_
+
+#include <stddef.h>
+#include <oml2/omlc.h>
+
+/** Maximum number of samples converted by omlf_batch_to_double at once */
+#define OMLF_BATCH_CHUNK 256
+
+size_t omlf_batch_to_double(const OmlValueU* values, size_t count, size_t stride, OmlValueT type, double* out);
+double omlf_batch_sum(const double* v, size_t n);
+void omlf_batch_minmax(const double* v, size_t n, double* min, double* max);
+double omlf_batch_sqdev(const double* v, size_t n, double mean);
+
+int omlf_vector_to_double(const void* elts, size_t n, OmlValueT type, double* out);
+void omlf_vector_add(double* restrict acc, const double* restrict v, size_t n);
+void omlf_vector_minmax(double* restrict min, double* restrict max, const double* restrict v, size_t n);
+void omlf_vector_welford(double* restrict m, double* restrict s, const double* restrict v, size_t n, double count);
+void omlf_vector_combine(double* restrict m, double* restrict s, const double* restrict mb, const double* restrict sb,
+    size_t n, double na, double nb);
+
+#endif /* OML_FILTER_BATCH_H_ */
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -28,6 +28,8 @@ typedef struct FilterType {
   oml_filter_output output;
   oml_filter_newwindow newwindow;
   oml_filter_meta meta;
+  oml_filter_merge merge;
+  oml_filter_input_batch input_batch;
 
   OmlFilterDef* definition;
   int output_count;
@@ -115,6 +117,8 @@ create_filter(
   f->input = ft->input;
   f->output = ft->output;
   f->newwindow = ft->newwindow;
+  f->merge = ft->merge;
+  f->input_batch = ft->input_batch;
   f->meta = ft->meta;
   f->definition = ft->definition;   /* FIXME:  Copy and substitute OML_INPUT_VALUE types */
   f->output_count = ft->output_count;
@@ -124,6 +128,65 @@ create_filter(
   return f;
 }
 
+/** Create a new instance of the same type as an existing filter.
+ *
+ * The new instance has the same name, input type and index as f, but none of
+ * the parameters which may have been given to f through its set function. It
+ * is meant to accumulate samples separately, before they get merged into f.
+ *
+ * \param f OmlFilter to clone
+ * \return a new OmlFilter, or NULL if f does not support merging
+ * \see oml_filter_merge, destroy_filter
+ */
+OmlFilter*
+clone_filter(OmlFilter* f)
+{
+  OmlFilter* clone;
+  FilterType* ft = filter_types;
+
+  if (!f || !f->merge) {
+    return NULL;
+  }
+  for (; ft != NULL; ft = ft->next) {
+    if (ft->input == f->input && ft->merge == f->merge) break;
+  }
+  if (ft == NULL) {
+    return NULL;
+  }
+
+  clone = (OmlFilter*)oml_malloc(sizeof(OmlFilter));
+  if (!clone) {
+    return NULL;
+  }
+  memcpy(clone, f, sizeof(OmlFilter));
+  clone->next = NULL;
+  clone->result = create_filter_result_vector (clone->definition, clone->input_type, clone->output_count);
+  clone->instance_data = ft->create(clone->input_type, clone->result);
+  if (!clone->result || !clone->instance_data) {
+    destroy_filter(clone);
+    return NULL;
+  }
+
+  return clone;
+}
+
+/** Check whether a filter is an instance of a given filter type.
+ *
+ * \param f OmlFilter to check
+ * \param filter_type name of the filter type
+ * \return 1 if f is of type filter_type, 0 otherwise
+ */
+int
+filter_is_type(OmlFilter* f, const char* filter_type)
+{
+  FilterType* ft = filter_types;
+  for (; ft != NULL; ft = ft->next) {
+    if (strcmp (filter_type, ft->name) == 0) break;
+  }
+
+  return f && ft && f->input == ft->input && f->output == ft->output;
+}
+
 /** Destroy a filter and free its memory.
  *
  * This function is designed so it can be used in a while loop to clean up the
@@ -228,6 +291,8 @@ omlf_register_filter(const char* filter_name,
   ft->input = input;
   ft->output = output;
   ft->newwindow = newwindow;
+  ft->merge = NULL;
+  ft->input_batch = NULL;
   ft->output_count = 0;
 
   OmlFilterDef* dp = filter_def;
@@ -250,6 +315,42 @@ omlf_register_filter(const char* filter_name,
   return 0;
 }
 
+/*! Declare a merge function for filters of type filter_name.
+ */
+int
+omlf_set_filter_merge(const char* filter_name, oml_filter_merge merge)
+{
+  FilterType* ft = filter_types;
+  for (; ft != NULL; ft = ft->next) {
+    if (strcmp (filter_name, ft->name) == 0) break;
+  }
+  if (ft == NULL) {
+    logerror ("Cannot set merge function of unknown filter '%s'.\n", filter_name);
+    return -1;
+  }
+
+  ft->merge = merge;
+  return 0;
+}
+
+/*! Declare a batch input function for filters of type filter_name.
+ */
+int
+omlf_set_filter_input_batch(const char* filter_name, oml_filter_input_batch input_batch)
+{
+  FilterType* ft = filter_types;
+  for (; ft != NULL; ft = ft->next) {
+    if (strcmp (filter_name, ft->name) == 0) break;
+  }
+  if (ft == NULL) {
+    logerror ("Cannot set batch input function of unknown filter '%s'.\n", filter_name);
+    return -1;
+  }
+
+  ft->input_batch = input_batch;
+  return 0;
+}
+
 /* Builtin filter registration functions */
 void omlf_register_filter_average (void);
 void omlf_register_filter_first (void);
@@ -258,6 +359,9 @@ void omlf_register_filter_histogram (void);
 void omlf_register_filter_stddev (void);
 void omlf_register_filter_sum (void);
 void omlf_register_filter_delta (void);
+void omlf_register_filter_quantile (void);
+void omlf_register_filter_topk (void);
+void omlf_register_filter_vector (void);
 
 /**
  *  Register all built-in filters.
@@ -267,10 +371,13 @@ void register_builtin_filters ()
   omlf_register_filter_average ();
   omlf_register_filter_first ();
   omlf_register_filter_last ();
-  //  omlf_register_filter_histogram ();
+  omlf_register_filter_histogram ();
   omlf_register_filter_stddev ();
   omlf_register_filter_sum ();
   omlf_register_filter_delta ();
+  omlf_register_filter_quantile ();
+  omlf_register_filter_topk ();
+  omlf_register_filter_vector ();
 }
 
 /** Unregister all built-in filters.
@@ -42,6 +42,8 @@ create_filter(
     int         index
 );
 
+OmlFilter *clone_filter(OmlFilter* f);
+int filter_is_type(OmlFilter* f, const char* filter_type);
 OmlFilter *destroy_filter(OmlFilter* f);
 
 #endif /* OML_FILTER_FACTORY_H_ */
@@ -30,9 +30,15 @@ process(OmlFilter* filter, OmlWriter* writer);
 static int
 sample(OmlFilter* f, OmlValue* values);
 
+static int
+sample_batch(OmlFilter* f, const OmlValueU* values, size_t count, size_t stride);
+
 static int
 newwindow(OmlFilter* f);
 
+static int
+merge(OmlFilter* f, OmlFilter* partial);
+
 static int
 meta(OmlFilter* f, int param_index, char** namePtr, OmlValueT* type);
 
@@ -77,6 +83,8 @@ omlf_register_filter_first (void)
             newwindow,
             meta,
             def);
+  omlf_set_filter_merge (FILTER_NAME, merge);
+  omlf_set_filter_input_batch (FILTER_NAME, sample_batch);
 }
 
 static int
@@ -100,6 +108,24 @@ sample(OmlFilter* f, OmlValue * value)
   return 0;
 }
 
+static int
+sample_batch(OmlFilter* f, const OmlValueU* values, size_t count, size_t stride)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+  (void)stride;
+
+  if (count == 0) {
+    return 0;
+  }
+  self->sample_count += count;
+  if (self->is_first) {
+    self->is_first = 0;
+    return oml_value_set(&self->result[0], &values[0], f->input_type);
+  }
+
+  return 0;
+}
+
 static int
 process(OmlFilter* f, OmlWriter*  writer)
 {
@@ -121,6 +147,27 @@ newwindow(OmlFilter* f)
   return 0;
 }
 
+/* As there is no ordering between instances, the first sample is that of the
+ * first instance to be merged, rather than the earliest. */
+static int
+merge(OmlFilter* f, OmlFilter* partial)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+  InstanceData* other = (InstanceData*)partial->instance_data;
+  int ret = 0;
+
+  if (other->sample_count > 0) {
+    if (self->is_first) {
+      self->is_first = 0;
+      ret = oml_value_set(&self->result[0], oml_value_get_value(&other->result[0]), oml_value_get_type(&other->result[0]));
+    }
+    self->sample_count += other->sample_count;
+  }
+
+  newwindow(partial);
+  return ret;
+}
+
 static int
 meta(OmlFilter* f, int param_index, char** namePtr, OmlValueT* type)
 {
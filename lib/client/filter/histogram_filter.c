@@ -8,41 +8,62 @@
  * in the License.
  */
 /** \file histogram_filter.c
- * \brief Implements a filter which calculates
+ * \brief Implements a filter which counts how many samples of the sample
+ * period fell in each of a set of bins.
  *
- * XXX: This filter is currently non-functional, and therefore disabled.
+ * The bins are delimited by edges e_0 < e_1 < ... < e_n, and bin i covers
+ * [e_i, e_(i+1)). The filter outputs a vector of n+2 counts: samples below
+ * e_0, one count per bin, then samples greater than or equal to e_n.
+ *
+ * The edges are set through the following properties:
+ * - bins: number of bins (default 10);
+ * - min, max: range covered by the bins (default 0 and 100);
+ * - scale: "linear" (default) or "log" spacing of the edges between min and max;
+ * - edges: explicit list of edges, separated by commas or spaces.
+ *
+ * Whichever of edges or the other four properties was set last determines
+ * the bins.
  *
  * \see register_builtin_filters
  */
 
-#define _GNU_SOURCE  /* For NAN */
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 
 #include "oml2/omlc.h"
 #include "oml2/oml_filter.h"
 #include "ocomm/o_log.h"
 #include "oml_value.h"
 #include "histogram_filter.h"
+#include "batch.h"
 
 #define FILTER_NAME "histogram"
 
+#define DEF_HIST_BINS 10
+#define DEF_HIST_MIN 0.
+#define DEF_HIST_MAX 100.
+
 typedef struct OmlHistFilterInstanceData InstanceData;
 
+static int
+set(OmlFilter* f, const char* name, OmlValue* value);
+
 static int
 process(OmlFilter* filter, OmlWriter* writer);
 
 static int
 sample(OmlFilter* f, OmlValue* value);
 
+static int
+sample_batch(OmlFilter* f, const OmlValueU* values, size_t count, size_t stride);
+
 static int
 newwindow(OmlFilter* f);
 
-/*
 static int
-meta(OmlFilter* f, int param_index, char** namePtr, OmlValueT* type);
-*/
+update_edges(InstanceData* self);
 
 void*
 omlf_histogram_new(
@@ -59,11 +80,13 @@ omlf_histogram_new(
   if(self) {
     memset(self, 0, sizeof(InstanceData));
 
-    self->sample_sum = NAN;
-    self->sample_min = NAN;
-    self->sample_max = NAN;
-    self->sample_count = 0;
+    self->scale = OMLF_HIST_LINEAR;
+    self->bins = DEF_HIST_BINS;
+    self->min = DEF_HIST_MIN;
+    self->max = DEF_HIST_MAX;
+    self->dirty = 1;
     self->result = result;
+    update_edges(self);
   } else {
     logerror ("%s filter: Could not allocate %d bytes for instance data\n",
         FILTER_NAME,
@@ -79,20 +102,224 @@ omlf_register_filter_histogram (void)
 {
   OmlFilterDef def [] =
     {
-      { "avg", OML_DOUBLE_VALUE },
-      { "min", OML_DOUBLE_VALUE },
-      { "max", OML_DOUBLE_VALUE },
+      { "counts", OML_VECTOR_UINT64_VALUE },
       { NULL, 0 }
     };
 
   omlf_register_filter (FILTER_NAME,
             omlf_histogram_new,
-            NULL,
+            set,
             sample,
             process,
             newwindow,
             NULL,
             def);
+  omlf_set_filter_input_batch (FILTER_NAME, sample_batch);
+}
+
+/** Convert a numeric or string property value to a double.
+ *
+ * \param value OmlValue given to set()
+ * \param d pointer where the converted value is stored
+ * \return 0 on success, -1 if the value is not a number
+ */
+static int
+property_to_double(OmlValue* value, double* d)
+{
+  const char* s;
+  char* end;
+
+  if (omlc_is_numeric(*value)) {
+    *d = oml_value_to_double(value);
+    return 0;
+  }
+  if (oml_value_get_type(value) != OML_STRING_VALUE ||
+      !(s = omlc_get_string_ptr(*oml_value_get_value(value)))) {
+    return -1;
+  }
+  *d = strtod(s, &end);
+  while (isspace(*end)) { end++; }
+  return (end == s || *end) ? -1 : 0;
+}
+
+/** Parse an explicit list of edges into the instance data.
+ *
+ * \param self InstanceData to update
+ * \param s list of edges, separated by commas or spaces
+ * \return 0 on success, -1 if the list is invalid (the instance is left untouched)
+ */
+static int
+parse_edges(InstanceData* self, const char* s)
+{
+  double edges[OMLF_HIST_MAX_BINS + 1];
+  char* end;
+  int n = 0;
+
+  while (*s) {
+    if (isspace(*s) || *s == ',') {
+      s++;
+      continue;
+    }
+    if (n > OMLF_HIST_MAX_BINS) {
+      logerror("%s filter: More than %d bins in edges\n", FILTER_NAME, OMLF_HIST_MAX_BINS);
+      return -1;
+    }
+    edges[n] = strtod(s, &end);
+    if (end == s) {
+      logerror("%s filter: Invalid edge '%s'\n", FILTER_NAME, s);
+      return -1;
+    }
+    if (n > 0 && !(edges[n] > edges[n-1])) {
+      logerror("%s filter: Edges must be strictly increasing (%g after %g)\n",
+          FILTER_NAME, edges[n], edges[n-1]);
+      return -1;
+    }
+    n++;
+    s = end;
+  }
+  if (n < 2) {
+    logerror("%s filter: At least two edges are needed\n", FILTER_NAME);
+    return -1;
+  }
+
+  memcpy(self->edges, edges, n * sizeof(double));
+  self->nedges = n;
+  self->scale = OMLF_HIST_EXPLICIT;
+  self->dirty = 0;
+  memset(self->counts, 0, sizeof(self->counts));
+  self->sample_count = 0;
+
+  return 0;
+}
+
+/** Recompute the edges from the bins, min, max and scale properties.
+ *
+ * The properties are only checked for consistency here, so they can be set
+ * in any order. If they are inconsistent, the previous edges are kept.
+ *
+ * \param self InstanceData to update
+ * \return 0 on success, -1 otherwise
+ */
+static int
+update_edges(InstanceData* self)
+{
+  double ratio;
+  int i;
+
+  if (!self->dirty) {
+    return 0;
+  }
+  self->dirty = 0;
+
+  if (!(self->min < self->max)) {
+    logerror("%s filter: min (%g) must be lower than max (%g); keeping previous bins\n",
+        FILTER_NAME, self->min, self->max);
+    return -1;
+  }
+  if (self->scale == OMLF_HIST_LOG && !(self->min > 0.)) {
+    logerror("%s filter: min (%g) must be positive for a log scale; keeping previous bins\n",
+        FILTER_NAME, self->min);
+    return -1;
+  }
+
+  if (self->scale == OMLF_HIST_LOG) {
+    ratio = self->max / self->min;
+    for (i = 0; i < self->bins; i++) {
+      self->edges[i] = self->min * pow(ratio, (double)i / self->bins);
+    }
+  } else {
+    for (i = 0; i < self->bins; i++) {
+      self->edges[i] = self->min + (self->max - self->min) * i / self->bins;
+    }
+  }
+  self->edges[self->bins] = self->max;
+  self->nedges = self->bins + 1;
+  memset(self->counts, 0, sizeof(self->counts));
+  self->sample_count = 0;
+
+  return 0;
+}
+
+static int
+set(OmlFilter* f, const char* name, OmlValue* value)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+  const char* s = NULL;
+  double d;
+
+  if (oml_value_get_type(value) == OML_STRING_VALUE) {
+    s = omlc_get_string_ptr(*oml_value_get_value(value));
+  }
+
+  if (!strcmp(name, "edges")) {
+    if (!s) {
+      logerror("%s filter: Property edges must be a string\n", FILTER_NAME);
+      return -1;
+    }
+    return parse_edges(self, s);
+
+  } else if (!strcmp(name, "scale")) {
+    if (s && !strcmp(s, "linear")) {
+      self->scale = OMLF_HIST_LINEAR;
+    } else if (s && !strcmp(s, "log")) {
+      self->scale = OMLF_HIST_LOG;
+    } else {
+      logerror("%s filter: Unknown scale '%s'; use 'linear' or 'log'\n", FILTER_NAME, s?s:"");
+      return -1;
+    }
+
+  } else if (!strcmp(name, "bins") || !strcmp(name, "min") || !strcmp(name, "max")) {
+    if (property_to_double(value, &d)) {
+      logerror("%s filter: Property %s must be a number\n", FILTER_NAME, name);
+      return -1;
+    }
+    if (name[0] == 'b') {
+      if (d < 1 || d > OMLF_HIST_MAX_BINS || d != floor(d)) {
+        logerror("%s filter: Number of bins must be an integer between 1 and %d\n",
+            FILTER_NAME, OMLF_HIST_MAX_BINS);
+        return -1;
+      }
+      self->bins = (int)d;
+    } else if (name[1] == 'i') {
+      self->min = d;
+    } else {
+      self->max = d;
+    }
+    if (self->scale == OMLF_HIST_EXPLICIT) {
+      self->scale = OMLF_HIST_LINEAR;
+    }
+
+  } else {
+    logwarn("%s filter: Unknown property '%s'\n", FILTER_NAME, name);
+    return -1;
+  }
+
+  self->dirty = 1;
+  return 0;
+}
+
+/** Find the bucket of a value.
+ *
+ * The search is branch-free: it always takes log2(n) iterations, whose
+ * comparison compiles to a conditional move.
+ *
+ * \param edges array of n strictly increasing edges
+ * \param n number of edges
+ * \param v value to look up, not NaN
+ * \return 0 if v < edges[0], i if edges[i-1] <= v < edges[i], n if v >= edges[n-1]
+ */
+static inline int
+find_bucket(const double* edges, int n, double v)
+{
+  const double* base = edges;
+  int half;
+
+  while (n > 1) {
+    half = n / 2;
+    base = (base[half] <= v) ? base + half : base;
+    n -= half;
+  }
+  return (int)(base - edges) + (*base <= v);
 }
 
 static int
@@ -101,29 +328,47 @@ sample(
     OmlValue*  value  //! values of sample
 ) {
   InstanceData* self = (InstanceData*)f->instance_data;
-  OmlValueU* v = oml_value_get_value(value);;
-  OmlValueT type = oml_value_get_type(value);;
   double val;
 
-  switch (type) {
-  case OML_LONG_VALUE:
-    val = v->longValue;
-    break;
-  case OML_DOUBLE_VALUE:
-    val = v->doubleValue;
-    break;
-  default:
-    // raise error;
+  if (! omlc_is_numeric (*value))
     return -1;
+
+  update_edges(self);
+
+  val = oml_value_to_double (value);
+  if (!isnan(val)) {
+    self->counts[find_bucket(self->edges, self->nedges, val)]++;
   }
-  if (isnan(self->sample_sum)) {
-    self->sample_sum = val;
-  } else {
-    self->sample_sum += val;
-  }
-  if (val < self->sample_min || isnan(self->sample_min)) self->sample_min = val;
-  if (val > self->sample_max || isnan(self->sample_max)) self->sample_max = val;
   self->sample_count++;
+
+  return 0;
+}
+
+static int
+sample_batch(OmlFilter* f, const OmlValueU* values, size_t count, size_t stride)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+  double buf[OMLF_BATCH_CHUNK];
+  size_t i, n;
+
+  update_edges(self);
+
+  while (count > 0) {
+    if (!(n = omlf_batch_to_double(values, count, stride, f->input_type, buf))) {
+      return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+      if (!isnan(buf[i])) {
+        self->counts[find_bucket(self->edges, self->nedges, buf[i])]++;
+      }
+    }
+    self->sample_count += n;
+
+    values += n * stride;
+    count -= n;
+  }
+
   return 0;
 }
 
@@ -134,11 +379,11 @@ process(
 ) {
   InstanceData* self = (InstanceData*)f->instance_data;
 
-  omlc_set_double(*oml_value_get_value(&self->result[0]), 1.0 * self->sample_sum / self->sample_count);
-  omlc_set_double(*oml_value_get_value(&self->result[1]), self->sample_min);
-  omlc_set_double(*oml_value_get_value(&self->result[2]), self->sample_max);
+  update_edges(self);
 
-  writer->out(writer, self->result, 3);
+  omlc_set_vector_uint64(*oml_value_get_value(&self->result[0]), self->counts, self->nedges + 1);
+
+  writer->out(writer, self->result, f->output_count);
 
   return 0;
 }
@@ -148,41 +393,12 @@ newwindow(OmlFilter* f)
 {
   InstanceData* self = (InstanceData*)f->instance_data;
 
-  self->sample_sum = NAN;
-  self->sample_min = NAN;
-  self->sample_max = NAN;
+  memset(self->counts, 0, sizeof(self->counts));
   self->sample_count = 0;
 
   return 0;
 }
 
-/*
-static int
-meta(
-  OmlFilter* f,
-  int param_index,
-  char** namePtr,
-  OmlValueT* type
-) {
-
-  if (param_index > 2) return -1;
-
-  switch (param_index) {
-  case 0:
-    *namePtr = "avg";
-    break;
-  case 1:
-    *namePtr = "min";
-    break;
-  case 2:
-    *namePtr = "max";
-    break;
-  }
-  *type = OML_DOUBLE_VALUE;
-  return 0;
-}
-*/
-
 /*
  Local Variables:
  mode: C
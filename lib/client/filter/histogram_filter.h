@@ -23,6 +23,19 @@
 #ifndef HISTOGRAM_FILTER_H__
 #define HISTOGRAM_FILTER_H__
 
+#include <stdint.h>
+#include <oml2/omlc.h>
+
+/** Maximal number of bins of a histogram filter */
+#define OMLF_HIST_MAX_BINS 256
+
+/** How the bin edges of a histogram filter are placed */
+typedef enum {
+  OMLF_HIST_LINEAR = 0,   /**< Evenly spaced edges between min and max */
+  OMLF_HIST_LOG,          /**< Geometrically spaced edges between min and max */
+  OMLF_HIST_EXPLICIT,     /**< Edges given explicitly through the edges property */
+} OmlHistScale;
+
 struct OmlHistFilterInstanceData {
   /** Array to store the current output data for writing */
   OmlValue*     result;
@@ -30,13 +43,23 @@ struct OmlHistFilterInstanceData {
   /** Number of samples received during the current sampling period */
   unsigned int  sample_count;
 
-  /** Sum of the samples of the current sampling period */
-  double        sample_sum;
+  /** Placement of the bin edges */
+  OmlHistScale  scale;
+  /** Number of bins requested for linear and log scales */
+  int           bins;
+  /** Lower edge of the first bin for linear and log scales */
+  double        min;
+  /** Upper edge of the last bin for linear and log scales */
+  double        max;
+  /** Set when a property changed and the edges need to be recomputed */
+  int           dirty;
 
-  /** Minimal sample value seen during the current sampling period */
-  double        sample_min;
-  /** Maximal sample value seen during the current sampling period */
-  double        sample_max;
+  /** Number of edges in use (number of bins + 1) */
+  int           nedges;
+  /** Bin edges, in strictly increasing order */
+  double        edges[OMLF_HIST_MAX_BINS + 1];
+  /** Sample counts: underflow, one per bin, then overflow */
+  uint64_t      counts[OMLF_HIST_MAX_BINS + 2];
 };
 
 #endif // HISTOGRAM_FILTER_H__
@@ -30,9 +30,15 @@ process(OmlFilter* filter, OmlWriter* writer);
 static int
 sample(OmlFilter* f, OmlValue* values);
 
+static int
+sample_batch(OmlFilter* f, const OmlValueU* values, size_t count, size_t stride);
+
 static int
 newwindow(OmlFilter* f);
 
+static int
+merge(OmlFilter* f, OmlFilter* partial);
+
 void*
 omlf_last_new(
   OmlValueT type,
@@ -72,6 +78,8 @@ omlf_register_filter_last (void)
             newwindow,
             NULL,
             def);
+  omlf_set_filter_merge (FILTER_NAME, merge);
+  omlf_set_filter_input_batch (FILTER_NAME, sample_batch);
 }
 
 static int
@@ -93,6 +101,19 @@ sample(
   return oml_value_set(&self->result[0], v, type);
 }
 
+static int
+sample_batch(OmlFilter* f, const OmlValueU* values, size_t count, size_t stride)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+
+  if (count == 0) {
+    return 0;
+  }
+  self->sample_count += count;
+  /* Only the last sample matters */
+  return oml_value_set(&self->result[0], &values[(count - 1) * stride], f->input_type);
+}
+
 static int
 process(
   OmlFilter* f,
@@ -115,6 +136,24 @@ newwindow(OmlFilter* f)
   return 0;
 }
 
+/* As there is no ordering between instances, the last sample is that of the
+ * last instance to be merged, rather than the latest. */
+static int
+merge(OmlFilter* f, OmlFilter* partial)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+  InstanceData* other = (InstanceData*)partial->instance_data;
+  int ret = 0;
+
+  if (other->sample_count > 0) {
+    ret = oml_value_set(&self->result[0], oml_value_get_value(&other->result[0]), oml_value_get_type(&other->result[0]));
+    self->sample_count += other->sample_count;
+  }
+
+  newwindow(partial);
+  return ret;
+}
+
 /*
  Local Variables:
  mode: C
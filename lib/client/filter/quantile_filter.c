@@ -0,0 +1,599 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file quantile_filter.c
+ * \brief Implements a filter which estimates quantiles of the samples it
+ * received over the sample period, without keeping them all.
+ *
+ * The samples are counted in a DDSketch: bucket k covers absolute values in
+ * (gamma^(k-1), gamma^k], with gamma = (1+accuracy)/(1-accuracy), so any
+ * reported quantile is within the relative accuracy of an actual sample, at
+ * the cost of one log() and one increment per sample.
+ *
+ * Each sign has a fixed number of contiguous buckets. When the samples span
+ * more buckets than that, the lowest ones are collapsed together, so only the
+ * accuracy of the lowest quantiles degrades. Quantiles 0 and 1 are the exact
+ * minimum and maximum. Sketches with the same accuracy merge exactly.
+ *
+ * The sketch is set through the following properties:
+ * - accuracy: relative accuracy of the quantiles (default 0.01);
+ * - buckets: number of buckets for each sign (default 1024);
+ * - quantiles: list of quantiles to report, separated by commas or spaces
+ *   (default 0.5, 0.9, 0.99, 0.999).
+ *
+ * \see register_builtin_filters
+ */
+
+#define _GNU_SOURCE  /* For NAN */
+#include <math.h>
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "oml2/omlc.h"
+#include "oml2/oml_filter.h"
+#include "ocomm/o_log.h"
+#include "mem.h"
+#include "oml_value.h"
+#include "quantile_filter.h"
+#include "batch.h"
+
+#define FILTER_NAME "quantile"
+
+#define DEF_QUANTILE_ACCURACY 0.01
+#define MIN_QUANTILE_ACCURACY 1e-6
+#define MAX_QUANTILE_ACCURACY 0.5
+#define DEF_QUANTILE_BUCKETS 1024
+#define MIN_QUANTILE_BUCKETS 16
+#define MAX_QUANTILE_BUCKETS 65536
+/** Samples with a smaller absolute value are counted as 0 */
+#define QUANTILE_MIN_VALUE 1e-9
+
+static const double default_quantiles[] = { .5, .9, .99, .999 };
+
+typedef struct OmlQuantileFilterInstanceData InstanceData;
+
+static int
+set(OmlFilter* f, const char* name, OmlValue* value);
+
+static int
+process(OmlFilter* filter, OmlWriter* writer);
+
+static int
+sample(OmlFilter* f, OmlValue* value);
+
+static int
+sample_batch(OmlFilter* f, const OmlValueU* values, size_t count, size_t stride);
+
+static int
+newwindow(OmlFilter* f);
+
+static int
+merge(OmlFilter* f, OmlFilter* partial);
+
+static InstanceData*
+configure(InstanceData* self, double accuracy, int max_buckets);
+
+void*
+omlf_quantile_new(OmlValueT type, OmlValue* result)
+{
+  InstanceData* self;
+
+  if (! omlc_is_numeric_type (type)) {
+    logerror ("%s filter: Can only handle numeric parameters\n", FILTER_NAME);
+    return NULL;
+  }
+
+  if (!(self = configure(NULL, DEF_QUANTILE_ACCURACY, DEF_QUANTILE_BUCKETS))) {
+    return NULL;
+  }
+  self->result = result;
+  self->nquantiles = sizeof(default_quantiles) / sizeof(default_quantiles[0]);
+  memcpy(self->quantiles, default_quantiles, sizeof(default_quantiles));
+
+  return self;
+}
+
+void
+omlf_register_filter_quantile (void)
+{
+  OmlFilterDef def [] =
+    {
+      { "count", OML_UINT64_VALUE },
+      { "quantiles", OML_VECTOR_DOUBLE_VALUE },
+      { NULL, 0 }
+    };
+
+  omlf_register_filter (FILTER_NAME,
+                        omlf_quantile_new,
+                        set,
+                        sample,
+                        process,
+                        newwindow,
+                        NULL,
+                        def);
+  omlf_set_filter_merge (FILTER_NAME, merge);
+  omlf_set_filter_input_batch (FILTER_NAME, sample_batch);
+}
+
+/** Allocate or resize instance data, and empty it.
+ *
+ * \param self InstanceData to resize, or NULL to allocate a new one
+ * \param accuracy relative accuracy of the sketch
+ * \param max_buckets number of buckets for each sign
+ * \return the (possibly moved) InstanceData, or NULL on error (self is left untouched)
+ */
+static InstanceData*
+configure(InstanceData* self, double accuracy, int max_buckets)
+{
+  size_t size = sizeof(InstanceData) + 2 * max_buckets * sizeof(uint64_t);
+  InstanceData* new;
+
+  if (!self || self->max_buckets != max_buckets) {
+    if (!(new = (InstanceData*)oml_realloc(self, size))) {
+      logerror ("%s filter: Could not allocate %d bytes for instance data\n",
+          FILTER_NAME, size);
+      return NULL;
+    }
+    if (!self) {
+      memset(new, 0, sizeof(InstanceData));
+    }
+    self = new;
+  }
+
+  self->accuracy = accuracy;
+  self->gamma = (1. + accuracy) / (1. - accuracy);
+  self->inv_log_gamma = 1. / log(self->gamma);
+  self->max_buckets = max_buckets;
+
+  memset(self->buckets, 0, 2 * max_buckets * sizeof(uint64_t));
+  memset(&self->pos, 0, sizeof(self->pos));
+  memset(&self->neg, 0, sizeof(self->neg));
+  self->zero_count = 0;
+  self->sample_count = 0;
+  self->sample_min = NAN;
+  self->sample_max = NAN;
+
+  return self;
+}
+
+/** Convert a numeric or string property value to a double.
+ *
+ * \param value OmlValue given to set()
+ * \param d pointer where the converted value is stored
+ * \return 0 on success, -1 if the value is not a number
+ */
+static int
+property_to_double(OmlValue* value, double* d)
+{
+  const char* s;
+  char* end;
+
+  if (omlc_is_numeric(*value)) {
+    *d = oml_value_to_double(value);
+    return 0;
+  }
+  if (oml_value_get_type(value) != OML_STRING_VALUE ||
+      !(s = omlc_get_string_ptr(*oml_value_get_value(value)))) {
+    return -1;
+  }
+  *d = strtod(s, &end);
+  while (isspace(*end)) { end++; }
+  return (end == s || *end) ? -1 : 0;
+}
+
+/** Parse a list of quantiles into the instance data.
+ *
+ * \param self InstanceData to update
+ * \param s list of quantiles between 0 and 1, separated by commas or spaces
+ * \return 0 on success, -1 if the list is invalid (the instance is left untouched)
+ */
+static int
+parse_quantiles(InstanceData* self, const char* s)
+{
+  double q[OMLF_QUANTILE_MAX_QUANTILES];
+  char* end;
+  int n = 0;
+
+  while (*s) {
+    if (isspace(*s) || *s == ',') {
+      s++;
+      continue;
+    }
+    if (n >= OMLF_QUANTILE_MAX_QUANTILES) {
+      logerror("%s filter: More than %d quantiles\n", FILTER_NAME, OMLF_QUANTILE_MAX_QUANTILES);
+      return -1;
+    }
+    q[n] = strtod(s, &end);
+    if (end == s || !(q[n] >= 0. && q[n] <= 1.)) {
+      logerror("%s filter: Invalid quantile '%s'; quantiles must be between 0 and 1\n",
+          FILTER_NAME, s);
+      return -1;
+    }
+    n++;
+    s = end;
+  }
+  if (n < 1) {
+    logerror("%s filter: At least one quantile is needed\n", FILTER_NAME);
+    return -1;
+  }
+
+  memcpy(self->quantiles, q, n * sizeof(double));
+  self->nquantiles = n;
+
+  return 0;
+}
+
+static int
+set(OmlFilter* f, const char* name, OmlValue* value)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+  InstanceData* new;
+  double d;
+
+  if (!strcmp(name, "quantiles")) {
+    if (oml_value_get_type(value) != OML_STRING_VALUE) {
+      logerror("%s filter: Property quantiles must be a string\n", FILTER_NAME);
+      return -1;
+    }
+    return parse_quantiles(self, omlc_get_string_ptr(*oml_value_get_value(value)));
+
+  } else if (!strcmp(name, "accuracy")) {
+    if (property_to_double(value, &d) ||
+        !(d >= MIN_QUANTILE_ACCURACY && d <= MAX_QUANTILE_ACCURACY)) {
+      logerror("%s filter: Accuracy must be a number between %g and %g\n",
+          FILTER_NAME, MIN_QUANTILE_ACCURACY, MAX_QUANTILE_ACCURACY);
+      return -1;
+    }
+    configure(self, d, self->max_buckets);
+
+  } else if (!strcmp(name, "buckets")) {
+    if (property_to_double(value, &d) || d != floor(d) ||
+        d < MIN_QUANTILE_BUCKETS || d > MAX_QUANTILE_BUCKETS) {
+      logerror("%s filter: Number of buckets must be an integer between %d and %d\n",
+          FILTER_NAME, MIN_QUANTILE_BUCKETS, MAX_QUANTILE_BUCKETS);
+      return -1;
+    }
+    if (!(new = configure(self, self->accuracy, (int)d))) {
+      return -1;
+    }
+    f->instance_data = new;
+
+  } else {
+    logwarn("%s filter: Unknown property '%s'\n", FILTER_NAME, name);
+    return -1;
+  }
+
+  return 0;
+}
+
+/** Get the buckets of a store.
+ *
+ * \param self InstanceData containing the store
+ * \param s OmlQuantileStore, either self->pos or self->neg
+ * \return a pointer to the count of the bucket with key s->offset
+ */
+static inline uint64_t*
+store_buckets(InstanceData* self, OmlQuantileStore* s)
+{
+  return self->buckets + (s == &self->neg ? self->max_buckets : 0);
+}
+
+/** Move the buckets of a store so that its non-empty range is centred.
+ *
+ * \param self InstanceData containing the store
+ * \param s OmlQuantileStore to move
+ */
+static void
+store_recenter(InstanceData* self, OmlQuantileStore* s)
+{
+  uint64_t* b = store_buckets(self, s);
+  int n = self->max_buckets;
+  int offset = s->lo - (n - (s->hi - s->lo + 1)) / 2;
+  int delta = offset - s->offset;
+
+  if (delta >= n || delta <= -n) {
+    memset(b, 0, n * sizeof(uint64_t));
+  } else if (delta > 0) {
+    memmove(b, b + delta, (n - delta) * sizeof(uint64_t));
+    memset(b + n - delta, 0, delta * sizeof(uint64_t));
+  } else if (delta < 0) {
+    memmove(b - delta, b, (n + delta) * sizeof(uint64_t));
+    memset(b, 0, -delta * sizeof(uint64_t));
+  }
+  s->offset = offset;
+}
+
+/** Add samples to the bucket of a store.
+ *
+ * If the store would span more than max_buckets keys, its lowest buckets are
+ * collapsed into one. The buckets are only moved when the non-empty range
+ * leaves them, and are then centred on that range, so this is amortised O(1).
+ *
+ * \param self InstanceData containing the store
+ * \param s OmlQuantileStore to add the samples to
+ * \param key key of the bucket
+ * \param count number of samples to add
+ */
+static void
+store_add(InstanceData* self, OmlQuantileStore* s, int key, uint64_t count)
+{
+  int n = self->max_buckets;
+  uint64_t collapsed = 0;
+  uint64_t* b;
+  int k, lo;
+
+  if (!s->count) {
+    s->lo = s->hi = key;
+
+  } else if (key < s->lo) {
+    if (s->hi - key >= n) {
+      key = s->hi - n + 1;
+    }
+    s->lo = key;
+
+  } else if (key > s->hi) {
+    if (key - s->lo >= n) {
+      b = store_buckets(self, s);
+      lo = key - n + 1;
+      for (k = s->lo; k < lo && k <= s->hi; k++) {
+        collapsed += b[k - s->offset];
+        b[k - s->offset] = 0;
+      }
+      s->lo = lo;
+    }
+    s->hi = key;
+  }
+
+  if (s->lo < s->offset || s->hi >= s->offset + n) {
+    store_recenter(self, s);
+  }
+
+  b = store_buckets(self, s);
+  b[s->lo - s->offset] += collapsed;
+  b[key - s->offset] += count;
+  s->count += count;
+}
+
+/** Empty a store, only clearing its non-empty buckets.
+ *
+ * \param self InstanceData containing the store
+ * \param s OmlQuantileStore to empty
+ */
+static void
+store_clear(InstanceData* self, OmlQuantileStore* s)
+{
+  if (s->count) {
+    memset(store_buckets(self, s) + s->lo - s->offset, 0, (s->hi - s->lo + 1) * sizeof(uint64_t));
+    s->count = 0;
+  }
+}
+
+/** Key of the bucket of a positive value */
+static inline int
+key_of(InstanceData* self, double v)
+{
+  return (int)ceil(log(v > DBL_MAX ? DBL_MAX : v) * self->inv_log_gamma);
+}
+
+/** Value representing a bucket, within the relative accuracy of all its samples */
+static inline double
+value_of(InstanceData* self, int key)
+{
+  return 2. * pow(self->gamma, key) / (self->gamma + 1.);
+}
+
+/** Add samples of the same value to the sketch.
+ *
+ * \param self InstanceData to add the samples to
+ * \param v value of the samples, ignored if NaN
+ * \param count number of samples
+ */
+static inline void
+add_value(InstanceData* self, double v, uint64_t count)
+{
+  if (isnan(v)) {
+    return;
+  }
+
+  if (v > QUANTILE_MIN_VALUE) {
+    store_add(self, &self->pos, key_of(self, v), count);
+  } else if (v < -QUANTILE_MIN_VALUE) {
+    store_add(self, &self->neg, key_of(self, -v), count);
+  } else {
+    self->zero_count += count;
+  }
+
+  if (v < self->sample_min || isnan(self->sample_min)) self->sample_min = v;
+  if (v > self->sample_max || isnan(self->sample_max)) self->sample_max = v;
+  self->sample_count += count;
+}
+
+/** Estimate a quantile of the samples in the sketch.
+ *
+ * \param self InstanceData to query
+ * \param q quantile, between 0 and 1
+ * \return the estimated value, or NaN if there are no samples
+ */
+static double
+get_quantile(InstanceData* self, double q)
+{
+  double rank = q * (self->sample_count - 1);
+  uint64_t cum = 0;
+  uint64_t* b;
+  double v = self->sample_max;
+  int k;
+
+  if (!self->sample_count) {
+    return NAN;
+  } else if (q <= 0.) {
+    return self->sample_min;
+  } else if (q >= 1.) {
+    return self->sample_max;
+  }
+
+  b = store_buckets(self, &self->neg);
+  for (k = self->neg.hi; self->neg.count && k >= self->neg.lo; k--) {
+    if ((cum += b[k - self->neg.offset]) > rank) {
+      v = -value_of(self, k);
+      goto found;
+    }
+  }
+
+  if ((cum += self->zero_count) > rank) {
+    v = 0.;
+    goto found;
+  }
+
+  b = store_buckets(self, &self->pos);
+  for (k = self->pos.lo; self->pos.count && k <= self->pos.hi; k++) {
+    if ((cum += b[k - self->pos.offset]) > rank) {
+      v = value_of(self, k);
+      goto found;
+    }
+  }
+
+found:
+  /* Collapsed and extreme buckets may be estimated beyond the actual samples */
+  if (v < self->sample_min) v = self->sample_min;
+  if (v > self->sample_max) v = self->sample_max;
+  return v;
+}
+
+static int
+sample(OmlFilter* f, OmlValue* value)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+
+  if (! omlc_is_numeric (*value))
+    return -1;
+
+  add_value(self, oml_value_to_double (value), 1);
+
+  return 0;
+}
+
+static int
+sample_batch(OmlFilter* f, const OmlValueU* values, size_t count, size_t stride)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+  double buf[OMLF_BATCH_CHUNK];
+  size_t i, n;
+
+  while (count > 0) {
+    if (!(n = omlf_batch_to_double(values, count, stride, f->input_type, buf))) {
+      return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+      add_value(self, buf[i], 1);
+    }
+
+    values += n * stride;
+    count -= n;
+  }
+
+  return 0;
+}
+
+static int
+process(OmlFilter* f, OmlWriter* writer)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+  double q[OMLF_QUANTILE_MAX_QUANTILES];
+  int i;
+
+  for (i = 0; i < self->nquantiles; i++) {
+    q[i] = get_quantile(self, self->quantiles[i]);
+  }
+
+  omlc_set_uint64(*oml_value_get_value(&self->result[0]), self->sample_count);
+  omlc_set_vector_double(*oml_value_get_value(&self->result[1]), q, self->nquantiles);
+
+  writer->out(writer, self->result, f->output_count);
+
+  return 0;
+}
+
+static int
+newwindow(OmlFilter* f)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+
+  store_clear(self, &self->pos);
+  store_clear(self, &self->neg);
+  self->zero_count = 0;
+  self->sample_count = 0;
+  self->sample_min = NAN;
+  self->sample_max = NAN;
+
+  return 0;
+}
+
+/** Add the buckets of a store of another sketch.
+ *
+ * If both sketches have the same accuracy, buckets are added key by key;
+ * otherwise, each bucket is re-inserted by its representative value.
+ *
+ * \param self InstanceData to merge into
+ * \param dst OmlQuantileStore of self to merge into
+ * \param other InstanceData to merge from
+ * \param src OmlQuantileStore of other to merge from
+ */
+static void
+store_merge(InstanceData* self, OmlQuantileStore* dst, InstanceData* other, OmlQuantileStore* src)
+{
+  uint64_t* b = store_buckets(other, src);
+  int k;
+
+  for (k = src->lo; src->count && k <= src->hi; k++) {
+    if (b[k - src->offset]) {
+      store_add(self, dst,
+          other->gamma == self->gamma ? k : key_of(self, value_of(other, k)),
+          b[k - src->offset]);
+    }
+  }
+}
+
+static int
+merge(OmlFilter* f, OmlFilter* partial)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+  InstanceData* other = (InstanceData*)partial->instance_data;
+  InstanceData* new;
+
+  if (other->sample_count > 0) {
+    store_merge(self, &self->pos, other, &other->pos);
+    store_merge(self, &self->neg, other, &other->neg);
+    self->zero_count += other->zero_count;
+    if (other->sample_min < self->sample_min || isnan(self->sample_min)) self->sample_min = other->sample_min;
+    if (other->sample_max > self->sample_max || isnan(self->sample_max)) self->sample_max = other->sample_max;
+    self->sample_count += other->sample_count;
+  }
+
+  /* Clones are created without the properties of f; align them on the first merge */
+  if (other->gamma != self->gamma || other->max_buckets != self->max_buckets) {
+    if (!(new = configure(other, self->accuracy, self->max_buckets))) {
+      return -1;
+    }
+    partial->instance_data = other = new;
+  }
+
+  return newwindow(partial);
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+#ifndef QUANTILE_FILTER_H__
+#define QUANTILE_FILTER_H__
+
+#include <stdint.h>
+#include <oml2/omlc.h>
+
+/** Maximal number of quantiles reported by a quantile filter */
+#define OMLF_QUANTILE_MAX_QUANTILES 16
+
+/** Range of bucket keys covering the absolute values of samples of one sign */
+typedef struct OmlQuantileStore {
+  /** Key of the first bucket of the store */
+  int         offset;
+  /** Lowest and highest keys of non-empty buckets, if count is non-zero */
+  int         lo, hi;
+  /** Number of samples in the store */
+  uint64_t    count;
+} OmlQuantileStore;
+
+struct OmlQuantileFilterInstanceData {
+  /** Array to store the current output data for writing */
+  OmlValue*     result;
+
+  /** Number of samples received during the current sampling period */
+  uint64_t      sample_count;
+
+  /** Relative accuracy of the reported quantiles */
+  double        accuracy;
+  /** Ratio between the bounds of consecutive buckets, (1+accuracy)/(1-accuracy) */
+  double        gamma;
+  /** 1/log(gamma), to compute bucket keys */
+  double        inv_log_gamma;
+
+  /** Number of quantiles to report */
+  int           nquantiles;
+  /** Quantiles to report, between 0 and 1 */
+  double        quantiles[OMLF_QUANTILE_MAX_QUANTILES];
+
+  /** Smallest and largest samples of the current sampling period */
+  double        sample_min, sample_max;
+  /** Number of samples too close to 0 to be bucketed */
+  uint64_t      zero_count;
+
+  /** Number of buckets of each store */
+  int           max_buckets;
+  /** Buckets of positive samples */
+  OmlQuantileStore pos;
+  /** Buckets of negative samples */
+  OmlQuantileStore neg;
+  /** Counts of the buckets of pos, then neg (2 * max_buckets) */
+  uint64_t      buckets[];
+};
+
+#endif /* QUANTILE_FILTER_H__ */
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
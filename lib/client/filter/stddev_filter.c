@@ -43,6 +43,7 @@
 #include "ocomm/o_log.h"
 #include "oml_value.h"
 #include "stddev_filter.h"
+#include "batch.h"
 
 #define FILTER_NAME "stddev"
 
@@ -51,12 +52,18 @@ typedef struct OmlStddevFilterInstanceData InstanceData;
 static int
 input (OmlFilter* f, OmlValue* value);
 
+static int
+input_batch (OmlFilter* f, const OmlValueU* values, size_t count, size_t stride);
+
 static int
 output (OmlFilter* f, OmlWriter* writer);
 
 static int
 newwindow(OmlFilter* f);
 
+static int
+merge(OmlFilter* f, OmlFilter* partial);
+
 void*
 omlf_stddev_new(
   OmlValueT type,
@@ -104,6 +111,8 @@ omlf_register_filter_stddev (void)
                         newwindow,
                         NULL,
                         def);
+  omlf_set_filter_merge (FILTER_NAME, merge);
+  omlf_set_filter_input_batch (FILTER_NAME, input_batch);
 }
 
 static int
@@ -136,6 +145,58 @@ input (
   return 0;
 }
 
+/* Combine the running means and sums of squares of two sets of samples A and B
+ * (Chan et al.):
+ *
+ *    \f[\delta = M_B - M_A\f]
+ *    \f[M = M_A + \delta * n_B / (n_A + n_B)\f]
+ *    \f[S = S_A + S_B + \delta^2 * n_A * n_B / (n_A + n_B)\f]
+ */
+static void
+combine(InstanceData* self, unsigned int count, double m, double s)
+{
+  double na = self->sample_count;
+  double nb = count;
+  double delta;
+
+  if (count > 0) {
+    if (self->sample_count == 0) {
+      self->m = m;
+      self->s = s;
+    } else {
+      delta = m - self->m;
+      self->m += delta * nb / (na + nb);
+      self->s += s + delta * delta * na * nb / (na + nb);
+    }
+    self->sample_count += count;
+  }
+}
+
+/* Compute the mean and sum of squares of each chunk of samples in two passes,
+ * then combine them with the running ones. */
+static int
+input_batch (OmlFilter* f, const OmlValueU* values, size_t count, size_t stride)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+  double buf[OMLF_BATCH_CHUNK];
+  double m;
+  size_t n;
+
+  while (count > 0) {
+    if (!(n = omlf_batch_to_double(values, count, stride, f->input_type, buf))) {
+      return -1;
+    }
+
+    m = omlf_batch_sum(buf, n) / n;
+    combine(self, n, m, omlf_batch_sqdev(buf, n, m));
+
+    values += n * stride;
+    count -= n;
+  }
+
+  return 0;
+}
+
 static int
 output (
   OmlFilter* f,
@@ -162,6 +223,16 @@ newwindow(OmlFilter* f)
   return 0;
 }
 
+static int
+merge(OmlFilter* f, OmlFilter* partial)
+{
+  InstanceData* other = (InstanceData*)partial->instance_data;
+
+  combine((InstanceData*)f->instance_data, other->sample_count, other->m, other->s);
+
+  return newwindow(partial);
+}
+
 /*
  Local Variables:
  mode: C
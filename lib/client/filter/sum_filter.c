@@ -21,6 +21,7 @@
 #include "ocomm/o_log.h"
 #include "oml_value.h"
 #include "sum_filter.h"
+#include "batch.h"
 
 #define FILTER_NAME "sum"
 
@@ -32,9 +33,15 @@ process(OmlFilter* filter, OmlWriter* writer);
 static int
 sample(OmlFilter* f, OmlValue* value);
 
+static int
+sample_batch(OmlFilter* f, const OmlValueU* values, size_t count, size_t stride);
+
 static int
 newwindow(OmlFilter* f);
 
+static int
+merge(OmlFilter* f, OmlFilter* partial);
+
 void*
 omlf_sum_new(OmlValueT type, OmlValue* result)
 {
@@ -78,6 +85,8 @@ omlf_register_filter_sum (void)
                         newwindow,
                         NULL,
                         def);
+  omlf_set_filter_merge (FILTER_NAME, merge);
+  omlf_set_filter_input_batch (FILTER_NAME, sample_batch);
 }
 
 static int
@@ -97,6 +106,28 @@ sample(OmlFilter* f, OmlValue* value)
   return 0;
 }
 
+static int
+sample_batch(OmlFilter* f, const OmlValueU* values, size_t count, size_t stride)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+  double buf[OMLF_BATCH_CHUNK];
+  size_t n;
+
+  while (count > 0) {
+    if (!(n = omlf_batch_to_double(values, count, stride, f->input_type, buf))) {
+      return -1;
+    }
+
+    self->sample_sum += omlf_batch_sum(buf, n);
+    self->sample_count += n;
+
+    values += n * stride;
+    count -= n;
+  }
+
+  return 0;
+}
+
 static int
 process(OmlFilter* f, OmlWriter* writer)
 {
@@ -119,6 +150,18 @@ newwindow(OmlFilter* f)
   return 0;
 }
 
+static int
+merge(OmlFilter* f, OmlFilter* partial)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+  InstanceData* other = (InstanceData*)partial->instance_data;
+
+  self->sample_sum += other->sample_sum;
+  self->sample_count += other->sample_count;
+
+  return newwindow(partial);
+}
+
 /*
  Local Variables:
  mode: C
@@ -0,0 +1,532 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file topk_filter.c
+ * \brief Implements a filter which reports the most frequent strings it
+ * received over the sample period, in fixed memory.
+ *
+ * The strings are counted with the Space-Saving algorithm: a fixed number of
+ * counters monitor the strings seen so far; when a new string arrives and all
+ * counters are in use, the counter with the lowest count is reassigned to it,
+ * keeping its count as an overestimation. Any string occurring more than
+ * sample_count/capacity times is guaranteed to be monitored.
+ *
+ * Counters are found through an open-addressing hash table, and the lowest one
+ * through a min-heap, so each sample costs O(log capacity) at worst.
+ *
+ * The filter is set through the following properties:
+ * - k: number of strings to report (default 10);
+ * - capacity: number of counters (default 100);
+ * - separator: character separating the reported strings (default ' ').
+ *
+ * \see register_builtin_filters
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "oml2/omlc.h"
+#include "oml2/oml_filter.h"
+#include "ocomm/o_log.h"
+#include "mem.h"
+#include "oml_value.h"
+#include "topk_filter.h"
+
+#define FILTER_NAME "topk"
+
+#define DEF_TOPK_K 10
+#define DEF_TOPK_CAPACITY 100
+#define DEF_TOPK_SEPARATOR ' '
+
+typedef struct OmlTopKFilterInstanceData InstanceData;
+typedef OmlTopKCounter Counter;
+
+static int
+set(OmlFilter* f, const char* name, OmlValue* value);
+
+static int
+process(OmlFilter* filter, OmlWriter* writer);
+
+static int
+sample(OmlFilter* f, OmlValue* value);
+
+static int
+sample_batch(OmlFilter* f, const OmlValueU* values, size_t count, size_t stride);
+
+static int
+newwindow(OmlFilter* f);
+
+static int
+merge(OmlFilter* f, OmlFilter* partial);
+
+static InstanceData*
+configure(InstanceData* self, int capacity);
+
+void*
+omlf_topk_new(OmlValueT type, OmlValue* result)
+{
+  InstanceData* self;
+
+  if (! omlc_is_string_type (type)) {
+    logerror ("%s filter: Can only handle string parameters\n", FILTER_NAME);
+    return NULL;
+  }
+
+  if (!(self = configure(NULL, DEF_TOPK_CAPACITY))) {
+    return NULL;
+  }
+  self->result = result;
+  self->k = DEF_TOPK_K;
+  self->separator = DEF_TOPK_SEPARATOR;
+
+  return self;
+}
+
+void
+omlf_register_filter_topk (void)
+{
+  OmlFilterDef def [] =
+    {
+      { "keys", OML_STRING_VALUE },
+      { "counts", OML_VECTOR_UINT64_VALUE },
+      { NULL, 0 }
+    };
+
+  omlf_register_filter (FILTER_NAME,
+                        omlf_topk_new,
+                        set,
+                        sample,
+                        process,
+                        newwindow,
+                        NULL,
+                        def);
+  omlf_set_filter_merge (FILTER_NAME, merge);
+  omlf_set_filter_input_batch (FILTER_NAME, sample_batch);
+}
+
+/** Get the min-heap of counter indices */
+static inline int*
+heap_of(InstanceData* self)
+{
+  return (int*)(self->counters + self->capacity);
+}
+
+/** Get the hash table of counter indices + 1 (0 for empty slots) */
+static inline int*
+table_of(InstanceData* self)
+{
+  return heap_of(self) + self->capacity;
+}
+
+/** Allocate or resize instance data, and empty it.
+ *
+ * \param self InstanceData to resize, or NULL to allocate a new one
+ * \param capacity number of counters
+ * \return the (possibly moved) InstanceData, or NULL on error (self is left untouched)
+ */
+static InstanceData*
+configure(InstanceData* self, int capacity)
+{
+  int table_size = 1;
+  size_t size;
+  InstanceData* new;
+
+  while (table_size < 2 * capacity) {
+    table_size <<= 1;
+  }
+  size = sizeof(InstanceData) + capacity * (sizeof(Counter) + sizeof(int)) + table_size * sizeof(int);
+
+  if (!self || self->capacity != capacity) {
+    if (!(new = (InstanceData*)oml_realloc(self, size))) {
+      logerror ("%s filter: Could not allocate %d bytes for instance data\n",
+          FILTER_NAME, size);
+      return NULL;
+    }
+    if (!self) {
+      memset(new, 0, sizeof(InstanceData));
+    }
+    self = new;
+  }
+
+  self->capacity = capacity;
+  self->table_size = table_size;
+  self->ncounters = 0;
+  self->sample_count = 0;
+  memset(table_of(self), 0, table_size * sizeof(int));
+
+  return self;
+}
+
+static int
+set(OmlFilter* f, const char* name, OmlValue* value)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+  InstanceData* new;
+  const char* s = NULL;
+  char* end;
+  long l;
+
+  if (oml_value_get_type(value) == OML_STRING_VALUE) {
+    s = omlc_get_string_ptr(*oml_value_get_value(value));
+  }
+
+  if (!strcmp(name, "separator")) {
+    if (!s || strlen(s) != 1) {
+      logerror("%s filter: Separator must be a single character\n", FILTER_NAME);
+      return -1;
+    }
+    self->separator = s[0];
+    return 0;
+
+  } else if (strcmp(name, "k") && strcmp(name, "capacity")) {
+    logwarn("%s filter: Unknown property '%s'\n", FILTER_NAME, name);
+    return -1;
+  }
+
+  if (s) {
+    l = strtol(s, &end, 10);
+    if (end == s || *end) {
+      logerror("%s filter: Property %s must be an integer\n", FILTER_NAME, name);
+      return -1;
+    }
+  } else if (omlc_is_integer(*value)) {
+    l = (long)oml_value_to_double(value);
+  } else {
+    logerror("%s filter: Property %s must be an integer\n", FILTER_NAME, name);
+    return -1;
+  }
+
+  if (name[0] == 'k') {
+    if (l < 1 || l > OMLF_TOPK_MAX_K) {
+      logerror("%s filter: k must be between 1 and %d\n", FILTER_NAME, OMLF_TOPK_MAX_K);
+      return -1;
+    }
+    self->k = (int)l;
+
+  } else {
+    if (l < 1 || l > OMLF_TOPK_MAX_CAPACITY) {
+      logerror("%s filter: Capacity must be between 1 and %d\n", FILTER_NAME, OMLF_TOPK_MAX_CAPACITY);
+      return -1;
+    }
+    if (!(new = configure(self, (int)l))) {
+      return -1;
+    }
+    f->instance_data = self = new;
+  }
+
+  if (self->capacity < self->k) {
+    logwarn("%s filter: Capacity (%d) is lower than k (%d); only %d strings will be reported\n",
+        FILTER_NAME, self->capacity, self->k, self->capacity);
+  }
+
+  return 0;
+}
+
+/** FNV-1a hash of a string */
+static inline uint32_t
+hash_key(const char* key, size_t len)
+{
+  uint32_t h = 2166136261U;
+
+  while (len--) {
+    h = (h ^ (unsigned char)*key++) * 16777619U;
+  }
+  return h;
+}
+
+/** Find the slot of the hash table holding a string, or the empty slot where it would go.
+ *
+ * \param self InstanceData to search
+ * \param hash hash of the string
+ * \param key string, truncated to OMLF_TOPK_KEY_SIZE-1 characters
+ * \param len length of key
+ * \return the index of the slot
+ */
+static int
+table_find(InstanceData* self, uint32_t hash, const char* key, size_t len)
+{
+  int* table = table_of(self);
+  int mask = self->table_size - 1;
+  int slot = hash & mask;
+  Counter* c;
+
+  while (table[slot]) {
+    c = &self->counters[table[slot] - 1];
+    if (c->hash == hash && !strncmp(c->key, key, len) && c->key[len] == '\0') {
+      break;
+    }
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+/** Remove a counter from the hash table, shifting back the following entries.
+ *
+ * \param self InstanceData to update
+ * \param i index of the counter to remove
+ */
+static void
+table_remove(InstanceData* self, int i)
+{
+  int* table = table_of(self);
+  int mask = self->table_size - 1;
+  int slot = self->counters[i].hash & mask;
+  int next, home;
+
+  while (table[slot] != i + 1) {
+    slot = (slot + 1) & mask;
+  }
+
+  for (next = (slot + 1) & mask; table[next]; next = (next + 1) & mask) {
+    home = self->counters[table[next] - 1].hash & mask;
+    /* Move the entry back if its home slot is not between slot and next */
+    if ((next > slot && (home <= slot || home > next)) ||
+        (next < slot && (home <= slot && home > next))) {
+      table[slot] = table[next];
+      slot = next;
+    }
+  }
+  table[slot] = 0;
+}
+
+/** Swap two entries of the heap */
+static inline void
+heap_swap(InstanceData* self, int* heap, int a, int b)
+{
+  int i = heap[a];
+
+  heap[a] = heap[b];
+  heap[b] = i;
+  self->counters[heap[a]].heap = a;
+  self->counters[heap[b]].heap = b;
+}
+
+/** Move a counter down the heap after its count increased */
+static void
+heap_down(InstanceData* self, int pos)
+{
+  int* heap = heap_of(self);
+  int child;
+
+  while ((child = 2 * pos + 1) < self->ncounters) {
+    if (child + 1 < self->ncounters &&
+        self->counters[heap[child + 1]].count < self->counters[heap[child]].count) {
+      child++;
+    }
+    if (self->counters[heap[pos]].count <= self->counters[heap[child]].count) {
+      break;
+    }
+    heap_swap(self, heap, pos, child);
+    pos = child;
+  }
+}
+
+/** Move a new counter up the heap */
+static void
+heap_up(InstanceData* self, int pos)
+{
+  int* heap = heap_of(self);
+  int parent;
+
+  while (pos > 0) {
+    parent = (pos - 1) / 2;
+    if (self->counters[heap[parent]].count <= self->counters[heap[pos]].count) {
+      break;
+    }
+    heap_swap(self, heap, pos, parent);
+    pos = parent;
+  }
+}
+
+/** Count occurrences of a string.
+ *
+ * \param self InstanceData to update
+ * \param key string
+ * \param len length of key
+ * \param count number of occurrences
+ * \param error overestimation of count
+ */
+static void
+add_key(InstanceData* self, const char* key, size_t len, uint64_t count, uint64_t error)
+{
+  int* table = table_of(self);
+  int* heap = heap_of(self);
+  uint32_t hash;
+  int slot, i;
+  Counter* c;
+
+  if (len >= OMLF_TOPK_KEY_SIZE) {
+    len = OMLF_TOPK_KEY_SIZE - 1;
+  }
+  hash = hash_key(key, len);
+  slot = table_find(self, hash, key, len);
+  self->sample_count += count;
+
+  if (table[slot]) {
+    c = &self->counters[table[slot] - 1];
+    c->count += count;
+    c->error += error;
+    heap_down(self, c->heap);
+    return;
+  }
+
+  if (self->ncounters < self->capacity) {
+    i = self->ncounters++;
+    c = &self->counters[i];
+    c->count = c->error = 0;
+    c->heap = i;
+    heap[i] = i;
+  } else {
+    /* Take over the least frequent string's counter */
+    i = heap[0];
+    c = &self->counters[i];
+    table_remove(self, i);
+    slot = table_find(self, hash, key, len);
+    c->error = c->count;
+  }
+
+  memcpy(c->key, key, len);
+  c->key[len] = '\0';
+  c->hash = hash;
+  c->count += count;
+  c->error += error;
+  table[slot] = i + 1;
+
+  heap_up(self, c->heap);
+  heap_down(self, c->heap);
+}
+
+static int
+sample(OmlFilter* f, OmlValue* value)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+  OmlValueU* v = oml_value_get_value(value);
+  const char* key;
+
+  if (! omlc_is_string (*value))
+    return -1;
+
+  /* Only strings not stored inline can be NULL */
+  if (!(key = omlc_get_string_ptr(*v)))
+    return -1;
+
+  add_key(self, key, omlc_get_string_length(*v), 1, 0);
+
+  return 0;
+}
+
+static int
+sample_batch(OmlFilter* f, const OmlValueU* values, size_t count, size_t stride)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+
+  if (! omlc_is_string_type (f->input_type))
+    return -1;
+
+  for (; count > 0; count--, values += stride) {
+    if (omlc_get_string_ptr(*values)) {
+      add_key(self, omlc_get_string_ptr(*values), omlc_get_string_length(*values), 1, 0);
+    }
+  }
+
+  return 0;
+}
+
+/** Order counters by decreasing count, for qsort(3) */
+static int
+counter_cmp(const void* a, const void* b)
+{
+  const Counter* ca = *(const Counter* const*)a;
+  const Counter* cb = *(const Counter* const*)b;
+
+  return (ca->count < cb->count) - (ca->count > cb->count);
+}
+
+static int
+process(OmlFilter* f, OmlWriter* writer)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+  const Counter* top[OMLF_TOPK_MAX_CAPACITY];
+  uint64_t counts[OMLF_TOPK_MAX_K];
+  char keys[OMLF_TOPK_MAX_K * OMLF_TOPK_KEY_SIZE];
+  size_t len = 0, l;
+  int i, n;
+
+  for (i = 0; i < self->ncounters; i++) {
+    top[i] = &self->counters[i];
+  }
+  qsort(top, self->ncounters, sizeof(top[0]), counter_cmp);
+
+  n = self->ncounters < self->k ? self->ncounters : self->k;
+  for (i = 0; i < n; i++) {
+    if (i > 0) {
+      keys[len++] = self->separator;
+    }
+    l = strlen(top[i]->key);
+    memcpy(keys + len, top[i]->key, l);
+    len += l;
+    counts[i] = top[i]->count;
+  }
+  keys[len] = '\0';
+
+  omlc_set_string_copy(*oml_value_get_value(&self->result[0]), keys, len);
+  omlc_set_vector_uint64(*oml_value_get_value(&self->result[1]), counts, n);
+
+  writer->out(writer, self->result, f->output_count);
+
+  return 0;
+}
+
+static int
+newwindow(OmlFilter* f)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+
+  self->ncounters = 0;
+  self->sample_count = 0;
+  memset(table_of(self), 0, self->table_size * sizeof(int));
+
+  return 0;
+}
+
+static int
+merge(OmlFilter* f, OmlFilter* partial)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+  InstanceData* other = (InstanceData*)partial->instance_data;
+  InstanceData* new;
+  Counter* c;
+  int i;
+
+  for (i = 0; i < other->ncounters; i++) {
+    c = &other->counters[i];
+    add_key(self, c->key, strlen(c->key), c->count, c->error);
+  }
+
+  /* Clones are created without the properties of f; align them on the first merge */
+  if (other->capacity != self->capacity) {
+    if (!(new = configure(other, self->capacity))) {
+      return -1;
+    }
+    partial->instance_data = other = new;
+  }
+  other->k = self->k;
+  other->separator = self->separator;
+
+  return newwindow(partial);
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
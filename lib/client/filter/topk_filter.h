@@ -0,0 +1,70 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+#ifndef TOPK_FILTER_H__
+#define TOPK_FILTER_H__
+
+#include <stdint.h>
+#include <oml2/omlc.h>
+
+/** Maximal length of the strings counted by a top-K filter; longer ones are truncated */
+#define OMLF_TOPK_KEY_SIZE 64
+/** Maximal number of strings reported by a top-K filter */
+#define OMLF_TOPK_MAX_K 64
+/** Maximal number of strings counted by a top-K filter */
+#define OMLF_TOPK_MAX_CAPACITY 1024
+
+/** Counter of one of the strings monitored by a top-K filter */
+typedef struct OmlTopKCounter {
+  /** Estimated number of occurrences of the string (never underestimated) */
+  uint64_t    count;
+  /** Maximal overestimation of count */
+  uint64_t    error;
+  /** Hash of the string */
+  uint32_t    hash;
+  /** Position of this counter in the heap */
+  int         heap;
+  /** Nul-terminated string */
+  char        key[OMLF_TOPK_KEY_SIZE];
+} OmlTopKCounter;
+
+struct OmlTopKFilterInstanceData {
+  /** Array to store the current output data for writing */
+  OmlValue*     result;
+
+  /** Number of samples received during the current sampling period */
+  uint64_t      sample_count;
+
+  /** Number of strings to report */
+  int           k;
+  /** Separator between the reported strings */
+  char          separator;
+
+  /** Number of counters */
+  int           capacity;
+  /** Number of counters in use */
+  int           ncounters;
+  /** Number of slots of the hash table (a power of 2) */
+  int           table_size;
+
+  /** Counters, followed by a min-heap of counter indices (by count), and
+   * by an open-addressing hash table of counter indices + 1 */
+  OmlTopKCounter counters[];
+};
+
+#endif /* TOPK_FILTER_H__ */
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -0,0 +1,359 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file vector_filter.c
+ * \brief Implements filters which aggregate numeric vector samples element
+ * by element over the sample period.
+ *
+ * Three filters are registered, mirroring their scalar counterparts:
+ * - vavg: element-wise average, minimum and maximum;
+ * - vsum: element-wise sum;
+ * - vstddev: element-wise standard deviation and variance.
+ *
+ * All samples of a sample period must have the same number of elements;
+ * samples of a different length are rejected until the next period.
+ *
+ * \see register_builtin_filters, omlf_vector_add
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "oml2/omlc.h"
+#include "oml2/oml_filter.h"
+#include "ocomm/o_log.h"
+#include "mem.h"
+#include "oml_value.h"
+#include "vector_filter.h"
+#include "batch.h"
+
+typedef struct OmlVectorFilterInstanceData InstanceData;
+
+/** Filter names, by OmlVectorAggregate */
+static const char* const filter_names[] = { "vavg", "vsum", "vstddev" };
+/** Number of arrays of per-element doubles, by OmlVectorAggregate */
+static const int filter_arrays[] = { 4, 2, 3 };
+
+static int
+process(OmlFilter* filter, OmlWriter* writer);
+
+static int
+sample(OmlFilter* f, OmlValue* value);
+
+static int
+sample_batch(OmlFilter* f, const OmlValueU* values, size_t count, size_t stride);
+
+static int
+newwindow(OmlFilter* f);
+
+static int
+merge(OmlFilter* f, OmlFilter* partial);
+
+static void*
+vector_new(OmlValueT type, OmlValue* result, OmlVectorAggregate aggregate)
+{
+  InstanceData* self;
+
+  if (type == OML_VECTOR_BOOL_VALUE || ! omlc_is_vector_type (type)) {
+    logerror ("%s filter: Can only handle numeric vector parameters\n", filter_names[aggregate]);
+    return NULL;
+  }
+
+  if (!(self = (InstanceData *)oml_malloc(sizeof(InstanceData)))) {
+    logerror ("%s filter: Could not allocate %d bytes for instance data\n",
+        filter_names[aggregate],
+        sizeof(InstanceData));
+    return NULL;
+  }
+  memset(self, 0, sizeof(InstanceData));
+  self->aggregate = aggregate;
+  self->result = result;
+
+  return self;
+}
+
+void*
+omlf_vavg_new(OmlValueT type, OmlValue* result)
+{
+  return vector_new(type, result, OMLF_VECTOR_AVG);
+}
+
+void*
+omlf_vsum_new(OmlValueT type, OmlValue* result)
+{
+  return vector_new(type, result, OMLF_VECTOR_SUM);
+}
+
+void*
+omlf_vstddev_new(OmlValueT type, OmlValue* result)
+{
+  return vector_new(type, result, OMLF_VECTOR_STDDEV);
+}
+
+void
+omlf_register_filter_vector (void)
+{
+  OmlFilterDef avg_def [] =
+    {
+      { "avg", OML_VECTOR_DOUBLE_VALUE },
+      { "min", OML_VECTOR_DOUBLE_VALUE },
+      { "max", OML_VECTOR_DOUBLE_VALUE },
+      { NULL, 0 }
+    };
+  OmlFilterDef sum_def [] =
+    {
+      { "sum", OML_VECTOR_DOUBLE_VALUE },
+      { NULL, 0 }
+    };
+  OmlFilterDef stddev_def [] =
+    {
+      { "stddev", OML_VECTOR_DOUBLE_VALUE },
+      { "variance", OML_VECTOR_DOUBLE_VALUE },
+      { NULL, 0 }
+    };
+
+  omlf_register_filter ("vavg", omlf_vavg_new, NULL, sample, process, newwindow, NULL, avg_def);
+  omlf_register_filter ("vsum", omlf_vsum_new, NULL, sample, process, newwindow, NULL, sum_def);
+  omlf_register_filter ("vstddev", omlf_vstddev_new, NULL, sample, process, newwindow, NULL, stddev_def);
+
+  omlf_set_filter_merge ("vavg", merge);
+  omlf_set_filter_merge ("vsum", merge);
+  omlf_set_filter_merge ("vstddev", merge);
+  omlf_set_filter_input_batch ("vavg", sample_batch);
+  omlf_set_filter_input_batch ("vsum", sample_batch);
+  omlf_set_filter_input_batch ("vstddev", sample_batch);
+}
+
+/** Get one of the arrays of per-element doubles.
+ *
+ * Array 0 is a conversion buffer, array 1 holds the sums (or means for
+ * vstddev); for vavg, arrays 2 and 3 hold the minima and maxima; for vstddev,
+ * array 2 holds the sums of squared deviations.
+ *
+ * \param self InstanceData
+ * \param i index of the array
+ * \return a pointer to the first element of the array
+ */
+static inline double*
+array(InstanceData* self, int i)
+{
+  return self->data + i * self->capacity;
+}
+
+/** Make sure the arrays of an empty instance can hold vectors of a given length.
+ *
+ * \param f OmlFilter whose instance data may be reallocated
+ * \param length number of elements
+ * \return the (possibly moved) InstanceData, or NULL on error
+ */
+static InstanceData*
+reserve(OmlFilter* f, size_t length)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+  size_t size;
+
+  if (length > self->capacity) {
+    size = sizeof(InstanceData) + filter_arrays[self->aggregate] * length * sizeof(double);
+    if (!(self = (InstanceData*)oml_realloc(self, size))) {
+      logerror ("%s filter: Could not allocate %d bytes for %d elements\n",
+          filter_names[((InstanceData*)f->instance_data)->aggregate], size, length);
+      return NULL;
+    }
+    self->capacity = length;
+    f->instance_data = self;
+  }
+  self->length = length;
+
+  return self;
+}
+
+/** Aggregate one vector sample.
+ *
+ * \param f OmlFilter
+ * \param v OmlValueU containing a vector of type f->input_type
+ * \return 0 on success, -1 otherwise
+ */
+static int
+add_vector(OmlFilter* f, const OmlValueU* v)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+  size_t n = omlc_get_vector_nof_elts(*v);
+  double* buf;
+
+  if (self->sample_count == 0) {
+    if (!(self = reserve(f, n))) {
+      return -1;
+    }
+  } else if (n != self->length) {
+    logwarn("%s filter: Ignoring sample with %d elements instead of %d until the next period\n",
+        filter_names[self->aggregate], n, self->length);
+    return -1;
+  }
+
+  buf = array(self, 0);
+  if (omlf_vector_to_double(omlc_get_vector_ptr(*v), n, f->input_type, buf)) {
+    return -1;
+  }
+  self->sample_count++;
+
+  if (self->sample_count == 1) {
+    memcpy(array(self, 1), buf, n * sizeof(double));
+    if (self->aggregate == OMLF_VECTOR_AVG) {
+      memcpy(array(self, 2), buf, n * sizeof(double));
+      memcpy(array(self, 3), buf, n * sizeof(double));
+    } else if (self->aggregate == OMLF_VECTOR_STDDEV) {
+      memset(array(self, 2), 0, n * sizeof(double));
+    }
+    return 0;
+  }
+
+  switch (self->aggregate) {
+  case OMLF_VECTOR_AVG:
+    omlf_vector_add(array(self, 1), buf, n);
+    omlf_vector_minmax(array(self, 2), array(self, 3), buf, n);
+    break;
+  case OMLF_VECTOR_SUM:
+    omlf_vector_add(array(self, 1), buf, n);
+    break;
+  case OMLF_VECTOR_STDDEV:
+    omlf_vector_welford(array(self, 1), array(self, 2), buf, n, self->sample_count);
+    break;
+  }
+
+  return 0;
+}
+
+static int
+sample(OmlFilter* f, OmlValue* value)
+{
+  if (oml_value_get_type(value) != f->input_type)
+    return -1;
+
+  return add_vector(f, oml_value_get_value(value));
+}
+
+static int
+sample_batch(OmlFilter* f, const OmlValueU* values, size_t count, size_t stride)
+{
+  int ret = 0;
+
+  for (; count > 0; count--, values += stride) {
+    if (add_vector(f, values)) {
+      ret = -1;
+    }
+  }
+
+  return ret;
+}
+
+static int
+process(OmlFilter* f, OmlWriter* writer)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+  size_t i, n = self->sample_count ? self->length : 0;
+  double* buf = array(self, 0);
+  double* acc = array(self, 1);
+
+  switch (self->aggregate) {
+  case OMLF_VECTOR_AVG:
+    for (i = 0; i < n; i++) {
+      buf[i] = acc[i] / self->sample_count;
+    }
+    omlc_set_vector_double(*oml_value_get_value(&self->result[0]), buf, n);
+    omlc_set_vector_double(*oml_value_get_value(&self->result[1]), array(self, 2), n);
+    omlc_set_vector_double(*oml_value_get_value(&self->result[2]), array(self, 3), n);
+    break;
+
+  case OMLF_VECTOR_SUM:
+    omlc_set_vector_double(*oml_value_get_value(&self->result[0]), acc, n);
+    break;
+
+  case OMLF_VECTOR_STDDEV:
+    for (i = 0; i < n; i++) {
+      buf[i] = array(self, 2)[i] / (self->sample_count - 1);
+    }
+    omlc_set_vector_double(*oml_value_get_value(&self->result[1]), buf, n);
+    for (i = 0; i < n; i++) {
+      buf[i] = sqrt(buf[i]);
+    }
+    omlc_set_vector_double(*oml_value_get_value(&self->result[0]), buf, n);
+    break;
+  }
+
+  writer->out(writer, self->result, f->output_count);
+
+  return 0;
+}
+
+static int
+newwindow(OmlFilter* f)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+
+  self->sample_count = 0;
+
+  return 0;
+}
+
+static int
+merge(OmlFilter* f, OmlFilter* partial)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+  InstanceData* other = (InstanceData*)partial->instance_data;
+  size_t n = other->length;
+  int i;
+
+  if (other->sample_count == 0) {
+    return 0;
+  }
+
+  if (self->sample_count == 0) {
+    if (!(self = reserve(f, n))) {
+      return -1;
+    }
+    for (i = 1; i < filter_arrays[self->aggregate]; i++) {
+      memcpy(array(self, i), array(other, i), n * sizeof(double));
+    }
+
+  } else if (n != self->length) {
+    logwarn("%s filter: Dropping %d staged samples with %d elements instead of %d\n",
+        filter_names[self->aggregate], other->sample_count, n, self->length);
+    newwindow(partial);
+    return -1;
+
+  } else {
+    switch (self->aggregate) {
+    case OMLF_VECTOR_AVG:
+      omlf_vector_add(array(self, 1), array(other, 1), n);
+      omlf_vector_minmax(array(self, 2), array(self, 3), array(other, 2), n);
+      omlf_vector_minmax(array(self, 2), array(self, 3), array(other, 3), n);
+      break;
+    case OMLF_VECTOR_SUM:
+      omlf_vector_add(array(self, 1), array(other, 1), n);
+      break;
+    case OMLF_VECTOR_STDDEV:
+      omlf_vector_combine(array(self, 1), array(self, 2), array(other, 1), array(other, 2),
+          n, self->sample_count, other->sample_count);
+      break;
+    }
+  }
+  self->sample_count += other->sample_count;
+
+  return newwindow(partial);
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
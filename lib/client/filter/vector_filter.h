@@ -0,0 +1,52 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+#ifndef VECTOR_FILTER_H__
+#define VECTOR_FILTER_H__
+
+#include <stddef.h>
+#include <oml2/omlc.h>
+
+/** Aggregate computed by a vector filter */
+typedef enum {
+  OMLF_VECTOR_AVG = 0,    /**< Element-wise average, minimum and maximum */
+  OMLF_VECTOR_SUM,        /**< Element-wise sum */
+  OMLF_VECTOR_STDDEV,     /**< Element-wise standard deviation and variance */
+} OmlVectorAggregate;
+
+struct OmlVectorFilterInstanceData {
+  /** Array to store the current output data for writing */
+  OmlValue*     result;
+
+  /** Number of samples received during the current sampling period */
+  unsigned int  sample_count;
+
+  /** Aggregate computed by this instance */
+  OmlVectorAggregate aggregate;
+
+  /** Number of elements of the samples of the current sampling period */
+  size_t        length;
+  /** Number of elements each of the arrays below can hold */
+  size_t        capacity;
+
+  /** Arrays of capacity doubles: conversion buffer, then sums (or means),
+   * minima, maxima and sums of squared deviations, as needed by the aggregate */
+  double        data[];
+};
+
+#endif /* VECTOR_FILTER_H__ */
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -55,7 +55,7 @@
  *    filters
  *    filter_thread()
  *   }
- *   note "filter_thread() is started if OmlMP::sample_interval>0;\nit calls filter_process() every OmlMP::sample_interval" as filter_thread #ff6600
+ *   note "filter_thread() is shared by all MSs with OmlMP::sample_interval>0;\nit calls filter_process() for each of them every OmlMP::sample_interval" as filter_thread #ff6600
  *   OmlMStream .. filter_thread
  *
  *   note "filter_process() calls OmlWriter::row_{start,end}(),\nand OmlFilter::output(), which calls OmlWriter::out()" as filter_process
@@ -103,7 +103,7 @@
  *   }
  *   BufferedWriter *-- "1..*" BufferChunk: writerchunk, firstchunk
  *   BufferChunk -- "1..*" BufferChunk: next
- *   note "readerThread() wakes up on semaphore, holds lock,\nand empties processes the BufferChunk\nlist with outStream::write()" as readerThread #ff6600
+ *   note "readerThread() wakes up on semaphore, holds lock,\nand empties processes the BufferChunk\nlist with outStream::writev()" as readerThread #ff6600
  *  note "bw_get_write_buf() acquires lock,\nand returns writerChunk" as bw_get_write_buf
  *  note "bw_release_write_buf() releases lock,\nand signals semaphore" as bw_unlock_buf
  *  BufferedWriter .. readerThread
@@ -118,6 +118,7 @@
  * class OmlOutStream {
  *  dest
  *  write()
+ *  writev()
  *  close()
  * }
  * @enduml
@@ -139,6 +140,7 @@
 #include "oml2/oml_writer.h"
 #include "ocomm/o_log.h"
 #include "mem.h"
+#include "marshal.h"
 #include "mstring.h"
 #include "oml_value.h"
 #include "validate.h"
@@ -217,6 +219,10 @@ omlc_init(const char* application, int* pargc, const char** argv, o_log_fn custo
   double sample_interval = 0.0;
   int max_queue = 0;
   uint32_t instr_interval = 1;
+  int thread_staging = 0;
+  const char* spill_dir = NULL;
+  int block_rows = 0;
+  int dict_size = 0;
   const char** arg = argv;
 
   if (!app_name) {
@@ -349,6 +355,38 @@ omlc_init(const char* application, int* pargc, const char** argv, o_log_fn custo
           loginfo("Client instrumentation disabled\n");
         }
 
+      } else if (strcmp(*arg, "--oml-thread-staging") == 0) {
+        *pargc -= 1;
+        thread_staging = 1;
+      } else if (strcmp(*arg, "--oml-spill-dir") == 0) {
+        if (--i <= 0) {
+          logerror("Missing argument to '--oml-spill-dir'\n");
+          return -1;
+        }
+        spill_dir = *++arg;
+        *pargc -= 2;
+      } else if (strcmp(*arg, "--oml-block-rows") == 0) {
+        if (--i <= 0) {
+          logerror("Missing argument to '--oml-block-rows'\n");
+          return -1;
+        }
+        block_rows = atoi(*++arg);
+        if (block_rows < 0 || block_rows > OMB_BLOCK_MAX_ROWS) {
+          logwarn("Invalid argument to '--oml-block-rows', using %d\n", OMB_BLOCK_MAX_ROWS);
+          block_rows = OMB_BLOCK_MAX_ROWS;
+        }
+        *pargc -= 2;
+      } else if (strcmp(*arg, "--oml-dict-size") == 0) {
+        if (--i <= 0) {
+          logerror("Missing argument to '--oml-dict-size'\n");
+          return -1;
+        }
+        dict_size = atoi(*++arg);
+        if (dict_size < 0 || dict_size > OMB_DICT_MAX_SIZE) {
+          logwarn("Invalid argument to '--oml-dict-size', using %d\n", OMB_DICT_MAX_SIZE);
+          dict_size = OMB_DICT_MAX_SIZE;
+        }
+        *pargc -= 2;
       } else if (strcmp(*arg, "--oml-noop") == 0) {
         *pargc -= 1;
         loginfo("OML reporting disabled from command line\n");
@@ -409,6 +447,10 @@ omlc_init(const char* application, int* pargc, const char** argv, o_log_fn custo
   omlc_instance->max_queue = max_queue;
   omlc_instance->instr_time = 0;
   omlc_instance->instr_interval = instr_interval;
+  omlc_instance->thread_staging = thread_staging;
+  omlc_instance->spill_dir = spill_dir;
+  omlc_instance->block_rows = block_rows;
+  omlc_instance->dict_size = dict_size;
 
   if (local_data_file != NULL) {
     // dump every sample into local_data_file
@@ -628,6 +670,15 @@ omlc_start()
       return -3;
     }
   }
+  OmlMP* mp;
+  OmlMStream* ms;
+  for (mp = omlc_instance->mpoints; mp; mp = mp->next) {
+    for (ms = mp->streams; ms; ms = ms->next) {
+      if (!filter_passthrough_enable(ms) && omlc_instance->thread_staging) {
+        ms_staging_enable(ms);
+      }
+    }
+  }
   install_close_handler(termination_handler);
   if (write_meta() == -1) {
     return -1;
@@ -713,6 +764,7 @@ omlc_close(void)
     install_close_handler(SIG_DFL);
 
     while( (mp = destroy_mp(mp)) );
+    filter_engine_shutdown();
     if (w) {
       while( (w =  w->close(w)) );
     }
@@ -751,6 +803,10 @@ usage(void)
   printf("  --oml-bufsize size     .. Set size of internal buffers to 'size' bytes\n");
   printf("  --oml-log-file file    .. Writes log messages to 'file'\n");
   printf("  --oml-log-level level  .. Log level used (error: -2 .. info: 0 .. debug4: 4)\n");
+  printf("  --oml-thread-staging   .. Stage samples per thread to reduce locking\n");
+  printf("  --oml-spill-dir dir    .. Spill full buffers to files in 'dir' rather than dropping samples\n");
+  printf("  --oml-block-rows count .. Send binary samples in compressed blocks of 'count' per stream\n");
+  printf("  --oml-dict-size count  .. Send up to 'count' repeated strings only once per connection\n");
   printf("  --oml-noop             .. Do not collect measurements\n");
   printf("  --oml-list-filters     .. List the available types of filters\n");
   printf("  --oml-help             .. Print this message\n");
@@ -1001,6 +1057,10 @@ create_mstream (const char *name, OmlMP* mp, OmlWriter* writer, double sample_in
 }
 
 /** Add a new writer to an existing MS
+ *
+ * Adding a writer already used by the MS is a no-op, so samples are not
+ * output twice to it.
+ *
  * \param ms MStream to add w to
  * \param w writer to add to MS
  *
@@ -1017,6 +1077,13 @@ oml_ms_add_writer(OmlMStream *ms, OmlWriter *w)
     return -1;
   }
 
+  for (n = 0; n < ms->nwriters; n++) {
+    if (ms->writers[n] == w) {
+      logdebug("%s: Writer %p already added\n", ms->table_name, w);
+      return 0;
+    }
+  }
+
   n = ms->nwriters + 1;
 
   writers = (OmlWriter **)oml_realloc(ms->writers, n*sizeof(OmlWriter*));
@@ -1056,10 +1123,16 @@ destroy_ms(OmlMStream *ms)
 
   next = ms->next;
 
+  if (ms->sample_interval > 0) {
+    filter_engine_stop(ms);
+  }
+
   if (ms->sample_size > 0) {
     loginfo("Reporting last (partial) sample for MS %s\n", ms->table_name);
     filter_process(ms);
   }
+  ms_staging_destroy(ms);
+  filter_fanout_destroy(ms);
   ft = ms->filters;
 
   while( (ft = destroy_filter(ft)) );
@@ -1133,6 +1206,7 @@ oml_mp_get_default_ms(OmlMP *mp)
       if (omlc_instance->sample_interval > 0) {
         filter_engine_start(mp->streams);
       }
+      filter_passthrough_enable(mp->streams);
     }
     mp->default_ms = mp->streams;
 
@@ -1243,7 +1317,9 @@ write_meta(void)
   OmlWriter* writer = omlc_instance->first_writer;
   for (; writer != NULL; writer = writer->next) {
     char s[128];
-    sprintf(s, "protocol: %d", OML_PROTOCOL_VERSION);
+    /* Only ask for the features the encoding of this writer uses, so older
+     * servers can still accept it */
+    sprintf(s, "protocol: %d", writer->protocol ? writer->protocol : OML_PROTOCOL_VERSION);
     writer->meta(writer, s);
     sprintf(s, "domain: %s", omlc_instance->domain);
     writer->meta(writer, s);
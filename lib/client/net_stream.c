@@ -28,6 +28,7 @@
 #include "net_stream.h"
 
 static ssize_t net_stream_write(OmlOutStream* hdl, uint8_t* buffer, size_t  length, uint8_t* header, size_t  header_length);
+static ssize_t net_stream_writev(OmlOutStream* hdl, const struct iovec* iov, int iovcnt, uint8_t* header, size_t header_length);
 static int net_stream_close(OmlOutStream* hdl);
 
 /** Create a new out stream for sending over the network
@@ -65,6 +66,7 @@ net_stream_new(const char *transport, const char *hostname, const char *service)
   /* } */
 
   self->write = net_stream_write;
+  self->writev = net_stream_writev;
   self->close = net_stream_close;
   return (OmlOutStream*)self;
 }
@@ -152,18 +154,17 @@ open_socket(OmlNetOutStream* self)
 
 /** Do the actual writing into the OComm Socket, with error handling
  * \param self OmlNetOutStream through which the data should be written
- * \param buffer data to write
- * \param length length of the data to write
+ * \param iov array of buffers to write
+ * \param iovcnt number of buffers in iov
  *
  * \return the size of data written, or -1 on error
  *
- * \see write(3)
+ * \see socket_sendv
  */
 static ssize_t
-socket_write(OmlOutStream* outs, uint8_t* buffer, size_t  length)
+socket_writev(OmlNetOutStream* self, const struct iovec* iov, int iovcnt)
 {
-  OmlNetOutStream *self = (OmlNetOutStream*) outs;
-  int result = socket_sendto(self->socket, (char*)buffer, length);
+  ssize_t result = socket_sendv(self->socket, iov, iovcnt);
 
   if (result == -1 && socket_is_disconnected (self->socket)) {
     logwarn ("%s: Connection lost\n", self->dest);
@@ -176,15 +177,32 @@ socket_write(OmlOutStream* outs, uint8_t* buffer, size_t  length)
 /** Called to write into the socket
  * \see oml_outs_write_f
  *
- * If the connection needs to be re-established, header is sent first, then buffer,
- *
- * \see \see open_socket, socket_write
+ * \see net_stream_writev
  */
 static ssize_t
 net_stream_write(OmlOutStream* hdl, uint8_t* buffer, size_t  length, uint8_t* header, size_t  header_length)
+{
+  struct iovec iov = { buffer, length };
+
+  return net_stream_writev(hdl, &iov, 1, header, header_length);
+}
+
+/** Called to write several buffers into the socket
+ * \see oml_outs_writev_f
+ *
+ * If the connection needs to be re-established, header is sent first, in the
+ * same system call as the data.
+ *
+ * \see open_socket, socket_writev
+ */
+static ssize_t
+net_stream_writev(OmlOutStream* hdl, const struct iovec* iov, int iovcnt, uint8_t* header, size_t header_length)
 {
   OmlNetOutStream* self = (OmlNetOutStream*)hdl;
-  size_t count;
+  struct iovec vec[OML_OUTS_IOV_MAX];
+  size_t hlen = 0;
+  ssize_t count;
+  int i, n = 0;
 
   /* The header can be NULL, but header_length MUST be 0 in that case */
   assert(header || !header_length);
@@ -204,14 +222,29 @@ net_stream_write(OmlOutStream* hdl, uint8_t* buffer, size_t  length, uint8_t* he
     self->header_written = 0;
   }
 
-  out_stream_write_header(hdl, socket_write, header, header_length);
+  if (!self->header_written && header_length > 0) {
+    hlen = header_length;
+    vec[n].iov_base = header;
+    vec[n++].iov_len = header_length;
+  }
+  for (i = 0; i < iovcnt && n < OML_OUTS_IOV_MAX; i++) {
+    if(o_log_level_active(O_LOG_DEBUG4)) {
+      char *out = to_octets(iov[i].iov_base, iov[i].iov_len);
+      logdebug("%s: Sending data %s\n", self->dest, out);
+      oml_free(out);
+    }
+    vec[n++] = iov[i];
+  }
+
+  count = socket_writev(self, vec, n);
 
-  if(o_log_level_active(O_LOG_DEBUG4)) {
-    char *out = to_octets(buffer, length);
-    logdebug("%s: Sending data %s\n", self->dest, out);
-    oml_free(out);
+  if (count > 0 && !self->header_written) {
+    if ((size_t)count < hlen) {
+      logwarn("%s: Only wrote parts of the header; this might cause problem later on\n", self->dest);
+    }
+    self->header_written = 1;
+    count = ((size_t)count > hlen) ? count - (ssize_t)hlen : 0;
   }
-  count = socket_write(hdl, buffer, length);
   return count;
 }
 
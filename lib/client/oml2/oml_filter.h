@@ -69,6 +69,36 @@ typedef int (*oml_filter_output)(struct OmlFilter* filter, struct OmlWriter* wri
  */
 typedef int (*oml_filter_newwindow)(struct OmlFilter* filter);
 
+/** Optional function merging the samples accumulated by another instance of
+ * the same filter type into this one.
+ *
+ * This allows samples to be input into separate (e.g., per-thread) instances,
+ * and aggregated only when output is requested. Once merged, the other
+ * instance must start a new sampling window.
+ *
+ * \param filter pointer to OmlFilter instance to merge into
+ * \param partial pointer to OmlFilter instance whose samples to merge
+ * \return 0 on success, -1 otherwise
+ * \see omlf_set_filter_merge, clone_filter
+ */
+typedef int (*oml_filter_merge)(struct OmlFilter* filter, struct OmlFilter* partial);
+
+/** Optional function called to deliver several samples at once to the filter.
+ *
+ * This is equivalent to calling oml_filter_input() for each sample in turn,
+ * but lets the filter process them in a tight loop. The samples are all of the
+ * filter's input_type, and are read from values[0], values[stride], ...,
+ * values[(count-1)*stride]; a stride of 1 denotes a contiguous array.
+ *
+ * \param filter pointer to OmlFilter instance
+ * \param values pointer to the first sample
+ * \param count number of samples
+ * \param stride distance, in OmlValueU, between two consecutive samples
+ * \return 0 on success, -1 otherwise
+ * \see omlf_set_filter_input_batch, oml_filter_input
+ */
+typedef int (*oml_filter_input_batch)(struct OmlFilter* filter, const OmlValueU* values, size_t count, size_t stride);
+
 /** Optional function returning metainformation for complex outputs.
  *
  * XXX: This function will probably go at some point soon. Don't use it.
@@ -141,6 +171,11 @@ typedef struct OmlFilter {
 
   /** Function to start a new sampling period \see oml_filter_newwindow */
   oml_filter_newwindow newwindow; /* XXX: To be pulled up after output on the next ABI version change */
+
+  /** Function to merge samples from another instance (optional) \see oml_filter_merge */
+  oml_filter_merge merge; /* XXX: To be pulled up after newwindow on the next ABI version change */
+  /** Function to process several samples at once (optional) \see oml_filter_input_batch */
+  oml_filter_input_batch input_batch; /* XXX: To be pulled up after input on the next ABI version change */
 } OmlFilter;
 
 /** Register a new filter type.
@@ -174,6 +209,26 @@ int
 omlf_register_filter(const char* filter_name, oml_filter_create create, oml_filter_set set, oml_filter_input input,
     oml_filter_output output, oml_filter_newwindow newwindow, oml_filter_meta meta, OmlFilterDef* filter_def);
 
+/** Declare that instances of a registered filter type can merge their samples.
+ *
+ * \param filter_name name of a filter type previously registered with omlf_register_filter()
+ * \param merge oml_filter_merge() function merging the samples of one instance into another
+ * \return 0 on success, -1 otherwise
+ * \see omlf_register_filter, oml_filter_merge
+ */
+int
+omlf_set_filter_merge(const char* filter_name, oml_filter_merge merge);
+
+/** Declare that instances of a registered filter type can process batches of samples.
+ *
+ * \param filter_name name of a filter type previously registered with omlf_register_filter()
+ * \param input_batch oml_filter_input_batch() function processing several samples at once
+ * \return 0 on success, -1 otherwise
+ * \see omlf_register_filter, oml_filter_input_batch
+ */
+int
+omlf_set_filter_input_batch(const char* filter_name, oml_filter_input_batch input_batch);
+
 #ifdef __cplusplus
 }
 #endif
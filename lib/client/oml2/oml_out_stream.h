@@ -19,6 +19,8 @@
 
 #include <unistd.h>
 #include <stdint.h>
+#include <limits.h>
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -26,6 +28,13 @@ extern "C" {
 
 struct OmlOutStream;
 
+/** Maximum number of buffers to pass to an oml_outs_writev_f at once */
+#ifdef IOV_MAX
+# define OML_OUTS_IOV_MAX IOV_MAX
+#else
+# define OML_OUTS_IOV_MAX 16 /* _XOPEN_IOV_MAX */
+#endif
+
 /** Write a chunk into the lower level out stream
  *
  * \param outs OmlOutStream to write into
@@ -40,6 +49,21 @@ struct OmlOutStream;
  */
 typedef ssize_t (*oml_outs_write_f)(struct OmlOutStream* outs, uint8_t* buffer, size_t length, uint8_t* header, size_t header_length);
 
+/** Write several chunks into the lower level out stream at once
+ *
+ * The header is written first, in the same operation, if the stream was not
+ * connected yet.
+ *
+ * \param outs OmlOutStream to write into
+ * \param iov array of buffers to write, in order
+ * \param iovcnt number of buffers in iov, at most OML_OUTS_IOV_MAX
+ * \param header pointer to the beginning of header data to write in case of disconnection
+ * \param header_length length of header data to write in case of disconnection
+ * \return the number of sent bytes from iov (not counting the header) on success, -1 otherwise
+ * \see oml_outs_write_f, out_stream_writev, writev(2)
+ */
+typedef ssize_t (*oml_outs_writev_f)(struct OmlOutStream* outs, const struct iovec* iov, int iovcnt, uint8_t* header, size_t header_length);
+
 /** Close an OmlOutStream
  *
  * \param writer OmlOutStream to close
@@ -80,6 +104,21 @@ struct OmlOutStream* create_out_stream(const char *uri);
  */
 ssize_t out_stream_write_header(struct OmlOutStream* outs, oml_outs_write_f_immediate writefp, uint8_t* header, size_t header_length);
 
+/** Write several chunks into an OmlOutStream, using its writev function if it has one
+ *
+ * OmlOutStreams without a writev function have each buffer written in turn
+ * with their write function, until one is only partially written.
+ *
+ * \param outs OmlOutStream to write into
+ * \param iov array of buffers to write, in order
+ * \param iovcnt number of buffers in iov, at most OML_OUTS_IOV_MAX
+ * \param header pointer to the beginning of header data to write in case of disconnection
+ * \param header_length length of header data to write in case of disconnection
+ * \return the number of sent bytes from iov on success, -1 otherwise
+ * \see oml_outs_writev_f, oml_outs_write_f
+ */
+ssize_t out_stream_writev(struct OmlOutStream* outs, const struct iovec* iov, int iovcnt, uint8_t* header, size_t header_length);
+
 /** A low-level output stream */
 typedef struct OmlOutStream {
   /** Pointer to a function in charge of writing into the stream \see oml_outs_write_f */
@@ -90,6 +129,8 @@ typedef struct OmlOutStream {
   char* dest;
   /** True if header has been written to the stream */
   int   header_written;
+  /** Pointer to a function in charge of writing several buffers at once, or NULL \see oml_outs_writev_f */
+  oml_outs_writev_f writev; /* XXX: To be pulled up after write on the next ABI version change */
 } OmlOutStream;
 
 extern OmlOutStream *file_stream_new(const char *file);
@@ -101,6 +142,16 @@ int file_stream_get_buffered(OmlOutStream* hdl);
 
 extern OmlOutStream *net_stream_new(const char *transport, const char *hostname, const char *port);
 
+/* from udp_stream.c */
+
+extern OmlOutStream *udp_stream_new(const char *hostname, const char *port);
+
+int udp_stream_set_mtu(OmlOutStream* hdl, size_t mtu);
+
+/* from zlib_stream.c */
+
+extern OmlOutStream *zlib_stream_new(OmlOutStream* os);
+
 #ifdef __cplusplus
 }
 #endif
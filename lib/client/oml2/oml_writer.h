@@ -28,10 +28,11 @@
  * This also defines the highest protocol revision that the oml2-server built
  * along can understand.
  */
-#define OML_PROTOCOL_VERSION 5
+#define OML_PROTOCOL_VERSION 8
 
 struct OmlWriter;
 typedef struct BufferedWriter BufferedWriter; /* XXX: From buffered_writer.h */
+struct MBuffer; /* From mbuf.h */
 
 /** Function called whenever some header metadata needs to be added.
  * \param writer pointer to OmlWriter instance
@@ -83,6 +84,34 @@ typedef int (*oml_writer_row_end)(struct OmlWriter* writer, OmlMStream* ms);
  */
 typedef int (*oml_writer_out)( struct OmlWriter* writer, OmlValue* values, int values_count);
 
+/** Function called to serialise a complete sample into an MBuffer, rather than into the writer's BufferedWriter
+ *
+ * This allows a sample output on several writers using the same encoding to
+ * only be serialised once, and pushed to each of them with oml_writer_row_push.
+ *
+ * \param writer pointer to OmlWriter instance
+ * \param mbuf MBuffer into which the sample is serialised as a new message
+ * \param ms OmlMStream for which the sample is
+ * \param now current timestamp
+ * \param values array of OmlValue to write out
+ * \param values_count size of the values array
+ * \return 1 on success, 0 on error
+ * \see oml_writer_row_push, filter_fanout
+ */
+typedef int (*oml_writer_row_encode)(struct OmlWriter* writer, struct MBuffer* mbuf, OmlMStream* ms, double now, OmlValue* values, int values_count);
+
+/** Function called to output a sample serialised by another writer's oml_writer_row_encode
+ *
+ * The sample is only pushed to writers sharing the same oml_writer_row_encode function.
+ *
+ * \param writer pointer to OmlWriter instance
+ * \param ms OmlMStream for which the sample is
+ * \param mbuf MBuffer containing the serialised sample as its current message
+ * \return 1 on success, 0 on error
+ * \see oml_writer_row_encode, mbuf_message
+ */
+typedef int (*oml_writer_row_push)(struct OmlWriter* writer, OmlMStream* ms, struct MBuffer* mbuf);
+
 /** Function called to close the writer and free its allocated objects.
  *
  * This function is designed so it can be used in a while loop to clean up the
@@ -120,6 +149,14 @@ typedef struct OmlWriter {
   /** Buffered writer into which the serialised data is written */
   BufferedWriter* bufferedWriter;
 
+  /** Pointer to function serialising a sample into an MBuffer, or NULL if not supported \see oml_writer_row_encode */
+  oml_writer_row_encode row_encode; /* XXX: To be pulled up after out on the next ABI version change */
+  /** Pointer to function outputting an already serialised sample \see oml_writer_row_push */
+  oml_writer_row_push row_push; /* XXX: To be pulled up after out on the next ABI version change */
+
+  /** Lowest OMSP version needed by the encoding of this writer, announced in its headers; OML_PROTOCOL_VERSION if 0 */
+  int protocol;
+
 } OmlWriter;
 
 /** Stream encoding type, for use with create_writer */
@@ -129,16 +166,32 @@ enum StreamEncoding {
   SE_Binary
 };
 
+/** Queueing engine of the BufferedWriter, for use with create_writer2
+ *
+ * BE_Chain is the historical chain of mutex-protected chunks; BE_Ring is a
+ * lock-free multi-producer/single-consumer byte ring which lets threads
+ * injecting into different MPs write to the same collector without contending
+ * on a lock.
+ */
+enum BufferEngine {
+  BE_Default, // Not explicitly specified by the user
+  BE_Chain,
+  BE_Ring
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 OmlWriter* create_writer(const char* uri, enum StreamEncoding encoding);
+OmlWriter* create_writer2(const char* uri, enum StreamEncoding encoding, enum BufferEngine engine);
 
 /* from (bin|text)_writer.c */
 
 OmlWriter *text_writer_new(OmlOutStream* out_stream);
+OmlWriter *text_writer_new2(OmlOutStream* out_stream, enum BufferEngine engine);
 OmlWriter *bin_writer_new(OmlOutStream* out_stream);
+OmlWriter *bin_writer_new2(OmlOutStream* out_stream, enum BufferEngine engine);
 
 #ifdef __cplusplus
 }
@@ -100,6 +100,16 @@ typedef enum OmlValueT {
 #define omlc_is_vector(v) \
   omlc_is_vector_type((v).type)
 
+struct OmlValueRef;
+
+/** Function releasing data lent to OML by reference, once OML does not need it anymore.
+ *
+ * \param data pointer to the data which was lent
+ * \param arg opaque argument given when lending the data
+ * \see omlc_set_blob_borrowed, omlc_set_vector_borrowed
+ */
+typedef void (*omlc_release_fn)(void *data, void *arg);
+
 /**  Representation of a vector value. */
 typedef struct OmlVector {
 
@@ -118,22 +128,39 @@ typedef struct OmlVector {
   /** The size (in octets) of an individual element */
   uint16_t elt_sz;
 
+  /** Reference held on data lent by the application, if any; ptr then points
+   * to the lent data, and size is 0 \see omlc_set_vector_borrowed */
+  struct OmlValueRef *ref;
+
 } OmlVector;
 
+/** Size of the inline storage of an OmlString, including the nil-terminator.
+ * Copies of shorter strings are stored inline, without allocating memory.
+ * \see omlc_set_string_copy
+ */
+#define OMLC_STRING_INLINE_SIZE 24
+
 /**  Representation of a string measurement value.  */
 typedef struct OmlString {
-  /** Pointer to a nil-terminated C string */
+  /** Pointer to a nil-terminated C string, unless is_inline is set */
   char *ptr;
 
-  /** Length of string pointed to by ptr, not including nil-terminator */
+  /** Length of the string, not including nil-terminator */
   size_t length;
 
-  /** Size of the allocated underlying storage in ptr (>= length + 1) */
+  /** Size of the allocated underlying storage in ptr (>= length + 1 if used) */
   size_t size;
 
   /** True if ptr references const storage */
   int is_const;
 
+  /** True if the string is stored in inline_buf rather than in ptr; any
+   * storage allocated in ptr is kept for later use */
+  int is_inline;
+
+  /** Inline storage for copies of short strings */
+  char inline_buf[OMLC_STRING_INLINE_SIZE];
+
 } OmlString;
 
 /**  Representation of a blob measurement value.  */
@@ -147,6 +174,10 @@ typedef struct OmlBlob {
   /** Size of the allocated underlying storage in ptr (>= length) */
   size_t size;
 
+  /** Reference held on data lent by the application, if any; ptr then points
+   * to the lent data, and size is 0 \see omlc_set_blob_borrowed */
+  struct OmlValueRef *ref;
+
 } OmlBlob;
 
 /** An opaque type to represent globally unique IDs.  */
@@ -183,13 +214,14 @@ typedef union OmlValueU {
   OmlVector vectorValue;
 } OmlValueU;
 
-/* Declarations from internal "mem.h", to be used in the macros below
+/* Declarations from internal "mem.h" and "oml_value.h", to be used in the macros below
  * 
  * DO NOT USE DIRECTLY IN CLIENT APPLICATIONS!
  */
 void *oml_malloc (size_t size);
 void oml_free (void *ptr);
 size_t oml_malloc_usable_size(void *ptr);
+void oml_value_ref_release (struct OmlValueRef *ref);
 
 /** Zero out a freshly declared OmlValueU.
  *
@@ -321,9 +353,12 @@ size_t oml_malloc_usable_size(void *ptr);
 #define _oml_set_storage_field(var, type, field, val) \
   ((var).type ## Value.field = (val))
 
-/** \see _oml_get_storage_field */
-#define omlc_get_string_ptr(var) \
-  (_oml_get_storage_field(var, string, ptr))
+/** Get a pointer to the string, wherever it is stored
+ * \see _oml_get_storage_field */
+#define omlc_get_string_ptr(var)                          \
+  (_oml_get_storage_field(var, string, is_inline) ?       \
+   _oml_get_storage_field(var, string, inline_buf) :      \
+   _oml_get_storage_field(var, string, ptr))
 /** Get string length (not including nil-terminator)
  * \see _oml_get_storage_field, strlen(3) */
 #define omlc_get_string_length(var) \
@@ -334,10 +369,16 @@ size_t oml_malloc_usable_size(void *ptr);
 /** \see _oml_get_storage_field */
 #define omlc_get_string_is_const(var) \
   (_oml_get_storage_field(var, string, is_const))
-
-/** \see _oml_set_storage_field */
-#define omlc_set_string_ptr(var, val) \
-  _oml_set_storage_field(var, string, ptr, (char*)(val))
+/** True if the string is stored inline, rather than in separate storage
+ * \see _oml_get_storage_field, OMLC_STRING_INLINE_SIZE */
+#define omlc_get_string_is_inline(var) \
+  (_oml_get_storage_field(var, string, is_inline))
+
+/** Set the string pointer, which then takes precedence over any inline storage
+ * \see _oml_set_storage_field */
+#define omlc_set_string_ptr(var, val)                     \
+  (_oml_set_storage_field(var, string, is_inline, 0),     \
+   _oml_set_storage_field(var, string, ptr, (char*)(val)))
 /** Set string length (not including nil-terminator)
  * \see _oml_set_storage_field, strlen(3) */
 #define omlc_set_string_length(var, val) \
@@ -358,6 +399,9 @@ size_t oml_malloc_usable_size(void *ptr);
 /** \see _oml_get_storage_field */
 #define omlc_get_blob_size(var) \
   (_oml_get_storage_field(var, blob, size))
+/** \see _oml_get_storage_field, omlc_set_blob_borrowed */
+#define omlc_get_blob_ref(var) \
+  (_oml_get_storage_field(var, blob, ref))
 
 /** \see _oml_set_storage_field */
 #define omlc_set_blob_ptr(var, val) \
@@ -408,6 +452,25 @@ size_t oml_malloc_usable_size(void *ptr);
     _oml_set_storage_field((var), type, length, 0);       \
   } while(0)
 
+/** Release the reference an OmlValueU holds on lent data, if any.
+ *
+ * DO NOT USE THIS MACRO DIRECTLY!
+ *
+ * It is a helper for specific manipulation macros, which share its behaviour,
+ * but have less parameters.
+ *
+ * \param var OmlValueU to operate on
+ * \param type type of data contained in the OmlValueU (blob or vector)
+ * \see omlc_set_blob_borrowed, omlc_set_vector_borrowed
+ */
+#define _omlc_release_ref(var, type)                      \
+  do {                                                    \
+    if (_oml_get_storage_field((var), type, ref)) {       \
+      oml_value_ref_release(_oml_get_storage_field((var), type, ref)); \
+      _oml_set_storage_field((var), type, ref, NULL);     \
+    }                                                     \
+  } while(0)
+
 /** Copy data into the dedicated storage of an OmlValueU, allocating memory if needed.
  *
  * DO NOT USE THIS MACRO DIRECTLY!
@@ -423,11 +486,13 @@ size_t oml_malloc_usable_size(void *ptr);
  * \see oml_malloc, memcpy(3)
  */
 /* XXX: Does not check result of oml_malloc */
+/* At least one byte is allocated, so storage for empty data has a non-zero
+ * size and is freed by _omlc_free_storage */
 #define _omlc_set_storage_copy(var, type, data, len)                          \
   do {                                                                        \
     if (len >= _oml_get_storage_field((var), type, size)) {                   \
       _omlc_reset_storage((var), type);                                       \
-      _oml_set_storage_field((var), type, ptr, oml_malloc(len));                 \
+      _oml_set_storage_field((var), type, ptr, oml_malloc((len) ? (len) : 1));   \
       _oml_set_storage_field((var), type, size,                               \
           oml_malloc_usable_size(_oml_get_storage_field((var), type, ptr)));     \
     }                                                                         \
@@ -439,38 +504,51 @@ size_t oml_malloc_usable_size(void *ptr);
 #define omlc_free_string(var) \
   _omlc_free_storage((var), string)
 /** \see _omlc_reset_storage */
-#define omlc_reset_string(var)          \
-  do {                                  \
-    _omlc_reset_storage((var), string); \
-    omlc_set_string_is_const(var, 0);   \
+#define omlc_reset_string(var)                            \
+  do {                                                    \
+    _omlc_reset_storage((var), string);                   \
+    omlc_set_string_is_const(var, 0);                     \
+    _oml_set_storage_field((var), string, is_inline, 0);  \
   } while(0)
 
 /** Copy a string into the dedicated storage of an OmlValueU.
  *
- * Allocate (or reuse) a buffer of size len+1, copy the string, and
- * nul-terminate it.
+ * Strings shorter than OMLC_STRING_INLINE_SIZE are copied in the OmlValueU
+ * itself. Longer ones are copied in a buffer of size len+1, allocated if the
+ * current one is not large enough. The copy is nul-terminated.
  *
  * The length attribute is the length of the string; not how much of the
  * storage is used (len + 1), as is the case for generic storage (blobs).
  *
  * \param var OmlValueU to manipulate
- * \param str terminated string to copy
+ * \param str string to copy, which needs not be nul-terminated
  * \param len length of the string (not including nul terminator, i.e., output of strlen(3))
- * \see _omlc_set_storage_copy, strlen(3)
+ * \see OMLC_STRING_INLINE_SIZE, oml_malloc, strlen(3)
  */
-#define omlc_set_string_copy(var, str, len)                    \
-  do {                                                         \
-    _omlc_set_storage_copy((var), string, (str), (len) + 1);   \
-    ((char*)(var).stringValue.ptr)[len] = '\0';                \
-    omlc_set_string_length(var, len);                          \
-    omlc_set_string_is_const(var, 0);                          \
+/* XXX: Does not check result of oml_malloc */
+#define omlc_set_string_copy(var, str, len)                                  \
+  do {                                                                       \
+    if ((size_t)(len) < OMLC_STRING_INLINE_SIZE) {                           \
+      _oml_set_storage_field((var), string, is_inline, 1);                   \
+    } else if ((size_t)(len) >= omlc_get_string_size(var)) {                 \
+      omlc_reset_string(var);                                                \
+      omlc_set_string_ptr((var), oml_malloc((len) + 1));                     \
+      omlc_set_string_size((var),                                            \
+          oml_malloc_usable_size(_oml_get_storage_field((var), string, ptr))); \
+    } else {                                                                 \
+      _oml_set_storage_field((var), string, is_inline, 0);                   \
+    }                                                                        \
+    memcpy(omlc_get_string_ptr(var), (void*)(str), (len));                   \
+    omlc_get_string_ptr(var)[len] = '\0';                                    \
+    omlc_set_string_length(var, len);                                        \
+    omlc_set_string_is_const(var, 0);                                        \
   } while(0)
 
-/** Duplicate an OmlValueU containing a string, allocating storage for an actual copy of the C string.
+/** Duplicate an OmlValueU containing a string, storing an actual copy of the C string.
  *
- * Allocate (or reuse) a buffer of size len+1, copy the string, and
- * nul-terminate it. As the string is actually copied. the destination string
- * is never const, regardless of the source.
+ * Copy the string inline, or in an allocated (or reused) buffer of size
+ * len+1, and nul-terminate it. As the string is actually copied. the
+ * destination string is never const, regardless of the source.
  *
  * \param dst destination OmlValueU
  * \param src source OmlValueU
@@ -506,18 +584,27 @@ size_t oml_malloc_usable_size(void *ptr);
     omlc_set_string_length((var), ((str)==NULL)?0:strlen(str)); \
   } while (0)
 
-/** \see _omlc_free_storage */
-#define omlc_free_blob(var) \
-  _omlc_free_storage((var), blob)
-/** \see _omlc_reset_storage */
-#define omlc_reset_blob(var) \
-  _omlc_reset_storage((var), blob)
+/** \see _omlc_free_storage, _omlc_release_ref */
+#define omlc_free_blob(var)                 \
+  do {                                      \
+    _omlc_release_ref((var), blob);         \
+    _omlc_free_storage((var), blob);        \
+  } while(0)
+/** \see _omlc_reset_storage, _omlc_release_ref */
+#define omlc_reset_blob(var)                \
+  do {                                      \
+    _omlc_release_ref((var), blob);         \
+    _omlc_reset_storage((var), blob);       \
+  } while(0)
 /** Convenience alias to omlc_set_blob_copy */
 #define omlc_set_blob(var, val, len) \
   omlc_set_blob_copy(var, val, len)
-/** \see _omlc_set_storage */
-#define omlc_set_blob_copy(var, val, len) \
-  _omlc_set_storage_copy((var), blob, (val), (len))
+/** \see _omlc_set_storage, _omlc_release_ref */
+#define omlc_set_blob_copy(var, val, len)                   \
+  do {                                                      \
+    _omlc_release_ref((var), blob);                         \
+    _omlc_set_storage_copy((var), blob, (val), (len));      \
+  } while(0)
 
 /** Duplicate an OmlValueU containing a blob, allocating storage for an actual copy of the data.
  *
@@ -528,7 +615,7 @@ size_t oml_malloc_usable_size(void *ptr);
  * \see _omlc_set_storage_copy
  */
 #define omlc_copy_blob(dst, src) \
-  _omlc_set_storage_copy((dst), blob, omlc_get_blob_ptr(src), omlc_get_blob_length(src))
+  omlc_set_blob_copy((dst), omlc_get_blob_ptr(src), omlc_get_blob_length(src))
 
 /** \see _oml_get_storage_field */
 #define omlc_get_vector_ptr(var) \
@@ -545,6 +632,9 @@ size_t oml_malloc_usable_size(void *ptr);
 /** \see _oml_get_storage_field */
 #define omlc_get_vector_nof_elts(var) \
   (_oml_get_storage_field((var), vector, nof_elts))
+/** \see _oml_get_storage_field, omlc_set_vector_borrowed */
+#define omlc_get_vector_ref(var) \
+  (_oml_get_storage_field((var), vector, ref))
 
 /** \see _oml_set_storage_field */
 #define omlc_set_vector_ptr(var, val)                   \
@@ -562,12 +652,16 @@ size_t oml_malloc_usable_size(void *ptr);
 #define omlc_set_vector_nof_elts(var, val) \
   (_oml_set_storage_field((var), vector, nof_elts, (uint16_t)(val)))
 
-/** \see _omlc_free_storage */
-#define omlc_free_vector(var) \
-    _omlc_free_storage((var), vector)                       
-/** \see _omlc_reset_storage */
+/** \see _omlc_free_storage, _omlc_release_ref */
+#define omlc_free_vector(var)                                    \
+  do {                                                           \
+    _omlc_release_ref((var), vector);                            \
+    _omlc_free_storage((var), vector);                           \
+  } while(0)
+/** \see _omlc_reset_storage, _omlc_release_ref */
 #define omlc_reset_vector(var)                                   \
   do {                                                           \
+    _omlc_release_ref((var), vector);                            \
     _omlc_reset_storage((var), vector);                          \
     omlc_set_vector_elt_size((var), 0);                          \
     omlc_set_vector_nof_elts((var), 0);                          \
@@ -588,6 +682,7 @@ size_t oml_malloc_usable_size(void *ptr);
 #define _omlc_set_vector_copy(var, data, nof_elts, size)         \
   do {                                                           \
     size_t bytes = (nof_elts) * (size);                          \
+    _omlc_release_ref((var), vector);                            \
     _omlc_set_storage_copy((var), vector, data, bytes);          \
     omlc_set_vector_nof_elts((var), (nof_elts));                 \
     omlc_set_vector_elt_size((var), (size));                     \
@@ -690,6 +785,10 @@ typedef struct OmlMP {
 /* Forward declaration from oml_filter.h */
 struct OmlFilter;   // can't include oml_filter.h yet
 struct OmlWriter;   // forward declaration
+/** Per-thread staging state of an MS, opaque outside of staging.c */
+typedef struct OmlMSStaging OmlMSStaging;
+/** State of an MS serialising its samples once for all its writers, opaque outside of filter.c */
+typedef struct OmlMSFanout OmlMSFanout;
 
 /** Definition of a Measurement Stream.
  *
@@ -733,7 +832,8 @@ typedef struct OmlMStream {
 
   /** Condition variable for sample-mode filter (XXX: Never used) */
   pthread_cond_t  condVar;
-  /** Filtering thread */
+  /** Filtering thread
+   * XXX: Not used anymore, all interval-based MSs share the same scheduler thread */
   pthread_t  filter_thread;
 
   /** Outputting function
@@ -757,6 +857,15 @@ typedef struct OmlMStream {
   /** Number of tuples dropped */
   uint32_t dropped;
 
+  /** Per-thread staging of injected samples, NULL if disabled */
+  OmlMSStaging* staging;
+
+  /** Set to !0 if injected samples are output as is, bypassing the filters \see filter_passthrough */
+  int passthrough;
+
+  /** Samples serialised for several writers, NULL until needed \see filter_fanout */
+  OmlMSFanout* fanout;
+
 } OmlMStream;
 
 /* Initialise the measurement library. */
@@ -771,6 +880,15 @@ int omlc_start(void);
 /*  Inject a measurement sample into a Measurement Point.  */
 int omlc_inject(OmlMP *mp, OmlValueU *values);
 
+/*  Inject a batch of measurement samples into a Measurement Point.  */
+int omlc_inject_batch(OmlMP *mp, OmlValueU *rows, int nrows);
+
+/*  Lend a blob to OML, to be released by a callback once it is not needed anymore.  */
+int omlc_set_blob_borrowed(OmlValueU *var, void *data, size_t length, omlc_release_fn release, void *arg);
+
+/*  Lend a vector to OML, to be released by a callback once it is not needed anymore.  */
+int omlc_set_vector_borrowed(OmlValueU *var, void *data, size_t nof_elts, size_t elt_size, omlc_release_fn release, void *arg);
+
 /** Inject metadata (key/value) for a specific MP.  */
 int omlc_inject_metadata(OmlMP *mp, const char *key, const OmlValueU *value, OmlValueT type, const char *fname);
 
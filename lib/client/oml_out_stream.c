@@ -55,7 +55,14 @@ create_out_stream_from_components(const char *scheme, const char *hostname, cons
     os = net_stream_new(scheme, hostname, port);
     break;
 
+  case OML_URI_ZLIB_TCP:
+    os = zlib_stream_new(net_stream_new("tcp", hostname, port));
+    break;
+
   case OML_URI_UDP:
+    os = udp_stream_new(hostname, port);
+    break;
+
   case OML_URI_UNKNOWN:
   default:
     logwarn ("URI scheme %s is not supported\n", scheme);
@@ -132,6 +139,33 @@ out_stream_write_header(OmlOutStream* self, oml_outs_write_f_immediate writefp,
   return count;
 }
 
+/** Write several chunks into an OmlOutStream, using its writev function if it has one */
+ssize_t
+out_stream_writev(OmlOutStream* self, const struct iovec* iov, int iovcnt, uint8_t* header, size_t header_length)
+{
+  ssize_t count, total = 0;
+  int i;
+
+  assert(self);
+  assert(iov || !iovcnt);
+
+  if (self->writev) {
+    return self->writev(self, iov, iovcnt, header, header_length);
+  }
+
+  for (i = 0; i < iovcnt; i++) {
+    if ((count = self->write(self, iov[i].iov_base, iov[i].iov_len, header, header_length)) < 0) {
+      return total ? total : -1;
+    }
+    total += count;
+    if ((size_t)count < iov[i].iov_len) {
+      break;
+    }
+  }
+
+  return total;
+}
+
 /*
  Local Variables:
  mode: C
@@ -20,10 +20,25 @@
  * \param encoding StreamEncoding to use for the output, either SE_Text or SE_Binary
  * \return a pointer to the new OmlWriter, or NULL on error
  *
- * \see create_out_stream
+ * \see create_writer2, create_out_stream
  */
 OmlWriter*
 create_writer(const char* uri, enum StreamEncoding encoding)
+{
+  return create_writer2(uri, encoding, BE_Default);
+}
+
+/** Create an OmlWriter for the specified URI, using a specific queueing engine
+ *
+ * \param uri collection URI
+ * \param encoding StreamEncoding to use for the output, either SE_Text or SE_Binary
+ * \param engine BufferEngine to queue data with, BE_Default selecting BE_Chain
+ * \return a pointer to the new OmlWriter, or NULL on error
+ *
+ * \see create_out_stream, bw_create2
+ */
+OmlWriter*
+create_writer2(const char* uri, enum StreamEncoding encoding, enum BufferEngine engine)
 {
   OmlOutStream* out_stream = NULL;
   OmlWriter* writer = NULL;
@@ -44,8 +59,8 @@ create_writer(const char* uri, enum StreamEncoding encoding)
   }
 
   switch (encoding) {
-  case SE_Text:   writer = text_writer_new (out_stream); break;
-  case SE_Binary: writer = bin_writer_new (out_stream); break;
+  case SE_Text:   writer = text_writer_new2 (out_stream, engine); break;
+  case SE_Binary: writer = bin_writer_new2 (out_stream, engine); break;
   case SE_None:
     logerror ("No encoding specified (this should never happen -- please report this as an OML bug)\n");
     // should cleanup streams
@@ -30,6 +30,7 @@ enum ConfToken {
   CT_COLLECT,
   CT_COLLECT_URL,
   CT_COLLECT_ENCODING,
+  CT_COLLECT_QUEUE,
   CT_STREAM,
   CT_STREAM_NAME,
   CT_STREAM_SOURCE,
@@ -89,6 +90,7 @@ init_tokens (void)
   setcurtok (CT_COLLECT),          mksyn ("collect");
   setcurtok (CT_COLLECT_URL),      mksyn ("url");
   setcurtok (CT_COLLECT_ENCODING), mksyn ("encoding");
+  setcurtok (CT_COLLECT_QUEUE),    mksyn ("queue");
   setcurtok (CT_STREAM),           mksyn ("mp"), mksyn ("stream");
   setcurtok (CT_STREAM_NAME),      mksyn ("name");
   /* CT_STREAM_SOURCE is a special case */
@@ -298,7 +300,17 @@ parse_collector(xmlNodePtr el)
     logerror("Config line %hu: Unknown 'encoding' value '%s' for <%s ...>'.\n", el->line, encoding_s, el->name);
     return -1;
   }
-  if ((writer = create_writer(url, encoding)) == NULL) {
+  char* queue_s = get_xml_attr(el, CT_COLLECT_QUEUE);
+  enum BufferEngine engine;
+  if (queue_s == NULL || strcmp(queue_s, "chain") == 0) {
+    engine = BE_Chain;
+  } else if (strcmp(queue_s, "ring") == 0) {
+    engine = BE_Ring;
+  } else {
+    logerror("Config line %hu: Unknown 'queue' value '%s' for <%s ...>'.\n", el->line, queue_s, el->name);
+    return -1;
+  }
+  if ((writer = create_writer2(url, encoding, engine)) == NULL) {
     return -2;
 
   } else {
@@ -0,0 +1,292 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file staging.c
+ * \brief Per-thread staging of the samples injected into an MS.
+ *
+ * When staging is enabled on an MS, each injecting thread inputs its samples
+ * into its own clones of the MS's filters, without locking the MP. The clones
+ * are merged back into the MS's filters when filter_process() is about to
+ * output a new sample, or when their thread exits.
+ *
+ * This requires all the filters of the MS to implement oml_filter_merge.
+ *
+ * \see omlc_inject, filter_process, oml_filter_merge
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "oml2/omlc.h"
+#include "oml2/oml_filter.h"
+#include "ocomm/o_log.h"
+#include "mem.h"
+#include "oml_value.h"
+#include "filter/factory.h"
+#include "client.h"
+
+/** Filters private to one injecting thread */
+typedef struct StagingThread {
+
+  struct StagingThread* next;	/**< Link to the next thread staging samples into the same MS */
+
+  OmlMStream* ms;		/**< MS whose filters are cloned */
+
+  pthread_mutex_t lock;		/**< Mutex held while inputting samples into the filters, or merging them */
+
+  OmlFilter* filters;		/**< Clones of the MS's filters, in the same order */
+
+} StagingThread;
+
+/** Staging state of an MS */
+struct OmlMSStaging {
+
+  pthread_key_t key;		/**< Key to the StagingThread of the calling thread */
+
+  pthread_mutex_t lock;		/**< Mutex protecting the list of StagingThreads */
+
+  StagingThread* threads;	/**< All StagingThreads created for this MS */
+
+};
+
+static StagingThread* get_staging_thread(OmlMStream* ms);
+static void destroy_staging_thread(StagingThread* st);
+static void release_staging_thread(void* value);
+
+/** Enable per-thread staging of the samples injected into an MS.
+ *
+ * Staging is only enabled if all the filters of the MS can merge their
+ * samples, and if the MS does not output every sample anyway.
+ *
+ * \param ms OmlMStream on which to enable staging
+ * \return 0 if staging has been enabled, -1 otherwise
+ * \see ms_staging_destroy
+ */
+int
+ms_staging_enable(OmlMStream* ms)
+{
+  OmlFilter* f;
+  OmlMSStaging* staging;
+
+  if (!ms || ms->staging) {
+    return -1;
+  }
+
+  if (ms->sample_thres == 1) {
+    logdebug("%s: Every sample is reported, not staging them per thread\n", ms->table_name);
+    return -1;
+  }
+
+  for (f = ms->filters; f; f = f->next) {
+    if (!f->merge) {
+      logdebug("%s: Filter %s cannot merge samples, not staging them per thread\n",
+          ms->table_name, f->name);
+      return -1;
+    }
+  }
+
+  if (!(staging = (OmlMSStaging*)oml_malloc(sizeof(OmlMSStaging)))) {
+    return -1;
+  }
+  memset(staging, 0, sizeof(OmlMSStaging));
+
+  if (pthread_key_create(&staging->key, release_staging_thread)) {
+    logerror("%s: Cannot create thread-specific key: %s\n", ms->table_name, strerror(errno));
+    oml_free(staging);
+    return -1;
+  }
+  pthread_mutex_init(&staging->lock, NULL);
+
+  ms->staging = staging;
+  loginfo("%s: Staging samples per thread\n", ms->table_name);
+
+  return 0;
+}
+
+/** Input a sample into the calling thread's filters of an MS.
+ *
+ * \param ms OmlMStream with staging enabled
+ * \param values array of OmlValueU, as passed to omlc_inject
+ * \param v OmlValue to use as temporary storage
+ * \return 0 on success, -1 otherwise
+ * \see omlc_inject
+ */
+int
+ms_staging_inject(OmlMStream* ms, OmlValueU* values, OmlValue* v)
+{
+  OmlFilter* f;
+  OmlMPDef* defs = ms->mp->param_defs;
+  StagingThread* st = get_staging_thread(ms);
+
+  if (!st) {
+    return -1;
+  }
+
+  oml_lock(&st->lock, __FUNCTION__);
+  for (f = st->filters; f; f = f->next) {
+    oml_value_set_view(v, &values[f->index], defs[f->index].param_types);
+    f->input(f, v);
+  }
+  oml_unlock(&st->lock, __FUNCTION__);
+
+  return 0;
+}
+
+/** Merge the samples staged by all threads into the filters of an MS.
+ *
+ * \warning The MP lock should be held when calling this function.
+ *
+ * \param ms OmlMStream with staging enabled
+ * \see filter_process
+ */
+void
+ms_staging_merge(OmlMStream* ms)
+{
+  OmlFilter *f, *pf;
+  StagingThread* st;
+
+  oml_lock(&ms->staging->lock, __FUNCTION__);
+  for (st = ms->staging->threads; st; st = st->next) {
+    oml_lock(&st->lock, __FUNCTION__);
+    for (f = ms->filters, pf = st->filters; f && pf; f = f->next, pf = pf->next) {
+      f->merge(f, pf);
+    }
+    oml_unlock(&st->lock, __FUNCTION__);
+  }
+  oml_unlock(&ms->staging->lock, __FUNCTION__);
+}
+
+/** Disable staging on an MS, and free the associated memory.
+ *
+ * Samples staged but not merged are lost; filter_process() should be called
+ * first to report them.
+ *
+ * \param ms OmlMStream on which to disable staging
+ * \see ms_staging_enable
+ */
+void
+ms_staging_destroy(OmlMStream* ms)
+{
+  StagingThread* st;
+
+  if (!ms || !ms->staging) {
+    return;
+  }
+
+  while ((st = ms->staging->threads)) {
+    ms->staging->threads = st->next;
+    destroy_staging_thread(st);
+  }
+  pthread_key_delete(ms->staging->key);
+  pthread_mutex_destroy(&ms->staging->lock);
+  oml_free(ms->staging);
+  ms->staging = NULL;
+}
+
+/** Get the StagingThread of the calling thread, creating it if needed.
+ *
+ * \param ms OmlMStream with staging enabled
+ * \return the StagingThread, or NULL on error
+ */
+static StagingThread*
+get_staging_thread(OmlMStream* ms)
+{
+  OmlFilter *f, *pf, *last = NULL;
+  StagingThread* st = (StagingThread*)pthread_getspecific(ms->staging->key);
+
+  if (st) {
+    return st;
+  }
+
+  if (!(st = (StagingThread*)oml_malloc(sizeof(StagingThread)))) {
+    return NULL;
+  }
+  memset(st, 0, sizeof(StagingThread));
+  st->ms = ms;
+  pthread_mutex_init(&st->lock, NULL);
+
+  for (f = ms->filters; f; f = f->next) {
+    if (!(pf = clone_filter(f))) {
+      logerror("%s: Cannot clone filter %s for staging\n", ms->table_name, f->name);
+      destroy_staging_thread(st);
+      return NULL;
+    }
+    if (last) {
+      last->next = pf;
+    } else {
+      st->filters = pf;
+    }
+    last = pf;
+  }
+
+  oml_lock(&ms->staging->lock, __FUNCTION__);
+  st->next = ms->staging->threads;
+  ms->staging->threads = st;
+  oml_unlock(&ms->staging->lock, __FUNCTION__);
+
+  pthread_setspecific(ms->staging->key, st);
+  return st;
+}
+
+/** Merge the samples of an exiting thread, and free its StagingThread.
+ *
+ * \param value StagingThread of the exiting thread
+ * \see get_staging_thread, pthread_key_create(3)
+ */
+static void
+release_staging_thread(void* value)
+{
+  StagingThread *st = (StagingThread*)value, **prev;
+  OmlMStream* ms = st->ms;
+  OmlFilter *f, *pf;
+
+  if (mp_lock(ms->mp) == -1) {
+    /* Leave it to ms_staging_destroy() */
+    return;
+  }
+  oml_lock(&ms->staging->lock, __FUNCTION__);
+  for (f = ms->filters, pf = st->filters; f && pf; f = f->next, pf = pf->next) {
+    f->merge(f, pf);
+  }
+  for (prev = &ms->staging->threads; *prev; prev = &(*prev)->next) {
+    if (*prev == st) {
+      *prev = st->next;
+      break;
+    }
+  }
+  oml_unlock(&ms->staging->lock, __FUNCTION__);
+  mp_unlock(ms->mp);
+
+  destroy_staging_thread(st);
+}
+
+/** Free a StagingThread and its filters.
+ *
+ * \param st StagingThread to free
+ */
+static void
+destroy_staging_thread(StagingThread* st)
+{
+  OmlFilter* f = st->filters;
+
+  while( (f = destroy_filter(f)) );
+  pthread_mutex_destroy(&st->lock);
+  oml_free(st);
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -28,6 +28,9 @@
 #include "string_utils.h"
 #include "base64.h"
 
+/** Protocol version of the text encoding, which has not changed since OMSPv5 */
+#define OML_TEXT_PROTOCOL_VERSION 5
+
 typedef struct OmlTextWriter {
 
   /*
@@ -50,14 +53,17 @@ typedef struct OmlTextWriter {
   OmlWriter* next;
   /** \see OmlWriter::bufferedWriter */
   BufferedWriter* bufferedWriter;
+  /** \see OmlWriter::row_encode */
+  oml_writer_row_encode row_encode;
+  /** \see OmlWriter::row_push */
+  oml_writer_row_push row_push;
+  /** \see OmlWriter::protocol */
+  int protocol;
 
   /*
    * Fields specific to the OmlTextWriter
    */
 
-  /** Currently active MBuffer of the bufferedWriter chain */
-  MBuffer* mbuf;
-
   /** This used to be an 'OmlOutStream' pointer, kept like this not to risk breaking ABIs */
   void* unused;
 
@@ -69,6 +75,9 @@ static int owt_header_done(OmlWriter* writer);
 static int owt_row_start(OmlWriter* writer, OmlMStream* ms, double now);
 static int owt_row_cols(OmlWriter* writer, OmlValue* values, int value_count);
 static int owt_row_end(OmlWriter* writer, OmlMStream* ms);
+static int owt_row_encode(OmlWriter* writer, MBuffer* mbuf, OmlMStream* ms, double now, OmlValue* values, int value_count);
+static int owt_row_push(OmlWriter* writer, OmlMStream* ms, MBuffer* mbuf);
+static void owt_row_commit(OmlTextWriter* self, OmlMStream* ms, MBuffer* mbuf);
 
 static OmlWriter* owt_close(OmlWriter* writer);
 
@@ -81,21 +90,40 @@ static OmlWriter* owt_close(OmlWriter* writer);
  */
 OmlWriter*
 text_writer_new(OmlOutStream* out_stream)
+{
+  return text_writer_new2(out_stream, BE_Default);
+}
+
+/** Create a new OmlTextWriter using a specific queueing engine
+ * \param out_stream OmlOutStream into which the data should be written
+ * \param engine BufferEngine to queue data with
+ *
+ * \return a pointer to the new OmlTextWriter cast as an OmlWriter
+ *
+ * \see BufferedWriter, bw_create2
+ */
+OmlWriter*
+text_writer_new2(OmlOutStream* out_stream, enum BufferEngine engine)
 {
   assert(out_stream != NULL);
 
   OmlTextWriter* self = (OmlTextWriter *)oml_malloc(sizeof(OmlTextWriter));
   memset(self, 0, sizeof(OmlTextWriter));
 
-  self->bufferedWriter = bw_create(out_stream, omlc_instance->max_queue, 0);
+  self->bufferedWriter = bw_create2(out_stream, omlc_instance->max_queue, 0, engine);
+  if (self->bufferedWriter && omlc_instance->spill_dir) {
+    bw_spill_enable(self->bufferedWriter, omlc_instance->spill_dir);
+  }
 
   self->meta = owt_meta;
   self->header_done = owt_header_done;
   self->row_start = owt_row_start;
   self->row_end = owt_row_end;
   self->out = owt_row_cols;
+  self->row_encode = owt_row_encode;
+  self->row_push = owt_row_push;
   self->close = owt_close;
-
+  self->protocol = OML_TEXT_PROTOCOL_VERSION;
 
   return (OmlWriter*)self;
 }
@@ -132,20 +160,33 @@ owt_header_done(OmlWriter* writer)
 }
 
 
-/** Function called for every result value in a measurement tuple (sample)
- * \see oml_writer_out
+/** Serialise the header of a sample into the current message of an MBuffer.
+ * \param mbuf MBuffer to write into
+ * \param ms OmlMStream for which the sample is
+ * \param now current timestamp
+ * \return 0 on success, -1 otherwise
+ * \see owt_row_start, owt_row_encode
  */
 static int
-owt_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
+owt_encode_header(MBuffer* mbuf, OmlMStream* ms, double now)
 {
-  char *enc;
-  OmlTextWriter* self = (OmlTextWriter*)writer;
-  MBuffer* mbuf;
-  if ((mbuf = self->mbuf) == NULL) {
-    return 0; /* previous use of mbuf failed */
-  }
+  return mbuf_print(mbuf, "%f\t%d\t%ld", now, ms->index, ms->seq_no) ? -1 : 0;
+}
 
+/** Serialise result values into the current message of an MBuffer.
+ * \param mbuf MBuffer to write into
+ * \param values array of OmlValue to write out
+ * \param value_count size of the values array
+ * \return 0 on success, -1 otherwise
+ * \see owt_row_cols, owt_row_encode
+ */
+static int
+owt_encode_cols(MBuffer* mbuf, OmlValue* values, int value_count)
+{
+  char encbuf[256]; /* Encoding buffer for most strings, to avoid allocating memory */
+  char *enc;
   int i;
+  size_t j, enc_size;
   OmlValue* v = values;
   for (i = 0; i < value_count; i++, v++) {
     int res;
@@ -179,10 +220,17 @@ owt_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
     case OML_STRING_VALUE:
       if(omlc_get_string_ptr(*oml_value_get_value(v)) &&
           0 < omlc_get_string_length(*oml_value_get_value(v))) {
-        enc = oml_malloc(backslash_encode_size(omlc_get_string_size(v->value)));
+        enc_size = backslash_encode_size(omlc_get_string_length(v->value));
+        enc = (enc_size <= sizeof(encbuf)) ? encbuf : oml_malloc(enc_size);
+        if (!enc) {
+          res = -1;
+          break;
+        }
         backslash_encode(omlc_get_string_ptr(v->value), enc);
         res = mbuf_print(mbuf, "\t%s", enc);
-        oml_free(enc);
+        if (enc != encbuf) {
+          oml_free(enc);
+        }
 
       } else {
         logdebug ("Attempting to send NULL or empty string; string of length 0 will be sent\n");
@@ -218,8 +266,8 @@ owt_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
       size_t nof_elts = omlc_get_vector_nof_elts(*u);
       double *elts = omlc_get_vector_ptr(*u);
       res = mbuf_print(mbuf, "\t%zu", nof_elts);
-      for(i = 0; 0 == res && i < nof_elts; i++)
-        res = mbuf_print(mbuf, " %.*g", DBL_DIG, elts[i]);
+      for(j = 0; 0 == res && j < nof_elts; j++)
+        res = mbuf_print(mbuf, " %.*g", DBL_DIG, elts[j]);
       break;
     }
 
@@ -228,8 +276,8 @@ owt_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
       size_t nof_elts = omlc_get_vector_nof_elts(*u);
       int32_t *elts = omlc_get_vector_ptr(*u);
       res = mbuf_print(mbuf, "\t%zu", nof_elts);
-      for(i = 0; 0 == res && i < nof_elts; i++)
-        res = mbuf_print(mbuf, " %" PRId32, elts[i]);
+      for(j = 0; 0 == res && j < nof_elts; j++)
+        res = mbuf_print(mbuf, " %" PRId32, elts[j]);
       break;
     }
 
@@ -238,8 +286,8 @@ owt_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
       size_t nof_elts = omlc_get_vector_nof_elts(*u);
       uint32_t *elts = omlc_get_vector_ptr(*u);
       res = mbuf_print(mbuf, "\t%zu", nof_elts);
-      for(i = 0; 0 == res && i < nof_elts; i++)
-        res = mbuf_print(mbuf, " %" PRIu32, elts[i]);
+      for(j = 0; 0 == res && j < nof_elts; j++)
+        res = mbuf_print(mbuf, " %" PRIu32, elts[j]);
       break;
     }
 
@@ -248,8 +296,8 @@ owt_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
       size_t nof_elts = omlc_get_vector_nof_elts(*u);
       int64_t *elts = omlc_get_vector_ptr(*u);
       res = mbuf_print(mbuf, "\t%zu", nof_elts);
-      for(i = 0; 0 == res && i < nof_elts; i++)
-        res = mbuf_print(mbuf, " %" PRId64, elts[i]);
+      for(j = 0; 0 == res && j < nof_elts; j++)
+        res = mbuf_print(mbuf, " %" PRId64, elts[j]);
       break;
     }
 
@@ -258,8 +306,8 @@ owt_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
       size_t nof_elts = omlc_get_vector_nof_elts(*u);
       uint64_t *elts = omlc_get_vector_ptr(*u);
       res = mbuf_print(mbuf, "\t%zu", nof_elts);
-      for(i = 0; 0 == res && i < nof_elts; i++)
-        res = mbuf_print(mbuf, " %" PRIu64, elts[i]);
+      for(j = 0; 0 == res && j < nof_elts; j++)
+        res = mbuf_print(mbuf, " %" PRIu64, elts[j]);
       break;
     }
 
@@ -268,23 +316,39 @@ owt_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
       size_t nof_elts = omlc_get_vector_nof_elts(*u);
       bool *elts = omlc_get_vector_ptr(*u);
       res = mbuf_print(mbuf, "\t%zu", nof_elts);
-      for(i = 0; 0 == res && i < nof_elts; i++)
-        res = mbuf_print(mbuf, " %s", elts[i] ? "True" : "False");
+      for(j = 0; 0 == res && j < nof_elts; j++)
+        res = mbuf_print(mbuf, " %s", elts[j] ? "True" : "False");
       break;
     }
 
     default:
       res = -1;
       logerror("%s: Unsupported value type '%d'\n", __FUNCTION__, oml_value_get_type(v));
-      return 0;
     }
 
     if (res < 0) {
-      mbuf_reset_write(mbuf);
-      self->mbuf = NULL;
-      return 0;
+      return -1;
     }
   }
+  return 0;
+}
+
+/** Function called for every result value in a measurement tuple (sample)
+ * \see oml_writer_out
+ */
+static int
+owt_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
+{
+  OmlTextWriter* self = (OmlTextWriter*)writer;
+  MBuffer* mbuf;
+  if ((mbuf = bw_current_write_buf(self->bufferedWriter)) == NULL) {
+    return 0; /* previous use of mbuf failed */
+  }
+
+  if (owt_encode_cols(mbuf, values, value_count)) {
+    bw_abort_write_buf(self->bufferedWriter);
+    return 0;
+  }
   return 1;
 }
 
@@ -298,14 +362,13 @@ owt_row_start(OmlWriter* writer, OmlMStream* ms, double now)
   assert(self->bufferedWriter != NULL);
 
   MBuffer* mbuf;
-  if ((mbuf = self->mbuf = bw_get_write_buf(self->bufferedWriter)) == NULL) {
+  if ((mbuf = bw_get_write_buf(self->bufferedWriter)) == NULL) {
     return 0;
   }
 
   mbuf_begin_write(mbuf);
-  if (mbuf_print(mbuf, "%f\t%d\t%ld", now, ms->index, ms->seq_no)) {
-    mbuf_reset_write(mbuf);
-    self->mbuf = NULL;
+  if (owt_encode_header(mbuf, ms, now)) {
+    bw_abort_write_buf(self->bufferedWriter);
     return 0;
   }
   return 1;
@@ -320,7 +383,8 @@ owt_row_end(OmlWriter* writer, OmlMStream* ms)
   (void)ms;
   OmlTextWriter* self = (OmlTextWriter*)writer;
   MBuffer* mbuf;
-  if ((mbuf = self->mbuf) == NULL) {
+  if ((mbuf = bw_current_write_buf(self->bufferedWriter)) == NULL) {
+    bw_release_write_buf(self->bufferedWriter);
     return 0; /* previous use of mbuf failed */
   }
 
@@ -329,37 +393,92 @@ owt_row_end(OmlWriter* writer, OmlMStream* ms)
     mbuf_reset_write(mbuf);
 
   } else {
-    // success, lock in message
-    if (0 == ms->index) {
-      /* This is schema0, also push the data into the meta_buf
-       * to be replayed after a disconnection.
-       *
-       * At the moment, the oml_outs_write_f takes header information as a
-       * whole, but does not push more once it has sent the initial block. Its
-       * two last parameters are only used to resend the entirety of the headers
-       * when a disconnection does occur, nothing before.
-       *
-       * We therefore send the extra piece of data the normal way, but also
-       * record it, separately, in the meta_buf
-       *
-       * XXX: This logic should be in higher layer levels, but given the current
-       * implementation, with some of it already spread down into the
-       * OmlOutStream (oml_outs_write_f), this require a much bigger refactoring.
-       * It is also duplicated with the OmlBinWriter (see #1101).
-       */
-      _bw_push_meta(self->bufferedWriter,
-          mbuf_message(self->mbuf), mbuf_message_length(self->mbuf));
-    }
+    owt_row_commit(self, ms, mbuf);
+  }
 
-    mbuf_begin_write (mbuf);
+  bw_msgcount_add(self->bufferedWriter, 1);
+  bw_release_write_buf(self->bufferedWriter);
+  return res == 0;
+}
+
+/** Function called to serialise a complete sample into an MBuffer
+ * \see oml_writer_row_encode
+ */
+static int
+owt_row_encode(OmlWriter* writer, MBuffer* mbuf, OmlMStream* ms, double now, OmlValue* values, int value_count)
+{
+  (void)writer;
+  mbuf_begin_write(mbuf);
+  if (owt_encode_header(mbuf, ms, now) ||
+      owt_encode_cols(mbuf, values, value_count) ||
+      mbuf_write(mbuf, (uint8_t*)"\n", 1)) {
+    mbuf_reset_write(mbuf);
+    return 0;
+  }
+  return 1;
+}
+
+/** Function called to output a sample serialised by owt_row_encode
+ * \see oml_writer_row_push
+ */
+static int
+owt_row_push(OmlWriter* writer, OmlMStream* ms, MBuffer* row)
+{
+  OmlTextWriter* self = (OmlTextWriter*)writer;
+  assert(self->bufferedWriter != NULL);
+
+  MBuffer* mbuf;
+  if ((mbuf = bw_get_write_buf(self->bufferedWriter)) == NULL) {
+    return 0;
+  }
+
+  int res;
+  mbuf_begin_write(mbuf);
+  if ((res = mbuf_write(mbuf, mbuf_message(row), mbuf_message_length(row))) != 0) {
+    mbuf_reset_write(mbuf);
+
+  } else {
+    owt_row_commit(self, ms, mbuf);
   }
 
-  self->mbuf = NULL;
   bw_msgcount_add(self->bufferedWriter, 1);
   bw_release_write_buf(self->bufferedWriter);
   return res == 0;
 }
 
+/** Lock in a complete sample in the current message of the writer's MBuffer
+ * \param self OmlTextWriter holding the write buffer
+ * \param ms OmlMStream for which the sample is
+ * \param mbuf MBuffer containing the sample as its current message
+ * \see owt_row_end, owt_row_push
+ */
+static void
+owt_row_commit(OmlTextWriter* self, OmlMStream* ms, MBuffer* mbuf)
+{
+  if (0 == ms->index) {
+    /* This is schema0, also push the data into the meta_buf
+     * to be replayed after a disconnection.
+     *
+     * At the moment, the oml_outs_write_f takes header information as a
+     * whole, but does not push more once it has sent the initial block. Its
+     * two last parameters are only used to resend the entirety of the headers
+     * when a disconnection does occur, nothing before.
+     *
+     * We therefore send the extra piece of data the normal way, but also
+     * record it, separately, in the meta_buf
+     *
+     * XXX: This logic should be in higher layer levels, but given the current
+     * implementation, with some of it already spread down into the
+     * OmlOutStream (oml_outs_write_f), this require a much bigger refactoring.
+     * It is also duplicated with the OmlBinWriter (see #1101).
+     */
+    bw_push_meta(self->bufferedWriter,
+        mbuf_message(mbuf), mbuf_message_length(mbuf));
+  }
+
+  mbuf_begin_write (mbuf);
+}
+
 /** Function called to close the writer and free its allocated objects.
  * \see oml_writer_close
  */
@@ -0,0 +1,328 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/**\file udp_stream.c
+ * \brief An OmlOutStream implementation sending measurement tuples in UDP datagrams.
+ *
+ * Messages are packed into datagrams of at most payload_size bytes, but are
+ * never split across datagrams, so the loss of a datagram only loses the
+ * messages it contained. Such losses show as gaps in the sequence numbers of
+ * the affected streams.
+ *
+ * Message boundaries are found according to the content type announced in
+ * the headers: text messages are lines, and binary messages have their
+ * length in their marshalling header. The headers themselves are sent, split
+ * at line boundaries, before any data, and again whenever the Socket reports
+ * an error (e.g., an ICMP port unreachable while the server was down).
+ *
+ * \see udp_stream_new, udp_stream_set_mtu, socket_udp_out_new
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "oml2/omlc.h"
+#include "oml2/oml_out_stream.h"
+#include "ocomm/o_log.h"
+#include "ocomm/o_socket.h"
+#include "mem.h"
+#include "mstring.h"
+#include "marshal.h"
+#include "oml_utils.h"
+#include "client.h"
+#include "udp_stream.h"
+
+static ssize_t udp_stream_write(OmlOutStream* hdl, uint8_t* buffer, size_t  length, uint8_t* header, size_t  header_length);
+static ssize_t udp_stream_writev(OmlOutStream* hdl, const struct iovec* iov, int iovcnt, uint8_t* header, size_t header_length);
+static int udp_stream_close(OmlOutStream* hdl);
+
+/** Create a new out stream for sending datagrams over the network
+ * \param hostname string representing the host to send to (oml_strndup()'d locally)
+ * \param service symbolic name or port number of the service to send to (oml_strndup()'d locally)
+ * \return a new OmlOutStream instance
+ *
+ * \see oml_strndup, udp_stream_set_mtu
+ */
+OmlOutStream*
+udp_stream_new(const char *hostname, const char *service)
+{
+  MString *dest;
+  assert(hostname != NULL && service != NULL);
+  OmlUdpOutStream* self = (OmlUdpOutStream *)oml_malloc(sizeof(OmlUdpOutStream));
+  memset(self, 0, sizeof(OmlUdpOutStream));
+
+  dest = mstring_create();
+  mstring_sprintf(dest, "udp://%s:%s", hostname, service);
+  self->dest = (char*)oml_strndup (mstring_buf(dest), mstring_len(dest));
+  mstring_delete(dest);
+
+  self->host = (char*)oml_strndup (hostname, strlen (hostname));
+  self->service = (char*)oml_strndup (service, strlen (service));
+  self->payload_size = DEF_UDP_PAYLOAD_SIZE;
+
+  logdebug("%s: Created OmlUdpOutStream\n", self->dest);
+  socket_set_non_blocking_mode(0);
+
+  self->write = udp_stream_write;
+  self->writev = udp_stream_writev;
+  self->close = udp_stream_close;
+  return (OmlOutStream*)self;
+}
+
+/** Set the path MTU towards the destination of an OmlUdpOutStream
+ *
+ * Datagrams are filled with messages up to the MTU, minus the size of the
+ * IPv6 and UDP headers.
+ *
+ * \param hdl pointer to the OmlOutStream
+ * \param mtu MTU to the destination, in bytes
+ * \return 0 on success, -1 if hdl is not a UDP stream or the MTU is too small
+ */
+int
+udp_stream_set_mtu(OmlOutStream* hdl, size_t mtu)
+{
+  OmlUdpOutStream* self = (OmlUdpOutStream*)hdl;
+
+  if (!self || self->writev != udp_stream_writev) {
+    logwarn("%s: Not a UDP stream, cannot set its MTU\n", self ? self->dest : "(null)");
+    return -1;
+  }
+  if (mtu <= UDP_HEADERS_SIZE) {
+    logwarn("%s: MTU %zuB too small, keeping %zuB datagrams\n",
+        self->dest, mtu, self->payload_size);
+    return -1;
+  }
+  self->payload_size = mtu - UDP_HEADERS_SIZE;
+  if (self->payload_size > MAX_UDP_PAYLOAD_SIZE) {
+    self->payload_size = MAX_UDP_PAYLOAD_SIZE;
+  }
+  return 0;
+}
+
+/** Called to close the socket
+ * \see oml_outs_close_f
+ */
+static int
+udp_stream_close(OmlOutStream* stream)
+{
+  OmlUdpOutStream* self = (OmlUdpOutStream*)stream;
+
+  logdebug("%s: Destroying OmlUdpOutStream at %p\n", self->dest, self);
+
+  if (self->socket != 0) {
+    socket_free(self->socket);
+    self->socket = NULL;
+  }
+  oml_free(self->dest);
+  oml_free(self->host);
+  oml_free(self->service);
+  oml_free(self);
+  return 0;
+}
+
+/** Tell whether some headers announce binary content
+ * \param header buffer containing the headers
+ * \param header_length length of header
+ * \return 1 if a "content: binary" line is present, 0 otherwise
+ */
+static int
+udp_stream_header_is_binary(const uint8_t* header, size_t header_length)
+{
+  static const char line[] = "content: binary\n";
+  size_t i;
+
+  for (i = 0; i + sizeof(line) - 1 <= header_length; i++) {
+    if ((0 == i || '\n' == header[i-1]) && !memcmp(header + i, line, sizeof(line) - 1)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/** Find the length of the first message in a buffer
+ *
+ * \param buf buffer starting with a message
+ * \param len length of buf
+ * \param binary non-zero if buf contains binary messages, 0 for text lines
+ * \return the length of the first message; if it is not complete, or not a
+ * valid message, the data up to the next message, or the end of buf
+ */
+static size_t
+udp_stream_message_length(const uint8_t* buf, size_t len, int binary)
+{
+  const uint8_t* next;
+  ssize_t mlen;
+
+  if (!binary) {
+    next = memchr(buf, '\n', len);
+    return next ? (size_t)(next - buf) + 1 : len;
+  }
+
+  if ((mlen = marshal_get_message_length(buf, len)) > 0 && (size_t)mlen <= len) {
+    return mlen;
+  }
+  next = (len > 2) ? find_sync(buf + 2, len - 2) : NULL;
+  return next ? (size_t)(next - buf) : len;
+}
+
+/** Send one datagram
+ * \param self OmlUdpOutStream through which the datagram should be sent
+ * \param iov buffers making up the datagram
+ * \param iovcnt number of buffers in iov
+ * \param length total length of the datagram
+ * \return 0 on success, -1 otherwise
+ * \see socket_sendv
+ */
+static int
+udp_stream_send_datagram(OmlUdpOutStream* self, const struct iovec* iov, int iovcnt, size_t length)
+{
+  ssize_t sent = socket_sendv(self->socket, iov, iovcnt);
+
+  if (sent < (ssize_t)length) {
+    if (sent >= 0 && socket_is_disconnected(self->socket)) {
+      logdebug("%s: Destination unreachable\n", self->dest);
+    }
+    return -1;
+  }
+  return 0;
+}
+
+/** Pack whole messages from several buffers into as few datagrams as possible, and send them
+ *
+ * Messages larger than the payload size are sent in a datagram of their own,
+ * and those too large for any datagram are dropped.
+ *
+ * \param self OmlUdpOutStream through which the data should be sent
+ * \param iov array of buffers containing whole messages
+ * \param iovcnt number of buffers in iov
+ * \param binary non-zero if the buffers contain binary messages, 0 for text lines
+ * \return the size of data sent (or dropped) from iov, in order
+ */
+static ssize_t
+udp_stream_sendv(OmlUdpOutStream* self, const struct iovec* iov, int iovcnt, int binary)
+{
+  struct iovec dgram[OML_OUTS_IOV_MAX];
+  ssize_t count = 0;
+  size_t fill = 0, off, mlen;
+  uint8_t* buf;
+  int i, n = 0;
+
+  for (i = 0; i < iovcnt; i++) {
+    buf = (uint8_t*)iov[i].iov_base;
+    for (off = 0; off < iov[i].iov_len; off += mlen) {
+      mlen = udp_stream_message_length(buf + off, iov[i].iov_len - off, binary);
+
+      /* Send the current datagram if this message doesn't fit in */
+      if (n > 0 && (fill + mlen > self->payload_size || n == OML_OUTS_IOV_MAX)) {
+        if (udp_stream_send_datagram(self, dgram, n, fill)) {
+          return count;
+        }
+        count += fill;
+        fill = 0;
+        n = 0;
+      }
+
+      if (mlen > MAX_UDP_PAYLOAD_SIZE) {
+        logwarn("%s: Dropping %dB message, too large for a datagram\n", self->dest, mlen);
+        count += mlen;
+        continue;
+      }
+
+      if (n > 0 && (uint8_t*)dgram[n-1].iov_base + dgram[n-1].iov_len == buf + off) {
+        dgram[n-1].iov_len += mlen;
+      } else {
+        dgram[n].iov_base = buf + off;
+        dgram[n++].iov_len = mlen;
+      }
+      fill += mlen;
+    }
+  }
+
+  if (n > 0 && !udp_stream_send_datagram(self, dgram, n, fill)) {
+    count += fill;
+  }
+  return count;
+}
+
+/** Called to write into the socket
+ * \see oml_outs_write_f
+ *
+ * \see udp_stream_writev
+ */
+static ssize_t
+udp_stream_write(OmlOutStream* hdl, uint8_t* buffer, size_t  length, uint8_t* header, size_t  header_length)
+{
+  struct iovec iov = { buffer, length };
+
+  return udp_stream_writev(hdl, &iov, 1, header, header_length);
+}
+
+/** Called to write several buffers of whole messages into the socket
+ * \see oml_outs_writev_f
+ *
+ * If the headers have not been sent, or an error was reported since, they are
+ * sent first, in their own datagrams.
+ *
+ * \see udp_stream_sendv
+ */
+static ssize_t
+udp_stream_writev(OmlOutStream* hdl, const struct iovec* iov, int iovcnt, uint8_t* header, size_t header_length)
+{
+  OmlUdpOutStream* self = (OmlUdpOutStream*)hdl;
+  struct iovec hiov = { header, header_length };
+  ssize_t count;
+  int i;
+
+  /* The header can be NULL, but header_length MUST be 0 in that case */
+  assert(header || !header_length);
+
+  if (self->socket == NULL) {
+    if (NULL == (self->socket = socket_udp_out_new(self->dest, self->host, self->service))) {
+      return 0;
+    }
+    self->header_written = 0;
+  }
+
+  /* Errors reported by the Socket may mean the server has been restarted,
+   * which needs the headers again */
+  if(socket_is_disconnected(self->socket)) {
+    self->header_written = 0;
+  }
+
+  if (!self->header_written) {
+    self->binary = udp_stream_header_is_binary(header, header_length);
+    if (udp_stream_sendv(self, &hiov, 1, 0) < (ssize_t)header_length) {
+      logdebug("%s: Could not send headers\n", self->dest);
+      return 0;
+    }
+    self->header_written = 1;
+  }
+
+  if(o_log_level_active(O_LOG_DEBUG4)) {
+    for (i = 0; i < iovcnt; i++) {
+      char *out = to_octets(iov[i].iov_base, iov[i].iov_len);
+      logdebug("%s: Sending data %s\n", self->dest, out);
+      oml_free(out);
+    }
+  }
+
+  count = udp_stream_sendv(self, iov, iovcnt, self->binary);
+  return count;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
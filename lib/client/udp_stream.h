@@ -0,0 +1,71 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/**\file udp_stream.h
+ * \brief Interface for the UDP OmlOutStream.
+ * \see OmlOutStream, OSocket
+ */
+#include "ocomm/o_socket.h"
+#include "oml2/oml_out_stream.h"
+
+/** Largest UDP payload fitting in a 1500B Ethernet frame, over both IPv4 and IPv6 */
+#define DEF_UDP_PAYLOAD_SIZE 1452
+/** Largest possible UDP payload */
+#define MAX_UDP_PAYLOAD_SIZE 65507
+/** Size of the IPv6 and UDP headers, subtracted from the MTU to get the payload size */
+#define UDP_HEADERS_SIZE 48
+
+/** OmlOutStream sending whole messages in datagrams through an OComm Socket */
+typedef struct OmlUdpOutStream {
+
+  /*
+   * Fields from OmlOutStream interface
+   */
+
+  /** \see OmlOutStream::write, oml_outs_write_f */
+  oml_outs_write_f write;
+  /** \see OmlOutStream::close, oml_outs_close_f */
+  oml_outs_close_f close;
+
+  /** \see OmlOutStream::dest */
+  char *dest;
+
+  /** \see OmlOutStream::header_written */
+  int   header_written;
+
+  /** \see OmlOutStream::writev, oml_outs_writev_f */
+  oml_outs_writev_f writev;
+
+  /*
+   * Fields specific to the OmlUdpOutStream
+   */
+
+  /** OComm Socket through which the datagrams are sent */
+  Socket*    socket;
+
+  /** Host to send to */
+  char*       host;
+  /** Service to send to */
+  char*       service;
+
+  /** Maximum size of the datagrams, unless a single message is larger */
+  size_t      payload_size;
+
+  /** Non-zero if the headers announced binary content, 0 for text */
+  int         binary;
+
+} OmlUdpOutStream;
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ vim: sw=2:sts=2:expandtab
+*/
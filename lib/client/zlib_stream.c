@@ -0,0 +1,341 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/**\file zlib_stream.c
+ * \brief An OmlOutStream implementation compressing data for another OmlOutStream.
+ *
+ * The headers are written uncompressed, with an additional `compression:
+ * deflate` line. Everything else is compressed into independent deflate
+ * frames, as described in compress.c.
+ *
+ * Each call to the write functions produces one frame, which bounds the
+ * latency added by the compression to that of the BufferedWriter feeding the
+ * stream, which writes all the data it has ready in one call. Frames are
+ * handed over whole to the underlying stream: no new data is accepted until
+ * the previous frame has been completely written. If the underlying stream
+ * reports an error, the current frame is written again from its start, after
+ * the headers if a new connection has been established.
+ *
+ * \see zlib_stream_new, compress.c
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "oml2/omlc.h"
+#include "oml2/oml_out_stream.h"
+#include "ocomm/o_log.h"
+#include "mem.h"
+#include "mbuf.h"
+#include "mstring.h"
+#include "compress.h"
+#include "headers.h"
+#include "client.h"
+#include "zlib_stream.h"
+
+static ssize_t zlib_stream_write(OmlOutStream* hdl, uint8_t* buffer, size_t  length, uint8_t* header, size_t  header_length);
+static ssize_t zlib_stream_writev(OmlOutStream* hdl, const struct iovec* iov, int iovcnt, uint8_t* header, size_t header_length);
+static int zlib_stream_close(OmlOutStream* hdl);
+
+/** Create a new out stream compressing data for another out stream
+ *
+ * The new stream takes ownership of os, and closes it when closed.
+ *
+ * \param os OmlOutStream to which the compressed data should be written
+ * \return a new OmlOutStream instance, or NULL on error
+ */
+OmlOutStream*
+zlib_stream_new(OmlOutStream* os)
+{
+  MString *dest;
+  OmlZlibOutStream* self;
+
+  if (!os) {
+    return NULL;
+  }
+
+  if (!(self = (OmlZlibOutStream *)oml_malloc(sizeof(OmlZlibOutStream)))) {
+    os->close(os);
+    return NULL;
+  }
+  memset(self, 0, sizeof(OmlZlibOutStream));
+
+  /* Negative windowBits produce raw deflate data, without zlib header or trailer */
+  if (deflateInit2(&self->strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    logerror("zlib+%s: Cannot initialise compressor: %s\n", os->dest, self->strm.msg ? self->strm.msg : "unknown error");
+    oml_free(self);
+    os->close(os);
+    return NULL;
+  }
+
+  if (!(self->zbuf = mbuf_create())) {
+    deflateEnd(&self->strm);
+    oml_free(self);
+    os->close(os);
+    return NULL;
+  }
+  self->os = os;
+
+  dest = mstring_create();
+  mstring_sprintf(dest, "zlib+%s", os->dest);
+  self->dest = (char*)oml_strndup (mstring_buf(dest), mstring_len(dest));
+  mstring_delete(dest);
+
+  logdebug("%s: Created OmlZlibOutStream\n", self->dest);
+
+  self->write = zlib_stream_write;
+  self->writev = zlib_stream_writev;
+  self->close = zlib_stream_close;
+  return (OmlOutStream*)self;
+}
+
+/** Prepare the headers announcing the compression
+ *
+ * The compression header is inserted after the first line (the protocol
+ * version) of the original headers.
+ *
+ * \param self OmlZlibOutStream
+ * \param header original headers
+ * \param header_length length of header
+ * \return 0 on success, -1 on error
+ */
+static int
+zlib_stream_header(OmlZlibOutStream* self, uint8_t* header, size_t header_length)
+{
+  char line[64];
+  uint8_t *eol;
+  size_t first, line_length;
+
+  if (self->header && self->orig_header_length == header_length &&
+      !memcmp(self->header + self->header_length - header_length / 2,
+        header + header_length - header_length / 2, header_length / 2)) {
+    /* Same headers as before; schemas are only ever appended at the end */
+    return 0;
+  }
+  if (self->header) {
+    oml_free(self->header);
+    self->header = NULL;
+    self->header_length = 0;
+  }
+  self->orig_header_length = header_length;
+  if (!header_length) {
+    return 0;
+  }
+
+  eol = memchr(header, '\n', header_length);
+  first = eol ? (size_t)(eol - header) + 1 : header_length;
+  line_length = snprintf(line, sizeof(line), "%s: %s\n", tag_to_string(H_COMPRESSION), COMPRESSION_DEFLATE);
+
+  if (!(self->header = oml_malloc(header_length + line_length))) {
+    return -1;
+  }
+  memcpy(self->header, header, first);
+  memcpy(self->header + first, line, line_length);
+  memcpy(self->header + first + line_length, header + first, header_length - first);
+  self->header_length = header_length + line_length;
+
+  return 0;
+}
+
+/** Compress data into a new frame at the end of the pending buffer
+ *
+ * \param self OmlZlibOutStream
+ * \param iov array of buffers to compress
+ * \param iovcnt number of buffers in iov
+ * \param length number of bytes to compress from iov, at most their total size
+ * \return 0 on success, -1 on error
+ */
+static int
+zlib_stream_compress(OmlZlibOutStream* self, const struct iovec* iov, int iovcnt, size_t length)
+{
+  uint8_t out[ZLIB_CHUNK_SIZE];
+  uint8_t prefix[COMPRESS_FRAME_HEADER_SIZE] = { 0 };
+  size_t start = mbuf_write_offset(self->zbuf);
+  size_t payload = 0, n;
+  int i, ret = Z_OK;
+
+  if (mbuf_write(self->zbuf, prefix, sizeof(prefix)) < 0) {
+    return -1;
+  }
+
+  deflateReset(&self->strm);
+  for (i = 0; i < iovcnt && length > 0; i++) {
+    self->strm.next_in = (Bytef*)iov[i].iov_base;
+    self->strm.avail_in = (iov[i].iov_len < length) ? iov[i].iov_len : length;
+    length -= self->strm.avail_in;
+    do {
+      self->strm.next_out = out;
+      self->strm.avail_out = sizeof(out);
+      ret = deflate(&self->strm, (i == iovcnt - 1 || !length) ? Z_FINISH : Z_NO_FLUSH);
+      if (ret == Z_STREAM_ERROR) {
+        logerror("%s: Compression error: %s\n", self->dest, self->strm.msg ? self->strm.msg : "unknown error");
+        mbuf_reset_write(self->zbuf);
+        return -1;
+      }
+      n = sizeof(out) - self->strm.avail_out;
+      if (mbuf_write(self->zbuf, out, n) < 0) {
+        mbuf_reset_write(self->zbuf);
+        return -1;
+      }
+      payload += n;
+    } while (self->strm.avail_out == 0);
+  }
+  assert(ret == Z_STREAM_END);
+
+  compress_frame_header(mbuf_buffer(self->zbuf) + start, payload);
+  logdebug3("%s: Compressed %d buffers into a %dB frame\n", self->dest, i, payload);
+
+  return 0;
+}
+
+/** Write the pending frames to the underlying stream
+ *
+ * \param self OmlZlibOutStream
+ * \return 1 if all frames have been written, 0 if some remain, or -1 on error
+ */
+static int
+zlib_stream_flush(OmlZlibOutStream* self)
+{
+  MBuffer* zbuf = self->zbuf;
+  struct iovec iov;
+  ssize_t frame_length, count;
+  size_t sent;
+
+  while (mbuf_message_length(zbuf) > 0) {
+    if (self->failed) {
+      /* The frame might have been cut short; start it again */
+      mbuf_reset_read(zbuf);
+      self->failed = 0;
+    }
+
+    sent = mbuf_read_offset(zbuf) - mbuf_message_offset(zbuf);
+    frame_length = compress_frame_length(mbuf_message(zbuf), mbuf_message_length(zbuf));
+    assert(frame_length > 0);
+
+    iov.iov_base = mbuf_rdptr(zbuf);
+    iov.iov_len = frame_length - sent;
+    count = out_stream_writev(self->os, &iov, 1, self->header, self->header_length);
+    self->header_written = self->os->header_written;
+    if (count < 0) {
+      self->failed = 1;
+      return -1;
+    }
+
+    mbuf_read_skip(zbuf, count);
+    if ((size_t)count < frame_length - sent) {
+      return 0;
+    }
+    mbuf_consume_message(zbuf);
+  }
+  mbuf_repack_message(zbuf);
+
+  return 1;
+}
+
+/** Called to compress and write data
+ * \see oml_outs_write_f
+ *
+ * \see zlib_stream_writev
+ */
+static ssize_t
+zlib_stream_write(OmlOutStream* hdl, uint8_t* buffer, size_t  length, uint8_t* header, size_t  header_length)
+{
+  struct iovec iov = { buffer, length };
+
+  return zlib_stream_writev(hdl, &iov, 1, header, header_length);
+}
+
+/** Called to compress several buffers into one frame, and write it
+ * \see oml_outs_writev_f
+ *
+ * No more than COMPRESS_MAX_INFLATED_SIZE bytes are put in a frame, as the
+ * server refuses frames decompressing to more than that.
+ *
+ * \return the size of the data taken, which is either all of it (up to
+ * COMPRESS_MAX_INFLATED_SIZE), or 0 if previous frames have not been
+ * completely written yet; -1 on error
+ *
+ * \see zlib_stream_compress, zlib_stream_flush
+ */
+static ssize_t
+zlib_stream_writev(OmlOutStream* hdl, const struct iovec* iov, int iovcnt, uint8_t* header, size_t header_length)
+{
+  OmlZlibOutStream* self = (OmlZlibOutStream*)hdl;
+  size_t length = 0;
+  int i;
+
+  /* The header can be NULL, but header_length MUST be 0 in that case */
+  assert(header || !header_length);
+
+  if (zlib_stream_header(self, header, header_length)) {
+    return 0;
+  }
+
+  if (zlib_stream_flush(self) != 1) {
+    return 0;
+  }
+
+  for (i = 0; i < iovcnt; i++) {
+    length += iov[i].iov_len;
+  }
+  if (!length) {
+    return 0;
+  }
+  if (length > COMPRESS_MAX_INFLATED_SIZE) {
+    length = COMPRESS_MAX_INFLATED_SIZE;
+  }
+
+  if (zlib_stream_compress(self, iov, iovcnt, length)) {
+    return -1;
+  }
+  /* The frame is ours now, and will be written on the next call if not now */
+  zlib_stream_flush(self);
+
+  return length;
+}
+
+/** Destroy an OmlZlibOutStream, trying to write any pending frame first, and
+ * close the underlying stream
+ * \see oml_outs_close_f
+ */
+static int
+zlib_stream_close(OmlOutStream* hdl)
+{
+  OmlZlibOutStream* self = (OmlZlibOutStream*)hdl;
+  int ret;
+
+  logdebug("%s: Destroying OmlZlibOutStream at %p\n", self->dest, self);
+
+  if (zlib_stream_flush(self) != 1) {
+    logwarn("%s: Could not write %dB of compressed data before closing\n",
+        self->dest, mbuf_message_length(self->zbuf));
+  }
+
+  deflateEnd(&self->strm);
+  mbuf_destroy(self->zbuf);
+  ret = self->os->close(self->os);
+
+  if (self->header) {
+    oml_free(self->header);
+  }
+  oml_free(self->dest);
+  oml_free(self);
+  return ret;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -0,0 +1,77 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/**\file zlib_stream.h
+ * \brief Interface for the compressing OmlOutStream.
+ * \see OmlOutStream, compress.h
+ */
+#include <zlib.h>
+
+#include "mbuf.h"
+#include "oml2/oml_out_stream.h"
+
+/** Size of the buffer in which compressed data is produced */
+#define ZLIB_CHUNK_SIZE 16384
+
+/** OmlOutStream compressing data into deflate frames written to another OmlOutStream */
+typedef struct OmlZlibOutStream {
+
+  /*
+   * Fields from OmlOutStream interface
+   */
+
+  /** \see OmlOutStream::write, oml_outs_write_f */
+  oml_outs_write_f write;
+  /** \see OmlOutStream::close, oml_outs_close_f */
+  oml_outs_close_f close;
+
+  /** \see OmlOutStream::dest */
+  char *dest;
+
+  /** \see OmlOutStream::header_written */
+  int   header_written;
+
+  /** \see OmlOutStream::writev, oml_outs_writev_f */
+  oml_outs_writev_f writev;
+
+  /*
+   * Fields specific to the OmlZlibOutStream
+   */
+
+  /** OmlOutStream to which the frames are written */
+  OmlOutStream* os;
+
+  /** Compressor state, reset for every frame */
+  z_stream    strm;
+
+  /** Compressed frames not completely written yet; the message pointer is at
+   * the start of the current frame, and the read pointer after the data
+   * already written */
+  MBuffer*    zbuf;
+
+  /** Headers passed to os, announcing the compression */
+  uint8_t*    header;
+  /** Length of header */
+  size_t      header_length;
+  /** Length of the original headers from which header was derived */
+  size_t      orig_header_length;
+
+  /** Non-zero if the last write failed, in which case the current frame is
+   * written again from its start */
+  int         failed;
+
+} OmlZlibOutStream;
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ vim: sw=2:sts=2:expandtab
+*/
@@ -13,9 +13,13 @@
  * \see eventloop_init, eventloop_run, eventloop_stop
  * \eventloop_on_stdin, eventloop_on_monitor_in_channel, eventloop_on_read_in_channel, eventloop_on_out_channel
  * \see o_el_timer_callback, o_el_read_socket_callback, o_el_monitor_socket_callback, o_el_state_socket_callback, o_el_timer_callback
- * \see poll(3)
+ * \see eventloop_set_backend, poll(3), epoll(7)
  */
 
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,19 +27,31 @@
 #include <assert.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <time.h>
+#if HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
 
 #include "mem.h"
 #include "ocomm/o_log.h"
 #include "ocomm/o_socket.h"
 #include "ocomm/o_eventloop.h"
 #include "mem.h"
+#include "mbuf.h"
 
 /** Initial expected number of socket event sources */
 #define DEF_FDS_LENGTH 10
 #define MAX_READ_BUFFER_SIZE 512
+/** Free space an MBuffer is repacked or grown to have before reading into it
+ * \see read_channel_buffer */
+#define BUFFER_READ_SIZE 32768
+
+/** Maximum number of ready descriptors reported by each epoll_wait() */
+#define EPOLL_MAX_EVENTS 256
 
 /** Default time, in second, after which an idle socket is cleaned up */
 #define DEF_SOCKET_TIMEOUT 60
@@ -117,6 +133,14 @@ typedef struct _channel {
   /** Function pointer to the read callback for this channel */
   o_el_read_socket_callback read_cbk;
 
+  /** Function pointer to the buffered read callback for this channel
+   * \see mbuf */
+  o_el_read_buffer_callback buffer_cbk;
+
+  /** MBuffer into which data is read for the buffer_cbk
+   * \see eventloop_socket_set_buffer */
+  MBuffer* mbuf;
+
   /** Function pointer to the monitoring callback for this channel */
   o_el_monitor_socket_callback monitor_cbk;
 
@@ -140,10 +164,27 @@ typedef struct _channel {
 
   /** Last UNIX time this channel was active */
   time_t last_activity;
+
+  /** Last wakeup of the EventLoop with events for this channel
+   * \see EventLoop */
+  unsigned int last_wakeup;
 } Channel;
 
+/** Task posted to an EventLoop, waiting to be run.
+ *
+ * \see eventloop_post
+ */
+typedef struct _task {
+  /** Function to run \see o_el_task_callback */
+  o_el_task_callback callback;
+  /** Pointer to application-provided data */
+  void *handle;
+  /** Pointer to next Task in the queue */
+  struct _task* next;
+} Task;
+
 /** EventLoop object storing the internal internal state */
-typedef struct _eventLoop {
+struct _eventLoop {
   /** Linked list of registered channels */
   Channel* channels;
   /** Linked list registered timers */
@@ -157,11 +198,25 @@ typedef struct _eventLoop {
   /** If non zero, fds structure needs to get recomputed
    * \see eventloop_socket_activate */
   int fds_dirty;
-  /** Number of active descriptors in the fds array */
+  /** Number of active descriptors in the fds array (or monitored by epoll_fd) */
   int size;
   /** Allocated size of fds and fds_channels arrays */
   int length;
 
+  /** Mechanism used to wait for events \see eventloop_set_backend */
+  EventLoopBackend backend;
+  /** Descriptor of the epoll instance, when backend is EVENTLOOP_BACKEND_EPOLL */
+  int epoll_fd;
+  /** Number of wakeups with events, to find channels without any
+   * \see Channel */
+  unsigned int wakeups;
+  /** Number of channels released but not removed yet \see eventloop_socket_release */
+  int removable;
+#if HAVE_SYS_EPOLL_H
+  /** Events reported by the last epoll_wait() */
+  struct epoll_event events[EPOLL_MAX_EVENTS];
+#endif
+
   /** Timeout after which sockets are considered idle, and reaped
    * \see DEF_SOCKET_TIMEOUT */
   int socket_timeout;
@@ -181,7 +236,21 @@ typedef struct _eventLoop {
    * \see time(3) */
   time_t last_reaped;
 
-} EventLoop;
+  /** If non zero, the task queue (tasks_lock and wakeup_fds) is initialised
+   * \see eventloop_self */
+  int has_tasks;
+  /** Pipe written to by other threads to wake the EventLoop up when posting tasks */
+  int wakeup_fds[2];
+  /** Channel monitoring wakeup_fds[0], running the tasks */
+  Channel* wakeup;
+  /** Protects tasks and last_task, which other threads append to */
+  pthread_mutex_t tasks_lock;
+  /** Queue of tasks posted to this EventLoop \see eventloop_post */
+  Task* tasks;
+  /** Last task of the queue */
+  Task* last_task;
+
+};
 
 
 /* Local helpers, defined at the end of this file */
@@ -194,21 +263,52 @@ static Channel* eventloop_on_out_fd( char* name, int fd, o_el_state_socket_callb
 
 static int update_fds(void);
 static void terminate_fds(void);
+static void epoll_update(Channel* ch);
+
+static int process_channel(Channel* ch, int revents);
+static void reap_channel(Channel* ch);
 
 static void do_read_callback (Channel *ch, void *buffer, int buf_size);
+static void do_buffer_callback (Channel *ch, size_t len);
+static ssize_t read_channel (Channel *ch);
 static void do_monitor_callback (Channel *ch);
 static void do_status_callback (Channel *ch, SocketStatus status, int error);
+static void run_tasks (SockEvtSource* source, void* handle);
 
 
+#if HAVE_TLS
+/** EventLoop object of the current thread */
+static __thread EventLoop self;
+#else
 /** Global EventLoop object */
 static EventLoop self;
+#endif
 
 
-/** Initialise the global EventLoop
- * \see eventloop_run, eventloop_stop, eventloop_terminate
+/** Initialise the EventLoop of the current thread
+ *
+ * Where supported by the compiler, each thread has its own EventLoop, which
+ * it can run independently of the others; they can communicate with
+ * eventloop_post().
+ *
+ * \see eventloop_run, eventloop_stop, eventloop_terminate, eventloop_self
  */
 void eventloop_init()
 {
+  Task* t;
+
+  if (self.backend == EVENTLOOP_BACKEND_EPOLL) {
+    close(self.epoll_fd);
+  }
+  if (self.has_tasks) {
+    close(self.wakeup_fds[0]);
+    close(self.wakeup_fds[1]);
+    pthread_mutex_destroy(&self.tasks_lock);
+    for (; self.tasks; self.tasks = t) {
+      t = self.tasks->next;
+      oml_free(self.tasks);
+    }
+  }
   memset(&self, 0, sizeof(EventLoop));
 
   self.fds = NULL;
@@ -222,6 +322,70 @@ void eventloop_init()
 
   /* Just to be sure we initialise everything */
   self.start = self.now = self.last_reaped = -1;
+
+  self.epoll_fd = -1;
+  self.backend = EVENTLOOP_BACKEND_POLL;
+  eventloop_set_backend(EVENTLOOP_BACKEND_AUTO);
+}
+
+/** Select the mechanism used by the EventLoop to wait for events.
+ *
+ * By default, eventloop_init selects epoll(7) where available. Its cost per
+ * wakeup only depends on the number of ready descriptors, while poll(2)
+ * requires scanning all of them, which becomes significant with thousands of
+ * connected clients. The EventLoop falls back to poll(2) on its own if a
+ * descriptor cannot be monitored with epoll(7) (e.g., STDIN redirected from a
+ * regular file).
+ *
+ * This can only be changed before any channel has been registered.
+ *
+ * \param backend EventLoopBackend to use
+ * \return 0 on success, -1 otherwise (e.g., backend is not available)
+ * \see eventloop_init, eventloop_get_backend
+ */
+int eventloop_set_backend(EventLoopBackend backend)
+{
+  if (self.channels) {
+    o_log(O_LOG_WARN, "EventLoop: Cannot change backend with channels already registered\n");
+    return -1;
+  }
+
+  if (self.backend == EVENTLOOP_BACKEND_EPOLL) {
+    close(self.epoll_fd);
+    self.epoll_fd = -1;
+    self.backend = EVENTLOOP_BACKEND_POLL;
+  }
+
+  if (backend != EVENTLOOP_BACKEND_POLL) {
+#if HAVE_SYS_EPOLL_H
+    if ((self.epoll_fd = epoll_create(EPOLL_MAX_EVENTS)) >= 0) {
+      self.backend = EVENTLOOP_BACKEND_EPOLL;
+    } else {
+      o_log(backend == EVENTLOOP_BACKEND_AUTO ? O_LOG_DEBUG : O_LOG_WARN,
+          "EventLoop: Cannot use epoll, falling back to poll: %s\n", strerror(errno));
+    }
+#else
+    o_log(backend == EVENTLOOP_BACKEND_AUTO ? O_LOG_DEBUG : O_LOG_WARN,
+        "EventLoop: epoll not supported, using poll\n");
+#endif
+    if (backend == EVENTLOOP_BACKEND_EPOLL && self.backend != EVENTLOOP_BACKEND_EPOLL) {
+      return -1;
+    }
+  }
+  o_log(O_LOG_DEBUG2, "EventLoop: Using %s\n",
+      self.backend == EVENTLOOP_BACKEND_EPOLL ? "epoll" : "poll");
+
+  return 0;
+}
+
+/** Get the mechanism currently used by the EventLoop to wait for events.
+ *
+ * \return EVENTLOOP_BACKEND_POLL or EVENTLOOP_BACKEND_EPOLL
+ * \see eventloop_set_backend
+ */
+EventLoopBackend eventloop_get_backend(void)
+{
+  return self.backend;
 }
 
 /** Set the timeout, in seconds, after which idle sockets are reaped.
@@ -234,29 +398,34 @@ void eventloop_set_socket_timeout(unsigned int to)
   self.socket_timeout = to;
 }
 
-/** Run the global EventLoop until eventloop_stop() or eventloop_terminate() is called.
+/** Run the EventLoop of the current thread until eventloop_stop() or eventloop_terminate() is called.
+ *
+ * The loop is based around the poll(2) or epoll_wait(2) system calls. It
+ * monitor event sources such as Channel or Timers, registered in the
+ * respective fields of the EventLoop object self. It first consider all
+ * timers to find whether some have expired and to set the timeout for the
+ * poll(2) call. It then waits for events on the file descriptors (STDIN or
+ * sockets) related to active Channels, and runs the relevant callbacks for
+ * those with pending events.  It finally executes the callback functions of
+ * the expired timers.  The loop will not return until eventloop_stop() or
+ * eventloop_terminate() is called.  In the former case, it will try to wait
+ * until all active sockets are close, while not in the latter.
  *
- * The loop is based around the poll(3) system call. It monitor event sources
- * such as Channel or Timers, registered in the respective fields of the global
- * EventLoop object self. It first consider all timers to find whether some
- * have expired and to set the timeout for the poll(3) call. It then calls
- * poll(3) on the file descriptors (STDIN or sockets) related to active
- * Channels, and runs the relevant callbacks for those with pending events.  It
- * finally executes the callback functions of the expired timers.  The loop
- * will not return until eventloop_stop() or eventloop_terminate() is called.
- * In the former case, it will try to wait until all active sockets are close,
- * while not in the latter.
+ * With poll(2), all Channels are visited after each wakeup. With epoll(7),
+ * only those with pending events are; others are checked for idleness at most
+ * once per second, or while stopping.
  *
  * \return the (non-zero) value passed to eventloop_stop() or eventloop_terminate()
  *
- * \see eventloop_init, eventloop_stop, eventloop_terminate
+ * \see eventloop_init, eventloop_stop, eventloop_terminate, eventloop_set_backend
  * \eventloop_on_stdin, eventloop_on_monitor_in_channel, eventloop_on_read_in_channel, eventloop_on_out_channel
  * \see o_el_timer_callback, o_el_read_socket_callback, o_el_monitor_socket_callback, o_el_state_socket_callback, o_el_timer_callback
- * \see poll(3)
+ * \see poll(2), epoll(7)
  */
 int eventloop_run()
 {
-  int i;
+  int i, count;
+  Channel *ch;
   self.stopping = 0;
   self.force_stop = 0;
   self.start = self.now = self.last_reaped = time(NULL);
@@ -275,140 +444,81 @@ int eventloop_run()
     if (timeout != -1)
       o_log(O_LOG_DEBUG3, "EventLoop: Timeout = %d\n", timeout);
 
-    if (self.fds_dirty)
-      if (update_fds()<1 && timeout < 0) /* No FD nor timeout */
-        continue;
-    o_log(O_LOG_DEBUG4, "EventLoop: About to poll() on %d FDs with a timeout of %ds\n", self.size, timeout);
-    /* for(i=0; i < self.size; i++) {
-      o_log(O_LOG_DEBUG4, "EventLoop: FD %d->%s\n", self.fds[i].fd, self.fds_channels[i]->name);
-    } */
-
-    int count = poll(self.fds, self.size, timeout);
-    self.now = time(NULL);
+#if HAVE_SYS_EPOLL_H
+    if (self.backend == EVENTLOOP_BACKEND_EPOLL) {
+      Channel *next;
+      o_log(O_LOG_DEBUG4, "EventLoop: About to epoll_wait() on %d FDs with a timeout of %ds\n", self.size, timeout);
+      count = epoll_wait(self.epoll_fd, self.events, EPOLL_MAX_EVENTS, timeout);
+      self.now = time(NULL);
 
-    if (count < 1) {
-      o_log(O_LOG_DEBUG4, "EventLoop: Timeout\n");
-    } else {
-    // Check sockets
-      i = 0;
-      o_log(O_LOG_DEBUG4, "EventLoop: Got events\n");
-      for (; i < self.size; i++) {
-        Channel* ch = self.fds_channels[i];
-        if (self.fds[i].revents & POLLERR) {
-          char buf[32];
-          SocketStatus status;
-          int len;
-
-          if ((len = recv(self.fds[i].fd, buf, 32, 0)) <= 0) {
-            switch (errno) {
-            case ECONNREFUSED:
-              status = SOCKET_CONN_REFUSED;
-              break;
-            default:
-              status = SOCKET_UNKNOWN;
-              if (!ch->status_cbk) {
-                o_log(O_LOG_ERROR, "EventLoop: While reading from socket '%s': (%d) %s\n",
-                      ch->name, errno, strerror(errno));
-              }
-            }
-            eventloop_socket_activate((SockEvtSource*)ch, 0);
-            do_status_callback (ch, status, errno);
-          } else {
-            o_log(O_LOG_ERROR, "EventLoop: Expected error on socket '%s' but read '%s'\n", ch->name, buf);
+      if (count < 1) {
+        o_log(O_LOG_DEBUG4, "EventLoop: Timeout\n");
+      } else {
+        o_log(O_LOG_DEBUG4, "EventLoop: Got events on %d FDs\n", count);
+        self.wakeups++;
+        for (i = 0; i < count; i++) {
+          ch = (Channel*)self.events[i].data.ptr;
+          ch->last_wakeup = self.wakeups;
+          /* The EPOLL* flags we use have the same values as their POLL* counterparts */
+          if (!process_channel(ch, self.events[i].events & (EPOLLIN|EPOLLOUT|EPOLLERR|EPOLLHUP))) {
+            reap_channel(ch);
           }
-        } else if (self.fds[i].revents & POLLHUP) {
-          eventloop_socket_activate((SockEvtSource*)ch, 0);
-
-          /* Client closed the connection, but there might still be bytes
-             for us to read from our end of the connection. */
-          int len;
-          int fd = self.fds[i].fd;
-          char buf[MAX_READ_BUFFER_SIZE];
-          do {
-            if (fd == 0) {
-              len = read(fd, buf, MAX_READ_BUFFER_SIZE);
-            } else {
-              len = recv(fd, buf, 512, 0);
-            }
-            if (len > 0) {
-              o_log(O_LOG_DEBUG3, "EventLoop: Received last %i bytes\n", len);
-              do_read_callback (ch, buf, len);
-            }
-          } while (len > 0);
-          do_status_callback (ch, SOCKET_CONN_CLOSED, 0);
-        } else if (self.fds[i].revents & POLLIN) {
-          char buf[MAX_READ_BUFFER_SIZE];
-          if (ch->read_cbk) {
-            int len;
-            int fd = self.fds[i].fd;
-            if (fd == 0) {
-              // stdin
-              len = read(fd, buf, MAX_READ_BUFFER_SIZE);
-            } else {
-              // socket
-              len = recv(fd, buf, 512, 0);
-            }
-            ch->last_activity = self.now;
-            if (len > 0) {
-              o_log(O_LOG_DEBUG3, "EventLoop: Received %i bytes\n", len);
-              do_read_callback (ch, buf, len);
-            } else if (len == 0 && ch->socket != NULL) {  // skip stdin
-              // closed down
-              eventloop_socket_activate((SockEvtSource*)ch, 0);
-              do_status_callback (ch, SOCKET_CONN_CLOSED, 0);
-            } else if (len < 0) {
-              if (errno == ENOTSOCK) {
-                o_log(O_LOG_ERROR,
-                      "EventLoop: Monitored socket '%s' is now invalid; "
-                      "removing from monitored set\n",
-                      ch->name);
-                eventloop_socket_remove ((SockEvtSource*)ch);
-              } else {
-                o_log(O_LOG_ERROR, "EventLoop: Unrecognized read error not handled (errno=%d)\n",
-                      errno);
-              }
+        }
+        if (self.stopping || (self.socket_timeout > 0 && self.now != self.last_reaped)) {
+          /* Look for channels which did not get any event */
+          for (ch = self.channels; ch != NULL; ch = next) {
+            next = ch->next;
+            if (ch->is_active && ch->last_wakeup != self.wakeups &&
+                !process_channel(ch, 0)) {
+              reap_channel(ch);
             }
-          } else {
-            do_monitor_callback (ch);
           }
-        } else if (ch->is_shutting_down) {
-          /* The socket was shutting down, and nothing new has appeared;
-           * We flushed the buffers, mark it as removable */
-          eventloop_socket_release((SockEvtSource*)ch);
+          self.last_reaped = self.now;
         }
-
-        if (self.fds[i].revents & POLLOUT) {
-          do_status_callback(ch, SOCKET_WRITEABLE, 0);
-          if (0 != ch->last_activity) {
-            /* If we track the activity of this socket */
-            ch->last_activity = self.now;
+        if (self.removable > 0) {
+          for (ch = self.channels; ch != NULL; ch = next) {
+            next = ch->next;
+            if (ch->is_removable)
+              eventloop_socket_remove ((SockEvtSource*)ch);
           }
         }
+      }
+    } else
+#endif
+    {
+      if (self.fds_dirty)
+        if (update_fds()<1 && timeout < 0) /* No FD nor timeout */
+          continue;
+      o_log(O_LOG_DEBUG4, "EventLoop: About to poll() on %d FDs with a timeout of %ds\n", self.size, timeout);
+
+      count = poll(self.fds, self.size, timeout);
+      self.now = time(NULL);
+
+      if (count < 1) {
+        o_log(O_LOG_DEBUG4, "EventLoop: Timeout\n");
+      } else {
+        // Check sockets
+        o_log(O_LOG_DEBUG4, "EventLoop: Got events\n");
+        for (i = 0; i < self.size; i++) {
+          ch = self.fds_channels[i];
+          if (process_channel(ch, self.fds[i].revents)) {
+            continue;
+          }
 
-        if (self.fds[i].revents & POLLNVAL) {
-          o_log(O_LOG_WARN, "EventLoop: socket '%s' invalid, deactivating...\n", ch->name);
-          eventloop_socket_activate((SockEvtSource*)ch, 0);
-          do_status_callback(ch, SOCKET_DROPPED, 0);
+          /* We reap idle channels as we go through the list.  XXX: There might
+           * be a corner case where all FDs are already used, and some of them
+           * idle, however a new a new connection (on one listening socket early
+           * in the list) would be dropped before cleanup triggered by its
+           * arrival freed the resources it needs (from the idle sockets further
+           * towards the end of the list. See #959.*/
+          reap_channel(ch);
         }
-
-        /* We reap idle channels as we go through the list.  XXX: There might
-         * be a corner case where all FDs are already used, and some of them
-         * idle, however a new a new connection (on one listening socket early
-         * in the list) would be dropped before cleanup triggered by its
-         * arrival freed the resources it needs (from the idle sockets further
-         * towards the end of the list. See #959.*/
-        if (ch->last_activity != 0 &&
-            self.socket_timeout > 0 &&
-            self.now - ch->last_activity > self.socket_timeout) {
-            o_log(O_LOG_DEBUG2, "EventLoop: Socket '%s' idle for %ds, reaping...\n", ch->name, self.now - ch->last_activity);
-          do_status_callback(ch, SOCKET_IDLE, 0);
+        for (i = 0; i < self.size; i++) {
+          ch = self.fds_channels[i];
+          if (ch->is_removable)
+            eventloop_socket_remove ((SockEvtSource*)ch);
         }
       }
-      for (i = 0; i < self.size; i++) {
-        Channel* ch = self.fds_channels[i];
-        if (ch->is_removable)
-          eventloop_socket_remove ((SockEvtSource*)ch);
-      }
     }
     if (timeout >= 0) {
       // check timers
@@ -438,6 +548,113 @@ int eventloop_run()
   return self.stopping;
 }
 
+/** Process the events reported for a Channel.
+ *
+ * \param ch Channel to process
+ * \param revents mask of events returned for the Channel \see poll(2)
+ * \return 0 if ch is still valid, -1 if it has been removed (and freed)
+ * \see eventloop_run
+ */
+static int process_channel(Channel* ch, int revents)
+{
+  if (revents & POLLERR) {
+    char buf[32];
+    SocketStatus status;
+    int len;
+
+    if ((len = recv(ch->fds_fd, buf, 32, 0)) <= 0) {
+      switch (errno) {
+      case ECONNREFUSED:
+        status = SOCKET_CONN_REFUSED;
+        break;
+      default:
+        status = SOCKET_UNKNOWN;
+        if (!ch->status_cbk) {
+          o_log(O_LOG_ERROR, "EventLoop: While reading from socket '%s': (%d) %s\n",
+                ch->name, errno, strerror(errno));
+        }
+      }
+      eventloop_socket_activate((SockEvtSource*)ch, 0);
+      do_status_callback (ch, status, errno);
+    } else {
+      o_log(O_LOG_ERROR, "EventLoop: Expected error on socket '%s' but read '%s'\n", ch->name, buf);
+    }
+  } else if (revents & POLLHUP) {
+    eventloop_socket_activate((SockEvtSource*)ch, 0);
+
+    /* Client closed the connection, but there might still be bytes
+       for us to read from our end of the connection. */
+    ssize_t len;
+    do {
+      if ((len = read_channel(ch)) > 0) {
+        o_log(O_LOG_DEBUG3, "EventLoop: Received last %i bytes\n", (int)len);
+      }
+    } while (len > 0);
+    do_status_callback (ch, SOCKET_CONN_CLOSED, 0);
+  } else if (revents & POLLIN) {
+    if (ch->read_cbk || ch->buffer_cbk) {
+      ssize_t len = read_channel(ch);
+      ch->last_activity = self.now;
+      if (len > 0) {
+        o_log(O_LOG_DEBUG3, "EventLoop: Received %i bytes\n", (int)len);
+      } else if (len == 0 && ch->socket != NULL) {  // skip stdin
+        // closed down
+        eventloop_socket_activate((SockEvtSource*)ch, 0);
+        do_status_callback (ch, SOCKET_CONN_CLOSED, 0);
+      } else if (len < 0) {
+        if (errno == ENOTSOCK) {
+          o_log(O_LOG_ERROR,
+                "EventLoop: Monitored socket '%s' is now invalid; "
+                "removing from monitored set\n",
+                ch->name);
+          eventloop_socket_remove ((SockEvtSource*)ch);
+          return -1;
+        } else {
+          o_log(O_LOG_ERROR, "EventLoop: Unrecognized read error not handled (errno=%d)\n",
+                errno);
+        }
+      }
+    } else {
+      do_monitor_callback (ch);
+    }
+  } else if (ch->is_shutting_down) {
+    /* The socket was shutting down, and nothing new has appeared;
+     * We flushed the buffers, mark it as removable */
+    eventloop_socket_release((SockEvtSource*)ch);
+  }
+
+  if (revents & POLLOUT) {
+    do_status_callback(ch, SOCKET_WRITEABLE, 0);
+    if (0 != ch->last_activity) {
+      /* If we track the activity of this socket */
+      ch->last_activity = self.now;
+    }
+  }
+
+  if (revents & POLLNVAL) {
+    o_log(O_LOG_WARN, "EventLoop: socket '%s' invalid, deactivating...\n", ch->name);
+    eventloop_socket_activate((SockEvtSource*)ch, 0);
+    do_status_callback(ch, SOCKET_DROPPED, 0);
+  }
+
+  return 0;
+}
+
+/** Report a Channel as idle if it has not been active for longer than the socket timeout.
+ *
+ * \param ch Channel to check
+ * \see eventloop_set_socket_timeout, eventloop_run
+ */
+static void reap_channel(Channel* ch)
+{
+  if (ch->last_activity != 0 &&
+      self.socket_timeout > 0 &&
+      self.now - ch->last_activity > self.socket_timeout) {
+      o_log(O_LOG_DEBUG2, "EventLoop: Socket '%s' idle for %ds, reaping...\n", ch->name, self.now - ch->last_activity);
+    do_status_callback(ch, SOCKET_IDLE, 0);
+  }
+}
+
 /** Stop the eventloop,
  *
  * The eventloop will try to gracefully finish by waiting for all active FDs to be closed.
@@ -465,6 +682,77 @@ void eventloop_terminate(int reason)
     eventloop_stop(reason);
 }
 
+/** Get a reference to the EventLoop of the current thread.
+ *
+ * The first call sets up the queue of tasks which other threads can post to
+ * this EventLoop, which must have been initialised already.
+ *
+ * \return a reference to pass to eventloop_post(), or NULL on error
+ * \see eventloop_init, eventloop_post
+ */
+EventLoop* eventloop_self(void)
+{
+  if (!self.has_tasks) {
+    if (pipe(self.wakeup_fds)) {
+      o_log(O_LOG_ERROR, "EventLoop: Cannot create wakeup pipe: %s\n", strerror(errno));
+      return NULL;
+    }
+    fcntl(self.wakeup_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(self.wakeup_fds[1], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&self.tasks_lock, NULL);
+    self.has_tasks = 1;
+  }
+  if (!self.wakeup) {
+    self.wakeup = eventloop_on_in_fd("wakeup", self.wakeup_fds[0], NULL, run_tasks, NULL, NULL);
+  }
+
+  return &self;
+}
+
+/** Post a task to be run by the EventLoop of another thread.
+ *
+ * This function can be called from any thread. The task will be run the next
+ * time the target thread wakes up in eventloop_run(); tasks posted by the same
+ * thread are run in order. Tasks posted after the target EventLoop has been
+ * told to stop are not run.
+ *
+ * \param loop EventLoop returned by eventloop_self() in the target thread
+ * \param task function to run
+ * \param handle pointer to opaque data passed to task
+ * \return 0 on success, -1 otherwise
+ * \see eventloop_self, o_el_task_callback
+ */
+int eventloop_post(EventLoop* loop, o_el_task_callback task, void* handle)
+{
+  Task* t;
+  int wake;
+
+  if (loop == NULL || !loop->has_tasks ||
+      !(t = (Task*)oml_malloc(sizeof(Task)))) {
+    return -1;
+  }
+  t->callback = task;
+  t->handle = handle;
+  t->next = NULL;
+
+  pthread_mutex_lock(&loop->tasks_lock);
+  /* The EventLoop only needs waking up for the first task it has not seen yet */
+  wake = (loop->tasks == NULL);
+  if (loop->last_task) {
+    loop->last_task->next = t;
+  } else {
+    loop->tasks = t;
+  }
+  loop->last_task = t;
+  pthread_mutex_unlock(&loop->tasks_lock);
+
+  if (wake && write(loop->wakeup_fds[1], "", 1) < 0 && errno != EAGAIN) {
+    o_log(O_LOG_WARN, "EventLoop: Cannot wake up EventLoop: %s\n", strerror(errno));
+  }
+
+  return 0;
+}
+
 /** Log a summary of resource usage.
  *
  * \param loglevel log level at which the message should be issued
@@ -472,7 +760,11 @@ void eventloop_terminate(int reason)
  */
 void eventloop_report (int loglevel)
 {
-  o_log(loglevel, "EventLoop: Open file descriptors: %d/%d\n", self.size, self.length);
+  if (self.backend == EVENTLOOP_BACKEND_EPOLL) {
+    o_log(loglevel, "EventLoop: Open file descriptors: %d (epoll)\n", self.size);
+  } else {
+    o_log(loglevel, "EventLoop: Open file descriptors: %d/%d\n", self.size, self.length);
+  }
   o_log(loglevel, "EventLoop: Memory usage: %s\n", oml_memsummary());
 }
 
@@ -607,6 +899,40 @@ SockEvtSource* eventloop_on_read_in_channel(
   return (SockEvtSource*)ch;
 }
 
+/** Register a Socket as a new input channel to read data from into an MBuffer.
+ *
+ * Data is read directly into mbuf, in large chunks, rather than being copied
+ * through a small intermediate buffer as with eventloop_on_read_in_channel().
+ *
+ * \param socket OComm Socket
+ * \param mbuf MBuffer to read data into, owned by the caller
+ * \param data_cbk buffered read callback called after fresh data has been read into mbuf
+ * \param status_cbk status-change callback, can be NULL
+ * \param handle pointer to opaque data passed to callback functions
+ * \return a pointer to a new Channel cast as a SockEvtSource
+ *
+ * \see Socket, o_el_read_buffer_callback, o_el_state_socket_callback
+ * \see eventloop_socket_set_buffer
+ */
+SockEvtSource* eventloop_on_read_in_buffer(
+  Socket* socket,
+  MBuffer* mbuf,
+  o_el_read_buffer_callback data_cbk,
+  o_el_state_socket_callback status_cbk,
+  void* handle
+) {
+  Channel* ch;
+
+  if (socket == NULL || mbuf == NULL) {
+    o_log(O_LOG_ERROR, "EventLoop: Missing socket or buffer\n");
+    return NULL;
+  }
+  ch = (Channel*)eventloop_on_read_in_channel(socket, NULL, status_cbk, handle);
+  ch->buffer_cbk = data_cbk;
+  ch->mbuf = mbuf;
+  return (SockEvtSource*)ch;
+}
+
 /** Register a Socket as a new channel to monitor (e.g., listening socket).
  *
  * \param socket OComm Socket
@@ -670,7 +996,7 @@ SockEvtSource* eventloop_on_out_channel(
  * \param source SockEvtSource to (de)activate
  * \param flag 0 to deactivate, anything else to activate (use 1)
  *
- * \see update_fds
+ * \see update_fds, epoll_update
  */
 void eventloop_socket_activate(SockEvtSource* source, int flag)
 {
@@ -678,6 +1004,9 @@ void eventloop_socket_activate(SockEvtSource* source, int flag)
   if (ch->is_active != flag) {
     ch->is_active = flag;
     self.fds_dirty = 1;
+    if (self.backend == EVENTLOOP_BACKEND_EPOLL) {
+      epoll_update(ch);
+    }
   }
 }
 
@@ -699,8 +1028,31 @@ void eventloop_socket_release(SockEvtSource* source)
 {
   Channel *ch = (Channel*)source;
   eventloop_socket_activate(source, 0);
+  if (!ch->is_removable) {
+    self.removable++;
+  }
   ch->is_removable = 1;
   ch->handle = NULL;
+  /* The MBuffer is likely to be freed with the handle */
+  ch->mbuf = NULL;
+}
+
+/** Change the MBuffer into which data is read for a channel.
+ *
+ * This is useful when the nature of the data changes mid-stream (e.g.,
+ * compressed data after a plain-text header), so that the next chunks are
+ * read directly where they are needed. Data already read into the previous
+ * buffer is left there.
+ *
+ * \param source SockEvtSource created with eventloop_on_read_in_buffer()
+ * \param mbuf MBuffer to read further data into
+ * \see eventloop_on_read_in_buffer
+ */
+void eventloop_socket_set_buffer(SockEvtSource* source, MBuffer* mbuf)
+{
+  Channel *ch = (Channel*)source;
+  assert(ch->buffer_cbk);
+  ch->mbuf = mbuf;
 }
 
 /** Remove channels from monitoring of the EventLoop.
@@ -716,6 +1068,9 @@ void eventloop_socket_remove(SockEvtSource* source)
   Channel* ch = (Channel*)source;
 
   eventloop_socket_activate(source, 0);
+  if (ch->is_removable) {
+    self.removable--;
+  }
 
   /* Update the linked list */
   if (self.channels == ch) {
@@ -743,7 +1098,7 @@ void eventloop_socket_remove(SockEvtSource* source)
 /** Create a new channel and register it to the EventLoop.
  *
  * The Channel is allocated and initialised. It is also registered to the
- * global EventLoop self, at the beginning of the channels linked list, and activated.
+ * EventLoop self, at the beginning of the channels linked list, and activated.
  *
  * \param name name of this object, used for debugging
  * \param fd file descriptor linked to the channel
@@ -854,13 +1209,23 @@ static Channel* eventloop_on_out_fd(
 }
 
 /** Update the number of currently active Channels
+ *
+ * With epoll, the monitored set is updated as Channels are (de)activated, and
+ * there is nothing to do.
+ *
  * \return the number of active channels
+ * \see epoll_update
  */
 static int update_fds(void)
 {
   Channel* ch = self.channels;
   int i = 0;
 
+  if (self.backend == EVENTLOOP_BACKEND_EPOLL) {
+    self.fds_dirty = 0;
+    return self.size;
+  }
+
   while (ch != NULL) {
     if (ch->is_active) {
       if (self.length <= i) {
@@ -885,6 +1250,53 @@ static int update_fds(void)
   return i;
 }
 
+/** Add or remove a Channel to or from the set monitored by epoll, depending on whether it is active.
+ *
+ * If the descriptor cannot be monitored with epoll (e.g., STDIN redirected
+ * from a regular file, or a descriptor shared by several Channels), the
+ * EventLoop falls back to poll for all Channels.
+ *
+ * \param ch Channel which has just been (de)activated
+ * \see eventloop_socket_activate, eventloop_set_backend
+ */
+static void epoll_update(Channel* ch)
+{
+#if HAVE_SYS_EPOLL_H
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  if (ch->is_active) {
+    /* The POLL* flags we use have the same values as their EPOLL* counterparts */
+    ev.events = ch->fds_events & (EPOLLIN|EPOLLOUT);
+    ev.data.ptr = ch;
+    if (!epoll_ctl(self.epoll_fd, EPOLL_CTL_ADD, ch->fds_fd, &ev)) {
+      self.size++;
+
+    } else if (errno == EPERM || errno == EEXIST) {
+      o_log(O_LOG_INFO, "EventLoop: Channel '%s' cannot be monitored with epoll, falling back to poll\n",
+          ch->name);
+      close(self.epoll_fd);
+      self.epoll_fd = -1;
+      self.backend = EVENTLOOP_BACKEND_POLL;
+      self.fds_dirty = 1;
+
+    } else {
+      o_log(O_LOG_ERROR, "EventLoop: Cannot monitor channel '%s': %s\n", ch->name, strerror(errno));
+      ch->is_active = 0;
+    }
+
+  } else {
+    /* The descriptor may already have been closed, which removes it from the set */
+    if (epoll_ctl(self.epoll_fd, EPOLL_CTL_DEL, ch->fds_fd, &ev) && errno != EBADF && errno != ENOENT) {
+      o_log(O_LOG_WARN, "EventLoop: Cannot stop monitoring channel '%s': %s\n", ch->name, strerror(errno));
+    }
+    self.size--;
+  }
+#else
+  (void)ch;
+#endif
+}
+
 /** Terminate sources.
  *
  * Close listening Sockets and shutdown() others
@@ -902,7 +1314,11 @@ static void terminate_fds(void)
   while (ch != NULL) {
     next = ch->next;
     o_log(O_LOG_DEBUG4, "EventLoop: Terminating channel %s\n", ch->name);
-    if (!ch->is_active ||
+    if (ch == self.wakeup) {
+      /* Tasks posted from now on are not run */
+      eventloop_socket_release((SockEvtSource*)ch);
+      self.wakeup = NULL;
+    } else if (!ch->is_active ||
         socket_is_disconnected(ch->socket) ||
         socket_is_listening(ch->socket)) {
       o_log(O_LOG_DEBUG3, "EventLoop: Releasing listening channel %s\n", ch->name);
@@ -939,6 +1355,88 @@ static void do_read_callback (Channel *ch, void *buffer, int buf_size)
   }
 }
 
+/** Execute the buffered data-read callback of a channel, if defined.
+ *
+ * \param ch Channel just read from
+ * \param len size of the data just read into ch->mbuf
+ *
+ * \see o_el_read_buffer_callback
+ */
+static void do_buffer_callback (Channel *ch, size_t len)
+{
+  if (ch->buffer_cbk && !ch->is_removable) {
+    ch->buffer_cbk ((SockEvtSource*)ch, ch->handle, ch->mbuf, len);
+  } else {
+    o_log(O_LOG_DEBUG, "EventLoop: Channel '%s' has fresh data but no defined callback\n",  ch->name);
+  }
+}
+
+/** Read data from a channel directly into its MBuffer.
+ *
+ * When less than BUFFER_READ_SIZE bytes are left in the buffer, it is first
+ * repacked, which only moves the data not consumed yet, then grown if needed.
+ * Data is then read into the free space at once.
+ *
+ * \param ch Channel to read from, with a buffer_cbk and an mbuf
+ * \return the number of bytes read, 0 on end of file, or -1 on error (errno is set)
+ * \see read_channel, mbuf_write_advance
+ */
+static ssize_t read_channel_buffer (Channel *ch)
+{
+  MBuffer* mbuf = ch->mbuf;
+  ssize_t len;
+
+  if (mbuf_wr_remaining(mbuf) < BUFFER_READ_SIZE) {
+    mbuf_repack_message(mbuf);
+    if (mbuf_check_resize(mbuf, BUFFER_READ_SIZE) && !mbuf_wr_remaining(mbuf)) {
+      o_log(O_LOG_ERROR, "EventLoop: Buffer of channel '%s' is full\n", ch->name);
+      errno = ENOBUFS;
+      return -1;
+    }
+  }
+
+  if (ch->fds_fd == 0) {
+    len = read(ch->fds_fd, mbuf_wrptr(mbuf), mbuf_wr_remaining(mbuf));
+  } else {
+    len = recv(ch->fds_fd, mbuf_wrptr(mbuf), mbuf_wr_remaining(mbuf), 0);
+  }
+  if (len > 0) {
+    mbuf_write_advance(mbuf, len);
+    do_buffer_callback (ch, len);
+  }
+
+  return len;
+}
+
+/** Read data from a channel, and pass it to its read callback.
+ *
+ * \param ch Channel to read from
+ * \return the number of bytes read, 0 on end of file, or -1 on error (errno is set)
+ * \see read_channel_buffer, do_read_callback
+ */
+static ssize_t read_channel (Channel *ch)
+{
+  char buf[MAX_READ_BUFFER_SIZE];
+  ssize_t len;
+
+  if (ch->buffer_cbk && ch->mbuf) {
+    return read_channel_buffer(ch);
+  }
+
+  if (ch->fds_fd == 0) {
+    // stdin
+    len = read(ch->fds_fd, buf, sizeof(buf));
+  } else {
+    // socket
+    len = recv(ch->fds_fd, buf, sizeof(buf), 0);
+  }
+  if (len > 0) {
+    do_read_callback (ch, buf, len);
+  }
+
+  return len;
+}
+
 /** Execute the monitoring callback of a channel, if defined.
  *
  * \param ch Channel which just changed state
@@ -954,6 +1452,36 @@ static void do_monitor_callback (Channel *ch)
   }
 }
 
+/** Run the tasks posted to the EventLoop.
+ *
+ * This is the monitoring callback of the wakeup channel.
+ *
+ * \param source wakeup Channel
+ * \param handle unused
+ *
+ * \see eventloop_post, o_el_monitor_socket_callback
+ */
+static void run_tasks (SockEvtSource* source, void* handle)
+{
+  char buf[64];
+  Task *t, *next;
+  (void)source;
+  (void)handle;
+
+  while (read(self.wakeup_fds[0], buf, sizeof(buf)) > 0);
+
+  pthread_mutex_lock(&self.tasks_lock);
+  t = self.tasks;
+  self.tasks = self.last_task = NULL;
+  pthread_mutex_unlock(&self.tasks_lock);
+
+  for (; t != NULL; t = next) {
+    next = t->next;
+    t->callback(t->handle);
+    oml_free(t);
+  }
+}
+
 /** Execute the status-change callback of a channel, if defined.
  *
  * Otherwise, a default behaviour is implemented, cleaning up ch->socket on
@@ -18,6 +18,7 @@
 #include <inttypes.h>
 #include <stdarg.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "ocomm/o_log.h"
 #include "oml_utils.h"
@@ -41,6 +42,8 @@ static void o_log_simplified(int level, const char* format, ...);
 
 /** Logfile to which messages are directed \see o_log_simplified */
 static FILE* logfile = NULL;
+/** Serialises o_vlog() and its rate-limiting state across threads */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
 /** Log level below which messages are shown \see O_LOG_ERROR, O_LOG_WARN, O_LOG_INFO, O_LOG_DEBUG, O_LOG_DEBUG2, O_LOG_DEBUG3, O_LOG_DEBUG4*/
 int o_log_level = O_LOG_INFO;
 
@@ -139,7 +142,7 @@ _o_log(time_t now, int level, char *msg)
 {
   const int label_max = LENGTH(log_labels)-1;
   int label_index;
-  struct tm* ltime;
+  struct tm ltime;
   char now_str[20], dbglvl[] = { 0, 0 };
 
   label_index = level - O_LOG_ERROR; /* O_LOG_ERROR is negative */
@@ -156,8 +159,8 @@ _o_log(time_t now, int level, char *msg)
     o_log_function(level, "%s%s\t%s", log_labels[label_index], dbglvl, msg);
 
   } else {
-    ltime = localtime(&now);
-    strftime(now_str, 20, "%b %d %H:%M:%S", ltime);
+    localtime_r(&now, &ltime);
+    strftime(now_str, 20, "%b %d %H:%M:%S", &ltime);
     o_log_function(level, "%s %s%s\t%s", now_str, log_labels[label_index], dbglvl ,msg);
   }
 }
@@ -173,6 +176,8 @@ _o_log(time_t now, int level, char *msg)
  *
  * The log message is limited to 1024 bytes (\ref LOG_BUF_LEN), not counting metaninformation.
  *
+ * This function can be called from several threads; messages are written one at a time.
+ *
  * \param level log level for the message
  * \param fmt format string
  * \param ... arguments for format
@@ -192,6 +197,7 @@ o_vlog(int log_level, const char* fmt, va_list va)
   if (!o_log_level_active(log_level)) { return; }
 
   time(&now);
+  pthread_mutex_lock(&log_lock);
 
   if (!new_log || !last_log || last_time == (time_t)-1) {
     /* Initialisation of static arrays */
@@ -246,6 +252,7 @@ o_vlog(int log_level, const char* fmt, va_list va)
     last_log = tmp;
 
   }
+  pthread_mutex_unlock(&log_lock);
 }
 
 /** Simplified logging function (default)
@@ -30,7 +30,7 @@
  * \see eventloop_init, eventloop_run, eventloop_stop
  * \eventloop_on_stdin, eventloop_on_monitor_in_channel, eventloop_on_read_in_channel, eventloop_on_out_channel
  * \see o_el_timer_callback, o_el_read_socket_callback, o_el_monitor_socket_callback, o_el_state_socket_callback, o_el_timer_callback
- * \see poll(3)
+ * \see poll(3), epoll(7)
  */
 
 #ifndef O_EVENTLOOP_H
@@ -115,6 +115,29 @@ typedef void (*o_el_timer_callback)(TimerEvtSource* source, void* handle);
  */
 typedef void (*o_el_read_socket_callback)(SockEvtSource* source, void* handle, void* buffer, int buf_size);
 
+struct MBuffer;
+
+/** Buffered data-read callback prototype for sockets.
+ *
+ * Unlike with o_el_read_socket_callback, the EventLoop reads data from the
+ * socket directly into an MBuffer supplied by the application, in large
+ * chunks, without intermediate copies. The newly-read data is at the end of
+ * the readable part of the MBuffer. The application should consume the data
+ * it has processed with the usual MBuffer functions; it does not need to
+ * repack the buffer, which the EventLoop does when it runs out of space.
+ *
+ * Called in the same conditions as o_el_read_socket_callback.
+ *
+ * \param source SockEvtSource from which the event originated
+ * \param handle pointer to application-supplied data
+ * \param mbuf MBuffer into which the data was read
+ * \param len size of the newly-read data
+ *
+ * \see eventloop_on_read_in_buffer, eventloop_socket_set_buffer
+ * \see o_el_read_socket_callback, mbuf_consume_message
+ */
+typedef void (*o_el_read_buffer_callback)(SockEvtSource* source, void* handle, struct MBuffer* mbuf, size_t len);
+
 /** Monitoring callback prototype for sockets.
  *
  * This callback is a fallback when no data-read callback. Listening sockets,
@@ -150,13 +173,44 @@ typedef void (*o_el_monitor_socket_callback)(SockEvtSource* source, void* handle
  */
 typedef void (*o_el_state_socket_callback)(SockEvtSource* source, SocketStatus status, int error, void* handle);
 
+/** Task callback prototype.
+ *
+ * Tasks are posted to the EventLoop of another thread with eventloop_post(),
+ * and run by that thread, from its eventloop_run().
+ *
+ * \param handle pointer to application-supplied data
+ *
+ * \see eventloop_post
+ */
+typedef void (*o_el_task_callback)(void* handle);
+
+/** EventLoop of a thread, opaque outside of eventloop.c
+ * \see eventloop_self, eventloop_post */
+typedef struct _eventLoop EventLoop;
+
+/** Mechanisms the EventLoop can use to wait for events on its channels
+ * \see eventloop_set_backend */
+typedef enum _EventLoopBackend {
+  /** Use the most scalable mechanism available */
+  EVENTLOOP_BACKEND_AUTO = 0,
+  /** poll(2), scanning all descriptors after each wakeup */
+  EVENTLOOP_BACKEND_POLL,
+  /** epoll(7), only visiting ready descriptors after each wakeup */
+  EVENTLOOP_BACKEND_EPOLL,
+} EventLoopBackend;
+
 void eventloop_init(void);
+int eventloop_set_backend(EventLoopBackend backend);
+EventLoopBackend eventloop_get_backend(void);
 void eventloop_set_socket_timeout(unsigned int to);
 int eventloop_run(void);
 void eventloop_stop(int reason);
 void eventloop_terminate(int reason);
 void eventloop_report (int loglevel);
 
+EventLoop* eventloop_self(void);
+int eventloop_post(EventLoop* loop, o_el_task_callback task, void* handle);
+
 TimerEvtSource* eventloop_every(char* name, int period, o_el_timer_callback callback, void* handle);
 void eventloop_timer_stop(TimerEvtSource* timer);
 
@@ -165,12 +219,14 @@ void eventloop_timer_stop(TimerEvtSource* timer);
 SockEvtSource* eventloop_on_stdin( o_el_read_socket_callback callback, void* handle);
 SockEvtSource* eventloop_on_monitor_in_channel(Socket* socket, o_el_monitor_socket_callback monitor_cbk, o_el_state_socket_callback status_cbk, void* handle);
 SockEvtSource* eventloop_on_read_in_channel(Socket* socket,o_el_read_socket_callback data_cbk, o_el_state_socket_callback status_cbk, void* handle);
+SockEvtSource* eventloop_on_read_in_buffer(Socket* socket, struct MBuffer* mbuf, o_el_read_buffer_callback data_cbk, o_el_state_socket_callback status_cbk, void* handle);
 SockEvtSource* eventloop_on_out_channel( Socket* socket, o_el_state_socket_callback status_cbk, void* handle);
 
 /* XXX: Is "socket" the right term here? */
 void eventloop_socket_activate(SockEvtSource* source, int flag);
 void eventloop_socket_release(SockEvtSource* source);
 void eventloop_socket_remove(SockEvtSource* source);
+void eventloop_socket_set_buffer(SockEvtSource* source, struct MBuffer* mbuf);
 
 #ifdef __cplusplus
 }
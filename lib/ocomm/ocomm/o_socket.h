@@ -64,6 +64,17 @@ typedef union {
  */
 typedef void (*o_so_connect_callback)(Socket* newSock, void* handle);
 
+/** Define the signature of a callback to report a datagram received on a
+ * UDP listening socket.
+ * \param socket listening Socket on which the datagram was received
+ * \param from address of the sender
+ * \param from_len length of from
+ * \param buf received datagram
+ * \param len length of the datagram
+ * \param handle opaque argument to datagram_callback
+ */
+typedef void (*o_so_datagram_callback)(Socket* socket, const sockaddr_t* from, socklen_t from_len, void* buf, size_t len, void* handle);
+
 /** Set a global flag which, when set true will cause all newly created sockets
  * to be put in non-blocking mode, otherwise the sockets remain in the system
  * default mode.
@@ -93,6 +104,15 @@ Socket* socket_server_new(const char* name, const char* node, const char* servic
 /** Create a outgoing TCP socket object. */
 Socket* socket_tcp_out_new(const char* name, const char* addr, const char *service);
 
+/** Create a outgoing UDP socket object. */
+Socket* socket_udp_out_new(const char* name, const char* addr, const char *service);
+
+/** Create UDP OSocket objects, and register them with the EventLoop to receive datagrams. */
+Socket* socket_udp_server_new(const char* name, const char* node, const char* service, o_so_datagram_callback callback, void* handle);
+
+/** Create an OSocket object representing the remote peer of a UDP listening socket. */
+Socket* socket_udp_peer_new(const sockaddr_t* addr, socklen_t addr_len);
+
 /** Prevent the remote sender from trasmitting more data. */
 int socket_shutdown(Socket *socket);
 
@@ -105,6 +125,9 @@ void socket_free (Socket* socket);
 /** Send a message through the socket */
 int socket_sendto(Socket* socket, char* buf, int buf_size);
 
+/** Send a message made of several buffers through the socket */
+ssize_t socket_sendv(Socket* socket, const struct iovec* iov, int iovcnt);
+
 /* Return the file descripter associated with this socket */
 int socket_get_sockfd(Socket* socket);
 
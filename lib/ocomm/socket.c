@@ -46,6 +46,8 @@
 #define ADDRLEN               INET6_ADDRSTRLEN
 #define SERVLEN               7   /* ndigits(65536) + 1          */
 #define SOCKNAMELEN           (HOSTLEN+SERVLEN+2)
+#define MAX_DATAGRAM_SIZE     65536 /* Larger than any UDP payload */
+#define MAX_DATAGRAMS_PER_EVENT 64  /* Let other sources be serviced */
 
 static int nonblocking_mode = 1;
 
@@ -69,7 +71,9 @@ typedef struct SocketInt {
 
   o_so_connect_callback connect_callback; /**< Callback for when new clients connect to listening sockets */
 
-  void* connect_handle;     /**< Opaque argument to connect_callback (TCP servers only) */
+  void* connect_handle;     /**< Opaque argument to connect_callback (TCP servers) or datagram_callback (UDP servers) */
+
+  o_so_datagram_callback datagram_callback; /**< Callback for datagrams received on UDP listening sockets */
 
   int is_disconnected;      /**< 1 if a SIGPIPE or ECONNREFUSED was received on a sendto() */
 
@@ -119,7 +123,8 @@ socket_is_disconnected (Socket* socket)
 int
 socket_is_listening (Socket* socket)
 {
-  return (NULL != ((SocketInt*)socket)->connect_callback);
+  return (NULL != ((SocketInt*)socket)->connect_callback ||
+      NULL != ((SocketInt*)socket)->datagram_callback);
 }
 
 /** Create a new instance of the Socket object (SocketInt).
@@ -207,8 +212,8 @@ socket_in_new(const char* name, const char* node, const char* service, int is_tc
   *nameserv = 0;
   memset(&hints, 0, sizeof(struct addrinfo));
 
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_protocol = IPPROTO_TCP; /* FIXME: We should check self->is_tcp */
+  hints.ai_socktype = is_tcp ? SOCK_STREAM : SOCK_DGRAM;
+  hints.ai_protocol = is_tcp ? IPPROTO_TCP : IPPROTO_UDP;
   hints.ai_flags= AI_PASSIVE;
   int val = 1;
 
@@ -290,9 +295,8 @@ s_connect(SocketInt* self)
   *name = 0;
 
   memset(&hints, 0, sizeof(struct addrinfo));
-  /* XXX: This should be pulled up when we support UDP and/or multicast */
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_protocol = IPPROTO_TCP; /* FIXME: We should check self->is_tcp */
+  hints.ai_socktype = self->is_tcp ? SOCK_STREAM : SOCK_DGRAM;
+  hints.ai_protocol = self->is_tcp ? IPPROTO_TCP : IPPROTO_UDP;
 
   if (!self->dest || !self->service) {
     o_log(O_LOG_ERROR, "socket(%s): destination or service missing. Is this an outgoing socket?\n",
@@ -360,15 +364,17 @@ s_connect(SocketInt* self)
   return 0;
 }
 
-/** Create a new outgoing TCP Socket.
+/** Create a new outgoing Socket.
  *
  * \param name name of this Socket, for debugging purposes
  * \param dest DNS name or address of the destination
  * \param service symbolic name or port number of the service to connect to
+ * \param is_tcp true if TCP, false for UDP
  * \return a newly-allocated Socket, or NULL on error
+ * \see socket_tcp_out_new, socket_udp_out_new
  */
-Socket*
-socket_tcp_out_new(const char* name, const char* dest, const char* service)
+static Socket*
+s_out_new(const char* name, const char* dest, const char* service, int is_tcp)
 {
   SocketInt* self;
 
@@ -377,7 +383,7 @@ socket_tcp_out_new(const char* name, const char* dest, const char* service)
     return NULL;
   }
 
-  if ((self = (SocketInt*)socket_new(name, TRUE)) == NULL) {
+  if ((self = (SocketInt*)socket_new(name, is_tcp)) == NULL) {
     return NULL;
   }
 
@@ -389,6 +395,36 @@ socket_tcp_out_new(const char* name, const char* dest, const char* service)
   return (Socket*)self;
 }
 
+/** Create a new outgoing TCP Socket.
+ *
+ * \param name name of this Socket, for debugging purposes
+ * \param dest DNS name or address of the destination
+ * \param service symbolic name or port number of the service to connect to
+ * \return a newly-allocated Socket, or NULL on error
+ */
+Socket*
+socket_tcp_out_new(const char* name, const char* dest, const char* service)
+{
+  return s_out_new(name, dest, service, TRUE);
+}
+
+/** Create a new outgoing UDP Socket.
+ *
+ * The underlying socket is connect()ed to the destination, so datagrams can
+ * be sent with socket_sendto() or socket_sendv(), and ICMP errors are
+ * reported as disconnections.
+ *
+ * \param name name of this Socket, for debugging purposes
+ * \param dest DNS name or address of the destination
+ * \param service symbolic name or port number of the service to send to
+ * \return a newly-allocated Socket, or NULL on error
+ */
+Socket*
+socket_udp_out_new(const char* name, const char* dest, const char* service)
+{
+  return s_out_new(name, dest, service, FALSE);
+}
+
 /** Eventloop callback called when a new connection is received on a listening Socket.
  *
  * This function accept()s the connection, and creates a SocketInt to wrap
@@ -481,6 +517,108 @@ socket_server_new(const char* name, const char* node, const char* service, o_so_
   return socketlist;
 }
 
+/** Eventloop callback called when datagrams are received on a UDP listening Socket.
+ *
+ * This function reads the datagrams already queued on the socket, and passes
+ * each of them to the user-supplied callback (passed to
+ * socket_udp_server_new() when creating the listening Socket), along with the
+ * address of their sender.
+ *
+ * \param source source from which the event was received (e.g., an OComm Channel)
+ * \param handle pointer to opaque data passed when creating the listening Socket
+ */
+static void
+on_datagram(SockEvtSource* source, void* handle)
+{
+  (void)source;
+  uint8_t buf[MAX_DATAGRAM_SIZE];
+  sockaddr_t from;
+  socklen_t from_len;
+  ssize_t len;
+  int i;
+  SocketInt* self = (SocketInt*)handle;
+
+  for (i = 0; i < MAX_DATAGRAMS_PER_EVENT; i++) {
+    from_len = sizeof(from.sa_stor);
+    if ((len = recvfrom(self->sockfd, buf, sizeof(buf), MSG_DONTWAIT, &from.sa, &from_len)) < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        o_log(O_LOG_WARN, "socket(%s): Error receiving datagram: %s\n",
+            self->name, strerror(errno));
+      }
+      return;
+    }
+
+    if (self->datagram_callback) {
+      self->datagram_callback((Socket*)self, &from, from_len, buf, len, self->connect_handle);
+    }
+  }
+}
+
+/** Create UDP OSocket objects, and register them with the EventLoop to receive datagrams.
+ *
+ * If callback is non-NULL, it is called for every datagram received.
+ *
+ * \param name name of the object, used for debugging
+ * \param node address or name to listen on; defaults to all if NULL
+ * \param service symbolic name or port number of the service to bind to
+ * \param callback function to call when a datagram is received
+ * \param handle pointer to opaque data passed to callback function
+ * \return a pointer to a linked list of Socket objects
+ *
+ * \see socket_in_new, socket_udp_peer_new
+ */
+Socket*
+socket_udp_server_new(const char* name, const char* node, const char* service, o_so_datagram_callback callback, void* handle)
+{
+  Socket *socketlist;
+  SocketInt *it;
+
+  socketlist = socket_in_new(name, node, service, FALSE);
+
+  for (it=(SocketInt*)socketlist; it; it=(SocketInt*)it->next) {
+    it->datagram_callback = callback;
+    it->connect_handle = handle;
+
+    if (callback) {
+      eventloop_on_monitor_in_channel((Socket*)it, on_datagram, NULL, it);
+    }
+  }
+  return socketlist;
+}
+
+/** Create an OSocket object representing the remote peer of a UDP listening socket.
+ *
+ * The returned Socket has no underlying system socket, and cannot be used to
+ * send or receive data, but can be queried for the address of the peer (e.g.,
+ * socket_get_peer_addr(), socket_get_port()) as a TCP socket returned by
+ * accept() would.
+ *
+ * \param addr address of the peer, as passed to an o_so_datagram_callback
+ * \param addr_len length of addr
+ * \return a newly-allocated Socket, or NULL on error
+ *
+ * \see socket_udp_server_new, socket_free
+ */
+Socket*
+socket_udp_peer_new(const sockaddr_t* addr, socklen_t addr_len)
+{
+  char name[SOCKNAMELEN];
+  SocketInt* self;
+
+  assert(addr);
+  if (addr_len > sizeof(self->servAddr)) {
+    return NULL;
+  }
+
+  sockaddr_get_name(addr, addr_len, name, sizeof(name));
+  if (NULL == (self = socket_initialize(name))) {
+    return NULL;
+  }
+  memcpy(&self->servAddr, addr, addr_len);
+
+  return (Socket*)self;
+}
+
 /** Prevent the remote sender from trasmitting more data.
  *
  * \param socket Socket object for which to shut communication down
@@ -515,32 +653,23 @@ socket_close(Socket* socket)
   return 0;
 }
 
-/** Send a message through the socket
- *
- * If a disconnection occurs, 0 will be returned, as no data was sent.  To
- * differentiate from cases where data couldn't be written just yet, the socket
- * should be inspected with socket_is_disconnected().
- *
- * \param socket Socket to send message through
- * \param buf data to send
- * \param buf_size amount of data to read from buf
- * \return the amount of data sent, or -1 on error
+/** Make sure a Socket is connected before sending data through it
  *
- * \see socket_is_disconnected, sendto(3)
+ * \param self SocketInt to check
+ * \return 1 if data can be sent, 0 otherwise
+ * \see socket_sendto, socket_sendv
  */
-int
-socket_sendto(Socket* socket, char* buf, int buf_size)
+static int
+s_prepare_send(SocketInt* self)
 {
-  SocketInt *self = (SocketInt*)socket;
   int sent;
 
-
   if (self->is_disconnected) {
     if(!s_connect(self)) {
       return 0;
     }
 
-  } else if((sent = recv(self->sockfd, NULL, 0, MSG_DONTWAIT)) == 0) {
+  } else if(self->is_tcp && (sent = recv(self->sockfd, NULL, 0, MSG_DONTWAIT)) == 0) {
     /* Test that the server kept the other side of the connection alive */
     if (!(sent < 0 && EAGAIN == errno)) {
       /* EAGAIN is the expected case: connection alive but no data,
@@ -554,30 +683,106 @@ socket_sendto(Socket* socket, char* buf, int buf_size)
 
   }
 
+  return 1;
+}
+
+/** Handle an error from sending data through a Socket
+ *
+ * \param self SocketInt on which the error occured, with errno set
+ * \return 0 if the error is transient or a disconnection, -1 otherwise
+ * \see socket_sendto, socket_sendv
+ */
+static int
+s_send_error(SocketInt* self)
+{
+  if (errno == EPIPE || errno == ECONNRESET) {
+    // The other end closed the connection.
+    self->is_disconnected = 1;
+    o_log(O_LOG_ERROR, "socket(%s): The remote peer closed the connection: %s\n",
+          self->name, strerror(errno));
+    return 0;
+  } else if (errno == ECONNREFUSED) {
+    self->is_disconnected = 1;
+    o_log(O_LOG_DEBUG, "socket(%s): Connection refused, trying next AI\n",
+          self->name);
+    self->rp = self->rp->ai_next;
+    return 0;
+  } else if (errno == EINTR) {
+    o_log(O_LOG_WARN, "socket(%s): Sending data interrupted: %s\n",
+          self->name, strerror(errno));
+    return 0;
+  } else {
+    o_log(O_LOG_ERROR, "socket(%s): Sending data failed: %s\n",
+          self->name, strerror(errno));
+  }
+  return -1;
+}
+
+/** Send a message through the socket
+ *
+ * If a disconnection occurs, 0 will be returned, as no data was sent.  To
+ * differentiate from cases where data couldn't be written just yet, the socket
+ * should be inspected with socket_is_disconnected().
+ *
+ * \param socket Socket to send message through
+ * \param buf data to send
+ * \param buf_size amount of data to read from buf
+ * \return the amount of data sent, or -1 on error
+ *
+ * \see socket_is_disconnected, sendto(3)
+ */
+int
+socket_sendto(Socket* socket, char* buf, int buf_size)
+{
+  SocketInt *self = (SocketInt*)socket;
+  int sent;
+
+  if (!s_prepare_send(self)) {
+    return 0;
+  }
+
   if ((sent = sendto(self->sockfd, buf, buf_size, MSG_NOSIGNAL,
                     &(self->servAddr.sa),
                     sizeof(self->servAddr.sa_stor))) < 0) {
-    if (errno == EPIPE || errno == ECONNRESET) {
-      // The other end closed the connection.
-      self->is_disconnected = 1;
-      o_log(O_LOG_ERROR, "socket(%s): The remote peer closed the connection: %s\n",
-            self->name, strerror(errno));
-      return 0;
-    } else if (errno == ECONNREFUSED) {
-      self->is_disconnected = 1;
-      o_log(O_LOG_DEBUG, "socket(%s): Connection refused, trying next AI\n",
-            self->name);
-      self->rp = self->rp->ai_next;
-      return 0;
-    } else if (errno == EINTR) {
-      o_log(O_LOG_WARN, "socket(%s): Sending data interrupted: %s\n",
-            self->name, strerror(errno));
-      return 0;
-    } else {
-      o_log(O_LOG_ERROR, "socket(%s): Sending data failed: %s\n",
-            self->name, strerror(errno));
-    }
-    return -1;
+    return s_send_error(self);
+  }
+  return sent;
+}
+
+/** Send a message made of several buffers through the socket, in one system call
+ *
+ * Similarly to socket_sendto(), if a disconnection occurs, 0 will be
+ * returned, and the socket should be inspected with socket_is_disconnected().
+ *
+ * \param socket Socket to send message through
+ * \param iov array of buffers to send, in order
+ * \param iovcnt number of buffers in iov
+ * \return the amount of data sent, or -1 on error
+ *
+ * \see socket_sendto, sendmsg(2)
+ */
+ssize_t
+socket_sendv(Socket* socket, const struct iovec* iov, int iovcnt)
+{
+  SocketInt *self = (SocketInt*)socket;
+  struct msghdr msg;
+  ssize_t sent;
+
+  if (!s_prepare_send(self)) {
+    return 0;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  if (self->is_tcp) {
+    /* Connected UDP sockets already know their destination */
+    msg.msg_name = &(self->servAddr.sa);
+    msg.msg_namelen = sizeof(self->servAddr.sa_stor);
+  }
+  msg.msg_iov = (struct iovec*)iov;
+  msg.msg_iovlen = iovcnt;
+
+  if ((sent = sendmsg(self->sockfd, &msg, MSG_NOSIGNAL)) < 0) {
+    return s_send_error(self);
   }
   return sent;
 }
@@ -637,18 +842,24 @@ socket_get_peer_addr(Socket *s, char *addr, size_t addr_sz)
   SocketInt *self = (SocketInt*)s;
 
   assert(self);
-  assert(self->sockfd>=0);
   assert(addr);
   assert(socket_get_addr_sz(s) <= addr_sz);
 
   memset(&sa, 0, sa_len);
 
-  if(getpeername(self->sockfd, &sa.sa, &sa_len)) {
+  if (self->sockfd < 0) {
+    /* Remote peer of a UDP listening socket \see socket_udp_peer_new */
+    memcpy(&sa, &self->servAddr, sizeof(sa));
+    sa_len = (AF_INET6 == sa.sa.sa_family) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+
+  } else if(getpeername(self->sockfd, &sa.sa, &sa_len)) {
     o_log(O_LOG_WARN, "%s: Error getting peer address: %s\n",
         self->name, strerror(errno));
     snprintf(addr, addr_sz, "Unknown peer");
+    return;
+  }
 
-  } else if ((ret=getnameinfo(&sa.sa, sa_len, addr, addr_sz, NULL, 0, NI_NUMERICHOST))) {
+  if ((ret=getnameinfo(&sa.sa, sa_len, addr, addr_sz, NULL, 0, NI_NUMERICHOST))) {
     o_log(O_LOG_WARN, "%s: Error converting peer address to name: %s\n",
         self->name, gai_strerror(ret));
     snprintf(addr, addr_sz, "Unknown address (AF%d)", sa.sa.sa_family);
@@ -10,9 +10,11 @@
 /** \file binary.c
  * \brief Functions for reading oml_message objects from an MBuffer using the OML binary format (\ref omspbin).
  */
+#include <string.h>
 #include <arpa/inet.h>
 
 #include "oml2/omlc.h"
+#include "htonll.h"
 #include "oml_value.h"
 #include "mbuf.h"
 #include "marshal.h"
@@ -132,6 +134,10 @@ bin_read_msg_start (struct oml_message *msg, MBuffer *mbuf)
 
   switch (packet_type) {
   case OMB_DATA_P:
+  case OMB_CDATA_P:
+  case OMB_BLOCK_P:
+  case OMB_DDATA_P:
+  case OMB_DICT_P:
     // FIXME:  Return type (maybe not enough bytes)
     mbuf_read (mbuf, (uint8_t*)&msglen16, 2);
     msglen16 = ntohs (msglen16);
@@ -139,6 +145,9 @@ bin_read_msg_start (struct oml_message *msg, MBuffer *mbuf)
     header_length = 5;
     break;
   case OMB_LDATA_P:
+  case OMB_LCDATA_P:
+  case OMB_LBLOCK_P:
+  case OMB_LDDATA_P:
     mbuf_read (mbuf, (uint8_t*)&length, 4);
     length = ntohl (length);
     header_length = 7;
@@ -162,6 +171,20 @@ bin_read_msg_start (struct oml_message *msg, MBuffer *mbuf)
   msg->length = length + header_length;
   msg->count = count;
 
+  if (marshal_msgtype_is_compact ((OmlBinMsgType)packet_type)) {
+    uint32_t seqno;
+    uint64_t timestamp;
+
+    msg->type = marshal_msgtype_is_block ((OmlBinMsgType)packet_type) ? MSG_BINARY_BLOCK :
+      marshal_msgtype_is_dict ((OmlBinMsgType)packet_type) ? MSG_BINARY_DICT : MSG_BINARY_COMPACT;
+    mbuf_read (mbuf, (uint8_t*)&seqno, sizeof (seqno));
+    mbuf_read (mbuf, (uint8_t*)&timestamp, sizeof (timestamp));
+    msg->seqno = letohl (seqno);
+    timestamp = letohll (timestamp);
+    memcpy (&msg->timestamp, &timestamp, sizeof (msg->timestamp));
+
+    return msg->length;
+  }
 
   oml_value_set_type(&value, OML_INT32_VALUE);
   // FIXME: check for error (e.g. type mismatch)
@@ -183,16 +206,18 @@ bin_read_msg_values (struct oml_message *msg, MBuffer *mbuf, struct schema *sche
 {
   int i = 0;
 
-  if (msg->count != schema->nfields)
+  if (msg->type == MSG_BINARY_BLOCK || msg->type == MSG_BINARY_DICT ||
+      msg->count != schema->nfields)
     return -1;
 
   for (i = 0; i < schema->nfields; i++) {
-    int bytes;
-
-    bytes = bin_read_value (mbuf, &values[i]);
+    if (msg->type == MSG_BINARY_COMPACT) {
+      if (!unmarshal_value_compact (mbuf, schema->fields[i].type, &values[i]))
+        return -1;
 
-    if (bytes == -1)
+    } else if (bin_read_value (mbuf, &values[i]) == -1) {
       return -1;
+    }
   }
 
   mbuf_consume_message (mbuf);
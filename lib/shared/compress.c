@@ -0,0 +1,109 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file compress.c
+ * \brief Framing of compressed measurement data.
+ *
+ * When a client announces `compression: deflate` in its headers, everything
+ * it sends after the headers is a sequence of frames. Each frame is a 32-bit
+ * length, in network byte order, followed by that many bytes of a complete
+ * raw deflate stream (RFC 1951).
+ *
+ * Frames are compressed independently of each other, so they can be decoded
+ * without knowing what came before. This lets the oml2-proxy-server store
+ * and forward them as opaque messages, and resume sending them over a new
+ * connection to the server.
+ *
+ * \see zlib_stream.c
+ */
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "ocomm/o_log.h"
+#include "compress.h"
+
+/** Write the length prefix of a compressed frame.
+ *
+ * \param buf buffer of at least COMPRESS_FRAME_HEADER_SIZE bytes
+ * \param payload_length length of the compressed data following the prefix
+ */
+void
+compress_frame_header (uint8_t *buf, uint32_t payload_length)
+{
+  uint32_t nlen = htonl (payload_length);
+  memcpy (buf, &nlen, sizeof (nlen));
+}
+
+/** Find the length of the compressed frame at the start of a buffer.
+ *
+ * \param buf buffer starting with a compressed frame
+ * \param len length of data in buf
+ * \return the total length of the frame, including its length prefix, 0 if
+ * buf does not contain the whole frame yet, or -1 if the frame is invalid
+ */
+ssize_t
+compress_frame_length (const uint8_t *buf, size_t len)
+{
+  uint32_t nlen, payload_length;
+
+  if (len < COMPRESS_FRAME_HEADER_SIZE) {
+    return 0;
+  }
+
+  memcpy (&nlen, buf, sizeof (nlen));
+  payload_length = ntohl (nlen);
+  if (payload_length == 0 || payload_length > COMPRESS_MAX_FRAME_SIZE) {
+    logdebug ("Invalid compressed frame length %u\n", payload_length);
+    return -1;
+  }
+
+  if (len < COMPRESS_FRAME_HEADER_SIZE + payload_length) {
+    return 0;
+  }
+  return COMPRESS_FRAME_HEADER_SIZE + payload_length;
+}
+
+/** Find the boundaries of the next compressed frame in an MBuffer.
+ *
+ * The frame is treated as a single opaque message, of which only the length
+ * is known.
+ *
+ * \param msg oml_message to fill in
+ * \param mbuf MBuffer whose read pointer is at the start of a frame
+ * \return the length of the frame, 0 if more data is needed, or -1 on error
+ * \see msg_start_fn, compress_frame_length
+ */
+int
+compress_read_msg_start (struct oml_message *msg, MBuffer *mbuf)
+{
+  ssize_t length;
+
+  if (msg == NULL || mbuf == NULL)
+    return -1;
+
+  length = compress_frame_length (mbuf_rdptr (mbuf), mbuf_rd_remaining (mbuf));
+  if (length <= 0)
+    return (int)length;
+
+  memset (msg, 0, sizeof (*msg));
+  msg->stream = -1;
+  msg->type = MSG_BINARY;
+  msg->length = (uint32_t)length;
+
+  return (int)length;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
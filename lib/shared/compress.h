@@ -0,0 +1,49 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file compress.h
+ * \brief Framing of compressed measurement data.
+ * \see compress.c
+ */
+#ifndef COMPRESS_H__
+#define COMPRESS_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "mbuf.h"
+#include "message.h"
+
+/** Value of the compression header for streams of deflate frames */
+#define COMPRESSION_DEFLATE "deflate"
+
+/** Size of the length prefix of each compressed frame */
+#define COMPRESS_FRAME_HEADER_SIZE 4
+
+/** Largest compressed payload accepted in a frame */
+#define COMPRESS_MAX_FRAME_SIZE (16 * 1024 * 1024)
+
+/** Largest amount of data a frame may decompress to */
+#define COMPRESS_MAX_INFLATED_SIZE (16 * 1024 * 1024)
+
+void compress_frame_header (uint8_t *buf, uint32_t payload_length);
+ssize_t compress_frame_length (const uint8_t *buf, size_t len);
+
+int compress_read_msg_start (struct oml_message *msg, MBuffer *mbuf);
+
+#endif /* COMPRESS_H__ */
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -189,6 +189,7 @@ static const struct {
   { "sender-id",     9,  H_SENDER_ID },
   { "start-time",    10, H_START_TIME },
   { "start_time",    10, H_START_TIME }, /* This one will be deprecated at some point */
+  { "compression",   11, H_COMPRESSION },
   { NULL, 0, H_NONE }
 };
 
@@ -8,7 +8,8 @@
  * in the License.
  */
 /** \file htonll.h
- * \brief Macros for converting 64 bit integers between host and network representation.
+ * \brief Macros for converting 64 bit integers between host and network
+ * representation, and integers between host and little-endian representation.
  */
 #ifndef HTONLL_H__
 #define HTONLL_H__
@@ -38,6 +39,19 @@
 #define ntohll(value) (bswap_64(value))
 #endif
 
+#ifdef WORDS_BIGENDIAN
+#define htoles(value) (bswap_16(value))
+#define htolel(value) (bswap_32(value))
+#define htolell(value) (bswap_64(value))
+#else
+#define htoles(value) (value)
+#define htolel(value) (value)
+#define htolell(value) (value)
+#endif
+#define letohs(value) htoles(value)
+#define letohl(value) htolel(value)
+#define letohll(value) htolell(value)
+
 #endif /* HTONLL_H__ */
 
 /*
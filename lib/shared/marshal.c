@@ -158,7 +158,107 @@
  *       | dbl[0]-byte-4 |  dbl[0]-byte-3  | dbl[0]-byte-2 |dbl[0]-LS-byte |
  *       +---------------+-----------------+---------------+---------------+--
  *
- * \see marshal_init, marshal_header_short, marshal_header_long, marshal_measurements, marshal_values, marshal_finalize
+ * \section omspbincompact OMSP Compact Binary Marshalling
+ *
+ * From OMSPv6, the same headers can carry a different packet type, \ref
+ * OMB_CDATA_P (short) or \ref OMB_LCDATA_P (long). In these packets, values
+ * are not preceded by a type byte: as both ends know the schema of ms-index
+ * from the headers, each value is laid out according to the type of its field.
+ * They are marshalled with marshal_values_compact(), and unmarshalled with
+ * unmarshal_values_compact().
+ *
+ * The sequence number is a 4-byte integer, and the timestamp an 8-byte IEEE
+ * 754 binary64 double. Fixed-width values are written in little-endian byte
+ * order, which is the native order of most hosts, so encoding and decoding
+ * them amount to copies.
+ *
+ * - 32-bit integers (including longs, clamped as above) take 4 bytes;
+ * - 64-bit integers and GUIDs take 8 bytes;
+ * - doubles are sent verbatim as IEEE 754 binary64 values (8 bytes), and are
+ *   therefore lossless, NaN and infinities included;
+ * - booleans take 1 byte, 0 or 1;
+ * - strings and blobs are prefixed by their length in bytes, as an unsigned
+ *   LEB128 varint (one byte for lengths up to 127), and are not limited to 254
+ *   characters;
+ * - vectors are prefixed by their number of elements, as a varint, followed by
+ *   the elements, in the same encoding as the scalar of the same type.
+ *
+ *     --+---------------+---------------+---------------+---------------+
+ *       |seqno-byte-LL  | seqno-byte-LH | seqno-byte-HL | seqno-byte-HH |
+ *     --+---------------+---------------+---------------+---------------+
+ *       |  ts-LS-byte   |      ...      |      ...      |  ts-MS-byte   |
+ *       +---------------+---------------+---------------+---------------+
+ *       |   value[0]    |      ...      |   value[1]    |      ...      |
+ *       +---------------+---------------+---------------+---------------+--
+ *
+ * \section omspbinblock OMSP Binary Blocks
+ *
+ * From OMSPv7, a client can also send up to \ref OMB_BLOCK_MAX_ROWS samples of
+ * the same stream in a single \ref OMB_BLOCK_P (short) or \ref OMB_LBLOCK_P
+ * (long) packet. The headers are those of compact packets, except that
+ * num-values is the number of samples in the block, and seqno and timestamp
+ * are those of its first sample. They are marshalled with marshal_block(), and
+ * unmarshalled with unmarshal_block().
+ *
+ * The samples are then encoded column by column, so that each column can be
+ * compressed based on the slow variations of time series, in the manner of
+ * Facebook's Gorilla: the number of fields (as a varint), the sequence numbers
+ * of the following samples, their timestamps, then each field in turn.
+ *
+ * - sequence numbers and integer fields (including booleans and GUIDs) are
+ *   written as the difference with the previous value of the column (0 for
+ *   the first), zigzag-encoded into an unsigned LEB128 varint, so that slowly
+ *   varying counters take one byte per sample;
+ * - timestamps are converted to a number of microseconds since that of the
+ *   first sample, and the differences between subsequent deltas are
+ *   bit-packed: '0' for a null delta-of-delta, then '10', '110' or '1110'
+ *   followed by the zigzag-encoded value in 7, 9 or 12 bits, or '1111' and
+ *   64 bits, so periodic samples take one bit each;
+ * - doubles are XORed with their predecessor and bit-packed: a '0' bit if
+ *   they are the same, '10' followed by the meaningful bits of the XOR if
+ *   they fit within the same window of leading and trailing zeros as the
+ *   previous one, or '11', the number of leading zeros in 5 bits, the number
+ *   of meaningful bits minus one in 6 bits, and the meaningful bits; the first
+ *   value is written as its 64 bits;
+ * - other types are written as in compact packets, one after the other.
+ *
+ * Bit-packed columns are written most significant bit first, and padded with
+ * zeros to a whole number of bytes. Apart from that of the first sample,
+ * timestamps are therefore rounded to the microsecond; all other values are
+ * transmitted without loss.
+ *
+ * \section omspbindict OMSP String Dictionary
+ *
+ * From OMSPv8, compact samples can also be sent in \ref OMB_DDATA_P (short) or
+ * \ref OMB_LDDATA_P (long) packets, in which strings are replaced by an
+ * identifier once they have been sent, so that strings coming from a small
+ * set (interface names, states, ...) are not sent in full in every sample.
+ * The identifiers are specific to each connection, and are defined by the
+ * samples themselves: each string value starts with an unsigned LEB128
+ * varint, which is
+ *
+ * - 'length << 1' for a string sent as in compact packets, followed by its bytes;
+ * - '(id << 2) | 3' for a string sent for the first time, followed by its
+ *   length as a varint and its bytes; it is then known as 'id';
+ * - '(id << 2) | 1' for string 'id'.
+ *
+ * All other values are encoded as in compact packets. These packets are
+ * marshalled with marshal_values_dict(), and unmarshalled with
+ * unmarshal_values_dict().
+ *
+ * Identifiers are lower than \ref OMB_DICT_MAX_SIZE, and only strings of up to
+ * \ref OMB_DICT_MAX_LENGTH bytes are entered into the dictionary.
+ *
+ * As the data following a reconnection may refer to strings defined in the
+ * data sent before it, the definitions are also kept with the protocol headers
+ * which are replayed to the new connection, in \ref OMB_DICT_P packets. Their
+ * headers are those of compact packets, with a stream index, sequence number
+ * and timestamp of 0, and num-values is the number of definitions they
+ * contain, each of which is the identifier and the length of the string, as
+ * varints, followed by its bytes. They are marshalled with marshal_dict(),
+ * and unmarshalled with unmarshal_dict().
+ *
+ * \see marshal_init, marshal_header_short, marshal_header_long, marshal_measurements, marshal_values, marshal_values_compact, marshal_block, marshal_values_dict, marshal_finalize
  */
 
 #define _GNU_SOURCE  /* For NAN */
@@ -178,6 +278,7 @@
 #include "mbuf.h"
 #include "oml_utils.h"
 #include "oml_value.h"
+#include "schema.h"
 #include "marshal.h"
 
 #define BIG_S 15
@@ -235,6 +336,13 @@
 
 #define MAX_STRING_LENGTH STRING_T_MAX_SIZE
 
+/** Maximal size of an unsigned LEB128 varint encoding a 32-bit length */
+#define VARINT_MAX_SIZE   5
+/** Maximal size of an unsigned LEB128 varint encoding a 64-bit value */
+#define VARINT64_MAX_SIZE 10
+/** Number of elements converted at once when marshalling vectors element by element */
+#define VECTOR_CHUNK      64
+
 #define MIN_LENGTH 64
 
 /** Map from OML_*_VALUE types to protocol types.
@@ -378,15 +486,59 @@ uint8_t* find_sync (const uint8_t *buf, int len)
   return NULL;
 }
 
+/** Get the length of the marshalled message at the beginning of a buffer.
+ *
+ * \param buf buffer starting with a marshalled message
+ * \param len length of buf
+ * \return the length of the whole message, headers included (possibly more
+ * than len), 0 if len is too short to contain the message headers, or -1 if
+ * buf does not start with a message header
+ * \see marshal_finalize, find_sync
+ */
+ssize_t
+marshal_get_message_length (const uint8_t *buf, size_t len)
+{
+  uint16_t nlen16;
+  uint32_t nlen32;
+
+  if (len < PACKET_HEADER_SIZE) {
+    return 0;
+  } else if (buf[0] != SYNC_BYTE || buf[1] != SYNC_BYTE) {
+    return -1;
+  }
+
+  switch (buf[2]) {
+  case OMB_DATA_P:
+  case OMB_CDATA_P:
+  case OMB_BLOCK_P:
+  case OMB_DDATA_P:
+  case OMB_DICT_P:
+    memcpy (&nlen16, &buf[3], sizeof (nlen16));
+    return PACKET_HEADER_SIZE + ntohs (nlen16);
+  case OMB_LDATA_P:
+  case OMB_LCDATA_P:
+  case OMB_LBLOCK_P:
+  case OMB_LDDATA_P:
+    if (len < PACKET_HEADER_SIZE + 2) {
+      return 0;
+    }
+    memcpy (&nlen32, &buf[3], sizeof (nlen32));
+    return PACKET_HEADER_SIZE + 2 + (ssize_t)ntohl (nlen32);
+  default:
+    return -1;
+  }
+}
+
 /** Prepare a short marshalling header into an MBuffer.
  *
  * \param mbuf MBuffer to write the mbuf marshalling header to
+ * \param msgtype short OmlBinMsgType of the packet (OMB_DATA_P, OMB_CDATA_P, OMB_BLOCK_P, OMB_DDATA_P or OMB_DICT_P)
  * \return the 0 on success, -1 on failure (\see mbuf_write)
  */
-static int marshal_header_short (MBuffer *mbuf)
+static int marshal_header_short (MBuffer *mbuf, OmlBinMsgType msgtype)
 {
   uint8_t buf[] = {
-    SYNC_BYTE, SYNC_BYTE, OMB_DATA_P, 0, 0
+    SYNC_BYTE, SYNC_BYTE, (uint8_t)msgtype, 0, 0
   };
   return mbuf_write (mbuf, buf, LENGTH (buf));
 }
@@ -394,12 +546,13 @@ static int marshal_header_short (MBuffer *mbuf)
 /** Prepare a long marshalling header into an MBuffer.
  *
  * \param mbuf MBuffer to write the mbuf marshalling header to
+ * \param msgtype long OmlBinMsgType of the packet (OMB_LDATA_P, OMB_LCDATA_P, OMB_LBLOCK_P or OMB_LDDATA_P)
  * \return the 0 on success, -1 on failure (\see mbuf_write)
  */
-static int marshal_header_long (MBuffer *mbuf)
+static int marshal_header_long (MBuffer *mbuf, OmlBinMsgType msgtype)
 {
   uint8_t buf[] = {
-    SYNC_BYTE, SYNC_BYTE, OMB_LDATA_P, 0, 0, 0, 0
+    SYNC_BYTE, SYNC_BYTE, (uint8_t)msgtype, 0, 0, 0, 0
   };
   return mbuf_write (mbuf, buf, LENGTH (buf));
 }
@@ -415,15 +568,60 @@ marshal_get_msgtype (MBuffer *mbuf)
   return (OmlBinMsgType)(mbuf_message (mbuf))[2];
 }
 
+/** Tell whether a message type carries untagged values laid out according to the schema.
+ *
+ * Block and dictionary messages also have untagged values, and their header
+ * is that of compact messages, but their values need to be unmarshalled with
+ * unmarshal_block(), unmarshal_values_dict() or unmarshal_dict().
+ *
+ * \param msgtype OmlBinMsgType to test
+ * \return 1 for OMB_CDATA_P, OMB_LCDATA_P, and block and dictionary messages, 0 otherwise
+ * \see marshal_values_compact, unmarshal_values_compact, marshal_msgtype_is_block, marshal_msgtype_is_dict
+ */
+int
+marshal_msgtype_is_compact (OmlBinMsgType msgtype)
+{
+  return msgtype == OMB_CDATA_P || msgtype == OMB_LCDATA_P ||
+    marshal_msgtype_is_block (msgtype) || marshal_msgtype_is_dict (msgtype);
+}
+
+/** Tell whether a message type carries a block of samples encoded column by column.
+ *
+ * \param msgtype OmlBinMsgType to test
+ * \return 1 for OMB_BLOCK_P and OMB_LBLOCK_P, 0 otherwise
+ * \see marshal_block, unmarshal_block
+ */
+int
+marshal_msgtype_is_block (OmlBinMsgType msgtype)
+{
+  return msgtype == OMB_BLOCK_P || msgtype == OMB_LBLOCK_P;
+}
+
+/** Tell whether a message type depends on the string dictionary of the connection.
+ *
+ * \param msgtype OmlBinMsgType to test
+ * \return 1 for OMB_DDATA_P, OMB_LDDATA_P and OMB_DICT_P, 0 otherwise
+ * \see marshal_values_dict, marshal_dict, unmarshal_values_dict, unmarshal_dict
+ */
+int
+marshal_msgtype_is_dict (OmlBinMsgType msgtype)
+{
+  return msgtype == OMB_DDATA_P || msgtype == OMB_LDDATA_P || msgtype == OMB_DICT_P;
+}
+
 /** Initialise the MBuffer to serialise a new measurement packet, starting at
  * the current write pointer.
  *
  * Two basic types (OmlBinMsgType) of packets are available, short and long.
  * Short packets (OMB_DATA_P) can contain up to UINT16_MAX, whislt long packets
- * (OMB_LDATA_P) extend this to UINT32_MAX.
+ * (OMB_LDATA_P) extend this to UINT32_MAX. OMB_CDATA_P and OMB_LCDATA_P are
+ * their respective counterparts for compact values (\ref omspbincompact),
+ * OMB_BLOCK_P and OMB_LBLOCK_P for blocks of samples (\ref omspbinblock), and
+ * OMB_DDATA_P and OMB_LDDATA_P for compact values using a string dictionary
+ * (\ref omspbindict), which is defined with short OMB_DICT_P packets.
  *
  * Packets headers start with two SYNC_BYTEs (0xAA), then the packet type
- * (OMB_DATA_P or OMB_LDATA_P).
+ * (any of the above).
  * - OMB_DATA_P headers are 5 bytes long, the last two bytes containing the
  *   size of the message (including headers) as a 16-bit integer.
  * - OMB_LDATA_P headers are 7 bytes long, the last four bytes containing the
@@ -452,8 +650,18 @@ marshal_init(MBuffer *mbuf, OmlBinMsgType msgtype)
   }
 
   switch (msgtype) {
-  case OMB_DATA_P:  result = marshal_header_short (mbuf); break;
-  case OMB_LDATA_P: result = marshal_header_long (mbuf); break;
+  case OMB_DATA_P:
+  case OMB_CDATA_P:
+  case OMB_BLOCK_P:
+  case OMB_DDATA_P:
+  case OMB_DICT_P:   result = marshal_header_short (mbuf, msgtype); break;
+  case OMB_LDATA_P:
+  case OMB_LCDATA_P:
+  case OMB_LBLOCK_P:
+  case OMB_LDDATA_P: result = marshal_header_long (mbuf, msgtype); break;
+  default:
+    logerror("Unknown packet type %d\n", (int)msgtype);
+    result = -1;
   }
 
   if (result == -1) {
@@ -470,7 +678,8 @@ marshal_init(MBuffer *mbuf, OmlBinMsgType msgtype)
  * counter for the number of elements in the message, and therefore starts at
  * 0, and the second one is the stream's index. This is followed by a
  * marshalled int32 value containing the sequence number, and a double value
- * containing the timestamp.
+ * containing the timestamp. In compact messages, these two values are written
+ * without type bytes, as 4 and 8 little-endian bytes (\ref omspbincompact).
  *
  * A marshalling message should have been prepared in the MBuffer first with
  * marshal_init(). Actual data can then be marshalled into the message with
@@ -502,6 +711,23 @@ marshal_measurements(MBuffer* mbuf, int stream, int seqno, double now)
 
   logdebug2("Marshalling sample %d for stream %d\n", seqno, stream);
 
+  if (marshal_msgtype_is_compact (marshal_get_msgtype (mbuf))) {
+    uint32_t nseqno = htolel((uint32_t)seqno);
+    uint64_t nnow;
+    uint8_t buf[INT32_T_SIZE + INT64_T_SIZE];
+
+    memcpy(&nnow, &now, sizeof(nnow));
+    nnow = htolell(nnow);
+    memcpy(buf, &nseqno, sizeof(nseqno));
+    memcpy(&buf[INT32_T_SIZE], &nnow, sizeof(nnow));
+    if (mbuf_write (mbuf, buf, LENGTH (buf)) == -1) {
+      logerror("Unable to marshal sequence number and timestamp (mbuf_write())\n");
+      mbuf_reset_write (mbuf);
+      return -1;
+    }
+    return 1;
+  }
+
   omlc_set_int32(v, seqno);
   marshal_value(mbuf, OML_INT32_VALUE, &v);
 
@@ -511,6 +737,30 @@ marshal_measurements(MBuffer* mbuf, int stream, int seqno, double now)
   return 1;
 }
 
+/** Increment the number of values of the message being marshalled.
+ *
+ * \param mbuf MBuffer containing the message as its current message
+ * \param value_count number of values to add
+ * \see marshal_values, marshal_values_compact
+ */
+static void
+marshal_add_count (MBuffer* mbuf, int value_count)
+{
+  uint8_t* buf = mbuf_message (mbuf);
+  OmlBinMsgType type = marshal_get_msgtype (mbuf);
+  switch (type) {
+  case OMB_DATA_P:
+  case OMB_CDATA_P:
+  case OMB_BLOCK_P:
+  case OMB_DDATA_P:
+  case OMB_DICT_P: buf[5] += value_count; break;
+  case OMB_LDATA_P:
+  case OMB_LCDATA_P:
+  case OMB_LBLOCK_P:
+  case OMB_LDDATA_P: buf[7] += value_count; break;
+  }
+}
+
 /** Marshal the array of values into an MBuffer.
  *
  * Metadata of the measurement stream should already have been written
@@ -545,12 +795,7 @@ int marshal_values(MBuffer* mbuf, OmlValue* values, int value_count)
       return -1;
   }
 
-  uint8_t* buf = mbuf_message (mbuf);
-  OmlBinMsgType type = marshal_get_msgtype (mbuf);
-  switch (type) {
-  case OMB_DATA_P: buf[5] += value_count; break;
-  case OMB_LDATA_P: buf[7] += value_count; break;
-  }
+  marshal_add_count (mbuf, value_count);
   return 1;
 }
 
@@ -842,6 +1087,290 @@ marshal_value(MBuffer* mbuf, OmlValueT val_type, OmlValueU* val)
   return 1;
 }
 
+/** Encode a length or a value as an unsigned LEB128 varint.
+ *
+ * \param buf buffer to write into, of at least VARINT_MAX_SIZE bytes if v fits in 32 bits, VARINT64_MAX_SIZE otherwise
+ * \param v value to encode
+ * \return the number of bytes written
+ */
+static size_t
+varint_encode(uint8_t* buf, uint64_t v)
+{
+  size_t n = 0;
+
+  while (v >= 0x80) {
+    buf[n++] = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  buf[n++] = (uint8_t)v;
+
+  return n;
+}
+
+/** Write an array of fixed-width elements into an MBuffer, in little-endian order.
+ *
+ * On little-endian hosts, this is a single mbuf_write(); otherwise, elements
+ * are swapped VECTOR_CHUNK at a time.
+ *
+ * \param mbuf MBuffer to write to
+ * \param elts array of elements
+ * \param n number of elements
+ * \param elt_size size of the elements, 4 or 8
+ * \return 0 on success, -1 on failure (\see mbuf_write)
+ */
+static int
+mbuf_write_le(MBuffer* mbuf, const void* elts, size_t n, size_t elt_size)
+{
+#ifdef WORDS_BIGENDIAN
+  uint64_t chunk[VECTOR_CHUNK];
+  size_t i, j;
+
+  for (i = 0; i < n; i += j) {
+    for (j = 0; j < VECTOR_CHUNK && i + j < n; j++) {
+      if (elt_size == sizeof(uint32_t)) {
+        ((uint32_t*)chunk)[j] = htolel(((const uint32_t*)elts)[i + j]);
+      } else {
+        chunk[j] = htolell(((const uint64_t*)elts)[i + j]);
+      }
+    }
+    if (mbuf_write (mbuf, (uint8_t*)chunk, j * elt_size) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+#else
+  return mbuf_write (mbuf, (const uint8_t*)elts, n * elt_size);
+#endif
+}
+
+static int
+marshal_value_dict(MBuffer* mbuf, OmlValueT val_type, OmlValueU* val, OmlStringDict* dict);
+static size_t
+string_dict_encode(OmlStringDict* dict, uint8_t* buf, const char* str, size_t* len);
+
+/** Marshal the array of values into an MBuffer, without type information.
+ *
+ * This is the counterpart of marshal_values() for compact messages (\ref
+ * omspbincompact), which should have been started with marshal_init() with
+ * either OMB_CDATA_P or OMB_LCDATA_P. The values must be of the types declared
+ * in the schema of the stream, as the receiver relies on it to decode them.
+ *
+ * \param mbuf MBuffer to write marshalled data to
+ * \param values array of OmlValue of length value_count
+ * \param value_count length  the values array
+ * \return 1 on success, or -1 otherwise (marshalling should then restart from marshal_init())
+ * \see marshal_init, marshal_measurements, marshal_value_compact, marshal_finalize, unmarshal_values_compact
+ */
+int
+marshal_values_compact(MBuffer* mbuf, OmlValue* values, int value_count)
+{
+  OmlValue* val = values;
+  int i;
+
+  for (i = 0; i < value_count; i++, val++) {
+    if(!marshal_value_compact(mbuf, oml_value_get_type(val), oml_value_get_value(val)))
+      return -1;
+  }
+
+  marshal_add_count (mbuf, value_count);
+  return 1;
+}
+
+/** Marshal the array of values into an MBuffer, without type information,
+ * replacing strings by their identifier in a dictionary.
+ *
+ * This is the counterpart of marshal_values_compact() for OMB_DDATA_P and
+ * OMB_LDDATA_P messages (\ref omspbindict). Strings short enough are entered
+ * into the dictionary the first time they are seen, and only their identifier
+ * is sent afterwards. The definitions should then also be sent with
+ * marshal_dict(), to be replayed if the connection is reopened.
+ *
+ * If marshalling fails, the definitions of the strings of this message are
+ * lost, and the dictionary should be reset with string_dict_forget().
+ *
+ * \param mbuf MBuffer to write marshalled data to
+ * \param values array of OmlValue of length value_count
+ * \param value_count length  the values array
+ * \param dict OmlStringDict of the connection
+ * \return 1 on success, or -1 otherwise (marshalling should then restart from marshal_init())
+ * \see marshal_values_compact, marshal_dict, unmarshal_values_dict
+ */
+int
+marshal_values_dict(MBuffer* mbuf, OmlValue* values, int value_count, OmlStringDict* dict)
+{
+  OmlValue* val = values;
+  int i;
+
+  for (i = 0; i < value_count; i++, val++) {
+    if(!marshal_value_dict(mbuf, oml_value_get_type(val), oml_value_get_value(val), dict))
+      return -1;
+  }
+
+  marshal_add_count (mbuf, value_count);
+  return 1;
+}
+
+/** Marshal a single OmlValueU of type OmlValueT into mbuf, without type information.
+ *
+ * Usually called by marshal_values_compact(). On failure, the whole message
+ * writing is reset using mbuf_reset_write(), and marshalling should restart
+ * with marshal_init().
+ *
+ * \param mbuf MBuffer to write marshalled data to
+ * \param val_type OmlValueT representing the type of val
+ * \param val pointer to OmlValueU, of type val_type, to marshall
+ * \return 1 on success, or 0 otherwise (marshalling should then restart from marshal_init())
+ * \see marshal_values_compact, marshal_value, unmarshal_value_compact
+ */
+int
+marshal_value_compact(MBuffer* mbuf, OmlValueT val_type, OmlValueU* val)
+{
+  return marshal_value_dict(mbuf, val_type, val, NULL);
+}
+
+/** Marshal a single OmlValueU into mbuf, without type information, and
+ * possibly replacing strings by their identifier in a dictionary.
+ *
+ * \copydetails marshal_value_compact
+ * \param dict OmlStringDict to encode strings with (\ref omspbindict), or NULL
+ * \see marshal_value_compact, marshal_values_dict, string_dict_encode
+ */
+static int
+marshal_value_dict(MBuffer* mbuf, OmlValueT val_type, OmlValueU* val, OmlStringDict* dict)
+{
+  uint8_t buf[UINT64_T_SIZE]; /* Largest of fixed-width values and VARINT_MAX_SIZE */
+  size_t len = 0;
+  const void* data = NULL;
+  size_t data_len = 0;
+  size_t elt_size = 0;
+  uint32_t v32;
+  uint64_t v64;
+
+  switch (val_type) {
+  case OML_LONG_VALUE:
+    v32 = htolel((uint32_t)oml_value_clamp_long (omlc_get_long(*val)));
+    memcpy(buf, &v32, sizeof(v32));
+    len = sizeof(v32);
+    break;
+
+  case OML_INT32_VALUE:
+  case OML_UINT32_VALUE:
+    v32 = htolel(omlc_get_uint32(*val));
+    memcpy(buf, &v32, sizeof(v32));
+    len = sizeof(v32);
+    break;
+
+  case OML_INT64_VALUE:
+  case OML_UINT64_VALUE:
+  case OML_GUID_VALUE:
+    v64 = htolell(val_type == OML_GUID_VALUE ? omlc_get_guid(*val) : omlc_get_uint64(*val));
+    memcpy(buf, &v64, sizeof(v64));
+    len = sizeof(v64);
+    break;
+
+  case OML_DOUBLE_VALUE: {
+    double d = omlc_get_double(*val);
+    memcpy(&v64, &d, sizeof(v64));
+    v64 = htolell(v64);
+    memcpy(buf, &v64, sizeof(v64));
+    len = sizeof(v64);
+    break;
+  }
+
+  case OML_BOOL_VALUE:
+    buf[0] = omlc_get_bool(*val) ? 1 : 0;
+    len = 1;
+    break;
+
+  case OML_STRING_VALUE:
+    data = omlc_get_string_ptr(*val);
+    if (data == NULL) {
+      logdebug("Attempting to send a NULL string; sending empty string instead\n");
+      data = "";
+    }
+    data_len = strlen(data);
+    if (dict) {
+      len = string_dict_encode(dict, buf, data, &data_len);
+    } else {
+      len = varint_encode(buf, data_len);
+    }
+    break;
+
+  case OML_BLOB_VALUE:
+    data = omlc_get_blob_ptr(*val);
+    data_len = omlc_get_blob_length(*val);
+    if (data == NULL || data_len == 0) {
+      logdebug ("Attempting to send NULL or empty blob; blob of length 0 will be sent\n");
+      data_len = 0;
+    } else if (data_len > BLOB_T_MAX_SIZE) {
+      logerror("Blob of %zu bytes is too long to be marshalled\n", data_len);
+      mbuf_reset_write (mbuf);
+      return 0;
+    }
+    len = varint_encode(buf, data_len);
+    break;
+
+  case OML_VECTOR_INT32_VALUE:
+  case OML_VECTOR_UINT32_VALUE:
+  case OML_VECTOR_INT64_VALUE:
+  case OML_VECTOR_UINT64_VALUE:
+  case OML_VECTOR_DOUBLE_VALUE:
+  case OML_VECTOR_BOOL_VALUE:
+    data = omlc_get_vector_ptr(*val);
+    data_len = omlc_get_vector_nof_elts(*val);
+    if (data == NULL) {
+      data_len = 0;
+    }
+    elt_size = (val_type == OML_VECTOR_INT32_VALUE || val_type == OML_VECTOR_UINT32_VALUE) ?
+      sizeof(uint32_t) : sizeof(uint64_t);
+    len = varint_encode(buf, data_len);
+    break;
+
+  default:
+    logerror("%s(): Unsupported value type '%d'\n", __func__, val_type);
+    return 0;
+  }
+
+  if (mbuf_write (mbuf, buf, len) == -1) {
+    logerror("Failed to marshal compact %s (mbuf_write())\n", oml_type_to_s (val_type));
+    mbuf_reset_write (mbuf);
+    return 0;
+  }
+
+  if (data_len > 0) {
+    int result;
+
+    if (val_type == OML_VECTOR_BOOL_VALUE) {
+      uint8_t chunk[VECTOR_CHUNK];
+      size_t i, j;
+
+      result = 0;
+      for (i = 0; i < data_len && result == 0; i += j) {
+        for (j = 0; j < VECTOR_CHUNK && i + j < data_len; j++) {
+          chunk[j] = ((const bool*)data)[i + j] ? 1 : 0;
+        }
+        result = mbuf_write (mbuf, chunk, j);
+      }
+
+    } else if (omlc_is_vector_type (val_type)) {
+      result = mbuf_write_le (mbuf, data, data_len, elt_size);
+
+    } else {
+      result = mbuf_write (mbuf, data, data_len);
+    }
+
+    if (result == -1) {
+      logerror("Failed to marshal %zu elements of compact %s (mbuf_write())\n",
+          data_len, oml_type_to_s (val_type));
+      mbuf_reset_write (mbuf);
+      return 0;
+    }
+  }
+
+  logdebug3("Marshalled compact %s\n", oml_type_to_s (val_type));
+  return 1;
+}
+
 /** Finalise a marshalled message.
  *
  * Depending on the number of values packed, change the type of message, and
@@ -866,7 +1395,8 @@ marshal_finalize(MBuffer*  mbuf)
     len = UINT32_MAX;
   }
 
-  if (type == OMB_DATA_P && len > UINT16_MAX) {
+  if ((type == OMB_DATA_P || type == OMB_CDATA_P || type == OMB_BLOCK_P || type == OMB_DDATA_P) &&
+      len > UINT16_MAX) {
     /*
      * We assumed a short packet, but there is too much data, so we
      * have to shift the whole buffer down by 2 bytes and convert to a
@@ -875,20 +1405,31 @@ marshal_finalize(MBuffer*  mbuf)
     uint8_t s[2] = {0};
     /* Put some padding in the buffer to make sure it has room, and maintains its invariants */
     mbuf_write (mbuf, s, sizeof (s));
+    buf = mbuf_message (mbuf); /* mbuf_write() may have moved the buffer */
     memmove (&buf[PACKET_HEADER_SIZE+2], &buf[PACKET_HEADER_SIZE],
              len - PACKET_HEADER_SIZE);
     len += 2;
-    buf[2] = type = OMB_LDATA_P;
+    type = (type == OMB_DATA_P) ? OMB_LDATA_P :
+      (type == OMB_CDATA_P) ? OMB_LCDATA_P :
+      (type == OMB_DDATA_P) ? OMB_LDDATA_P : OMB_LBLOCK_P;
+    buf[2] = type;
   }
 
 
   switch (type) {
   case OMB_DATA_P:
+  case OMB_CDATA_P:
+  case OMB_BLOCK_P:
+  case OMB_DDATA_P:
+  case OMB_DICT_P:
     len -= PACKET_HEADER_SIZE; // Data length minus header
     uint16_t nlen16 = htons (len);
     memcpy (&buf[3], &nlen16, sizeof (nlen16));
     break;
   case OMB_LDATA_P:
+  case OMB_LCDATA_P:
+  case OMB_LBLOCK_P:
+  case OMB_LDDATA_P:
     len -= PACKET_HEADER_SIZE + 2; // Data length minus header
     uint32_t nlen32 = htonl (len); // pure data length
     memcpy (&buf[3], &nlen32, sizeof (nlen32));
@@ -937,7 +1478,8 @@ unmarshal_init(MBuffer* mbuf, OmlBinaryHeader* header)
 
   header->type = (OmlBinMsgType)header_str[2];
 
-  if (header->type == OMB_DATA_P) {
+  if (header->type == OMB_DATA_P || header->type == OMB_CDATA_P || header->type == OMB_BLOCK_P ||
+      header->type == OMB_DDATA_P || header->type == OMB_DICT_P) {
     // Read 2 more bytes of the length field
     uint16_t nv16 = 0;
     result = mbuf_read (mbuf, (uint8_t*)&nv16, sizeof (uint16_t));
@@ -947,7 +1489,8 @@ unmarshal_init(MBuffer* mbuf, OmlBinaryHeader* header)
       return n;
     }
     header->length = (int)ntohs (nv16);
-  } else if (header->type == OMB_LDATA_P) {
+  } else if (header->type == OMB_LDATA_P || header->type == OMB_LCDATA_P || header->type == OMB_LBLOCK_P ||
+      header->type == OMB_LDDATA_P) {
     // Read 4 more bytes of the length field
     uint32_t nv32 = 0;
     result = mbuf_read (mbuf, (uint8_t*)&nv32, sizeof (uint32_t));
@@ -978,6 +1521,21 @@ unmarshal_init(MBuffer* mbuf, OmlBinaryHeader* header)
   header->values = (int)stream_header_str[0];
   header->stream = (int)stream_header_str[1];
 
+  if (marshal_msgtype_is_compact (header->type)) {
+    uint32_t nseqno;
+    uint64_t nts;
+
+    if (mbuf_read (mbuf, (uint8_t*)&nseqno, sizeof (nseqno)) == -1 ||
+        mbuf_read (mbuf, (uint8_t*)&nts, sizeof (nts)) == -1) {
+      logerror("Error reading seq-no and timestamp from compact binary packet\n");
+      return 0;
+    }
+    header->seqno = (int32_t)letohl(nseqno);
+    nts = letohll(nts);
+    memcpy(&header->timestamp, &nts, sizeof (header->timestamp));
+    return 1;
+  }
+
   if (unmarshal_typed_value (mbuf, "seq-no", OML_INT32_VALUE, &seqno) == -1)
     return 0;
 
@@ -1001,24 +1559,18 @@ unmarshal_measurements( MBuffer* mbuf, OmlBinaryHeader* header, OmlValue* values
   return unmarshal_values(mbuf, header, values, max_value_count);
 }
 
-/** Unmarshals the content of buffer into an array of values of size
- * value_count.
+/** Check that the values of a message can be unmarshalled into an array.
  *
- * If the returned number is negative, there were more values than could fit in
- * the array in the buffer, and some were skipped.  This number (when
- * multiplied by -1) indicates  by how much the values array should be
- * extended. If the number is less than
- * -100, it indicates an error.
+ * If the array is too short, the message is skipped.
  *
  * \param mbuf MBuffer to read from
  * \param header pointer to an OmlBinaryHeader corresponding to this message
- * \param values array of OmlValue to be filled
- * \param max_value_count length of the array (XXX: Should be < 100, otherwise confusion may happen with error returns)
- * \return the number of values found (positive), or the number of values that didn't fit in the array (negative; multiplied by -1), <-100 in case of error
- * \see unmarshal_init
+ * \param max_value_count length of the array
+ * \return 0 if the values fit, or the return value of the unmarshalling function otherwise
+ * \see unmarshal_values, unmarshal_values_compact
  */
-int
-unmarshal_values(MBuffer* mbuf, OmlBinaryHeader* header, OmlValue* values, int max_value_count)
+static int
+unmarshal_check_count(MBuffer* mbuf, OmlBinaryHeader* header, int max_value_count)
 {
   int value_count = header->values;
 
@@ -1039,6 +1591,40 @@ unmarshal_values(MBuffer* mbuf, OmlBinaryHeader* header, OmlValue* values, int m
     return max_value_count - value_count;  // value array is too small
   }
 
+  return 0;
+}
+
+/** Unmarshals the content of buffer into an array of values of size
+ * value_count.
+ *
+ * If the returned number is negative, there were more values than could fit in
+ * the array in the buffer, and some were skipped.  This number (when
+ * multiplied by -1) indicates  by how much the values array should be
+ * extended. If the number is less than
+ * -100, it indicates an error.
+ *
+ * \param mbuf MBuffer to read from
+ * \param header pointer to an OmlBinaryHeader corresponding to this message
+ * \param values array of OmlValue to be filled
+ * \param max_value_count length of the array (XXX: Should be < 100, otherwise confusion may happen with error returns)
+ * \return the number of values found (positive), or the number of values that didn't fit in the array (negative; multiplied by -1), <-100 in case of error
+ * \see unmarshal_init
+ */
+int
+unmarshal_values(MBuffer* mbuf, OmlBinaryHeader* header, OmlValue* values, int max_value_count)
+{
+  int value_count = header->values;
+  int ret;
+
+  if (marshal_msgtype_is_compact (header->type)) {
+    logwarn("Compact measurement packets need a schema to be unmarshalled\n");
+    return -101;
+  }
+
+  if ((ret = unmarshal_check_count (mbuf, header, max_value_count))) {
+    return ret;
+  }
+
   int i;
   OmlValue* val = values;
   for (i = 0; i < value_count; i++) {
@@ -1305,23 +1891,334 @@ unmarshal_value(MBuffer *mbuf, OmlValue *value)
   return 1;
 }
 
-/** Unmarshals the next content of an MBuffer into an OmlValue with
- * type-checking.
+/** Read an unsigned LEB128 varint of up to 64 bits from an MBuffer.
  *
  * \param mbuf MBuffer to read from
- * \param type OmlValueT specifying the type to unmarshall
- * \param value pointer to OmlValue to unmarshall the read data into
- * \return 1 if successful, 0 otherwise (e.g., type mismatch)
+ * \param v pointer to the decoded value
+ * \return 0 on success, -1 if the buffer is too short or the varint too long
+ * \see unmarshal_varint
  */
-int
-unmarshal_typed_value (MBuffer* mbuf, const char* name, OmlValueT type, OmlValue* value)
+static int
+unmarshal_varint64(MBuffer* mbuf, uint64_t* v)
 {
-  if (unmarshal_value (mbuf, value) != 1) {
-      logerror("Error reading %s from binary packet\n", name);
-      return -1;
-  }
+  int i, byte;
 
-  if (oml_value_get_type(value) != type) {
+  *v = 0;
+  for (i = 0; i < VARINT64_MAX_SIZE; i++) {
+    if ((byte = mbuf_read_byte (mbuf)) == -1) {
+      return -1;
+    }
+    *v |= (uint64_t)(byte & 0x7f) << (7 * i);
+    if (!(byte & 0x80)) {
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+/** Read an unsigned LEB128 varint of up to 32 bits from an MBuffer.
+ *
+ * \param mbuf MBuffer to read from
+ * \param v pointer to the decoded value
+ * \return 0 on success, -1 if the buffer is too short or the value too large
+ * \see unmarshal_varint64
+ */
+static int
+unmarshal_varint(MBuffer* mbuf, uint32_t* v)
+{
+  uint64_t v64;
+
+  if (unmarshal_varint64 (mbuf, &v64) == -1 || v64 > UINT32_MAX) {
+    return -1;
+  }
+  *v = (uint32_t)v64;
+
+  return 0;
+}
+
+static int
+unmarshal_values_schema(MBuffer* mbuf, OmlBinaryHeader* header, const struct schema* schema,
+                        OmlStringDict* dict, OmlValue* values, int max_value_count);
+static int
+unmarshal_value_dict(MBuffer* mbuf, OmlValueT type, OmlValue* value, OmlStringDict* dict);
+static int
+string_dict_decode(OmlStringDict* dict, MBuffer* mbuf, const char** str, uint32_t* len);
+
+/** Unmarshals the content of a compact message into an array of values, using
+ * the types of a schema.
+ *
+ * This is the counterpart of unmarshal_values() for OMB_CDATA_P and
+ * OMB_LCDATA_P messages (\ref omspbincompact), whose values do not carry their
+ * types; the fields of the schema are used instead.
+ *
+ * \param mbuf MBuffer to read from
+ * \param header pointer to an OmlBinaryHeader corresponding to this message
+ * \param schema schema of the measurement stream of the message
+ * \param values array of OmlValue to be filled
+ * \param max_value_count length of the array
+ * \return the number of values found (positive), or the number of values that didn't fit in the array (negative; multiplied by -1), <-100 in case of error
+ * \see unmarshal_init, unmarshal_value_compact, marshal_values_compact
+ */
+int
+unmarshal_values_compact(MBuffer* mbuf, OmlBinaryHeader* header,
+                         const struct schema* schema, OmlValue* values, int max_value_count)
+{
+  if (marshal_msgtype_is_dict (header->type)) {
+    logwarn("Dictionary measurement packets need to be unmarshalled with unmarshal_values_dict()\n");
+    return -101;
+  }
+
+  return unmarshal_values_schema (mbuf, header, schema, NULL, values, max_value_count);
+}
+
+/** Unmarshals the content of a compact message into an array of values, using
+ * the types of a schema, and a dictionary of strings.
+ *
+ * This is the counterpart of unmarshal_values_compact() for OMB_DDATA_P and
+ * OMB_LDDATA_P messages (\ref omspbindict), whose strings can be identifiers
+ * of strings of the dictionary, or define them. OMB_CDATA_P and OMB_LCDATA_P
+ * messages are also accepted.
+ *
+ * \param mbuf MBuffer to read from
+ * \param header pointer to an OmlBinaryHeader corresponding to this message
+ * \param schema schema of the measurement stream of the message
+ * \param dict OmlStringDict of the connection, updated with the strings defined in the message
+ * \param values array of OmlValue to be filled
+ * \param max_value_count length of the array
+ * \return the number of values found (positive), or the number of values that didn't fit in the array (negative; multiplied by -1), <-100 in case of error
+ * \see unmarshal_values_compact, unmarshal_dict, marshal_values_dict
+ */
+int
+unmarshal_values_dict(MBuffer* mbuf, OmlBinaryHeader* header, const struct schema* schema,
+                      OmlStringDict* dict, OmlValue* values, int max_value_count)
+{
+  if (header->type == OMB_DICT_P || dict == NULL) {
+    logwarn("Dictionary definitions need to be unmarshalled with unmarshal_dict()\n");
+    return -101;
+  }
+
+  return unmarshal_values_schema (mbuf, header, schema, dict, values, max_value_count);
+}
+
+/** Unmarshals the content of a compact message into an array of values.
+ *
+ * \see unmarshal_values_compact, unmarshal_values_dict
+ */
+static int
+unmarshal_values_schema(MBuffer* mbuf, OmlBinaryHeader* header, const struct schema* schema,
+                        OmlStringDict* dict, OmlValue* values, int max_value_count)
+{
+  int value_count = header->values;
+  int i, ret;
+
+  if (marshal_msgtype_is_block (header->type)) {
+    logwarn("Block measurement packets need to be unmarshalled with unmarshal_block()\n");
+    return -101;
+  }
+
+  if ((ret = unmarshal_check_count (mbuf, header, max_value_count))) {
+    return ret;
+  }
+
+  if (value_count != schema->nfields) {
+    logwarn("Compact measurement packet contains %d values, but schema '%s' has %d fields\n",
+        value_count, schema->name, schema->nfields);
+    return -103;
+  }
+
+  for (i = 0; i < value_count; i++) {
+    if (unmarshal_value_dict(mbuf, schema->fields[i].type, &values[i], dict) == 0) {
+      logwarn("Could not unmarshal compact values %d of %d\n", i, value_count);
+      return -101;
+    }
+  }
+  return value_count;
+}
+
+/** Unmarshals the next content of an MBuffer into an OmlValue of a known type.
+ *
+ * As with unmarshal_value(), OML_LONG_VALUE are unmarshalled into
+ * OML_INT32_VALUE.
+ *
+ * \param mbuf MBuffer to read from
+ * \param type OmlValueT of the field being read
+ * \param value pointer to OmlValue to unmarshall the read data into
+ * \return 1 if successful, 0 otherwise
+ * \see unmarshal_values_compact, marshal_value_compact
+ */
+int
+unmarshal_value_compact(MBuffer* mbuf, OmlValueT type, OmlValue* value)
+{
+  return unmarshal_value_dict (mbuf, type, value, NULL);
+}
+
+/** Unmarshals the next content of an MBuffer into an OmlValue of a known
+ * type, possibly looking strings up in a dictionary.
+ *
+ * \copydetails unmarshal_value_compact
+ * \param dict OmlStringDict to decode strings with (\ref omspbindict), or NULL
+ * \see unmarshal_value_compact, unmarshal_values_dict, string_dict_decode
+ */
+static int
+unmarshal_value_dict(MBuffer* mbuf, OmlValueT type, OmlValue* value, OmlStringDict* dict)
+{
+  OmlValueU* v = oml_value_get_value(value);
+  uint32_t v32, n;
+  uint64_t v64;
+
+  switch (type) {
+  case OML_LONG_VALUE:
+  case OML_INT32_VALUE:
+  case OML_UINT32_VALUE:
+    if (mbuf_read (mbuf, (uint8_t*)&v32, sizeof (v32)) == -1) {
+      break;
+    }
+    v32 = letohl(v32);
+    if (type == OML_UINT32_VALUE) {
+      oml_value_set_type(value, OML_UINT32_VALUE);
+      omlc_set_uint32(*v, v32);
+    } else {
+      oml_value_set_type(value, OML_INT32_VALUE);
+      omlc_set_int32(*v, (int32_t)v32);
+    }
+    return 1;
+
+  case OML_INT64_VALUE:
+  case OML_UINT64_VALUE:
+  case OML_GUID_VALUE:
+  case OML_DOUBLE_VALUE:
+    if (mbuf_read (mbuf, (uint8_t*)&v64, sizeof (v64)) == -1) {
+      break;
+    }
+    v64 = letohll(v64);
+    oml_value_set_type(value, type);
+    if (type == OML_INT64_VALUE) {
+      omlc_set_int64(*v, (int64_t)v64);
+    } else if (type == OML_UINT64_VALUE) {
+      omlc_set_uint64(*v, v64);
+    } else if (type == OML_GUID_VALUE) {
+      omlc_set_guid(*v, v64);
+    } else {
+      double d;
+      memcpy(&d, &v64, sizeof (d));
+      omlc_set_double(*v, d);
+    }
+    return 1;
+
+  case OML_BOOL_VALUE: {
+    int byte = mbuf_read_byte (mbuf);
+    if (byte == -1) {
+      break;
+    }
+    oml_value_set_type(value, OML_BOOL_VALUE);
+    omlc_set_bool(*v, byte ? OMLC_BOOL_TRUE : OMLC_BOOL_FALSE);
+    return 1;
+  }
+
+  case OML_STRING_VALUE:
+  case OML_BLOB_VALUE: {
+    uint8_t* data;
+
+    if (dict && type == OML_STRING_VALUE) {
+      if (string_dict_decode (dict, mbuf, (const char**)&data, &n) == -1) {
+        break;
+      }
+    } else {
+      if (unmarshal_varint (mbuf, &n) == -1 || n > mbuf_rd_remaining (mbuf)) {
+        break;
+      }
+      data = mbuf_rdptr (mbuf);
+      mbuf_read_skip (mbuf, n);
+    }
+    oml_value_set_type(value, type);
+    if (type == OML_BLOB_VALUE) {
+      omlc_set_blob (*v, data, n);
+    } else {
+      omlc_set_string_copy (*v, data, n);
+    }
+    return 1;
+  }
+
+  case OML_VECTOR_INT32_VALUE:
+  case OML_VECTOR_UINT32_VALUE:
+  case OML_VECTOR_INT64_VALUE:
+  case OML_VECTOR_UINT64_VALUE:
+  case OML_VECTOR_DOUBLE_VALUE:
+  case OML_VECTOR_BOOL_VALUE: {
+    size_t i, elt_size, wire_size;
+    uint8_t* data;
+    void* elts;
+
+    switch (type) {
+    case OML_VECTOR_INT32_VALUE:
+    case OML_VECTOR_UINT32_VALUE: elt_size = wire_size = sizeof (uint32_t); break;
+    case OML_VECTOR_BOOL_VALUE: elt_size = sizeof (bool); wire_size = 1; break;
+    default: elt_size = wire_size = sizeof (uint64_t); break;
+    }
+
+    if (unmarshal_varint (mbuf, &n) == -1 || n > mbuf_rd_remaining (mbuf) / wire_size) {
+      break;
+    }
+    if (!(elts = oml_calloc (n ? n : 1, elt_size))) {
+      break;
+    }
+
+    data = mbuf_rdptr (mbuf);
+    if (type == OML_VECTOR_BOOL_VALUE) {
+      for (i = 0; i < n; i++) {
+        ((bool*)elts)[i] = data[i] ? true : false;
+      }
+    } else {
+      memcpy (elts, data, n * elt_size);
+#ifdef WORDS_BIGENDIAN
+      for (i = 0; i < n; i++) {
+        if (elt_size == sizeof (uint32_t)) {
+          ((uint32_t*)elts)[i] = letohl(((uint32_t*)elts)[i]);
+        } else {
+          ((uint64_t*)elts)[i] = letohll(((uint64_t*)elts)[i]);
+        }
+      }
+#endif
+    }
+    mbuf_read_skip (mbuf, n * wire_size);
+
+    oml_value_set_type(value, type);
+    omlc_reset_vector(*v);
+    omlc_set_vector_ptr(*v, elts);
+    omlc_set_vector_length(*v, n * elt_size);
+    omlc_set_vector_size(*v, (n ? n : 1) * elt_size);
+    omlc_set_vector_nof_elts(*v, n);
+    omlc_set_vector_elt_size(*v, elt_size);
+    return 1;
+  }
+
+  default:
+    logerror("%s(): Unsupported value type '%d'\n", __func__, type);
+    return 0;
+  }
+
+  logerror("Failed to unmarshal compact %s; not enough data?\n", oml_type_to_s (type));
+  return 0;
+}
+
+/** Unmarshals the next content of an MBuffer into an OmlValue with
+ * type-checking.
+ *
+ * \param mbuf MBuffer to read from
+ * \param type OmlValueT specifying the type to unmarshall
+ * \param value pointer to OmlValue to unmarshall the read data into
+ * \return 1 if successful, 0 otherwise (e.g., type mismatch)
+ */
+int
+unmarshal_typed_value (MBuffer* mbuf, const char* name, OmlValueT type, OmlValue* value)
+{
+  if (unmarshal_value (mbuf, value) != 1) {
+      logerror("Error reading %s from binary packet\n", name);
+      return -1;
+  }
+
+  if (oml_value_get_type(value) != type) {
       logerror("Expected type '%s' for %s, but got type '%s' instead\n",
              oml_type_to_s (type), name, oml_type_to_s (oml_value_get_type(value)));
       return -1;
@@ -1329,6 +2226,909 @@ unmarshal_typed_value (MBuffer* mbuf, const char* name, OmlValueT type, OmlValue
   return 0;
 }
 
+/** Bit-packing state for the columns of block messages.
+ *
+ * Bits are written most significant first, and complete bytes are buffered
+ * before being written into the MBuffer.
+ *
+ * \see bits_write, bits_flush, BitReader
+ */
+typedef struct {
+  MBuffer* mbuf;        /**< MBuffer to write the packed bytes into */
+  uint8_t buf[64];      /**< Bytes not written into mbuf yet */
+  size_t len;           /**< Number of complete bytes in buf */
+  int used;             /**< Number of bits already used in buf[len] */
+  int error;            /**< Set if writing into mbuf failed */
+} BitWriter;
+
+/** Bit-unpacking state for the columns of block messages.
+ * \see bits_read, BitWriter
+ */
+typedef struct {
+  MBuffer* mbuf;        /**< MBuffer to read the packed bytes from */
+  int byte;             /**< Byte being unpacked */
+  int left;             /**< Number of bits of byte not read yet */
+  int error;            /**< Set if reading from mbuf failed */
+} BitReader;
+
+/** Append the nbits least significant bits of a value to a bit-packed column.
+ *
+ * \param w BitWriter to write into
+ * \param v value to write
+ * \param nbits number of bits to write, from 1 to 64
+ * \see bits_flush
+ */
+static void
+bits_write(BitWriter* w, uint64_t v, int nbits)
+{
+  int take;
+
+  while (nbits > 0) {
+    take = (nbits < 8 - w->used) ? nbits : 8 - w->used;
+    if (w->used == 0) {
+      w->buf[w->len] = 0;
+    }
+    w->buf[w->len] |= (uint8_t)(((v >> (nbits - take)) & ((1U << take) - 1)) << (8 - w->used - take));
+    w->used += take;
+    nbits -= take;
+
+    if (w->used == 8) {
+      w->used = 0;
+      if (++w->len == sizeof (w->buf)) {
+        if (mbuf_write (w->mbuf, w->buf, w->len) == -1) {
+          w->error = 1;
+        }
+        w->len = 0;
+      }
+    }
+  }
+}
+
+/** Write out the end of a bit-packed column, padded with zeros to a whole byte.
+ *
+ * \param w BitWriter to flush
+ * \return 0 on success, -1 if any write into the MBuffer failed
+ * \see bits_write
+ */
+static int
+bits_flush(BitWriter* w)
+{
+  size_t len = w->len + (w->used > 0);
+
+  if (len > 0 && mbuf_write (w->mbuf, w->buf, len) == -1) {
+    w->error = 1;
+  }
+  w->len = 0;
+  w->used = 0;
+
+  return w->error ? -1 : 0;
+}
+
+/** Read the next bits of a bit-packed column.
+ *
+ * \param r BitReader to read from
+ * \param nbits number of bits to read, from 1 to 64
+ * \return the bits read, or 0 if the MBuffer is too short, in which case r->error is set
+ */
+static uint64_t
+bits_read(BitReader* r, int nbits)
+{
+  uint64_t v = 0;
+  int take;
+
+  while (nbits > 0) {
+    if (r->left == 0) {
+      if ((r->byte = mbuf_read_byte (r->mbuf)) == -1) {
+        r->error = 1;
+        return 0;
+      }
+      r->left = 8;
+    }
+    take = (nbits < r->left) ? nbits : r->left;
+    v = (v << take) | ((r->byte >> (r->left - take)) & ((1U << take) - 1));
+    r->left -= take;
+    nbits -= take;
+  }
+
+  return v;
+}
+
+/** Map signed integers to unsigned ones, so that small magnitudes give small values.
+ * \see zigzag_decode
+ */
+static inline uint64_t
+zigzag_encode(int64_t v)
+{
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+/** \see zigzag_encode */
+static inline int64_t
+zigzag_decode(uint64_t v)
+{
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/** Tell whether values of a type are delta-encoded as integers in block messages.
+ *
+ * \param type OmlValueT to test
+ * \return 1 if values of this type can be converted to and from 64-bit integers, 0 otherwise
+ * \see block_int_get, block_int_set
+ */
+static int
+block_is_int_type(OmlValueT type)
+{
+  switch (type) {
+  case OML_LONG_VALUE:
+  case OML_INT32_VALUE:
+  case OML_UINT32_VALUE:
+  case OML_INT64_VALUE:
+  case OML_UINT64_VALUE:
+  case OML_GUID_VALUE:
+  case OML_BOOL_VALUE:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/** Get an integer value as 64 bits, sign-extended as needed.
+ *
+ * \param type OmlValueT of the value, for which block_is_int_type() is true
+ * \param val pointer to the OmlValueU to convert
+ * \return the value, as a two's complement 64-bit integer
+ * \see block_int_set
+ */
+static uint64_t
+block_int_get(OmlValueT type, OmlValueU* val)
+{
+  switch (type) {
+  case OML_LONG_VALUE:   return (uint64_t)(int64_t)oml_value_clamp_long (omlc_get_long(*val));
+  case OML_INT32_VALUE:  return (uint64_t)(int64_t)omlc_get_int32(*val);
+  case OML_UINT32_VALUE: return omlc_get_uint32(*val);
+  case OML_INT64_VALUE:  return (uint64_t)omlc_get_int64(*val);
+  case OML_UINT64_VALUE: return omlc_get_uint64(*val);
+  case OML_GUID_VALUE:   return omlc_get_guid(*val);
+  case OML_BOOL_VALUE:   return omlc_get_bool(*val) ? 1 : 0;
+  default:               return 0;
+  }
+}
+
+/** Set an OmlValue from a 64-bit integer.
+ *
+ * As with unmarshal_value(), OML_LONG_VALUE are set as OML_INT32_VALUE.
+ *
+ * \param type OmlValueT of the value, for which block_is_int_type() is true
+ * \param value pointer to the OmlValue to set
+ * \param v value, as returned by block_int_get()
+ * \see block_int_get
+ */
+static void
+block_int_set(OmlValueT type, OmlValue* value, uint64_t v)
+{
+  OmlValueU* val = oml_value_get_value(value);
+
+  oml_value_set_type(value, (type == OML_LONG_VALUE) ? OML_INT32_VALUE : type);
+  switch (type) {
+  case OML_LONG_VALUE:
+  case OML_INT32_VALUE:  omlc_set_int32(*val, (int32_t)v); break;
+  case OML_UINT32_VALUE: omlc_set_uint32(*val, (uint32_t)v); break;
+  case OML_INT64_VALUE:  omlc_set_int64(*val, (int64_t)v); break;
+  case OML_UINT64_VALUE: omlc_set_uint64(*val, v); break;
+  case OML_GUID_VALUE:   omlc_set_guid(*val, v); break;
+  case OML_BOOL_VALUE:   omlc_set_bool(*val, (v != 0)); break;
+  default: break;
+  }
+}
+
+/** Marshal one column of a block of samples.
+ *
+ * \param mbuf MBuffer to write marshalled data to
+ * \param type OmlValueT of all the values of the column
+ * \param values first value of the column
+ * \param nrows number of values in the column
+ * \param stride distance between subsequent values of the column in the values array
+ * \return 0 on success, -1 on failure
+ * \see marshal_block, unmarshal_block_column
+ */
+static int
+marshal_block_column(MBuffer* mbuf, OmlValueT type, OmlValue* values, int nrows, int stride)
+{
+  uint8_t buf[VARINT64_MAX_SIZE];
+  BitWriter w;
+  uint64_t v, x, prev = 0;
+  int lead, trail, prev_lead = -1, prev_trail = 0;
+  int i;
+  double d;
+
+  if (block_is_int_type (type)) {
+    for (i = 0; i < nrows; i++, values += stride) {
+      v = block_int_get (type, oml_value_get_value(values));
+      if (mbuf_write (mbuf, buf, varint_encode (buf, zigzag_encode ((int64_t)(v - prev)))) == -1) {
+        return -1;
+      }
+      prev = v;
+    }
+    return 0;
+
+  } else if (type == OML_DOUBLE_VALUE) {
+    memset(&w, 0, sizeof(w));
+    w.mbuf = mbuf;
+    for (i = 0; i < nrows; i++, values += stride) {
+      d = omlc_get_double(*oml_value_get_value(values));
+      memcpy(&v, &d, sizeof(v));
+
+      if (i == 0) {
+        bits_write (&w, v, 64);
+
+      } else if (!(x = v ^ prev)) {
+        bits_write (&w, 0, 1);
+
+      } else {
+        lead = __builtin_clzll (x);
+        trail = __builtin_ctzll (x);
+        if (lead > 31) {
+          lead = 31;
+        }
+        if (prev_lead >= 0 && lead >= prev_lead && trail >= prev_trail) {
+          bits_write (&w, 0x2, 2);
+          bits_write (&w, x >> prev_trail, 64 - prev_lead - prev_trail);
+        } else {
+          bits_write (&w, 0x3, 2);
+          bits_write (&w, lead, 5);
+          bits_write (&w, 64 - lead - trail - 1, 6);
+          bits_write (&w, x >> trail, 64 - lead - trail);
+          prev_lead = lead;
+          prev_trail = trail;
+        }
+      }
+      prev = v;
+    }
+    return bits_flush (&w);
+  }
+
+  for (i = 0; i < nrows; i++, values += stride) {
+    if (!marshal_value_compact (mbuf, type, oml_value_get_value(values))) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/** Marshal a block of samples of the same stream into a single message.
+ *
+ * The message is started with marshal_init(), and finalised with
+ * marshal_finalize(), so it is complete when this function returns. Its
+ * OmlBinMsgType should be checked with marshal_get_msgtype() afterwards, as
+ * OMB_BLOCK_P messages are changed into OMB_LBLOCK_P when too long.
+ *
+ * Samples are encoded column by column, as described in \ref omspbinblock.
+ * All values of a column must have the same type, which should be that of
+ * the corresponding field in the schema of the stream.
+ *
+ * \param mbuf MBuffer to write the message to
+ * \param msgtype OmlBinMsgType of the message, OMB_BLOCK_P or OMB_LBLOCK_P
+ * \param stream Measurement Stream's index
+ * \param nrows number of samples, from 1 to OMB_BLOCK_MAX_ROWS
+ * \param seqnos array of the nrows sequence numbers of the samples
+ * \param timestamps array of the nrows timestamps of the samples
+ * \param values array of nrows * nfields OmlValue, sample after sample
+ * \param nfields number of values in each sample
+ * \return 1 on success, or -1 otherwise (the whole message is then reset)
+ * \see unmarshal_block, marshal_block_column
+ */
+int
+marshal_block(MBuffer* mbuf, OmlBinMsgType msgtype, int stream, int nrows,
+              const int32_t* seqnos, const double* timestamps, OmlValue* values, int nfields)
+{
+  uint8_t buf[VARINT64_MAX_SIZE];
+  BitWriter w;
+  OmlValueT type;
+  int64_t offset, prev_offset = 0, delta, prev_delta = 0;
+  uint64_t v;
+  int i, j;
+
+  if (!marshal_msgtype_is_block (msgtype) || nrows < 1 || nrows > OMB_BLOCK_MAX_ROWS || nfields < 0) {
+    logerror("Cannot marshal %d samples of %d values into a packet of type %d\n",
+        nrows, nfields, (int)msgtype);
+    return -1;
+  }
+
+  if (marshal_init (mbuf, msgtype) ||
+      marshal_measurements (mbuf, stream, seqnos[0], timestamps[0]) != 1) {
+    return -1;
+  }
+
+  if (mbuf_write (mbuf, buf, varint_encode (buf, nfields)) == -1) {
+    goto fail;
+  }
+
+  for (i = 1; i < nrows; i++) {
+    v = zigzag_encode ((int64_t)seqnos[i] - seqnos[i-1]);
+    if (mbuf_write (mbuf, buf, varint_encode (buf, v)) == -1) {
+      goto fail;
+    }
+  }
+
+  memset(&w, 0, sizeof(w));
+  w.mbuf = mbuf;
+  for (i = 1; i < nrows; i++) {
+    offset = llround ((timestamps[i] - timestamps[0]) * 1e6);
+    delta = offset - prev_offset;
+    v = zigzag_encode (delta - prev_delta);
+    prev_offset = offset;
+    prev_delta = delta;
+
+    if (v == 0) {
+      bits_write (&w, 0, 1);
+    } else if (v < (1 << 7)) {
+      bits_write (&w, 0x2, 2);
+      bits_write (&w, v, 7);
+    } else if (v < (1 << 9)) {
+      bits_write (&w, 0x6, 3);
+      bits_write (&w, v, 9);
+    } else if (v < (1 << 12)) {
+      bits_write (&w, 0xe, 4);
+      bits_write (&w, v, 12);
+    } else {
+      bits_write (&w, 0xf, 4);
+      bits_write (&w, v, 64);
+    }
+  }
+  if (bits_flush (&w)) {
+    goto fail;
+  }
+
+  for (j = 0; j < nfields; j++) {
+    type = oml_value_get_type(&values[j]);
+    for (i = 1; i < nrows; i++) {
+      if (oml_value_get_type(&values[i * nfields + j]) != type) {
+        logerror("Value %d of sample %d in block is a %s rather than a %s\n",
+            j, i, oml_type_to_s (oml_value_get_type(&values[i * nfields + j])), oml_type_to_s (type));
+        mbuf_reset_write (mbuf);
+        return -1;
+      }
+    }
+
+    if (marshal_block_column (mbuf, type, &values[j], nrows, nfields)) {
+      goto fail;
+    }
+  }
+
+  marshal_add_count (mbuf, nrows);
+  marshal_finalize (mbuf);
+
+  logdebug3("Marshalled block of %d samples for stream %d\n", nrows, stream);
+  return 1;
+
+fail:
+  logerror("Failed to marshal block of %d samples (mbuf_write())\n", nrows);
+  mbuf_reset_write (mbuf);
+  return -1;
+}
+
+/** Unmarshal one column of a block of samples.
+ *
+ * \param mbuf MBuffer to read from
+ * \param type OmlValueT of the field of the column
+ * \param values first value of the column
+ * \param nrows number of values in the column
+ * \param stride distance between subsequent values of the column in the values array
+ * \return 0 on success, -1 on failure
+ * \see unmarshal_block, marshal_block_column
+ */
+static int
+unmarshal_block_column(MBuffer* mbuf, OmlValueT type, OmlValue* values, int nrows, int stride)
+{
+  BitReader r;
+  uint64_t v, x, acc = 0;
+  int lead, nbits, prev_lead = -1, prev_trail = 0;
+  int i;
+  double d;
+
+  if (block_is_int_type (type)) {
+    for (i = 0; i < nrows; i++, values += stride) {
+      if (unmarshal_varint64 (mbuf, &v) == -1) {
+        return -1;
+      }
+      acc += (uint64_t)zigzag_decode (v);
+      block_int_set (type, values, acc);
+    }
+    return 0;
+
+  } else if (type == OML_DOUBLE_VALUE) {
+    memset(&r, 0, sizeof(r));
+    r.mbuf = mbuf;
+    for (i = 0; i < nrows && !r.error; i++, values += stride) {
+      if (i == 0) {
+        acc = bits_read (&r, 64);
+
+      } else if (bits_read (&r, 1)) {
+        if (!bits_read (&r, 1)) {
+          if (prev_lead < 0) {
+            return -1;
+          }
+          x = bits_read (&r, 64 - prev_lead - prev_trail) << prev_trail;
+        } else {
+          lead = (int)bits_read (&r, 5);
+          nbits = (int)bits_read (&r, 6) + 1;
+          if (lead + nbits > 64) {
+            return -1;
+          }
+          prev_lead = lead;
+          prev_trail = 64 - lead - nbits;
+          x = bits_read (&r, nbits) << prev_trail;
+        }
+        acc ^= x;
+      }
+
+      memcpy(&d, &acc, sizeof(d));
+      oml_value_set_type(values, OML_DOUBLE_VALUE);
+      omlc_set_double(*oml_value_get_value(values), d);
+    }
+    return r.error ? -1 : 0;
+  }
+
+  for (i = 0; i < nrows; i++, values += stride) {
+    if (!unmarshal_value_compact (mbuf, type, values)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/** Unmarshal the content of a block message into arrays of samples, using the
+ * types of a schema.
+ *
+ * This is the counterpart of marshal_block(), for OMB_BLOCK_P and
+ * OMB_LBLOCK_P messages (\ref omspbinblock), of which unmarshal_init() has
+ * read the header. The sequence number and timestamp of the first sample are
+ * those of the header; header->values is the number of samples.
+ *
+ * \param mbuf MBuffer to read from
+ * \param header pointer to an OmlBinaryHeader corresponding to this message
+ * \param schema schema of the measurement stream of the message
+ * \param seqnos array of at least header->values sequence numbers to be filled
+ * \param timestamps array of at least header->values timestamps to be filled
+ * \param values array of OmlValue to be filled with the samples, one after the other
+ * \param max_value_count length of the array, which must be at least header->values * schema->nfields
+ * \return the number of samples found (positive), or <-100 in case of error
+ * \see unmarshal_init, marshal_block
+ */
+int
+unmarshal_block(MBuffer* mbuf, OmlBinaryHeader* header, const struct schema* schema,
+                int32_t* seqnos, double* timestamps, OmlValue* values, int max_value_count)
+{
+  int nrows = header->values;
+  int64_t offset = 0, delta = 0;
+  uint64_t v;
+  uint32_t nfields;
+  BitReader r;
+  int i, j;
+
+  if (!marshal_msgtype_is_block (header->type)) {
+    logwarn("Packet of type %d does not contain a block of samples\n", (int)header->type);
+    return -101;
+  }
+
+  if (0 == nrows) {
+    logwarn("No sample to unmarshall\n");
+    return -102;
+  }
+
+  if (unmarshal_varint (mbuf, &nfields) == -1) {
+    logwarn("Could not unmarshal number of values in block\n");
+    return -101;
+  }
+
+  if ((int)nfields != schema->nfields) {
+    logwarn("Block contains samples of %d values, but schema '%s' has %d fields\n",
+        nfields, schema->name, schema->nfields);
+    return -103;
+  }
+
+  if (nrows * schema->nfields > max_value_count) {
+    logwarn("Block of %d samples of %d values too large for internal storage (max %d values)\n",
+        nrows, schema->nfields, max_value_count);
+    return -104;
+  }
+
+  seqnos[0] = header->seqno;
+  for (i = 1; i < nrows; i++) {
+    if (unmarshal_varint64 (mbuf, &v) == -1) {
+      logwarn("Could not unmarshal sequence number %d of %d in block\n", i, nrows);
+      return -101;
+    }
+    seqnos[i] = (int32_t)(seqnos[i-1] + zigzag_decode (v));
+  }
+
+  memset(&r, 0, sizeof(r));
+  r.mbuf = mbuf;
+  timestamps[0] = header->timestamp;
+  for (i = 1; i < nrows && !r.error; i++) {
+    if (!bits_read (&r, 1)) {
+      v = 0;
+    } else if (!bits_read (&r, 1)) {
+      v = bits_read (&r, 7);
+    } else if (!bits_read (&r, 1)) {
+      v = bits_read (&r, 9);
+    } else if (!bits_read (&r, 1)) {
+      v = bits_read (&r, 12);
+    } else {
+      v = bits_read (&r, 64);
+    }
+    delta += zigzag_decode (v);
+    offset += delta;
+    timestamps[i] = timestamps[0] + offset / 1e6;
+  }
+  if (r.error) {
+    logwarn("Could not unmarshal timestamps in block\n");
+    return -101;
+  }
+
+  for (j = 0; j < schema->nfields; j++) {
+    if (unmarshal_block_column (mbuf, schema->fields[j].type, &values[j], nrows, schema->nfields)) {
+      logwarn("Could not unmarshal values %d of %d in block\n", j, schema->nfields);
+      return -101;
+    }
+  }
+
+  return nrows;
+}
+
+/** Dictionary of the strings sent on a connection (\ref omspbindict).
+ *
+ * Both ends keep the strings by identifier. The sending end also indexes them
+ * in a hash table, to find the identifiers of the strings it has already sent.
+ *
+ * \see string_dict_new, marshal_values_dict, unmarshal_values_dict
+ */
+struct OmlStringDict {
+  /** Maximal number of identifiers */
+  int max_size;
+  /** Number of identifiers allocated by string_dict_encode(); they are never reused */
+  int size;
+  /** First identifier whose definition has not been marshalled by marshal_dict() yet */
+  int pending;
+  /** Number of elements of strings */
+  int capacity;
+  /** Nul-terminated strings by identifier, NULL if undefined or forgotten */
+  char** strings;
+  /** Open-addressing hash table of identifiers + 1, allocated by string_dict_encode() */
+  int* table;
+  /** Number of slots of table, a power of 2 */
+  int table_size;
+};
+
+/** Create an empty dictionary of strings.
+ *
+ * \param max_size maximal number of strings, up to OMB_DICT_MAX_SIZE (which is also used if max_size is not positive)
+ * \return a new OmlStringDict, to be freed with string_dict_destroy(), or NULL on error
+ * \see string_dict_destroy
+ */
+OmlStringDict*
+string_dict_new(int max_size)
+{
+  OmlStringDict* dict;
+
+  if (max_size <= 0 || max_size > OMB_DICT_MAX_SIZE) {
+    max_size = OMB_DICT_MAX_SIZE;
+  }
+
+  if (!(dict = oml_malloc (sizeof (OmlStringDict)))) {
+    logerror("Could not allocate string dictionary\n");
+    return NULL;
+  }
+  memset(dict, 0, sizeof (OmlStringDict));
+  dict->max_size = max_size;
+
+  return dict;
+}
+
+/** Forget all the strings of a dictionary.
+ *
+ * This is needed on the sending end when messages defining strings may not
+ * reach the other end, e.g., when they are dropped, so that the strings are
+ * defined again. Their new identifiers are different from the old ones, so
+ * messages already marshalled still refer to the right strings.
+ *
+ * \param dict OmlStringDict to empty
+ * \see string_dict_encode
+ */
+void
+string_dict_forget(OmlStringDict* dict)
+{
+  int i;
+
+  for (i = 0; i < dict->capacity; i++) {
+    if (dict->strings[i]) {
+      oml_free (dict->strings[i]);
+      dict->strings[i] = NULL;
+    }
+  }
+  if (dict->table) {
+    memset(dict->table, 0, dict->table_size * sizeof (int));
+  }
+  dict->pending = dict->size;
+}
+
+/** Free a dictionary of strings.
+ *
+ * \param dict OmlStringDict to free
+ * \see string_dict_new
+ */
+void
+string_dict_destroy(OmlStringDict* dict)
+{
+  if (!dict) {
+    return;
+  }
+
+  string_dict_forget (dict);
+  oml_free (dict->strings);
+  oml_free (dict->table);
+  oml_free (dict);
+}
+
+/** Hash a string with 32-bit FNV-1a.
+ *
+ * \param str string to hash
+ * \param len length of str
+ * \return the hash of str
+ */
+static uint32_t
+string_dict_hash(const char* str, size_t len)
+{
+  uint32_t h = 2166136261U;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h ^= (uint8_t)str[i];
+    h *= 16777619U;
+  }
+
+  return h;
+}
+
+/** Define the string of an identifier of a dictionary.
+ *
+ * \param dict OmlStringDict to update
+ * \param id identifier of the string
+ * \param str string, not necessarily nul-terminated
+ * \param len length of str
+ * \return 0 on success, -1 if id is out of bounds or on allocation failure
+ */
+static int
+string_dict_set(OmlStringDict* dict, uint32_t id, const char* str, size_t len)
+{
+  char** strings;
+  int capacity;
+
+  if (id >= (uint32_t)dict->max_size) {
+    logwarn("String identifier %" PRIu32 " beyond dictionary size %d\n", id, dict->max_size);
+    return -1;
+  }
+
+  if ((int)id >= dict->capacity) {
+    for (capacity = dict->capacity ? dict->capacity : 16; capacity <= (int)id; capacity *= 2);
+    if (capacity > dict->max_size) {
+      capacity = dict->max_size;
+    }
+    if (!(strings = oml_realloc (dict->strings, capacity * sizeof (char*)))) {
+      logerror("Could not allocate dictionary of %d strings\n", capacity);
+      return -1;
+    }
+    memset(&strings[dict->capacity], 0, (capacity - dict->capacity) * sizeof (char*));
+    dict->strings = strings;
+    dict->capacity = capacity;
+  }
+
+  if (dict->strings[id]) {
+    if (!strncmp (dict->strings[id], str, len) && dict->strings[id][len] == '\0') {
+      return 0;
+    }
+    oml_free (dict->strings[id]);
+  }
+
+  return (dict->strings[id] = oml_strndup (str, len)) ? 0 : -1;
+}
+
+/** Encode the prefix of a string of an OMB_DDATA_P or OMB_LDDATA_P message.
+ *
+ * The string is looked up in the dictionary, and entered into it if it is
+ * short enough and there is room left.
+ *
+ * \param dict OmlStringDict to look the string up in
+ * \param buf buffer of at least 8 bytes to encode the prefix into
+ * \param str string to encode
+ * \param len pointer to the length of str, set to the number of bytes of str to send after the prefix
+ * \return the length of the prefix
+ * \see string_dict_decode, marshal_values_dict
+ */
+static size_t
+string_dict_encode(OmlStringDict* dict, uint8_t* buf, const char* str, size_t* len)
+{
+  uint32_t mask, slot;
+  size_t n;
+  int id;
+
+  if (*len == 0 || *len > OMB_DICT_MAX_LENGTH) {
+    return varint_encode (buf, (uint64_t)*len << 1);
+  }
+
+  if (!dict->table) {
+    for (dict->table_size = 16; dict->table_size < 2 * dict->max_size; dict->table_size *= 2);
+    if (!(dict->table = oml_calloc (dict->table_size, sizeof (int)))) {
+      dict->table_size = 0;
+      return varint_encode (buf, (uint64_t)*len << 1);
+    }
+  }
+
+  mask = dict->table_size - 1;
+  for (slot = string_dict_hash (str, *len) & mask; dict->table[slot]; slot = (slot + 1) & mask) {
+    id = dict->table[slot] - 1;
+    if (!strncmp (dict->strings[id], str, *len) && dict->strings[id][*len] == '\0') {
+      *len = 0;
+      return varint_encode (buf, ((uint64_t)id << 2) | 1);
+    }
+  }
+
+  if (dict->size >= dict->max_size || string_dict_set (dict, dict->size, str, *len)) {
+    return varint_encode (buf, (uint64_t)*len << 1);
+  }
+  id = dict->size++;
+  dict->table[slot] = id + 1;
+
+  n = varint_encode (buf, ((uint64_t)id << 2) | 3);
+  return n + varint_encode (buf + n, *len);
+}
+
+/** Decode a string of an OMB_DDATA_P or OMB_LDDATA_P message.
+ *
+ * Strings defined in the message are entered into the dictionary.
+ *
+ * \param dict OmlStringDict to look the string up in
+ * \param mbuf MBuffer to read from
+ * \param str pointer set to the string, in mbuf or dict, and not necessarily nul-terminated
+ * \param len pointer set to the length of the string
+ * \return 0 on success, -1 on error or if the string is not in the dictionary
+ * \see string_dict_encode, unmarshal_values_dict
+ */
+static int
+string_dict_decode(OmlStringDict* dict, MBuffer* mbuf, const char** str, uint32_t* len)
+{
+  uint64_t code;
+  uint32_t id, n;
+  const char* data;
+
+  if (unmarshal_varint64 (mbuf, &code) == -1) {
+    return -1;
+  }
+
+  if (!(code & 1)) {
+    if ((code >> 1) > (uint64_t)mbuf_rd_remaining (mbuf)) {
+      return -1;
+    }
+    *len = (uint32_t)(code >> 1);
+    *str = (const char*)mbuf_rdptr (mbuf);
+    mbuf_read_skip (mbuf, *len);
+    return 0;
+  }
+
+  if ((code >> 2) >= (uint64_t)dict->max_size) {
+    logwarn("String identifier %" PRIu64 " beyond dictionary size %d\n", code >> 2, dict->max_size);
+    return -1;
+  }
+  id = (uint32_t)(code >> 2);
+
+  if (code & 2) {
+    if (unmarshal_varint (mbuf, &n) == -1 || n > mbuf_rd_remaining (mbuf) || n > OMB_DICT_MAX_LENGTH) {
+      return -1;
+    }
+    data = (const char*)mbuf_rdptr (mbuf);
+    mbuf_read_skip (mbuf, n);
+    if (string_dict_set (dict, id, data, n)) {
+      return -1;
+    }
+
+  } else if ((int)id >= dict->capacity || !dict->strings[id]) {
+    logwarn("Unknown string %" PRIu32 " in dictionary\n", id);
+    return -1;
+  }
+
+  *str = dict->strings[id];
+  *len = strlen (*str);
+  return 0;
+}
+
+/** Marshal the definitions of the strings entered into a dictionary since the last call.
+ *
+ * The strings are written in one or more OMB_DICT_P messages (\ref
+ * omspbindict), starting at the write pointer of mbuf. As OMB_DDATA_P messages
+ * define their new strings themselves, these messages are not meant to be sent
+ * with the data, but to be replayed with the protocol headers when the
+ * connection is reopened, so the other end knows the strings referred to by
+ * the messages which have not been sent yet.
+ *
+ * \param mbuf MBuffer to write marshalled data to
+ * \param dict OmlStringDict whose new strings to marshal
+ * \return the number of strings defined, or -1 on error
+ * \see marshal_values_dict, unmarshal_dict
+ */
+int
+marshal_dict(MBuffer* mbuf, OmlStringDict* dict)
+{
+  uint8_t buf[2 * VARINT_MAX_SIZE];
+  int id, count = 0, n = 0;
+  size_t len, l;
+
+  for (id = dict->pending; id < dict->size; id++) {
+    if (!dict->strings[id]) {
+      continue;
+    }
+
+    if (0 == n && (marshal_init (mbuf, OMB_DICT_P) == -1 ||
+          marshal_measurements (mbuf, 0, 0, 0.) == -1)) {
+      return -1;
+    }
+
+    len = strlen (dict->strings[id]);
+    l = varint_encode (buf, (uint64_t)id);
+    l += varint_encode (buf + l, len);
+    if (mbuf_write (mbuf, buf, l) == -1 ||
+        mbuf_write (mbuf, (uint8_t*)dict->strings[id], len) == -1) {
+      logerror("Failed to marshal string %d of dictionary (mbuf_write())\n", id);
+      mbuf_reset_write (mbuf);
+      return -1;
+    }
+    marshal_add_count (mbuf, 1);
+    count++;
+
+    if (++n == UINT8_MAX) {
+      marshal_finalize (mbuf);
+      n = 0;
+    }
+  }
+  if (n > 0) {
+    marshal_finalize (mbuf);
+  }
+  dict->pending = dict->size;
+
+  return count;
+}
+
+/** Unmarshal the definitions of an OMB_DICT_P message into a dictionary.
+ *
+ * \param mbuf MBuffer to read from
+ * \param header pointer to an OmlBinaryHeader corresponding to this message
+ * \param dict OmlStringDict to update
+ * \return the number of strings defined, or <-100 in case of error
+ * \see unmarshal_init, marshal_dict
+ */
+int
+unmarshal_dict(MBuffer* mbuf, OmlBinaryHeader* header, OmlStringDict* dict)
+{
+  uint32_t id, n;
+  int i;
+
+  if (header->type != OMB_DICT_P) {
+    logwarn("Packet of type %d does not define strings\n", (int)header->type);
+    return -101;
+  }
+
+  for (i = 0; i < header->values; i++) {
+    if (unmarshal_varint (mbuf, &id) == -1 || unmarshal_varint (mbuf, &n) == -1 ||
+        n > mbuf_rd_remaining (mbuf) || n > OMB_DICT_MAX_LENGTH ||
+        string_dict_set (dict, id, (const char*)mbuf_rdptr (mbuf), n)) {
+      logwarn("Could not unmarshal string %d of %d of dictionary\n", i, header->values);
+      return -101;
+    }
+    mbuf_read_skip (mbuf, n);
+  }
+
+  return header->values;
+}
+
 /*
  Local Variables:
  mode: C
@@ -24,18 +24,50 @@
 #define MARSHAL_H_
 
 #include <stdint.h>
+#include <sys/types.h>
 
 #include "oml2/omlc.h"
 #include "mbuf.h"
+#include "schema.h"
 
-/** Represent whether a marshalled packet is short or long */
+/** First protocol version in which OMB_CDATA_P and OMB_LCDATA_P packets can be sent */
+#define OMB_COMPACT_PROTOCOL_VERSION 6
+/** First protocol version in which OMB_BLOCK_P and OMB_LBLOCK_P packets can be sent */
+#define OMB_BLOCK_PROTOCOL_VERSION 7
+/** Maximal number of samples in an OMB_BLOCK_P or OMB_LBLOCK_P packet */
+#define OMB_BLOCK_MAX_ROWS 255
+/** First protocol version in which OMB_DDATA_P, OMB_LDDATA_P and OMB_DICT_P packets can be sent */
+#define OMB_DICT_PROTOCOL_VERSION 8
+/** Maximal number of strings in the dictionary of a connection */
+#define OMB_DICT_MAX_SIZE 4096
+/** Maximal length of the strings entered in the dictionary of a connection */
+#define OMB_DICT_MAX_LENGTH 64
+
+/** Represent whether a marshalled packet is short or long, and how its values are encoded */
 typedef enum {
   /** Short packet of size \ref PACKET_HEADER_SIZE bytes */
   OMB_DATA_P = 0x1,
   /** Long packet of size \ref PACKET_HEADER_SIZE + \ref STREAM_HEADER_SIZE bytes */
   OMB_LDATA_P = 0x2,
+  /** Short packet with untagged values laid out according to the schema (OMSPv6) */
+  OMB_CDATA_P = 0x3,
+  /** Long packet with untagged values laid out according to the schema (OMSPv6) */
+  OMB_LCDATA_P = 0x4,
+  /** Short packet with a block of samples encoded column by column (OMSPv7) */
+  OMB_BLOCK_P = 0x5,
+  /** Long packet with a block of samples encoded column by column (OMSPv7) */
+  OMB_LBLOCK_P = 0x6,
+  /** Short packet with compact values, whose strings can refer to the connection's dictionary (OMSPv8) */
+  OMB_DDATA_P = 0x7,
+  /** Long packet with compact values, whose strings can refer to the connection's dictionary (OMSPv8) */
+  OMB_LDDATA_P = 0x8,
+  /** Short packet defining strings of the connection's dictionary (OMSPv8) */
+  OMB_DICT_P = 0x9,
 } OmlBinMsgType;
 
+/** Dictionary of the strings sent on a connection (\ref omspbindict) */
+typedef struct OmlStringDict OmlStringDict;
+
 
 typedef struct {
     OmlBinMsgType type;
@@ -50,8 +82,17 @@ int marshal_measurements(MBuffer* mbuf, int stream, int seqno, double now);
 int marshal_init(MBuffer* mbuf, OmlBinMsgType msgtype);
 int marshal_values(MBuffer* mbuffer, OmlValue* values, int value_count);
 int marshal_value(MBuffer* mbuf, OmlValueT val_type,  OmlValueU* val);
+int marshal_values_compact(MBuffer* mbuf, OmlValue* values, int value_count);
+int marshal_value_compact(MBuffer* mbuf, OmlValueT val_type, OmlValueU* val);
 int marshal_finalize(MBuffer*  mbuf);
 OmlBinMsgType marshal_get_msgtype (MBuffer *mbuf);
+int marshal_msgtype_is_compact (OmlBinMsgType msgtype);
+int marshal_msgtype_is_block (OmlBinMsgType msgtype);
+int marshal_msgtype_is_dict (OmlBinMsgType msgtype);
+int marshal_block(MBuffer* mbuf, OmlBinMsgType msgtype, int stream, int nrows,
+                  const int32_t* seqnos, const double* timestamps, OmlValue* values, int nfields);
+int marshal_values_dict(MBuffer* mbuf, OmlValue* values, int value_count, OmlStringDict* dict);
+int marshal_dict(MBuffer* mbuf, OmlStringDict* dict);
 
 
 int unmarshal_init(MBuffer*  mbuf, OmlBinaryHeader* header);
@@ -60,9 +101,22 @@ int unmarshal_measurements(MBuffer* mbuf, OmlBinaryHeader* header,
 int unmarshal_values(MBuffer*  mbuffer, OmlBinaryHeader* header,
                       OmlValue* values, int max_value_count);
 int unmarshal_value(MBuffer* mbuffer, OmlValue* value);
+int unmarshal_values_compact(MBuffer* mbuf, OmlBinaryHeader* header,
+                              const struct schema* schema, OmlValue* values, int max_value_count);
+int unmarshal_value_compact(MBuffer* mbuf, OmlValueT type, OmlValue* value);
 int unmarshal_typed_value (MBuffer* mbuf, const char* name, OmlValueT type, OmlValue* value);
+int unmarshal_block(MBuffer* mbuf, OmlBinaryHeader* header, const struct schema* schema,
+                    int32_t* seqnos, double* timestamps, OmlValue* values, int max_value_count);
+int unmarshal_values_dict(MBuffer* mbuf, OmlBinaryHeader* header, const struct schema* schema,
+                          OmlStringDict* dict, OmlValue* values, int max_value_count);
+int unmarshal_dict(MBuffer* mbuf, OmlBinaryHeader* header, OmlStringDict* dict);
+
+OmlStringDict* string_dict_new(int max_size);
+void string_dict_forget(OmlStringDict* dict);
+void string_dict_destroy(OmlStringDict* dict);
 
 uint8_t* find_sync (const uint8_t* buf, int len);
+ssize_t marshal_get_message_length (const uint8_t* buf, size_t len);
 
 #endif /*MARSHAL_H_*/
 
@@ -184,16 +184,14 @@ mbuf_rd_remaining (MBuffer* mbuf)
 }
 
 /** Get the remaining amount of data to write in MBuffer
- *
- * XXX: Shall we use wr_remaining directly?
  *
  * \param mbuf MBuffer to manipulate
- * \return the number of unread bytes in the buffer
+ * \return the number of bytes which can be written before the buffer needs resizing
  */
 size_t
 mbuf_wr_remaining (MBuffer* mbuf)
 {
-  return mbuf->wrptr - mbuf->rdptr;
+  return mbuf->wr_remaining;
 }
 
 
@@ -438,6 +436,37 @@ mbuf_write (MBuffer* mbuf, const uint8_t* buf, size_t len)
   return 0;
 }
 
+/** Account for data written directly into an MBuffer.
+ *
+ * This allows to fill the buffer without an intermediate copy, e.g., by
+ * passing mbuf_wrptr() to read(2), after having reserved enough space with
+ * mbuf_check_resize().  The write pointer is advanced by len bytes, which
+ * then become available for reading.
+ *
+ * \param mbuf MBuffer to manipulate
+ * \param len amount of data written at the write pointer
+ * \return 0 on success, or -1 if len is larger than the space left
+ * \see mbuf_wrptr, mbuf_wr_remaining, mbuf_check_resize
+ */
+int
+mbuf_write_advance (MBuffer* mbuf, size_t len)
+{
+  if (mbuf == NULL) return -1;
+
+  mbuf_check_invariant (mbuf);
+
+  if (mbuf->wr_remaining < len) return -1;
+
+  mbuf->wrptr += len;
+  mbuf->fill += len;
+  mbuf->wr_remaining -= len;
+  mbuf->rd_remaining += len;
+
+  mbuf_check_invariant (mbuf);
+
+  return 0;
+}
+
 /**  Append the printed string described by format to the MBuffer.
  *
  * Write the string described by a format string and arguments to the MBuffer,
@@ -85,6 +85,7 @@ int mbuf_check_resize (MBuffer* mbuf, size_t bytes);
 int mbuf_begin_write (MBuffer* mbuf);
 int mbuf_reset_write (MBuffer* mbuf);
 int mbuf_write (MBuffer* mbuf, const uint8_t* buf, size_t len);
+int mbuf_write_advance (MBuffer* mbuf, size_t len);
 int mbuf_print(MBuffer* mbuf, const char* format, ...);
 
 int mbuf_begin_read (MBuffer* mbuf);
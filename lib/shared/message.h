@@ -21,17 +21,20 @@
 
 enum MessageType {
   MSG_BINARY,
-  MSG_TEXT
+  MSG_TEXT,
+  MSG_BINARY_COMPACT,
+  MSG_BINARY_BLOCK,
+  MSG_BINARY_DICT
 };
 
 struct oml_message {
   int stream;       // The stream this message belongs to.
   uint32_t seqno;   // Sequence number of this message.
   double timestamp; // Relative time stamp of this message.
-  enum MessageType type; // Type of message (text/binary)
+  enum MessageType type; // Type of message (text/binary/compact binary/block/dictionary)
   uint32_t length;  // Length in octets of this message/line
   int count;        // Expected/actual count of fields in the measurement
-                    // (not including protocol metadata)
+                    // (not including protocol metadata), or of samples in a block
 };
 
 typedef int (*msg_start_fn) (struct oml_message *msg, MBuffer *mbuf);
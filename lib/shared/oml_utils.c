@@ -28,7 +28,7 @@
 /** Regular expression for URI parsing.
  *  Adapted from RFC 3986, Appendix B to allow missing '//' before the authority, separate port and host,
  *  allow bracketted IPs, and be more specific on schemes */
-#define URI_RE "^(((tcp|(flush)?file)):)?((//)?(([a-zA-Z0-9][-0-9A-Za-z+.]+|\\[[0-9a-fA-F:.]+])(:([0-9]+))?))?([^?#]*)(\\?([^#]*))?(#(.*))?"
+#define URI_RE "^(((zlib\\+tcp|tcp|udp|(flush)?file)):)?((//)?(([a-zA-Z0-9][-0-9A-Za-z+.]+|\\[[0-9a-fA-F:.]+])(:([0-9]+))?))?([^?#]*)(\\?([^#]*))?(#(.*))?"
 /*               123     4               56    78                                              9 a            b       c   d        e f
  *                `scheme                      |`host                                            `port        `path       `query     `fragment
  *                                             `authority
@@ -171,6 +171,9 @@ OmlURIType oml_uri_type(const char* uri) {
   } else if(URI_MATCH(uri, "tcp")) { /* len == 3 */
     ret = OML_URI_TCP;
 
+  } else if(URI_MATCH(uri, "zlib+tcp")) {
+    ret = OML_URI_ZLIB_TCP;
+
   } else if(URI_MATCH(uri, "udp")) {
     ret = OML_URI_UDP;
   }
@@ -191,7 +194,7 @@ inline int oml_uri_is_file(OmlURIType t) {
 
 /** Test OmlURIType as a network URI
  * \param t OmlURIType
- * \return 1 if t is a network type (tcp or udp schemes), 0 otherwise
+ * \return 1 if t is a network type (tcp, zlib+tcp or udp schemes), 0 otherwise
  * \see oml_uri_type
  */
 inline int oml_uri_is_network(OmlURIType t) {
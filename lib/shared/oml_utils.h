@@ -37,6 +37,7 @@ typedef enum {
   OML_URI_FILE = 0,
   OML_URI_FILE_FLUSH,
   OML_URI_TCP,
+  OML_URI_ZLIB_TCP,
   OML_URI_UDP,
 } OmlURIType;
 
@@ -130,7 +130,9 @@ oml_value_set_type(OmlValue* v, OmlValueT type)
  * large enough to fit; otherwise the block is freed and a new one allocated
  * large enough to hold the string (and its terminator).
  *
- * Blobs are handled in a similar fashion.
+ * Blobs and vectors are handled in a similar fashion, except when their data
+ * has been lent by the application, in which case to shares the reference
+ * held by value instead of copying the data.
  *
  * If the source pointer is NULL then an error is returned and a warning
  * message is sent to the log.
@@ -139,7 +141,7 @@ oml_value_set_type(OmlValue* v, OmlValueT type)
  * \param value pointer to original OmlValueU to copy into to
  * \param type OmlValueT of value
  * \return 0 if successful, -1 otherwise
- * \see oml_value_init, omlc_copy_string, omlc_copy_blob
+ * \see oml_value_init, omlc_copy_string, omlc_copy_blob, omlc_set_blob_borrowed
  */
 int
 oml_value_set(OmlValue *to, const OmlValueU *value, OmlValueT type)
@@ -151,20 +153,29 @@ oml_value_set(OmlValue *to, const OmlValueU *value, OmlValueT type)
     to->value = *value;
   } else {
     switch (type) {
-    case OML_STRING_VALUE:
-      if (!omlc_get_string_ptr(*value)) {
+    case OML_STRING_VALUE: {
+      const char* str = omlc_get_string_ptr(*value);
+      if (!str) {
         logwarn("Trying to copy OML_STRING_VALUE from a NULL source\n");
         return -1;
       }
-      omlc_copy_string(*oml_value_get_value(to), *value);
+      omlc_set_string_copy(*oml_value_get_value(to), str, omlc_get_string_length(*value));
       break;
+    }
 
     case OML_BLOB_VALUE:
       if (!omlc_get_blob_ptr(*value)) {
         logwarn("Trying to copy OML_BLOB_VALUE from a NULL source\n");
         return -1;
       }
-      omlc_copy_blob(*oml_value_get_value(to), *value);
+      if (omlc_get_blob_ref(*value)) {
+        /* Share lent data rather than copying it */
+        oml_value_ref_acquire(omlc_get_blob_ref(*value));
+        omlc_reset_blob(*oml_value_get_value(to));
+        to->value = *value;
+      } else {
+        omlc_copy_blob(*oml_value_get_value(to), *value);
+      }
       break;
 
     case OML_VECTOR_DOUBLE_VALUE:
@@ -177,7 +188,13 @@ oml_value_set(OmlValue *to, const OmlValueU *value, OmlValueT type)
         logwarn("Trying to copy OML_VECTOR_*_VALUE from a NULL source\n");
         return -1;
       }
-      omlc_copy_vector(*oml_value_get_value(to), *value);
+      if (omlc_get_vector_ref(*value)) {
+        oml_value_ref_acquire(omlc_get_vector_ref(*value));
+        omlc_reset_vector(*oml_value_get_value(to));
+        to->value = *value;
+      } else {
+        omlc_copy_vector(*oml_value_get_value(to), *value);
+      }
       break;
 
   default:
@@ -188,6 +205,201 @@ oml_value_set(OmlValue *to, const OmlValueU *value, OmlValueT type)
   return 0;
 }
 
+/** Make an OmlValue a shallow view of an OmlValueU of the given OmlValueT.
+ *
+ * Unlike oml_value_set, the contents of strings, blobs and vectors are not
+ * copied: the view refers to the storage of value, which it never frees, and
+ * which must therefore outlive it. Strings stored inline in value are copied
+ * along, as they are part of the OmlValueU.
+ *
+ * This is suitable to hand values to code which only reads them, or copies
+ * what it needs to keep, such as filter inputs.
+ *
+ * Data lent by the application is the exception: the view holds its own
+ * reference on it, which is dropped when the view is reset.
+ *
+ * Any storage previously owned by to is freed.
+ *
+ * \param to pointer to the OmlValue to turn into a view
+ * \param value pointer to the OmlValueU to refer to
+ * \param type OmlValueT of value
+ * \see oml_value_set, oml_value_reset
+ */
+void
+oml_value_set_view(OmlValue *to, const OmlValueU *value, OmlValueT type)
+{
+  oml_value_reset(to);
+  to->type = type;
+  to->value = *value;
+
+  switch (type) {
+  case OML_STRING_VALUE:
+    omlc_set_string_size(to->value, 0);
+    if (!omlc_get_string_is_inline(to->value)) {
+      omlc_set_string_is_const(to->value, 1);
+    }
+    break;
+
+  case OML_BLOB_VALUE:
+    omlc_set_blob_size(to->value, 0);
+    if (omlc_get_blob_ref(to->value)) {
+      oml_value_ref_acquire(omlc_get_blob_ref(to->value));
+    }
+    break;
+
+  case OML_VECTOR_DOUBLE_VALUE:
+  case OML_VECTOR_INT32_VALUE:
+  case OML_VECTOR_UINT32_VALUE:
+  case OML_VECTOR_INT64_VALUE:
+  case OML_VECTOR_UINT64_VALUE:
+  case OML_VECTOR_BOOL_VALUE:
+    omlc_set_vector_size(to->value, 0);
+    if (omlc_get_vector_ref(to->value)) {
+      oml_value_ref_acquire(omlc_get_vector_ref(to->value));
+    }
+    break;
+
+  default:
+    break;
+  }
+}
+
+/** Take one more reference on data lent by the application.
+ *
+ * \param ref OmlValueRef to acquire
+ * \return ref
+ * \see oml_value_ref_release
+ */
+struct OmlValueRef*
+oml_value_ref_acquire(struct OmlValueRef* ref)
+{
+  __sync_add_and_fetch(&ref->refcount, 1);
+  return ref;
+}
+
+/** Drop a reference on data lent by the application.
+ *
+ * When the last reference is dropped, the release function given when lending
+ * the data is called, from the current thread.
+ *
+ * \param ref OmlValueRef to release
+ * \see oml_value_ref_acquire, omlc_set_blob_borrowed, omlc_set_vector_borrowed
+ */
+void
+oml_value_ref_release(struct OmlValueRef* ref)
+{
+  if (__sync_sub_and_fetch(&ref->refcount, 1) == 0) {
+    if (ref->release) {
+      ref->release(ref->data, ref->arg);
+    }
+    oml_free(ref);
+  }
+}
+
+/** Create the first reference on data lent by the application.
+ *
+ * \param data lent data
+ * \param release function to call to release data, or NULL
+ * \param arg opaque argument to release
+ * \return a new OmlValueRef, or NULL on error
+ */
+static struct OmlValueRef*
+oml_value_ref_new(void* data, omlc_release_fn release, void* arg)
+{
+  struct OmlValueRef* ref;
+
+  if (!(ref = oml_malloc(sizeof(struct OmlValueRef)))) {
+    logerror("Could not allocate memory to lend %p to OML\n", data);
+    return NULL;
+  }
+  ref->refcount = 1;
+  ref->data = data;
+  ref->release = release;
+  ref->arg = arg;
+
+  return ref;
+}
+
+/** Lend a blob to OML, without copying it.
+ *
+ * The OmlValueU points to data, and holds a reference on it. Internal copies of
+ * the OmlValueU share this reference rather than copying data. Once the last
+ * reference has been dropped, usually after the sample has been marshalled by
+ * omlc_inject, release is called with data and arg. It is then safe to
+ * modify or free data. The data must not be modified until then.
+ *
+ * If an error occurs, release is not called, and data remains the
+ * responsibility of the caller.
+ *
+ * \param var pointer to the OmlValueU to set
+ * \param data pointer to the blob
+ * \param length length of the blob
+ * \param release function to call to release data, or NULL
+ * \param arg opaque argument to release
+ * \return 0 on success, -1 otherwise
+ * \see omlc_inject, omlc_set_vector_borrowed, oml_value_ref_release
+ */
+int
+omlc_set_blob_borrowed(OmlValueU* var, void* data, size_t length, omlc_release_fn release, void* arg)
+{
+  struct OmlValueRef* ref;
+
+  if (!var || !data) {
+    logwarn("%s(): Cannot lend NULL blob\n", __FUNCTION__);
+    return -1;
+  }
+  if (!(ref = oml_value_ref_new(data, release, arg))) {
+    return -1;
+  }
+
+  omlc_reset_blob(*var);
+  omlc_set_blob_ptr(*var, data);
+  omlc_set_blob_length(*var, length);
+  _oml_set_storage_field(*var, blob, ref, ref);
+
+  return 0;
+}
+
+/** Lend a vector to OML, without copying it.
+ *
+ * The vector is handled as blobs are by omlc_set_blob_borrowed.
+ *
+ * \param var pointer to the OmlValueU to set
+ * \param data pointer to the first element of the vector
+ * \param nof_elts number of elements in the vector
+ * \param elt_size size (in bytes) of each element
+ * \param release function to call to release data, or NULL
+ * \param arg opaque argument to release
+ * \return 0 on success, -1 otherwise
+ * \see omlc_set_blob_borrowed
+ */
+int
+omlc_set_vector_borrowed(OmlValueU* var, void* data, size_t nof_elts, size_t elt_size, omlc_release_fn release, void* arg)
+{
+  struct OmlValueRef* ref;
+
+  if (!var || !data) {
+    logwarn("%s(): Cannot lend NULL vector\n", __FUNCTION__);
+    return -1;
+  }
+  if (nof_elts > UINT16_MAX) {
+    logwarn("%s(): Cannot lend vector of more than %d elements\n", __FUNCTION__, UINT16_MAX);
+    return -1;
+  }
+  if (!(ref = oml_value_ref_new(data, release, arg))) {
+    return -1;
+  }
+
+  omlc_reset_vector(*var);
+  omlc_set_vector_ptr(*var, data);
+  omlc_set_vector_length(*var, nof_elts * elt_size);
+  omlc_set_vector_nof_elts(*var, nof_elts);
+  omlc_set_vector_elt_size(*var, elt_size);
+  _oml_set_storage_field(*var, vector, ref, ref);
+
+  return 0;
+}
+
 /** DEPRECATED \see oml_value_set */
 int
 oml_value_copy(OmlValueU *value, OmlValueT type, OmlValue *to)
@@ -60,7 +60,29 @@ static inline int32_t oml_value_clamp_long (long value)
 #define oml_value_get_type(v) \
   ((OmlValueT)(v)->type)
 
+/** Reference counter on data lent by the application.
+ *
+ * Each OmlValueU pointing to the lent data holds one reference; the data is
+ * released when the last one is dropped.
+ *
+ * \see omlc_set_blob_borrowed, omlc_set_vector_borrowed, oml_value_ref_release
+ */
+struct OmlValueRef {
+  /** Number of references held */
+  int refcount;
+  /** Lent data */
+  void *data;
+  /** Function to call to release data, or NULL */
+  omlc_release_fn release;
+  /** Opaque argument to release */
+  void *arg;
+};
+
+struct OmlValueRef* oml_value_ref_acquire(struct OmlValueRef* ref);
+void oml_value_ref_release(struct OmlValueRef* ref);
+
 int oml_value_set(OmlValue* to, const OmlValueU* value, OmlValueT type);
+void oml_value_set_view(OmlValue* to, const OmlValueU* value, OmlValueT type);
 int oml_value_copy(OmlValueU* value, OmlValueT type, OmlValue* to) __attribute__ ((deprecated));
 
 void oml_value_init(OmlValue* v);
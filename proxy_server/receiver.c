@@ -19,6 +19,7 @@
 #include "message.h"
 #include "text.h"
 #include "binary.h"
+#include "compress.h"
 #include "message_queue.h"
 #include "proxy_client.h"
 
@@ -204,6 +205,17 @@ proxy_message_loop (const char *client_id, Client *client, void *buf, size_t siz
       logerror ("Client content is not TEXT or BINARY\n");
       break;
     }
+    if (client->header_table[H_COMPRESSION] != NULL) {
+      /* Compressed frames are stored and forwarded as they are */
+      if (strcmp (client->header_table[H_COMPRESSION]->value, COMPRESSION_DEFLATE) == 0) {
+        client->msg_start = compress_read_msg_start;
+      } else {
+        logerror ("'%s': unsupported compression '%s'\n", client_id,
+                  client->header_table[H_COMPRESSION]->value);
+        client->state = C_PROTOCOL_ERROR;
+        goto loop;
+      }
+    }
     mbuf_consume_message (mbuf); // Next message starts after the headers.
     client->state = C_DATA;
     break;
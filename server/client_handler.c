@@ -32,17 +32,32 @@
 #include "marshal.h"
 #include "binary.h"
 #include "schema.h"
+#include "compress.h"
 #include "client_handler.h"
 
 #define DEF_TABLE_COUNT 10
+/** Size of the buffer into which compressed data is inflated */
+#define INFLATE_CHUNK_SIZE 16384
 
 /* XXX: This cannot be static anymore if we want to test it... */
 void
 client_callback(SockEvtSource* source, void* handle, void* buf, int buf_size);
 
+static void
+client_buffer_callback(SockEvtSource* source, void* handle, MBuffer* buf, size_t len);
+
 static void
 status_callback(SockEvtSource* source, SocketStatus status, int errcode, void* handle);
 
+static void
+client_insert(ClientHandler* self, DbTable* table, int seqno, double ts, OmlValue* values, int count);
+
+static int
+client_process(ClientHandler* self, SockEvtSource* source);
+
+static void
+client_resume(void* handle);
+
   const char *
 client_state_to_s (CState state)
 {
@@ -214,8 +229,9 @@ client_handler_new(Socket* new_sock)
   self->content = C_TEXT_DATA;
   self->mbuf = mbuf_create ();
   self->socket = new_sock;
-  self->event = eventloop_on_read_in_channel(new_sock, client_callback,
+  self->event = eventloop_on_read_in_buffer(new_sock, self->mbuf, client_buffer_callback,
       status_callback, (void*)self);
+  self->buffered = 1;
   strncpy (self->name, self->event->name, MAX_STRING_SIZE);
 
   const char *event = "Connect";
@@ -226,10 +242,70 @@ client_handler_new(Socket* new_sock)
   return self;
 }
 
+/** Create a client handler for a remote peer sending datagrams.
+ *
+ * Unlike client_handler_new(), no EventLoop channel is registered: the
+ * datagrams received from the peer should be passed to
+ * client_handler_datagram() by whoever receives them.
+ *
+ * \param peer_sock Socket object representing the peer, as created by socket_udp_peer_new()
+ * \return a pointer to the newly created ClientHandler
+ *
+ * \see client_handler_datagram, socket_udp_peer_new
+ */
+ClientHandler*
+client_handler_new_peer(Socket* peer_sock)
+{
+  ClientHandler* self = oml_malloc(sizeof(ClientHandler));
+  if (!self) return NULL;
+
+  memset(self, 0, sizeof(*self));
+  self->state = C_HEADER;
+  self->content = C_TEXT_DATA;
+  self->mbuf = mbuf_create ();
+  self->socket = peer_sock;
+  self->peer_event.name = peer_sock->name;
+  self->peer_event.socket = peer_sock;
+  self->event = &self->peer_event;
+  strncpy (self->name, self->event->name, MAX_STRING_SIZE);
+
+  client_event_report(self, "Connect", "");
+  loginfo("%s: New incoming datagram peer\n", self->name);
+
+  return self;
+}
+
+/** Process a datagram received from the peer of a ClientHandler.
+ *
+ * \param self ClientHandler created with client_handler_new_peer()
+ * \param buf data received from the peer
+ * \param buf_size size of the data
+ * \return 0 on success, -1 if a protocol error occured, in which case the
+ * ClientHandler should be freed
+ *
+ * \see client_handler_new_peer, client_callback
+ */
+int
+client_handler_datagram(ClientHandler* self, void* buf, int buf_size)
+{
+  assert(self->event == &self->peer_event);
+
+  client_callback(self->event, self, buf, buf_size);
+
+  return (C_PROTOCOL_ERROR == self->state) ? -1 : 0;
+}
+
 void client_handler_free (ClientHandler* self)
 {
-  if (self->event)
+  if (self->event && self->event != &self->peer_event) {
     eventloop_socket_release (self->event);
+    self->event = NULL;
+  }
+  if (self->database && database_queue_cancel(self->database, &self->waiter)) {
+    /* client_resume() has already been posted, and will free us */
+    self->closing = 1;
+    return;
+  }
   if (self->database)
     database_release (self->database);
   if (self->socket)
@@ -248,6 +324,17 @@ void client_handler_free (ClientHandler* self)
   }
   oml_free (self->values_vectors);
   oml_free (self->values_vector_counts);
+  if (self->block_values) {
+    oml_value_array_reset (self->block_values, self->block_value_count);
+    oml_free (self->block_values);
+  }
+  string_dict_destroy (self->dict);
+  if (self->zstrm) {
+    inflateEnd (self->zstrm);
+    oml_free (self->zstrm);
+  }
+  if (self->zbuf)
+    mbuf_destroy (self->zbuf);
   if (self->sender_name)
     oml_free (self->sender_name);
   if (self->app_name)
@@ -347,6 +434,98 @@ process_schema(ClientHandler* self, char* value)
   }
 }
 
+/** Prepare a ClientHandler to decompress the data following the headers.
+ *
+ * \param self ClientHandler
+ * \return 0 on success, -1 on error
+ * \see inflate_frames
+ */
+static int
+inflate_setup(ClientHandler* self)
+{
+  if (self->zstrm) {
+    return 0;
+  }
+
+  if (!(self->zstrm = oml_malloc(sizeof(z_stream)))) {
+    return -1;
+  }
+  memset(self->zstrm, 0, sizeof(z_stream));
+
+  /* Frames are raw deflate streams, without zlib header or trailer */
+  if (inflateInit2(self->zstrm, -MAX_WBITS) != Z_OK) {
+    logerror("%s: Cannot initialise decompressor: %s\n", self->name,
+        self->zstrm->msg ? self->zstrm->msg : "unknown error");
+    oml_free(self->zstrm);
+    self->zstrm = NULL;
+    return -1;
+  }
+  self->zbuf = mbuf_create();
+
+  return 0;
+}
+
+/** Decompress all complete frames received from a client.
+ *
+ * The decompressed data is appended to the ClientHandler's MBuffer, to be
+ * processed as if it had been received uncompressed.  Frames decompressing
+ * to more than COMPRESS_MAX_INFLATED_SIZE are rejected, so a small frame
+ * cannot make the MBuffer grow without bounds.
+ *
+ * \param self ClientHandler with compressed data in its zbuf
+ * \return 0 on success, -1 if the data is not a valid sequence of frames
+ * \see compress.c, inflate_setup
+ */
+static int
+inflate_frames(ClientHandler* self)
+{
+  uint8_t out[INFLATE_CHUNK_SIZE];
+  z_stream* strm = self->zstrm;
+  MBuffer* zbuf = self->zbuf;
+  ssize_t frame_length;
+  int ret;
+
+  while ((frame_length = compress_frame_length(mbuf_rdptr(zbuf), mbuf_rd_remaining(zbuf))) > 0) {
+    inflateReset(strm);
+    strm->next_in = mbuf_rdptr(zbuf) + COMPRESS_FRAME_HEADER_SIZE;
+    strm->avail_in = frame_length - COMPRESS_FRAME_HEADER_SIZE;
+    do {
+      strm->next_out = out;
+      strm->avail_out = sizeof(out);
+      ret = inflate(strm, Z_NO_FLUSH);
+      if (ret != Z_OK && ret != Z_STREAM_END) {
+        logerror("%s: Invalid compressed frame: %s\n", self->name,
+            strm->msg ? strm->msg : "truncated data");
+        return -1;
+      }
+      if (strm->total_out > COMPRESS_MAX_INFLATED_SIZE) {
+        logerror("%s: Compressed frame decompresses to more than %dB\n", self->name,
+            COMPRESS_MAX_INFLATED_SIZE);
+        return -1;
+      }
+      if (mbuf_write(self->mbuf, out, sizeof(out) - strm->avail_out) == -1) {
+        logerror("%s: Failed to write decompressed data into message buffer\n", self->name);
+        return -1;
+      }
+    } while (ret != Z_STREAM_END);
+
+    if (strm->avail_in) {
+      logerror("%s: %dB of garbage after compressed frame\n", self->name, strm->avail_in);
+      return -1;
+    }
+    logdebug2("%s: Decompressed %dB frame\n", self->name, frame_length);
+
+    mbuf_read_skip(zbuf, frame_length);
+    mbuf_consume_message(zbuf);
+  }
+
+  if (frame_length < 0) {
+    logerror("%s: Invalid compressed frame length\n", self->name);
+    return -1;
+  }
+  return 0;
+}
+
 /** \privatesection Process a single key/value pair contained in the header.
  *
  * XXX: This function actively does text protocol interpretation, see #1088
@@ -381,6 +560,7 @@ process_meta(ClientHandler* self, char* key, char* value)
       return -2;
 
     } else {
+      self->protocol = protocol;
       return 0;
     }
 
@@ -466,14 +646,7 @@ process_meta(ClientHandler* self, char* key, char* value)
        */
 
       start_time = atoi(value);
-      if (self->database->start_time == 0) {
-        // seed it with a time in the past
-        self->database->start_time = start_time;// - 100;
-        char s[64];
-        snprintf (s, LENGTH(s), "%u", start_time);
-        self->database->set_metadata (self->database, "start_time", s);
-      }
-      self->time_offset = start_time - self->database->start_time;
+      self->time_offset = start_time - database_start_time(self->database, start_time);
       return 0;
     }
 
@@ -490,7 +663,7 @@ process_meta(ClientHandler* self, char* key, char* value)
       return -2;
 
     } else {
-      self->sender_id = self->database->add_sender_id(self->database, value);
+      self->sender_id = database_add_sender_id(self->database, value);
       self->sender_name = oml_strndup (value, strlen (value));
       return 0;
     }
@@ -536,6 +709,26 @@ process_meta(ClientHandler* self, char* key, char* value)
       return -2;
     }
 
+  } else if (strcmp(key, "compression") == 0) {
+    if (self->state != C_HEADER) {
+      logwarn("%s: Meta '%s' is only valid in the headers, ignoring\n",
+          self->name, key);
+      return -1;
+
+    } else if (strcmp(value, COMPRESSION_DEFLATE) == 0) {
+      if (inflate_setup(self)) {
+        self->state = C_PROTOCOL_ERROR;
+        return -2;
+      }
+      logdebug("%s: Data will be compressed\n", self->name);
+      return 0;
+
+    } else {
+      logerror("%s: Unknown compression '%s'\n", self->name, value);
+      self->state = C_PROTOCOL_ERROR;
+      return -2;
+    }
+
   } else {
     /* Unknown key, let the caller deal with it */
     return 1;
@@ -597,6 +790,18 @@ process_header(ClientHandler* self, MBuffer* mbuf)
     self->state = self->content;
     client_event_report(self, "Ready", "");
     loginfo("%s: Client %s ready to send data\n", self->name, self->event->name);
+    if (self->zbuf) {
+      /* Everything after the headers is compressed */
+      if (self->buffered) {
+        eventloop_socket_set_buffer (self->event, self->zbuf);
+      }
+      mbuf_write (self->zbuf, mbuf_rdptr (mbuf), mbuf_rd_remaining (mbuf));
+      mbuf_read_skip (mbuf, mbuf_rd_remaining (mbuf));
+      mbuf_consume_message (mbuf);
+      if (inflate_frames (self)) {
+        self->state = C_PROTOCOL_ERROR;
+      }
+    }
     return 0;
   }
 
@@ -684,9 +889,18 @@ process_bin_data_message(ClientHandler* self, OmlBinaryHeader* header)
    * however, the schema might have been redefined sinc last time */
   count = self->values_vector_counts[table_index];
   oml_value_array_reset(v, count);
-  count = unmarshal_measurements(mbuf, header, v, count);
-
   schema = table->schema;
+  if (marshal_msgtype_is_dict(header->type)) {
+    if (!self->dict) {
+      self->dict = string_dict_new(OMB_DICT_MAX_SIZE);
+    }
+    count = unmarshal_values_dict(mbuf, header, schema, self->dict, v, count);
+  } else if (marshal_msgtype_is_compact(header->type)) {
+    count = unmarshal_values_compact(mbuf, header, schema, v, count);
+  } else {
+    count = unmarshal_measurements(mbuf, header, v, count);
+  }
+
   if (count<-100) {
     logerror("%s(bin): An error occured during unmarshalling (%d)\n",
         self->name, count);
@@ -745,8 +959,120 @@ process_bin_data_message(ClientHandler* self, OmlBinaryHeader* header)
 
   logdebug("%s(bin): Inserting data into table index %d '%s' (seqno=%d, ts=%f)\n",
       self->name, table_index, table->schema->name, seqno, ts);
-  self->database->insert(self->database, table, self->sender_id, header->seqno,
-      ts, self->values_vectors[table_index], count);
+  client_insert(self, table, header->seqno, ts, self->values_vectors[table_index], count);
+}
+
+/** Queue a sample for insertion into the database of a ClientHandler.
+ *
+ * If the queue of the database is full, the ClientHandler is throttled: it
+ * stops processing further data after the current message.
+ *
+ * \param self pointer to ClientHandler processing the data
+ * \param table DbTable to insert into
+ * \param seqno sequence number of the sample
+ * \param ts timestamp of the sample, rebased to the start time of the database
+ * \param values array of OmlValue containing the sample
+ * \param count number of elements in values
+ *
+ * \see database_insert, client_throttle
+ */
+static void
+client_insert(ClientHandler* self, DbTable* table, int seqno, double ts, OmlValue* values, int count)
+{
+  /* Only connections read by the EventLoop can be held back */
+  if (database_insert(self->database, table, self->sender_id, seqno, ts, values, count) > 0 &&
+      self->buffered) {
+    self->throttled = 1;
+  }
+}
+
+/** Process a block of samples, and insert them into the database.
+ *
+ * Blocks of schema 0 are not valid, as metadata samples need to be processed
+ * one by one.
+ *
+ * \param self pointer to ClientHandler processing the data
+ * \param header OmlBinaryHeader of the OMB_BLOCK_P or OMB_LBLOCK_P message
+ *
+ * \see process_bin_data_message, unmarshal_block
+ */
+static void
+process_bin_block_message(ClientHandler* self, OmlBinaryHeader* header)
+{
+  int32_t seqnos[OMB_BLOCK_MAX_ROWS];
+  double timestamps[OMB_BLOCK_MAX_ROWS];
+  int table_index = header->stream;
+  struct schema *schema;
+  DbTable *table;
+  OmlValue *v;
+  int i, count, nvalues;
+
+  if (table_index <= 0 || table_index >= self->table_count ||
+      NULL == (table = self->tables[table_index])) {
+    logwarn("%s(bin): Invalid table index %d for block, discarding samples %d to %d\n",
+        self->name, table_index, header->seqno, header->seqno + header->values - 1);
+    return;
+  }
+
+  schema = table->schema;
+  nvalues = header->values * schema->nfields;
+  if (nvalues > self->block_value_count) {
+    if (!(v = oml_realloc (self->block_values, nvalues * sizeof (OmlValue)))) {
+      logwarn("%s(bin): Could not reallocate memory for %d values of block\n",
+          self->name, nvalues);
+      return;
+    }
+    oml_value_array_init(&v[self->block_value_count], nvalues - self->block_value_count);
+    self->block_values = v;
+    self->block_value_count = nvalues;
+  }
+  v = self->block_values;
+  oml_value_array_reset(v, self->block_value_count);
+
+  count = unmarshal_block(self->mbuf, header, schema, seqnos, timestamps, v, self->block_value_count);
+  if (count < -100) {
+    logerror("%s(bin): An error occured during unmarshalling of block (%d)\n",
+        self->name, count);
+    return;
+  }
+  mbuf_consume_message (self->mbuf);
+
+  logdebug("%s(bin): Inserting %d samples into table index %d '%s' (seqno=%d, ts=%f)\n",
+      self->name, count, table_index, schema->name, seqnos[0], timestamps[0] + self->time_offset);
+  for (i = 0; i < count; i++, v += schema->nfields) {
+    client_insert(self, table, seqnos[i], timestamps[i] + self->time_offset, v, schema->nfields);
+  }
+}
+
+/** Process the definitions of strings of the dictionary of the client.
+ *
+ * These are replayed by the client with its headers when reconnecting, so the
+ * strings of the samples it had queued can be resolved.
+ *
+ * \param self pointer to ClientHandler processing the data
+ * \param header OmlBinaryHeader of the OMB_DICT_P message
+ *
+ * \see process_bin_data_message, unmarshal_dict
+ */
+static void
+process_bin_dict_message(ClientHandler* self, OmlBinaryHeader* header)
+{
+  int count;
+
+  if (!self->dict && !(self->dict = string_dict_new(OMB_DICT_MAX_SIZE))) {
+    logwarn("%s(bin): Could not create string dictionary, discarding definitions\n", self->name);
+    return;
+  }
+
+  count = unmarshal_dict(self->mbuf, header, self->dict);
+  if (count < -100) {
+    logerror("%s(bin): An error occured during unmarshalling of string definitions (%d)\n",
+        self->name, count);
+    return;
+  }
+  mbuf_consume_message (self->mbuf);
+
+  logdebug("%s(bin): Defined %d strings of the dictionary\n", self->name, count);
 }
 
 /** Read binary data from an MBuffer
@@ -786,6 +1112,47 @@ process_bin_message(ClientHandler* self, MBuffer* mbuf)
     return 0;
   }
   switch (header.type) {
+  case OMB_DICT_P:
+    if (self->protocol < OMB_DICT_PROTOCOL_VERSION) {
+      logerror("%s(bin): String definition packets are not valid in protocol version %d\n",
+          self->name, self->protocol);
+      self->state = C_PROTOCOL_ERROR;
+      return 0;
+    }
+    process_bin_dict_message(self, &header);
+    if (self->state != C_BINARY_DATA)
+      return 0;
+    break;
+  case OMB_BLOCK_P:
+  case OMB_LBLOCK_P:
+    if (self->protocol < OMB_BLOCK_PROTOCOL_VERSION) {
+      logerror("%s(bin): Block measurement packets are not valid in protocol version %d\n",
+          self->name, self->protocol);
+      self->state = C_PROTOCOL_ERROR;
+      return 0;
+    }
+    process_bin_block_message(self, &header);
+    if (self->state != C_BINARY_DATA)
+      return 0;
+    break;
+  case OMB_DDATA_P:
+  case OMB_LDDATA_P:
+    if (self->protocol < OMB_DICT_PROTOCOL_VERSION) {
+      logerror("%s(bin): Measurement packets using a string dictionary are not valid in protocol version %d\n",
+          self->name, self->protocol);
+      self->state = C_PROTOCOL_ERROR;
+      return 0;
+    }
+    /* Fall through */
+  case OMB_CDATA_P:
+  case OMB_LCDATA_P:
+    if (self->protocol < OMB_COMPACT_PROTOCOL_VERSION) {
+      logerror("%s(bin): Compact measurement packets are not valid in protocol version %d\n",
+          self->name, self->protocol);
+      self->state = C_PROTOCOL_ERROR;
+      return 0;
+    }
+    /* Fall through */
   case OMB_DATA_P:
   case OMB_LDATA_P:
     process_bin_data_message(self, &header);
@@ -920,8 +1287,7 @@ process_text_data_message(ClientHandler* self, char** msg, int count)
 
   logdebug("%s(txt): Inserting data into table index %d '%s' (seqno=%d, ts=%f)\n",
       self->name, table_index, table->schema->name, seqno, ts);
-  self->database->insert(self->database, table, self->sender_id, seqno,
-      ts, self->values_vectors[table_index], count - 3); /* Ignore first 3 elements */
+  client_insert(self, table, seqno, ts, self->values_vectors[table_index], count - 3); /* Ignore first 3 elements */
 }
 
 /** Process as many lines of data as possible from an MBuffer.
@@ -936,7 +1302,7 @@ process_text_message(ClientHandler* self, MBuffer* mbuf)
   char* line;
   int len;
 
-  while (C_TEXT_DATA == self->state) {
+  while (C_TEXT_DATA == self->state && !self->throttled) {
     if (read_line(&line, &len, mbuf) == 0) {
       return 0;
     }
@@ -980,39 +1346,78 @@ process_text_message(ClientHandler* self, MBuffer* mbuf)
   return 0;
 }
 
-/** * Callback function called when the socket receive some data
- * \param source the socket event
- * \param handle the client handler
- * \param buf data received from the socket
- * \param bufsize the size of the data set from the socket
+/** Stop reading from a ClientHandler's socket until the queue of its database drains.
+ *
+ * \param self ClientHandler which filled the queue
+ * \return 1 if the queue has already drained, and processing can go on, 0 otherwise
+ *
+ * \see database_queue_wait, client_resume
  */
-  void
-client_callback(SockEvtSource* source, void* handle, void* buf, int buf_size)
+static int
+client_throttle(ClientHandler* self)
 {
-  char *in;
-  ClientHandler* self = (ClientHandler*)handle;
-  MBuffer* mbuf = self->mbuf;
+  eventloop_socket_activate(self->event, 0);
 
-  logdebug2("%s(%s): Received %d bytes of data\n",
-      source->name,
-      client_state_to_s (self->state),
-      buf_size);
+  if (!database_queue_wait(self->database, &self->waiter, client_resume, self)) {
+    logdebug("%s: Database queue full, pausing reception\n", self->name);
+    return 0;
+  }
 
-  if(o_log_level_active(O_LOG_DEBUG4)) {
-    in = to_octets(buf, buf_size);
-    logdebug2("%s(%s): Received new packet\n%s\n",
-        source->name, client_state_to_s (self->state), in);
-    oml_free(in);
+  /* The queue drained meanwhile, or we cannot wait anyway */
+  self->throttled = 0;
+  if (!self->closing) {
+    eventloop_socket_activate(self->event, 1);
   }
+  return 1;
+}
 
-  int result = mbuf_write (mbuf, buf, buf_size);
+/** Resume processing data from a ClientHandler, once the queue of its database has drained.
+ *
+ * This is run as a task by the EventLoop of the ClientHandler.
+ *
+ * \param handle ClientHandler
+ *
+ * \see client_throttle, database_queue_wait, o_el_task_callback
+ */
+static void
+client_resume(void* handle)
+{
+  ClientHandler* self = (ClientHandler*)handle;
 
-  if (result == -1) {
-    logerror("%s: Failed to write message from client into message buffer\n",
-        source->name);
+  if (self->closing) {
+    if (NULL == self->event) {
+      /* client_handler_free() was called meanwhile */
+      client_handler_free (self);
+
+    } else {
+      /* The connection was closed while throttled; insert the rest of the data */
+      logdebug("%s: Database queue drained, processing remaining data\n", self->name);
+      self->throttled = 0;
+      if (!client_process(self, self->event) && !self->throttled) {
+        client_handler_free (self);
+      }
+    }
     return;
   }
 
+  logdebug("%s: Database queue drained, resuming reception\n", self->name);
+  self->throttled = 0;
+  eventloop_socket_activate(self->event, 1);
+  client_process(self, self->event);
+}
+
+/** Process all complete messages in the buffer of a ClientHandler.
+ *
+ * \param self ClientHandler
+ * \param source the socket event
+ * \return 0 if the unprocessed data should be kept, -1 if it has been
+ * discarded or the ClientHandler has been freed
+ */
+static int
+client_process(ClientHandler* self, SockEvtSource* source)
+{
+  MBuffer* mbuf = self->mbuf;
+
 process:
   switch (self->state)
   {
@@ -1025,7 +1430,7 @@ process:
     break;
 
   case C_BINARY_DATA:
-    while (process_bin_message(self, mbuf));
+    while (!self->throttled && process_bin_message(self, mbuf));
     break;
 
   case C_TEXT_DATA:
@@ -1037,24 +1442,141 @@ process:
     logerror("%s: Fatal error, disconnecting client\n",
         source->name);
     client_event_report(self, "Disconnect", "C_PROTOCOL_ERROR");
-    client_handler_free (self);
-    /*
-     * Protocol error --> no need to repack buffer, so just return;
-     */
-    return;
+    if (self->event != &self->peer_event) {
+      /* Datagram peers are freed by the caller of client_handler_datagram() */
+      client_handler_free (self);
+    }
+    return -1;
   default:
     logerror("%s: Unknown client state %d\n", source->name, self->state);
     mbuf_clear (mbuf);
-    return;
+    return -1;
   }
 
   if (self->state == C_PROTOCOL_ERROR)
     goto process;
 
+  if (self->throttled && client_throttle(self))
+    goto process;
+
+  return 0;
+}
+
+/** Log data received by a ClientHandler.
+ *
+ * \param self ClientHandler
+ * \param source the socket event
+ * \param buf data received from the socket
+ * \param buf_size the size of the data
+ */
+static void
+client_log_data(ClientHandler* self, SockEvtSource* source, void* buf, int buf_size)
+{
+  char *in;
+
+  logdebug2("%s(%s): Received %d bytes of data\n",
+      source->name,
+      client_state_to_s (self->state),
+      buf_size);
+
+  if(o_log_level_active(O_LOG_DEBUG4)) {
+    in = to_octets(buf, buf_size);
+    logdebug2("%s(%s): Received new packet\n%s\n",
+        source->name, client_state_to_s (self->state), in);
+    oml_free(in);
+  }
+}
+
+/** * Callback function called when the socket receive some data
+ * \param source the socket event
+ * \param handle the client handler
+ * \param buf data received from the socket
+ * \param bufsize the size of the data set from the socket
+ */
+  void
+client_callback(SockEvtSource* source, void* handle, void* buf, int buf_size)
+{
+  ClientHandler* self = (ClientHandler*)handle;
+  MBuffer* mbuf = self->mbuf;
+
+  client_log_data(self, source, buf, buf_size);
+
+  int result;
+  if (self->zbuf && self->state != C_HEADER) {
+    result = mbuf_write (self->zbuf, buf, buf_size);
+    if (result != -1 && inflate_frames (self)) {
+      self->state = C_PROTOCOL_ERROR;
+    }
+    mbuf_repack_message (self->zbuf);
+  } else {
+    result = mbuf_write (mbuf, buf, buf_size);
+  }
+
+  if (result == -1) {
+    logerror("%s: Failed to write message from client into message buffer\n",
+        source->name);
+    return;
+  }
+
+  if (client_process(self, source)) {
+    /*
+     * Protocol error --> no need to repack buffer, so just return;
+     */
+    return;
+  }
+
   // move remaining buffer content to beginning
   mbuf_repack_message (mbuf);
   logdebug2("%s: Buffer repacked to %d bytes\n", source->name, mbuf_fill(mbuf));
 }
+
+/** Callback function called when the EventLoop has read data into the
+ * buffer of a ClientHandler.
+ *
+ * The data is either in the ClientHandler's MBuffer or, once compressed data
+ * is expected, in its zbuf.  Unlike client_callback(), no repacking is done
+ * here, as the EventLoop takes care of it when the buffer gets full.
+ *
+ * \param source the socket event
+ * \param handle the client handler
+ * \param buf MBuffer into which the data was read
+ * \param len the size of the data newly read into buf
+ * \see eventloop_on_read_in_buffer, client_callback
+ */
+static void
+client_buffer_callback(SockEvtSource* source, void* handle, MBuffer* buf, size_t len)
+{
+  ClientHandler* self = (ClientHandler*)handle;
+
+  client_log_data(self, source, mbuf_wrptr(buf) - len, len);
+
+  if (buf == self->zbuf && inflate_frames (self)) {
+    self->state = C_PROTOCOL_ERROR;
+  }
+
+  client_process(self, source);
+}
+
+/** Free a ClientHandler whose connection has ended.
+ *
+ * If the ClientHandler is throttled, its buffer may still hold samples which
+ * have not been inserted. It is then kept until client_resume() has
+ * processed them.
+ *
+ * \param self ClientHandler
+ * \see client_handler_free, client_resume
+ */
+static void
+client_close(ClientHandler* self)
+{
+  if (self->throttled) {
+    logdebug("%s: Keeping unprocessed data until the database queue drains\n", self->name);
+    self->closing = 1;
+    return;
+  }
+  client_handler_free (self);
+}
+
 /** Callback function called when the status of the socket change
  * \param source the socket event
  * \param status the status of the socket
@@ -1079,13 +1601,13 @@ status_callback(SockEvtSource* source, SocketStatus status, int errcode, void* h
       /* Client closed the connection */
       client_event_report(self, event, message);
       loginfo("%s: Client %s closed connection\n", self->name, source->name);
-      client_handler_free (self);
+      client_close (self);
       break;
     case SOCKET_IDLE:
       /* Server dropped idle connection */
       client_event_report(self, event, message);
       loginfo("%s: Client %s dropped due to idleness\n", self->name, source->name);
-      client_handler_free (self);
+      client_close (self);
       break;
     case SOCKET_UNKNOWN:
     case SOCKET_CONN_REFUSED:
@@ -24,10 +24,12 @@
 #define CLIENT_HANDLER_H_
 
 #include <time.h>
+#include <zlib.h>
 #include <ocomm/o_socket.h>
 #include <ocomm/o_eventloop.h>
 #include <oml2/oml_writer.h>
 #include <mbuf.h>
+#include <marshal.h>
 
 #include "database.h"
 
@@ -55,9 +57,13 @@ typedef struct _clientHandler {
   OmlValue**  values_vectors;
   int*        values_vector_counts; // size of each vector in values_vectors
   int         table_count;    // size of tables, seqno_offsets and values_vectors arrays
+  OmlValue*   block_values;   // samples of the last block message, one after the other
+  int         block_value_count; // size of block_values
+  OmlStringDict* dict;        // strings defined by the client, created by the first message using them
   int         sender_id;
   char*       sender_name;
   char*       app_name;
+  int         protocol;       // OMSP version announced by the client
 
   CState      state;
   CState      content;
@@ -67,9 +73,20 @@ typedef struct _clientHandler {
 
   time_t      time_offset;  // value to add to remote ts to
                             // sync time across all connections
+
+  SockEvtSource peer_event; // event source of handlers for datagram peers, which have no EventLoop channel
+
+  z_stream*   zstrm;        // decompressor, if the client announced compressed data
+  MBuffer*    zbuf;         // compressed data not decompressed yet
+  int         buffered;     // data is read directly into mbuf (or zbuf) by the EventLoop
+  int         throttled;    // the database queue is full, stop processing data until it drains
+  int         closing;      // the connection is closed, but a resume task is still pending; see client_close
+  DbQueueWaiter waiter;     // registration to be resumed once the database queue drains
 } ClientHandler;
 
 ClientHandler* client_handler_new (Socket* new_sock);
+ClientHandler* client_handler_new_peer (Socket* peer_sock);
+int client_handler_datagram (ClientHandler* self, void* buf, int buf_size);
 void client_handler_free (ClientHandler* self);
 
 #endif /*CLIENT_HANDLER_H_*/
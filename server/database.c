@@ -56,6 +56,7 @@
 #include <time.h>
 #include <sys/time.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "ocomm/o_log.h"
 #include "oml_utils.h"
@@ -64,6 +65,7 @@
 #include "mstring.h"
 #include "database.h"
 #include "hook.h"
+#include "monitoring_server.h"
 #include "sqlite_adapter.h"
 
 #if HAVE_LIBPQ
@@ -89,6 +91,45 @@ static struct db_backend
 char* dbbackend = DEFAULT_DB_BACKEND;
 
 static Database *first_db = NULL;
+/** Protects first_db and the ref_count and ready state of its Databases,
+ * which ClientHandlers of different threads can find and release concurrently */
+static pthread_mutex_t databases_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Signalled when a Database being opened by database_find becomes ready,
+ * or fails to open */
+static pthread_cond_t databases_cond = PTHREAD_COND_INITIALIZER;
+
+/** Sample waiting to be inserted by the writer thread of a Database */
+typedef struct DbRow {
+  DbTable*  table;          /**< Table to insert the sample into */
+  int       sender_id;      /**< Sender of the sample */
+  int       seq_no;         /**< Sequence number of the sample */
+  double    time_stamp;     /**< Timestamp of the sample, rebased to the start time of the Database */
+  OmlValue* values;         /**< Copy of the values of the sample */
+  int       value_count;    /**< Number of values of the sample */
+  int       value_size;     /**< Number of OmlValue allocated in values */
+  struct DbRow* next;       /**< Next sample in the queue */
+} DbRow;
+
+/** Queue of samples inserted into a Database by a dedicated writer thread,
+ * so clients do not wait for the storage backend */
+typedef struct DbQueue {
+  pthread_mutex_t lock;     /**< Protects all other fields */
+  pthread_cond_t cond;      /**< Signalled when samples are queued, or the writer should stop */
+  pthread_t writer;         /**< Thread inserting the samples */
+  DbRow*    head;           /**< First sample to insert */
+  DbRow*    tail;           /**< Last sample to insert */
+  DbRow*    free_rows;      /**< Rows already inserted, kept with their values for reuse */
+  int       depth;          /**< Number of samples queued, including those being inserted */
+  int       stopping;       /**< Set when the writer should exit once the queue is empty */
+  DbQueueWaiter* waiters;   /**< Clients waiting for the queue to drain */
+  time_t    last_report;    /**< Time of the last report of the depth \see queue_report */
+  uint32_t  written;        /**< Number of samples inserted since the last report */
+} DbQueue;
+
+static DbTable* find_table (Database *database, const char *name);
+static DbTable* find_or_create_table (Database *database, struct schema *schema);
+static int queue_start (Database *database);
+static void queue_stop (Database *database);
 
 /** Get the list of valid database backends.
  *
@@ -195,42 +236,103 @@ database_create_function (const char *backend)
   return NULL;
 }
 
+/** Drop a reference to a Database which failed to open, freeing it if it was the last.
+ *
+ * Must be called with databases_lock held.
+ *
+ * \param self Database to drop, already removed from the list of databases
+ * \see database_find, database_abandon
+ */
+static void
+database_drop (Database *self)
+{
+  if (--self->ref_count == 0) {
+    pthread_mutex_destroy(&self->lock);
+    oml_free (self);
+  }
+}
+
+/** Give up on a Database which database_find could not open.
+ *
+ * The Database is removed from the list of databases, and the clients waiting
+ * for it to be ready are told it failed.
+ *
+ * \param self Database to abandon, whose backend has already been released
+ * \see database_find
+ */
+static void
+database_abandon (Database *self)
+{
+  Database **db;
+
+  pthread_mutex_lock(&databases_lock);
+  for (db = &first_db; *db && *db != self; db = &(*db)->next);
+  if (*db) {
+    *db = self->next;
+  }
+  self->ready = -1;
+  pthread_cond_broadcast(&databases_cond);
+  database_drop (self);
+  pthread_mutex_unlock(&databases_lock);
+}
+
 /** Find a database instance for name.
  *
- * If no database with this name exists, a new one is created.
+ * If no database with this name exists, a new one is created. Its backend is
+ * opened without holding the lock on the list of databases, so that other
+ * clients are not delayed by it; clients looking for the same database in the
+ * meantime wait until it is ready.
  *
  * \param name name of the database to find
- * \return a pointer to the database
+ * \return a pointer to the database, or NULL on error
  */
 Database*
 database_find (const char* name)
 {
+  pthread_mutex_lock(&databases_lock);
   Database* db = first_db;
   while (db != NULL) {
     if (!strcmp(name, db->name)) {
       loginfo ("%s: Database already open (%d client%s)\n",
                 name, db->ref_count, db->ref_count>1?"s":"");
       db->ref_count++;
+      while (db->ready == 0) {
+        pthread_cond_wait(&databases_cond, &databases_lock);
+      }
+      if (db->ready < 0) {
+        database_drop (db);
+        db = NULL;
+      }
+      pthread_mutex_unlock(&databases_lock);
       return db;
     }
     db = db->next;
   }
 
-  // need to create a new one
+  // need to create a new one, and hook it into the list of databases until ready
   Database *self = oml_malloc(sizeof(Database));
+  if (self == NULL) {
+    pthread_mutex_unlock(&databases_lock);
+    return NULL;
+  }
   logdebug("%s: Creating or opening database\n", name);
   strncpy(self->name, name, MAX_DB_NAME_SIZE);
   self->ref_count = 1;
+  pthread_mutex_init(&self->lock, NULL);
+  self->next = first_db;
+  first_db = self;
+  pthread_mutex_unlock(&databases_lock);
+
   self->create = database_create_function (dbbackend);
 
   if (self->create (self)) {
-    oml_free(self);
+    database_abandon (self);
     return NULL;
   }
 
   if (database_init (self) == -1) {
-    database_release(self);
-    oml_free (self);
+    self->release (self);
+    database_abandon (self);
     return NULL;
   }
 
@@ -247,12 +349,20 @@ database_find (const char* name)
     logdebug("%s: Retrieved start-time = %lu\n", name, self->start_time);
   }
 
-  // hook this one into the list of active databases
-  self->next = first_db;
-  first_db = self;
+  if (queue_start (self)) {
+    self->release (self);
+    database_abandon (self);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&databases_lock);
+  self->ready = 1;
+  pthread_cond_broadcast(&databases_cond);
+  pthread_mutex_unlock(&databases_lock);
 
   return self;
 }
+
 /** One client no longer uses this database.
  * If this was the last client checking out, close database.
  * \param self the database to release
@@ -265,7 +375,11 @@ database_release(Database* self)
     logerror("NONE: Trying to release a NULL database.\n");
     return;
   }
-  if (--self->ref_count > 0) return; // still in use
+  pthread_mutex_lock(&databases_lock);
+  if (--self->ref_count > 0) { // still in use
+    pthread_mutex_unlock(&databases_lock);
+    return;
+  }
 
   // unlink DB
   Database* db_p = first_db;
@@ -276,12 +390,17 @@ database_release(Database* self)
   }
   if (db_p == NULL) {
     logerror("%s:  Trying to release an unknown database\n", self->name);
+    pthread_mutex_unlock(&databases_lock);
     return;
   }
   if (prev_p == NULL)
     first_db = self->next; // was first
   else
     prev_p->next = self->next;
+  pthread_mutex_unlock(&databases_lock);
+
+  /* Wait for the pending samples to be inserted */
+  queue_stop (self);
 
   // no longer needed
   DbTable* t_p = self->first_table;
@@ -299,6 +418,7 @@ database_release(Database* self)
 
   database_hook_send_event(self, HOOK_CMD_DBCLOSED);
 
+  pthread_mutex_destroy(&self->lock);
   oml_free(self);
 }
 
@@ -325,6 +445,21 @@ database_cleanup()
  */
 DbTable*
 database_find_table (Database *database, const char *name)
+{
+  DbTable *table;
+
+  pthread_mutex_lock(&database->lock);
+  table = find_table(database, name);
+  pthread_mutex_unlock(&database->lock);
+
+  return table;
+}
+
+/** Find a table by name, with database->lock held.
+ * \copydetails database_find_table
+ * \see database_find_table */
+static DbTable*
+find_table (Database *database, const char *name)
 {
   DbTable *table = database->first_table;
   while (table) {
@@ -387,9 +522,24 @@ database_create_table (Database *database, const struct schema *schema)
 DbTable*
 database_find_or_create_table(Database *database, struct schema *schema)
 {
+  DbTable *table;
+
   if (database == NULL) return NULL;
   if (schema == NULL) return NULL;
 
+  pthread_mutex_lock(&database->lock);
+  table = find_or_create_table(database, schema);
+  pthread_mutex_unlock(&database->lock);
+
+  return table;
+}
+
+/** Search for, or create, a table, with database->lock held.
+ * \copydetails database_find_or_create_table
+ * \see database_find_or_create_table */
+static DbTable*
+find_or_create_table(Database *database, struct schema *schema)
+{
   DbTable *table = NULL;
   struct schema *s = schema_copy(schema);
   int i = 1;
@@ -398,7 +548,7 @@ database_find_or_create_table(Database *database, struct schema *schema)
   tnlen = strlen(schema->name);
 
   do {
-    table = database_find_table (database, s->name);
+    table = find_table (database, s->name);
 
     if (table) {
       diff = schema_diff (s, table->schema);
@@ -463,6 +613,427 @@ database_find_or_create_table(Database *database, struct schema *schema)
   return table;
 }
 
+/** Queue a sample for insertion into a table.
+ *
+ * The values are copied, and inserted later by the writer thread of the
+ * Database, so the caller never waits for the storage backend. Samples can be
+ * queued into the same Database from several threads; those queued by one
+ * thread are inserted in order.
+ *
+ * The queue is not strictly bounded, but once it holds more than
+ * DB_QUEUE_MAX_ROWS samples, callers should stop reading more data from their
+ * clients, and use database_queue_wait() to be told when to resume.
+ *
+ * \param database Database to insert into
+ * \param table DbTable of that Database to insert into
+ * \param sender_id sender ID, as returned by database_add_sender_id()
+ * \param seq_no sequence number of the sample
+ * \param time_stamp timestamp of the sample, rebased to the start time of database
+ * \param values array of OmlValue containing the sample
+ * \param value_count number of elements in values
+ * \return 0 on success, 1 if the queue is now full, -1 on error
+ *
+ * \see database_queue_wait, db_adapter_insert
+ */
+int
+database_insert(Database *database, DbTable *table, int sender_id, int seq_no,
+    double time_stamp, OmlValue *values, int value_count)
+{
+  DbQueue *q = database->queue;
+  DbRow *row;
+  OmlValue *v;
+  int i, ret = -1;
+
+  pthread_mutex_lock(&q->lock);
+
+  if ((row = q->free_rows)) {
+    q->free_rows = row->next;
+  } else if ((row = oml_malloc(sizeof(DbRow)))) {
+    memset(row, 0, sizeof(DbRow));
+  } else {
+    logerror("%s: Cannot allocate memory to queue sample %d for table '%s'\n",
+        database->name, seq_no, table->schema->name);
+    goto exit;
+  }
+
+  if (value_count > row->value_size) {
+    if (!(v = oml_realloc(row->values, value_count * sizeof(OmlValue)))) {
+      logerror("%s: Cannot allocate memory to queue %d values for table '%s'\n",
+          database->name, value_count, table->schema->name);
+      row->next = q->free_rows;
+      q->free_rows = row;
+      goto exit;
+    }
+    oml_value_array_init(&v[row->value_size], value_count - row->value_size);
+    row->values = v;
+    row->value_size = value_count;
+  }
+  for (i = 0; i < value_count; i++) {
+    if (oml_value_duplicate(&row->values[i], &values[i])) {
+      logerror("%s: Cannot copy value %d of sample %d for table '%s'\n",
+          database->name, i, seq_no, table->schema->name);
+      row->next = q->free_rows;
+      q->free_rows = row;
+      goto exit;
+    }
+  }
+  row->table = table;
+  row->sender_id = sender_id;
+  row->seq_no = seq_no;
+  row->time_stamp = time_stamp;
+  row->value_count = value_count;
+  row->next = NULL;
+
+  if (q->tail) {
+    q->tail->next = row;
+  } else {
+    q->head = row;
+    pthread_cond_signal(&q->cond);
+  }
+  q->tail = row;
+  ret = (++q->depth >= DB_QUEUE_MAX_ROWS);
+
+exit:
+  pthread_mutex_unlock(&q->lock);
+
+  return ret;
+}
+
+/** Get the number of samples waiting to be inserted into a Database.
+ *
+ * \param database Database
+ * \return the number of samples in the queue
+ *
+ * \see database_insert
+ */
+int
+database_queue_depth(Database *database)
+{
+  int depth;
+
+  pthread_mutex_lock(&database->queue->lock);
+  depth = database->queue->depth;
+  pthread_mutex_unlock(&database->queue->lock);
+
+  return depth;
+}
+
+/** Run the resume task of a DbQueueWaiter, in the thread which registered it.
+ * \param handle DbQueueWaiter
+ * \see database_queue_wait, o_el_task_callback */
+static void
+waiter_resume(void *handle)
+{
+  DbQueueWaiter *waiter = (DbQueueWaiter*)handle;
+
+  /* The writer no longer refers to waiter once it has been posted */
+  waiter->state = DB_WAITER_IDLE;
+  waiter->resume(waiter->handle);
+}
+
+/** Wait for the queue of a Database to drain.
+ *
+ * Once the queue has drained to half of DB_QUEUE_MAX_ROWS, resume is posted
+ * to the EventLoop of the calling thread. Until then, waiter must not be
+ * freed without calling database_queue_cancel().
+ *
+ * \param database Database whose queue is full
+ * \param waiter DbQueueWaiter to register, which must not be waiting already
+ * \param resume function to run, in the calling thread, once the queue has drained
+ * \param handle pointer to opaque data passed to resume
+ * \return 0 if resume will be run later, 1 if the queue has already drained
+ * (resume is not run), -1 on error
+ *
+ * \see database_insert, database_queue_cancel, eventloop_post
+ */
+int
+database_queue_wait(Database *database, DbQueueWaiter *waiter, o_el_task_callback resume, void *handle)
+{
+  DbQueue *q = database->queue;
+  int ret = 0;
+
+  assert(waiter->state == DB_WAITER_IDLE);
+  if (!(waiter->loop = eventloop_self())) {
+    return -1;
+  }
+  waiter->resume = resume;
+  waiter->handle = handle;
+
+  pthread_mutex_lock(&q->lock);
+  if (q->depth <= DB_QUEUE_MAX_ROWS / 2) {
+    ret = 1;
+  } else {
+    waiter->state = DB_WAITER_WAITING;
+    waiter->next = q->waiters;
+    q->waiters = waiter;
+  }
+  pthread_mutex_unlock(&q->lock);
+
+  return ret;
+}
+
+/** Stop waiting for the queue of a Database to drain.
+ *
+ * \param database Database whose queue waiter was registered with
+ * \param waiter DbQueueWaiter registered with database_queue_wait(), if at all
+ * \return 0 if waiter can be freed, 1 if its resume task has already been
+ * posted, and will still run
+ *
+ * \see database_queue_wait
+ */
+int
+database_queue_cancel(Database *database, DbQueueWaiter *waiter)
+{
+  DbQueue *q = database->queue;
+  DbQueueWaiter **w;
+
+  pthread_mutex_lock(&q->lock);
+  if (waiter->state == DB_WAITER_WAITING) {
+    for (w = &q->waiters; *w; w = &(*w)->next) {
+      if (*w == waiter) {
+        *w = waiter->next;
+        break;
+      }
+    }
+    waiter->state = DB_WAITER_IDLE;
+  }
+  pthread_mutex_unlock(&q->lock);
+
+  return waiter->state == DB_WAITER_POSTED;
+}
+
+/** Forget all the waiters of an EventLoop which is about to go away.
+ *
+ * This should be called by threads which exit while clients they were
+ * processing may still be waiting for a queue to drain.
+ *
+ * \param loop EventLoop of the exiting thread
+ * \see database_queue_wait, eventloop_self
+ */
+void
+database_queue_forget(EventLoop *loop)
+{
+  Database *db;
+  DbQueueWaiter **w;
+
+  pthread_mutex_lock(&databases_lock);
+  for (db = first_db; db; db = db->next) {
+    if (db->ready <= 0) {
+      /* Still being opened, so nobody can be waiting for it yet */
+      continue;
+    }
+    pthread_mutex_lock(&db->queue->lock);
+    for (w = &db->queue->waiters; *w; ) {
+      if ((*w)->loop == loop) {
+        (*w)->state = DB_WAITER_IDLE;
+        *w = (*w)->next;
+      } else {
+        w = &(*w)->next;
+      }
+    }
+    pthread_mutex_unlock(&db->queue->lock);
+  }
+  pthread_mutex_unlock(&databases_lock);
+}
+
+/** Report the depth of the queue of a Database, at most once per second.
+ *
+ * Must be called with the queue lock held.
+ *
+ * \param database Database
+ * \param now current time
+ * \see database_insert
+ */
+static void
+queue_report(Database *database, time_t now)
+{
+  DbQueue *q = database->queue;
+
+  if (now == q->last_report) {
+    return;
+  }
+  logdebug2("%s: %d samples queued, %u inserted\n", database->name, q->depth, q->written);
+#ifndef NOOML /* For unit tests */
+  database_queue_inject(database->name, q->depth, q->written);
+#endif
+  q->last_report = now;
+  q->written = 0;
+}
+
+/** Main function of the writer thread of a Database.
+ *
+ * The writer takes all the samples queued so far, and inserts them while
+ * more are queued, until asked to stop.
+ *
+ * \param arg Database
+ * \return NULL
+ * \see database_insert, queue_start, queue_stop
+ */
+static void*
+queue_run(void *arg)
+{
+  Database *db = (Database*)arg;
+  DbQueue *q = db->queue;
+  DbQueueWaiter *w, *next;
+  DbRow *batch, *last, *row;
+  int count;
+
+  pthread_mutex_lock(&q->lock);
+  while (1) {
+    while (!q->head && !q->stopping) {
+      pthread_cond_wait(&q->cond, &q->lock);
+    }
+    if (!q->head) {
+      break;
+    }
+    batch = q->head;
+    last = q->tail;
+    q->head = q->tail = NULL;
+    pthread_mutex_unlock(&q->lock);
+
+    count = 0;
+    pthread_mutex_lock(&db->lock);
+    for (row = batch; row; row = row->next, count++) {
+      db->insert(db, row->table, row->sender_id, row->seq_no, row->time_stamp,
+          row->values, row->value_count);
+    }
+    pthread_mutex_unlock(&db->lock);
+
+    pthread_mutex_lock(&q->lock);
+    last->next = q->free_rows;
+    q->free_rows = batch;
+    q->depth -= count;
+    q->written += count;
+
+    if (q->depth <= DB_QUEUE_MAX_ROWS / 2) {
+      for (w = q->waiters; w; w = next) {
+        /* The waiter belongs to its thread as soon as it is posted */
+        next = w->next;
+        w->state = DB_WAITER_POSTED;
+        if (eventloop_post(w->loop, waiter_resume, w)) {
+          logwarn("%s: Cannot resume client waiting for the queue to drain\n", db->name);
+        }
+      }
+      q->waiters = NULL;
+    }
+    queue_report(db, time(NULL));
+  }
+  pthread_mutex_unlock(&q->lock);
+
+  return NULL;
+}
+
+/** Start the writer thread of a Database.
+ *
+ * \param database Database
+ * \return 0 on success, -1 otherwise
+ * \see queue_run, queue_stop
+ */
+static int
+queue_start(Database *database)
+{
+  DbQueue *q;
+  int ret;
+
+  if (!(q = oml_malloc(sizeof(DbQueue)))) {
+    logerror("%s: Cannot allocate memory for insertion queue\n", database->name);
+    return -1;
+  }
+  memset(q, 0, sizeof(DbQueue));
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->cond, NULL);
+  database->queue = q;
+
+  if ((ret = pthread_create(&q->writer, NULL, queue_run, database))) {
+    logerror("%s: Cannot start writer thread: %s\n", database->name, strerror(ret));
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->lock);
+    oml_free(q);
+    database->queue = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+/** Insert all queued samples, then stop the writer thread of a Database.
+ *
+ * \param database Database
+ * \see queue_run, queue_start
+ */
+static void
+queue_stop(Database *database)
+{
+  DbQueue *q = database->queue;
+  DbRow *row;
+
+  pthread_mutex_lock(&q->lock);
+  q->stopping = 1;
+  pthread_cond_signal(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+  pthread_join(q->writer, NULL);
+
+  while ((row = q->free_rows)) {
+    q->free_rows = row->next;
+    oml_value_array_reset(row->values, row->value_size);
+    oml_free(row->values);
+    oml_free(row);
+  }
+  pthread_cond_destroy(&q->cond);
+  pthread_mutex_destroy(&q->lock);
+  oml_free(q);
+  database->queue = NULL;
+}
+
+/** Get the ID of a sender, adding it to the database if needed.
+ *
+ * \param database Database to look the sender up in
+ * \param sender_id name of the sender
+ * \return the ID of the sender
+ *
+ * \see db_add_sender_id
+ */
+int
+database_add_sender_id(Database *database, const char *sender_id)
+{
+  int ret;
+
+  pthread_mutex_lock(&database->lock);
+  ret = database->add_sender_id(database, sender_id);
+  pthread_mutex_unlock(&database->lock);
+
+  return ret;
+}
+
+/** Get the start time of a database, setting it if it has none yet.
+ *
+ * The first client to connect to a new database sets its start time, which is
+ * then saved in its metadata.
+ *
+ * \param database Database to get the start time of
+ * \param start_time start time of the client, used if the database has none
+ * \return the start time of the database
+ *
+ * \see db_adapter_set_metadata
+ */
+time_t
+database_start_time(Database *database, time_t start_time)
+{
+  char s[64];
+
+  pthread_mutex_lock(&database->lock);
+  if (database->start_time == 0) {
+    // seed it with a time in the past
+    database->start_time = start_time;// - 100;
+    snprintf (s, LENGTH(s), "%u", (unsigned int)start_time);
+    database->set_metadata (database, "start_time", s);
+  }
+  start_time = database->start_time;
+  pthread_mutex_unlock(&database->lock);
+
+  return start_time;
+}
+
 /*
  * Destroy a table in a database, by free all allocated data
  * structures.  Does not release the table in the backend adapter.
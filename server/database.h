@@ -13,7 +13,10 @@
 #ifndef DATABASE_H_
 #define DATABASE_H_
 
+#include <pthread.h>
+
 #include "oml2/omlc.h"
+#include "ocomm/o_eventloop.h"
 #include "mstring.h"
 #include "table_descr.h"
 #include "schema.h"
@@ -34,8 +37,13 @@
  */
 #define MAX_TABLE_RENAME 10
 
+/** Number of samples queued for insertion into a Database above which its
+ * clients should stop sending more \see database_insert, database_queue_wait */
+#define DB_QUEUE_MAX_ROWS 10000
+
 struct Database;
 struct DbTable;
+struct DbQueue;
 typedef struct DbTable DbTable;
 typedef struct Database Database;
 
@@ -191,6 +199,32 @@ struct DbTable {
   struct DbTable* next;
 };
 
+/** State of a DbQueueWaiter */
+typedef enum {
+  DB_WAITER_IDLE = 0,   /**< Not waiting */
+  DB_WAITER_WAITING,    /**< Waiting for the queue to drain */
+  DB_WAITER_POSTED,     /**< The queue has drained, and the resume task has been posted */
+} DbWaiterState;
+
+/** Client waiting for the queue of a Database to drain.
+ *
+ * This is usually embedded in the structure of the client.
+ *
+ * \see database_queue_wait, database_queue_cancel
+ */
+typedef struct DbQueueWaiter {
+  /** EventLoop of the thread in which to resume the client \see eventloop_self */
+  EventLoop*  loop;
+  /** Function posted to loop once the queue has drained */
+  o_el_task_callback resume;
+  /** Pointer to opaque data passed to resume */
+  void*       handle;
+  /** Current state */
+  DbWaiterState state;
+  /** Pointer to the next waiter of the same Database */
+  struct DbQueueWaiter* next;
+} DbQueueWaiter;
+
 /** An open and active database, with manipulations functions from its backend */
 struct Database{
   /** Name of this database */
@@ -200,12 +234,20 @@ struct Database{
 
   /** Number of active clients */
   int        ref_count;
+  /** 0 while database_find opens the backend, 1 once the database is usable,
+   * -1 if it could not be opened \see database_find */
+  int        ready;
   /** Pointer to the first data table */
   DbTable*   first_table;
   /** Experiment start time */
   time_t     start_time;
   /** Opaque pointer to database implementation handle */
   void*      handle;
+  /** Serialises accesses to the tables and backend of this database,
+   * which ClientHandlers of different threads may share */
+  pthread_mutex_t lock;
+  /** Samples waiting to be inserted by the writer thread \see database_insert */
+  struct DbQueue* queue;
 
   /** Pointer to OML-to-native type conversion function */
   db_adapter_oml_to_type o2t;
@@ -265,6 +307,15 @@ void     database_table_free(Database *database, DbTable* table);
 
 MString *database_make_sql_insert (Database *db, DbTable* table);
 
+int database_insert(Database *database, DbTable *table, int sender_id, int seq_no,
+    double time_stamp, OmlValue *values, int value_count);
+int database_queue_depth(Database *database);
+int database_queue_wait(Database *database, DbQueueWaiter *waiter, o_el_task_callback resume, void *handle);
+int database_queue_cancel(Database *database, DbQueueWaiter *waiter);
+void database_queue_forget(EventLoop *loop);
+int database_add_sender_id(Database *database, const char *sender_id);
+time_t database_start_time(Database *database, time_t start_time);
+
 
 #endif /*DATABASE_H_*/
 
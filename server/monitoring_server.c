@@ -82,6 +82,20 @@ client_event_inject(const char* address, uint32_t port, const char* oml_id, cons
   }
 }
 
+/** Inject the state of the insertion queue of a database into the monitoring OML server.
+ *
+ * \param domain  name of the database
+ * \param depth   number of samples waiting to be inserted
+ * \param written number of samples inserted since the last report
+ */
+void
+database_queue_inject(const char* domain, uint32_t depth, uint32_t written)
+{
+  if(oml_enabled) {
+    oml_inject_database_queue(g_oml_mps_oml2_server->database_queue, domain, depth, written);
+  }
+}
+
 /*
  Local Variables:
  mode: C
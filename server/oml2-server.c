@@ -44,6 +44,8 @@
 #include "oml_utils.h"
 #include "hook.h"
 #include "client_handler.h"
+#include "udp_listener.h"
+#include "workers.h"
 #include "database.h"
 #include "sqlite_adapter.h"
 #include "monitoring_server.h"
@@ -82,8 +84,10 @@ die (const char *fmt, ...)
 #define DEFAULT_LOG_FILE "oml_server.log"
 
 static char* listen_service = DEFAULT_PORT_STR;
+static int listen_udp = 0;
 static int log_level = O_LOG_INFO;
 static int socket_timeout = 60;
+static int worker_threads = 0;
 static char* logfile_name = NULL;
 static char* uidstr = NULL;
 static char* gidstr = NULL;
@@ -101,6 +105,7 @@ extern char *pg_conninfo;
 struct poptOption options[] = {
   POPT_AUTOHELP
   { "listen", 'l', POPT_ARG_STRING, &listen_service, 0, "Service to listen for TCP based clients", DEFAULT_PORT_STR},
+  { "udp", '\0', POPT_ARG_NONE, &listen_udp, 0, "Also receive datagrams from UDP based clients on the same service", NULL},
   { "backend", 'b', POPT_ARG_STRING, &dbbackend, 0, "Database server backend", DEFAULT_DB_BACKEND},
   { "data-dir", 'D', POPT_ARG_STRING, &sqlite_database_dir, 0, "Directory to store database files (sqlite)", "DIR" },
 #if HAVE_LIBPQ
@@ -114,6 +119,7 @@ struct poptOption options[] = {
   { "group", '\0', POPT_ARG_STRING, &gidstr, 0, "Change server's group id", "GID" },
   { "event-hook", 'H', POPT_ARG_STRING, &hook, 0, "Path to an event hook taking input on stdin", "HOOK" },
   { "timeout", 't', POPT_ARG_INT, &socket_timeout, 0, "Timeout after which idle receiving sockets are cleaned up to avoid resource exhaustion", "60"  },
+  { "threads", 'T', POPT_ARG_INT, &worker_threads, 0, "Number of worker threads processing clients, or 0 to process them in the main thread", "0"  },
   { "debug-level", 'd', POPT_ARG_INT, &log_level, 0, "Increase debug level", "{1 .. 4}"  },
   { "logfile", '\0', POPT_ARG_STRING, &logfile_name, 0, "File to log to", DEFAULT_LOG_FILE },
   { "version", 'v', POPT_ARG_NONE, NULL, 'v', "Print version information and exit", NULL },
@@ -255,7 +261,8 @@ static void drop_privileges (const char *uidstr, const char *gidstr)
 
 /** Callback called when a new connection is received on the listening Socket.
  *
- * This function creates a ClientHandler to manage the data from this Socket.
+ * This function creates a ClientHandler to manage the data from this Socket,
+ * or hands the Socket over to a worker thread to do so.
  * The listening Socket would have been created using socket_server_new().
  *
  * \param new_sock Socket object created by accept()ing the connection
@@ -267,6 +274,9 @@ static void drop_privileges (const char *uidstr, const char *gidstr)
 static void on_connect(Socket* new_sock, void* handle)
 {
   (void)handle;
+  if (!workers_dispatch(new_sock)) {
+    return;
+  }
   (void)client_handler_new(new_sock);
   logdebug("%s: New client connected\n", new_sock->name);
 }
@@ -336,6 +346,10 @@ int main(int argc, const char **argv)
     die ("Failed to create listening socket for service %s\n", listen_service);
   }
 
+  if (listen_udp && !udp_listener_setup(listen_service, socket_timeout)) {
+    logwarn ("Failed to create UDP listening socket for service %s, only accepting TCP clients\n", listen_service);
+  }
+
   drop_privileges (uidstr, gidstr);
 
   /* Important that this comes after drop_privileges(). */
@@ -347,8 +361,14 @@ int main(int argc, const char **argv)
 
   hook_setup();
 
+  workers_setup(worker_threads, socket_timeout);
+
   eventloop_run();
 
+  workers_cleanup();
+
+  udp_listener_cleanup();
+
   signal_cleanup();
 
   hook_cleanup();
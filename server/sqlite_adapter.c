@@ -282,15 +282,111 @@ sq3_release(Database* db)
   db->handle = NULL;
 }
 
+/** Number of rows inserted by each of the INSERT statements of a table,
+ * from the largest to a single row.
+ *
+ * Samples are accumulated until the largest batch is full, and stored with as
+ * few statements as possible, saving most of the per-statement overhead of
+ * SQLite for narrow tables.
+ *
+ * \see Sq3Table, sq3_insert, sq3_flush
+ */
+static const int sq3_batch_rows[SQ3_BATCH_SIZES] = { 64, 16, 4, 1 };
+
+/** Build an INSERT statement for several rows of a table.
+ *
+ * \param db Database containing the table
+ * \param table DbTable to insert into
+ * \param rows number of rows
+ * \return an MString containing the statement, to be mstring_delete()d by the
+ * caller, or NULL on error
+ * \see database_make_sql_insert
+ */
+static MString*
+sq3_make_sql_insert (Database *db, DbTable *table, int rows)
+{
+  MString *insert, *batch;
+  char *buf, *values;
+  int i, n = 0;
+
+  if (!(insert = database_make_sql_insert (db, table))) {
+    return NULL;
+  }
+  if (rows == 1) {
+    return insert;
+  }
+
+  /* Repeat the "(?, ..., ?)" of the single-row statement, without its ';' */
+  buf = mstring_buf (insert);
+  buf[mstring_len (insert) - 1] = '\0';
+  if (!(values = strstr (buf, ") VALUES ("))) {
+    mstring_delete (insert);
+    return NULL;
+  }
+  values += 9;
+
+  if ((batch = mstring_create ())) {
+    n += mstring_set (batch, buf);
+    for (i = 1; i < rows; i++) {
+      n += mstring_sprintf (batch, ", %s", values);
+    }
+    n += mstring_cat (batch, ";");
+    if (n != 0) {
+      mstring_delete (batch);
+      batch = NULL;
+    }
+  }
+  mstring_delete (insert);
+
+  return batch;
+}
+
+/** Get the INSERT statement for one of the batch sizes of a table, preparing
+ * it if needed.
+ *
+ * \param db Database containing the table
+ * \param table DbTable to insert into
+ * \param size index of the batch size in sq3_batch_rows
+ * \return the prepared statement, or NULL on error
+ */
+static sqlite3_stmt*
+sq3_insert_stmt (Database *db, DbTable *table, int size)
+{
+  Sq3DB* sq3db = (Sq3DB*)db->handle;
+  Sq3Table* sq3table = (Sq3Table*)table->handle;
+  MString *insert;
+
+  if (sq3table->insert_stmts[size]) {
+    return sq3table->insert_stmts[size];
+  }
+
+  if (!(insert = sq3_make_sql_insert (db, table, sq3_batch_rows[size]))) {
+    logerror ("sqlite:%s: Failed to build SQL INSERT INTO statement string for %d rows of table '%s'\n",
+        db->name, sq3_batch_rows[size], table->schema->name);
+    return NULL;
+  }
+
+  if (sqlite3_prepare_v2(sq3db->conn, mstring_buf(insert), -1,
+                         &sq3table->insert_stmts[size], 0) != SQLITE_OK) {
+    logerror("sqlite:%s: Could not prepare statement '%s': %s\n",
+        db->name, mstring_buf(insert), sqlite3_errmsg(sq3db->conn));
+    sq3table->insert_stmts[size] = NULL;
+  }
+  mstring_delete (insert);
+
+  return sq3table->insert_stmts[size];
+}
+
 /** Create the adapter structures required for the SQLite3 adapter
  * \see db_adapter_table_create
  */
 static int
 sq3_table_create (Database* db, DbTable* table, int shallow)
 {
-  MString *insert = NULL;
   Sq3DB* sq3db = NULL;
   Sq3Table *sq3table = NULL;
+  OmlValue *values;
+  int i, nrows, nfields, max_vars;
   if (db == NULL) {
       logwarn("sqlite: Tried to create a table in a NULL database\n");
       return -1;
@@ -320,145 +416,96 @@ sq3_table_create (Database* db, DbTable* table, int shallow)
         table->schema->name);
   }
   sq3table = (Sq3Table*)oml_malloc(sizeof(Sq3Table));
+  if (!sq3table) {
+    goto fail_exit;
+  }
+  memset(sq3table, 0, sizeof(Sq3Table));
   table->handle = sq3table;
 
-  /* XXX: Should not be done here, see #1056 */
-  insert = database_make_sql_insert (db, table);
-  if (!insert) {
-    logerror ("sqlite:%s: Failed to build SQL INSERT INTO statement string for table '%s'\n",
-             db->name, table->schema->name);
+  /* Do not batch more rows than fit in the variables of one statement */
+  nfields = table->schema->nfields;
+  max_vars = sqlite3_limit(sq3db->conn, SQLITE_LIMIT_VARIABLE_NUMBER, -1);
+  while (sq3table->first_size < SQ3_BATCH_SIZES - 1 &&
+      sq3_batch_rows[sq3table->first_size] * (nfields + 4) > max_vars) {
+    sq3table->first_size++;
+  }
+  nrows = sq3_batch_rows[sq3table->first_size];
+
+  sq3table->rows = (Sq3Row*)oml_malloc(nrows * (sizeof(Sq3Row) + nfields * sizeof(OmlValue)));
+  if (!sq3table->rows) {
+    logerror ("sqlite:%s: Failed to allocate memory to batch %d samples for table '%s'\n",
+             db->name, nrows, table->schema->name);
     goto fail_exit;
   }
+  values = (OmlValue*)&sq3table->rows[nrows];
+  oml_value_array_init(values, nrows * nfields);
+  for (i = 0; i < nrows; i++) {
+    sq3table->rows[i].values = &values[i * nfields];
+  }
 
-  if (sqlite3_prepare_v2(sq3db->conn, mstring_buf(insert), -1,
-                         &sq3table->insert_stmt, 0) != SQLITE_OK) {
-    logerror("sqlite:%s: Could not prepare statement '%s': %s\n",
-        db->name, mstring_buf(insert), sqlite3_errmsg(sq3db->conn));
+  /* XXX: Should not be done here, see #1056 */
+  if (!sq3_insert_stmt (db, table, SQ3_BATCH_SIZES - 1)) {
     goto fail_exit;
   }
 
-  if (insert) { mstring_delete (insert); }
   return 0;
 
  fail_exit:
-  if (insert) { mstring_delete (insert); }
-  if (sq3table) { oml_free (sq3table); }
-  return -1;
-}
-
-/** Free an SQLite3 table
- *
- * Parameter database is ignored in this implementation
- *
- * \see db_adapter_table_free, sqlite3_finalize
- */
-static int
-sq3_table_free (Database *database, DbTable* table)
-{
-  (void)database;
-  Sq3Table* sq3table = (Sq3Table*)table->handle;
-  int ret = 0;
   if (sq3table) {
-    ret = sqlite3_finalize (sq3table->insert_stmt);
-    if (ret != SQLITE_OK) {
-      logwarn("sqlite:%s: Couldn't finalise statement for table '%s' (database error)\n",
-          database->name, table->schema->name);
-    }
+    oml_free (sq3table->rows);
     oml_free (sq3table);
+    table->handle = NULL;
   }
-  return ret;
+  return -1;
 }
 
-/** Return a string suitable for an unbound variable is SQLite3.
+/** Bind a sample to the variables of one row of a (multi-row) INSERT statement.
  *
- * This is always "?"
+ * The values of the sample must stay unchanged until the statement is stepped.
  *
- * \see db_adapter_prepared_var
- */
-static char*
-sq3_prepared_var(Database *db, unsigned int order)
-{
-  char *s = oml_malloc(2);
-
-  (void)db;
-
-  if (NULL != s) {
-    *s = '?';
-    *(s+1) = 0;
-  }
-
-  return s;
-}
-
-/** Insert value in the SQLite3 database.
- * \see db_adapter_insert
+ * \param db Database containing the table
+ * \param table DbTable to insert into
+ * \param stmt prepared INSERT statement
+ * \param base number of variables of the rows before this one in stmt
+ * \param row Sq3Row to bind
+ * \return 0 on success, -1 otherwise
+ * \see sq3_flush
  * XXX: This function actively does text protocol interpretation, see #1088
  */
 static int
-sq3_insert(Database *db, DbTable *table, int sender_id, int seq_no, double time_stamp, OmlValue *values, int value_count)
+sq3_bind_row(Database *db, DbTable *table, sqlite3_stmt *stmt, int base, Sq3Row *row)
 {
   Sq3DB* sq3db = (Sq3DB*)db->handle;
-  Sq3Table* sq3table = (Sq3Table*)table->handle;
   int i;
-  double time_stamp_server;
-  sqlite3_stmt* stmt = sq3table->insert_stmt;
   char *json = NULL;
   ssize_t json_sz;
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  time_stamp_server = tv.tv_sec - db->start_time + 0.000001 * tv.tv_usec;
-
-  if (tv.tv_sec > sq3db->last_commit) {
-    if (dba_reopen_transaction (db) == -1) {
-      return -1;
-    }
-    sq3db->last_commit = tv.tv_sec;
-  }
 
-  //  o_log(O_LOG_DEBUG2, "sq3_insert(%s): insert row %d \n",
-  //        table->schema->name, seq_no);
-
-  if (sqlite3_bind_int(stmt, 1, sender_id) != SQLITE_OK) {
+  if (sqlite3_bind_int(stmt, base + 1, row->sender_id) != SQLITE_OK) {
     logerror("sqlite:%s: Could not bind 'oml_sender_id' in table '%s': %s\n",
         db->name, table->schema->name,
         sqlite3_errmsg(sq3db->conn));
   }
-  if (sqlite3_bind_int(stmt, 2, seq_no) != SQLITE_OK) {
+  if (sqlite3_bind_int(stmt, base + 2, row->seq_no) != SQLITE_OK) {
     logerror("sqlite:%s: Could not bind 'oml_seq' in table '%s': %s\n",
         db->name, table->schema->name,
         sqlite3_errmsg(sq3db->conn));
   }
-  if (sqlite3_bind_double(stmt, 3, time_stamp) != SQLITE_OK) {
+  if (sqlite3_bind_double(stmt, base + 3, row->time_stamp) != SQLITE_OK) {
     logerror("sqlite:%s: Could not bind 'oml_ts_client' in table '%s': %s\n",
         db->name, table->schema->name,
         sqlite3_errmsg(sq3db->conn));
   }
-  if (sqlite3_bind_double(stmt, 4, time_stamp_server) != SQLITE_OK) {
+  if (sqlite3_bind_double(stmt, base + 4, row->time_stamp_server) != SQLITE_OK) {
     logerror("sqlite:%s: Could not bind 'oml_ts_server' in table '%s': %s\n",
         db->name, table->schema->name,
         sqlite3_errmsg(sq3db->conn));
   }
 
-  OmlValue* v = values;
+  OmlValue* v = row->values;
   struct schema *schema = table->schema;
-  if (schema->nfields != value_count) {
-    logerror ("sqlite:%s: Failed to insert %d values into table '%s' with %d columns\n",
-        db->name, value_count, table->schema->name, schema->nfields);
-    sqlite3_reset (stmt);
-    return -1;
-  }
   for (i = 0; i < schema->nfields; i++, v++) {
-    if (oml_value_get_type(v) != schema->fields[i].type) {
-      const char *expected = oml_type_to_s (schema->fields[i].type);
-      const char *received = oml_type_to_s (oml_value_get_type(v));
-      logerror("sqlite:%s: Value %d type mismatch for table '%s'\n", db->name, i, table->schema->name);
-      logdebug("sqlite:%s: -> Column name='%s', type=%s, but trying to insert a %s\n",
-          db->name, schema->fields[i].name, expected, received);
-      sqlite3_reset (stmt);
-      return -1;
-    }
     int res;
-    int idx = i + 5;
+    int idx = base + i + 5;
     switch (schema->fields[i].type) {
     case OML_DOUBLE_VALUE:
       res = sqlite3_bind_double(stmt, idx, omlc_get_double(*oml_value_get_value(v)));
@@ -487,14 +534,14 @@ sq3_insert(Database *db, DbTable *table, int sender_id, int seq_no, double time_
 
     case OML_STRING_VALUE:
       res = sqlite3_bind_text (stmt, idx, omlc_get_string_ptr(*oml_value_get_value(v)),
-          -1, SQLITE_TRANSIENT);
+          -1, SQLITE_STATIC);
       break;
 
     case OML_BLOB_VALUE:
       res = sqlite3_bind_blob (stmt, idx,
           omlc_get_blob_ptr(*oml_value_get_value(v)),
           omlc_get_blob_length(*oml_value_get_value(v)),
-          SQLITE_TRANSIENT);
+          SQLITE_STATIC);
       break;
 
     case OML_GUID_VALUE:
@@ -560,24 +607,219 @@ sq3_insert(Database *db, DbTable *table, int sender_id, int seq_no, double time_
     default:
       logerror("sqlite:%s: Unknown type %d in col '%s' of table '%s; this is probably a bug'\n",
           db->name, schema->fields[i].type, schema->fields[i].name, table->schema->name);
-      sqlite3_reset (stmt);
       return -1;
     }
     if (res != SQLITE_OK) {
       logerror("sqlite:%s: Could not bind column '%s': %s\n",
           db->name, schema->fields[i].name, sqlite3_errmsg(sq3db->conn));
-      sqlite3_reset (stmt);
       return -1;
     }
   }
 
-  if (sqlite3_step(stmt) != SQLITE_DONE) {
-    logerror("sqlite:%s: Could not step SQL statement: %s\n",
-        db->name, sqlite3_errmsg(sq3db->conn));
+  return 0;
+}
+
+/** Store the samples batched for a table.
+ *
+ * The samples are inserted with as few statements as possible, using the
+ * largest batch sizes first, and smaller ones if they cannot be prepared. If
+ * a statement fails, the samples it contained are dropped, but the others are
+ * still inserted; if not even the single-row statement can be prepared, all
+ * remaining samples are dropped.
+ *
+ * \param db Database containing the table
+ * \param table DbTable to flush
+ * \return 0 on success, -1 if some samples could not be stored
+ * \see sq3_batch_rows, sq3_insert
+ */
+static int
+sq3_flush(Database *db, DbTable *table)
+{
+  Sq3DB* sq3db = (Sq3DB*)db->handle;
+  Sq3Table* sq3table = (Sq3Table*)table->handle;
+  sqlite3_stmt* stmt;
+  int ncols = table->schema->nfields + 4;
+  int size = sq3table->first_size, done = 0, ret = 0;
+  int nrows, i, failed;
+
+  while (done < sq3table->nrows) {
+    nrows = sq3_batch_rows[size];
+    if (nrows > sq3table->nrows - done) {
+      size++;
+      continue;
+    }
+    if (!(stmt = sq3_insert_stmt (db, table, size))) {
+      if (size < SQ3_BATCH_SIZES - 1) {
+        /* Try again with smaller batches */
+        size++;
+        continue;
+      }
+      logerror("sqlite:%s: Dropped %d samples from table '%s' without an INSERT statement\n",
+          db->name, sq3table->nrows - done, table->schema->name);
+      ret = -1;
+      break;
+    }
+
+    failed = 0;
+    for (i = 0; i < nrows; i++) {
+      if (sq3_bind_row (db, table, stmt, i * ncols, &sq3table->rows[done + i])) {
+        failed = 1;
+        break;
+      }
+    }
+    if (!failed && sqlite3_step(stmt) != SQLITE_DONE) {
+      logerror("sqlite:%s: Could not step SQL statement: %s\n",
+          db->name, sqlite3_errmsg(sq3db->conn));
+      failed = 1;
+    }
+    if (failed) {
+      logwarn("sqlite:%s: Dropped %d samples from table '%s'\n",
+          db->name, nrows, table->schema->name);
+      ret = -1;
+    }
     sqlite3_reset(stmt);
+    done += nrows;
+  }
+  sq3table->nrows = 0;
+
+  return ret;
+}
+
+/** Store the samples batched for all the tables of a database.
+ *
+ * \param db Database to flush
+ * \return 0 on success, -1 if some samples could not be stored
+ * \see sq3_flush
+ */
+static int
+sq3_flush_all(Database *db)
+{
+  DbTable *table;
+  int ret = 0;
+
+  for (table = db->first_table; table; table = table->next) {
+    if (table->handle && ((Sq3Table*)table->handle)->nrows > 0 &&
+        sq3_flush (db, table)) {
+      ret = -1;
+    }
+  }
+
+  return ret;
+}
+
+/** Free an SQLite3 table, after storing its pending samples
+ *
+ * \see db_adapter_table_free, sqlite3_finalize
+ */
+static int
+sq3_table_free (Database *database, DbTable* table)
+{
+  Sq3Table* sq3table = (Sq3Table*)table->handle;
+  int i, ret = 0;
+  if (sq3table) {
+    if (sq3table->nrows > 0) {
+      sq3_flush (database, table);
+    }
+    for (i = 0; i < SQ3_BATCH_SIZES; i++) {
+      if (sq3table->insert_stmts[i] &&
+          sqlite3_finalize (sq3table->insert_stmts[i]) != SQLITE_OK) {
+        logwarn("sqlite:%s: Couldn't finalise statement for table '%s' (database error)\n",
+            database->name, table->schema->name);
+        ret = -1;
+      }
+    }
+    oml_value_array_reset(sq3table->rows[0].values,
+        sq3_batch_rows[sq3table->first_size] * table->schema->nfields);
+    oml_free (sq3table->rows);
+    oml_free (sq3table);
+    table->handle = NULL;
+  }
+  return ret;
+}
+
+/** Return a string suitable for an unbound variable is SQLite3.
+ *
+ * This is always "?"
+ *
+ * \see db_adapter_prepared_var
+ */
+static char*
+sq3_prepared_var(Database *db, unsigned int order)
+{
+  char *s = oml_malloc(2);
+
+  (void)db;
+
+  if (NULL != s) {
+    *s = '?';
+    *(s+1) = 0;
+  }
+
+  return s;
+}
+
+/** Insert value in the SQLite3 database.
+ *
+ * The sample is copied and batched with the following ones of the same
+ * table; the batch is stored when it is full, or before the current
+ * transaction is committed, at most every second.
+ *
+ * \see db_adapter_insert, sq3_flush
+ */
+static int
+sq3_insert(Database *db, DbTable *table, int sender_id, int seq_no, double time_stamp, OmlValue *values, int value_count)
+{
+  Sq3DB* sq3db = (Sq3DB*)db->handle;
+  Sq3Table* sq3table = (Sq3Table*)table->handle;
+  Sq3Row* row;
+  int i, ret = 0;
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+
+  if (tv.tv_sec > sq3db->last_commit) {
+    /* Samples received before the commit belong in the committed transaction */
+    ret = sq3_flush_all (db);
+    if (dba_reopen_transaction (db) == -1) {
+      return -1;
+    }
+    sq3db->last_commit = tv.tv_sec;
+  }
+
+  //  o_log(O_LOG_DEBUG2, "sq3_insert(%s): insert row %d \n",
+  //        table->schema->name, seq_no);
+
+  OmlValue* v = values;
+  struct schema *schema = table->schema;
+  if (schema->nfields != value_count) {
+    logerror ("sqlite:%s: Failed to insert %d values into table '%s' with %d columns\n",
+        db->name, value_count, table->schema->name, schema->nfields);
     return -1;
   }
-  return sqlite3_reset(stmt);
+  row = &sq3table->rows[sq3table->nrows];
+  for (i = 0; i < schema->nfields; i++, v++) {
+    if (oml_value_get_type(v) != schema->fields[i].type) {
+      const char *expected = oml_type_to_s (schema->fields[i].type);
+      const char *received = oml_type_to_s (oml_value_get_type(v));
+      logerror("sqlite:%s: Value %d type mismatch for table '%s'\n", db->name, i, table->schema->name);
+      logdebug("sqlite:%s: -> Column name='%s', type=%s, but trying to insert a %s\n",
+          db->name, schema->fields[i].name, expected, received);
+      return -1;
+    }
+    if (oml_value_duplicate(&row->values[i], v)) {
+      logerror("sqlite:%s: Could not copy value %d for table '%s'\n", db->name, i, table->schema->name);
+      return -1;
+    }
+  }
+  row->sender_id = sender_id;
+  row->seq_no = seq_no;
+  row->time_stamp = time_stamp;
+  row->time_stamp_server = tv.tv_sec - db->start_time + 0.000001 * tv.tv_usec;
+
+  if (++sq3table->nrows == sq3_batch_rows[sq3table->first_size] &&
+      sq3_flush (db, table)) {
+    ret = -1;
+  }
+  return ret;
 }
 
 /** Do a key-value style select on a database table.
@@ -19,8 +19,30 @@ typedef struct Sq3DB {
   time_t    last_commit;
 } Sq3DB;
 
+/** Number of different sizes of multi-row INSERT statements per table
+ * \see sq3_batch_rows */
+#define SQ3_BATCH_SIZES 4
+
+/** Sample accepted by sq3_insert, but not stored yet */
+typedef struct Sq3Row {
+  int       sender_id;          /**< Sender of the sample */
+  int       seq_no;             /**< Sequence number of the sample */
+  double    time_stamp;         /**< Client timestamp of the sample */
+  double    time_stamp_server;  /**< Server timestamp of the sample */
+  OmlValue* values;             /**< Copy of the values of the sample */
+} Sq3Row;
+
 typedef struct Sq3Table {
-  sqlite3_stmt* insert_stmt;  // prepared insert statement
+  /** Prepared INSERT statements for batches of sq3_batch_rows[i] rows,
+   * only prepared when needed, except for the last single-row one */
+  sqlite3_stmt* insert_stmts[SQ3_BATCH_SIZES];
+  /** Index of the largest batch size which does not exceed the maximum
+   * number of variables of a statement */
+  int       first_size;
+  /** Samples waiting to be stored, up to sq3_batch_rows[first_size] */
+  Sq3Row*   rows;
+  /** Number of samples in rows */
+  int       nrows;
 } Sq3Table;
 
 int sq3_backend_setup (void);
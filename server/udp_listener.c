@@ -0,0 +1,247 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file udp_listener.c
+ * \brief Reception of measurements sent by clients over UDP.
+ *
+ * Clients send whole messages in each datagram (see udp_stream.c). Datagrams
+ * are dispatched, based on the address of their sender, to one ClientHandler
+ * per peer, which processes them as it would data read from a TCP stream.
+ *
+ * A peer is only known once its headers have been received, in a datagram
+ * starting with the "protocol" key; datagrams from unknown peers are dropped.
+ * Receiving headers from a known peer restarts its ClientHandler, as the
+ * client has most likely been restarted. Datagrams lost in transit show up as
+ * gaps in the oml_seq column of the corresponding tables.
+ *
+ * As there is no connection to be closed, peers which have been silent for
+ * longer than the socket timeout are forgotten.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ocomm/o_log.h"
+#include "ocomm/o_socket.h"
+#include "ocomm/o_eventloop.h"
+#include "mem.h"
+#include "client_handler.h"
+#include "udp_listener.h"
+
+/** Start of the headers sent by a client */
+#define HEADER_START "protocol:"
+
+/** Remote client sending datagrams */
+typedef struct UdpPeer {
+  sockaddr_t addr;            /**< Address the peer sends from */
+  socklen_t addr_len;         /**< Length of addr */
+  ClientHandler* ch;          /**< ClientHandler processing the datagrams of this peer */
+  time_t last_activity;       /**< Time at which the last datagram was received */
+  struct UdpPeer* next;       /**< Next known peer */
+} UdpPeer;
+
+/** All known peers */
+static UdpPeer* peers = NULL;
+/** Time after which silent peers are forgotten, or 0 to keep them forever */
+static int peer_timeout = 0;
+/** Timer periodically forgetting silent peers */
+static TimerEvtSource* reaper = NULL;
+
+/** Find the known peer sending from an address.
+ *
+ * \param addr address of the sender
+ * \param addr_len length of addr
+ * \return a pointer to the UdpPeer, or NULL if the address is unknown
+ */
+static UdpPeer*
+udp_peer_find(const sockaddr_t* addr, socklen_t addr_len)
+{
+  UdpPeer* peer;
+
+  for (peer = peers; peer; peer = peer->next) {
+    if (peer->addr_len == addr_len && !memcmp(&peer->addr, addr, addr_len)) {
+      break;
+    }
+  }
+  return peer;
+}
+
+/** Create a UdpPeer and its ClientHandler, and add it to the known peers.
+ *
+ * \param addr address of the sender
+ * \param addr_len length of addr
+ * \return a pointer to the new UdpPeer, or NULL on error
+ */
+static UdpPeer*
+udp_peer_new(const sockaddr_t* addr, socklen_t addr_len)
+{
+  Socket* sock;
+  UdpPeer* peer = oml_malloc(sizeof(UdpPeer));
+
+  if (!peer) {
+    return NULL;
+  }
+  memset(peer, 0, sizeof(UdpPeer));
+
+  if (!(sock = socket_udp_peer_new(addr, addr_len))) {
+    oml_free(peer);
+    return NULL;
+  }
+  if (!(peer->ch = client_handler_new_peer(sock))) {
+    socket_free(sock);
+    oml_free(peer);
+    return NULL;
+  }
+
+  memcpy(&peer->addr, addr, addr_len);
+  peer->addr_len = addr_len;
+  peer->next = peers;
+  peers = peer;
+
+  return peer;
+}
+
+/** Remove a UdpPeer from the known peers, and free it with its ClientHandler.
+ *
+ * \param peer UdpPeer to free
+ */
+static void
+udp_peer_free(UdpPeer* peer)
+{
+  UdpPeer** prev;
+
+  for (prev = &peers; *prev; prev = &(*prev)->next) {
+    if (*prev == peer) {
+      *prev = peer->next;
+      break;
+    }
+  }
+  client_handler_free(peer->ch);
+  oml_free(peer);
+}
+
+/** Dispatch a datagram to the ClientHandler of its sender.
+ *
+ * This is the o_so_datagram_callback of the UDP listening sockets.
+ *
+ * \copydetails o_so_datagram_callback
+ * \see socket_udp_server_new, client_handler_datagram
+ */
+void
+udp_listener_datagram(Socket* socket, const sockaddr_t* from, socklen_t from_len, void* buf, size_t len, void* handle)
+{
+  (void)handle;
+  UdpPeer* peer = udp_peer_find(from, from_len);
+  int is_header = len >= sizeof(HEADER_START) - 1 &&
+    !strncmp((char*)buf, HEADER_START, sizeof(HEADER_START) - 1);
+
+  if (peer && is_header) {
+    logdebug("%s: Received new headers, restarting\n", peer->ch->name);
+    udp_peer_free(peer);
+    peer = NULL;
+  }
+
+  if (!peer) {
+    if (!is_header) {
+      logdebug("%s: Dropping %zu bytes from unknown peer\n", socket->name, len);
+      return;
+    }
+    if (!(peer = udp_peer_new(from, from_len))) {
+      logwarn("%s: Could not create handler for new peer\n", socket->name);
+      return;
+    }
+  }
+
+  peer->last_activity = time(NULL);
+  if (client_handler_datagram(peer->ch, buf, len)) {
+    udp_peer_free(peer);
+  }
+}
+
+/** Forget the peers which have been silent for longer than the timeout.
+ *
+ * \param now current time
+ * \see udp_listener_setup
+ */
+void
+udp_listener_reap(time_t now)
+{
+  UdpPeer *peer, *next;
+
+  if (peer_timeout <= 0) {
+    return;
+  }
+
+  for (peer = peers; peer; peer = next) {
+    next = peer->next;
+    if (now - peer->last_activity > peer_timeout) {
+      loginfo("%s: Peer dropped due to idleness\n", peer->ch->name);
+      udp_peer_free(peer);
+    }
+  }
+}
+
+/** Timer callback to forget silent peers.
+ * \see o_el_timer_callback, udp_listener_reap
+ */
+static void
+reaper_callback(TimerEvtSource* source, void* handle)
+{
+  (void)source;
+  (void)handle;
+  udp_listener_reap(time(NULL));
+}
+
+/** Create UDP listening sockets, and dispatch their datagrams to ClientHandlers.
+ *
+ * \param service service (port) to listen on
+ * \param timeout time after which silent peers are forgotten, or 0 to keep them forever
+ * \return the listening Socket, or NULL on error
+ * \see udp_listener_cleanup
+ */
+Socket*
+udp_listener_setup(const char* service, int timeout)
+{
+  Socket* sock = socket_udp_server_new("udp-server", NULL, service, udp_listener_datagram, NULL);
+
+  if (!sock) {
+    return NULL;
+  }
+
+  peer_timeout = timeout;
+  if (timeout > 0) {
+    reaper = eventloop_every("udp-reaper", timeout, reaper_callback, NULL);
+  }
+
+  return sock;
+}
+
+/** Forget all peers and stop the idleness timer.
+ * \see udp_listener_setup
+ */
+void
+udp_listener_cleanup(void)
+{
+  if (reaper) {
+    eventloop_timer_stop(reaper);
+    reaper = NULL;
+  }
+  while (peers) {
+    udp_peer_free(peers);
+  }
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
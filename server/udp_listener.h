@@ -0,0 +1,34 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file udp_listener.h
+ * \brief Interface for the reception of measurements over UDP.
+ */
+#ifndef UDP_LISTENER_H_
+#define UDP_LISTENER_H_
+
+#include <time.h>
+
+#include "ocomm/o_socket.h"
+
+Socket* udp_listener_setup (const char* service, int timeout);
+void udp_listener_datagram (Socket* socket, const sockaddr_t* from, socklen_t from_len, void* buf, size_t len, void* handle);
+void udp_listener_reap (time_t now);
+void udp_listener_cleanup (void);
+
+#endif /* UDP_LISTENER_H_ */
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -0,0 +1,222 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file workers.c
+ * \brief Worker threads processing client connections.
+ *
+ * Each worker thread runs its own EventLoop. The main thread keeps accepting
+ * connections, and hands each new Socket over to the next worker in turn,
+ * which creates and runs the ClientHandler for it until the connection is
+ * closed. All the processing of a given connection therefore happens in a
+ * single thread, and only the Databases are shared between workers.
+ *
+ * Worker threads block all signals, so they are handled by the main thread.
+ *
+ * \see eventloop_post, client_handler_new
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+
+#include "ocomm/o_log.h"
+#include "ocomm/o_socket.h"
+#include "ocomm/o_eventloop.h"
+#include "mem.h"
+#include "client_handler.h"
+#include "database.h"
+#include "workers.h"
+
+/** Thread running an EventLoop for some of the clients */
+typedef struct Worker {
+  pthread_t thread;           /**< Thread of this worker */
+  EventLoop* loop;            /**< EventLoop of the thread, to post new clients to */
+  int ready;                  /**< Set once the thread has initialised its EventLoop */
+} Worker;
+
+/** All workers */
+static Worker* workers = NULL;
+/** Number of elements in workers */
+static int worker_count = 0;
+/** Index of the worker to dispatch the next client to */
+static int next_worker = 0;
+/** Time after which idle connections are closed by the workers */
+static int worker_timeout = 0;
+/** Protects the ready field of the workers while they start */
+static pthread_mutex_t workers_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Signalled by each worker once ready */
+static pthread_cond_t workers_ready = PTHREAD_COND_INITIALIZER;
+
+/** Main function of the worker threads.
+ *
+ * \param arg pointer to the Worker
+ * \return NULL
+ */
+static void*
+worker_run (void* arg)
+{
+  Worker* w = (Worker*)arg;
+
+  eventloop_init();
+  eventloop_set_socket_timeout(worker_timeout);
+
+  pthread_mutex_lock(&workers_lock);
+  w->loop = eventloop_self();
+  w->ready = 1;
+  pthread_cond_signal(&workers_ready);
+  pthread_mutex_unlock(&workers_lock);
+
+  if (w->loop) {
+    eventloop_run();
+    /* Clients left behind must not be resumed in this thread anymore */
+    database_queue_forget(w->loop);
+  }
+
+  return NULL;
+}
+
+/** Create a ClientHandler for a new connection, in the worker thread.
+ * \param handle Socket of the connection
+ * \see o_el_task_callback */
+static void
+worker_new_client (void* handle)
+{
+  Socket* new_sock = (Socket*)handle;
+
+  (void)client_handler_new(new_sock);
+  logdebug("%s: New client connected\n", new_sock->name);
+}
+
+/** Stop the EventLoop of a worker, in the worker thread.
+ * \param handle unused
+ * \see o_el_task_callback */
+static void
+worker_stop (void* handle)
+{
+  (void)handle;
+  eventloop_terminate(1);
+}
+
+/** Start worker threads.
+ *
+ * If no worker could be started, clients are processed by the main thread.
+ *
+ * \param count number of threads to start
+ * \param timeout time after which idle connections are closed, or 0
+ * \return the number of workers started
+ *
+ * \see workers_dispatch, workers_cleanup
+ */
+int
+workers_setup (int count, int timeout)
+{
+  sigset_t all, old;
+  int i, ret;
+
+  if (count <= 0) {
+    return 0;
+  }
+#if !HAVE_TLS
+  logwarn("Worker threads are not supported on this platform, processing all clients in the main thread\n");
+  return 0;
+#endif
+
+  if (!(workers = (Worker*)oml_malloc(count * sizeof(Worker)))) {
+    logerror("Cannot allocate memory for %d worker threads\n", count);
+    return 0;
+  }
+  memset(workers, 0, count * sizeof(Worker));
+  worker_timeout = timeout;
+
+  /* Signals are only handled by the main thread */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  for (i = 0; i < count; i++) {
+    if ((ret = pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]))) {
+      logwarn("Cannot start worker thread %d: %s\n", i, strerror(ret));
+      break;
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  pthread_mutex_lock(&workers_lock);
+  for (worker_count = 0; worker_count < i; worker_count++) {
+    while (!workers[worker_count].ready) {
+      pthread_cond_wait(&workers_ready, &workers_lock);
+    }
+  }
+  pthread_mutex_unlock(&workers_lock);
+
+  loginfo("Started %d worker thread%s\n", worker_count, worker_count>1?"s":"");
+
+  return worker_count;
+}
+
+/** Hand a new connection over to the next worker.
+ *
+ * \param new_sock Socket object created by accept()ing the connection
+ * \return 0 on success, -1 if the connection should be processed in the calling thread
+ *
+ * \see workers_setup, client_handler_new
+ */
+int
+workers_dispatch (Socket* new_sock)
+{
+  int i;
+
+  for (i = 0; i < worker_count; i++) {
+    Worker* w = &workers[next_worker];
+    next_worker = (next_worker + 1) % worker_count;
+
+    if (!eventloop_post(w->loop, worker_new_client, new_sock)) {
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+/** Stop all worker threads, and wait for them to finish.
+ *
+ * Connections still open are closed.
+ *
+ * \see workers_setup
+ */
+void
+workers_cleanup (void)
+{
+  int i;
+
+  for (i = 0; i < worker_count; i++) {
+    if (eventloop_post(workers[i].loop, worker_stop, NULL)) {
+      logwarn("Cannot stop worker thread %d\n", i);
+      pthread_cancel(workers[i].thread);
+    }
+  }
+  for (i = 0; i < worker_count; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+
+  worker_count = 0;
+  next_worker = 0;
+  oml_free(workers);
+  workers = NULL;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
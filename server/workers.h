@@ -0,0 +1,31 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file workers.h
+ * \brief Interface for the worker threads processing client connections.
+ */
+#ifndef WORKERS_H_
+#define WORKERS_H_
+
+#include "ocomm/o_socket.h"
+
+int workers_setup (int count, int timeout);
+int workers_dispatch (Socket* new_sock);
+void workers_cleanup (void);
+
+#endif /* WORKERS_H_ */
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
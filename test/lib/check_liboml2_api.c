@@ -10,7 +10,10 @@
 /** \file  check_liboml2_api.c
  * \brief Test the user-visible OML API.
  */
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <check.h>
 
 #include "ocomm/o_log.h"
@@ -20,6 +23,7 @@
 #include "oml_value.h"
 #include "validate.h"
 #include "client.h"
+#include "filter/average_filter.h"
 
 typedef struct
 {
@@ -77,6 +81,20 @@ static Name names_vector [] =
     { "1/invalid/app/name/",    0, 0 },
   };
 
+/** Writer options, and the protocol version their encoding should announce */
+static struct {
+  const char* encoding;
+  const char* option;
+  const char* value;
+  int protocol;
+} protocol_vector [] =
+  {
+    { "--oml-text",   NULL,               NULL, 5 },
+    { "--oml-binary", NULL,               NULL, 6 },
+    { "--oml-binary", "--oml-block-rows", "8",  7 },
+    { "--oml-binary", "--oml-dict-size",  "16", 8 },
+  };
+
 /******************************************************************************/
 /*                    APP and MP NAME HANDLING CHECKS                         */
 /******************************************************************************/
@@ -224,6 +242,457 @@ START_TEST(test_api_metadata)
 }
 END_TEST
 
+START_TEST(test_api_batch)
+{
+  OmlMP *mp;
+  OmlValueU rows[3];
+  const char* labels[] = { "a", "b", "c" };
+  char line[256], label[16];
+  double ts;
+  int i, index, msindex, n = 0;
+  long seqno;
+  FILE* f;
+
+  o_set_log_level (2);
+  logdebug("%s\n", __FUNCTION__);
+
+  MAKEOMLCMDLINE(argc, argv, "file:test_api_batch");
+  unlink("test_api_batch");
+
+  omlc_zero_array(rows, 3);
+  for (i = 0; i < 3; i++) {
+    omlc_set_string(rows[i], labels[i]);
+  }
+
+  fail_if(omlc_init("app", &argc, argv, NULL), "Error initialising OML");
+
+  mp = omlc_add_mp("MP", mpdef);
+  fail_if(mp == NULL, "Failed to add MP");
+
+  fail_unless(omlc_inject_batch(mp, rows, 3),
+      "omlc_inject_batch() succeeded before omlc_start was called");
+
+  fail_if(omlc_start(), "Error starting OML");
+
+  fail_unless(omlc_inject_batch(mp, NULL, 3),
+      "omlc_inject_batch() accepted NULL rows");
+  fail_if(omlc_inject_batch(mp, rows, 0),
+      "omlc_inject_batch() failed with an empty batch");
+  fail_if(omlc_inject_batch(mp, rows, 3),
+      "omlc_inject_batch() failed after omlc_start was called");
+  msindex = mp->streams->index;
+
+  fail_if(omlc_close(), "Error closing OML");
+
+  /* Every row should have been output, in order */
+  fail_if((f = fopen("test_api_batch", "r")) == NULL, "Cannot open output file");
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "%lf\t%d\t%ld\t%15s", &ts, &index, &seqno, label) == 4 && index == msindex) {
+      fail_unless(n < 3, "Too many samples output");
+      fail_unless(seqno == n + 1, "Sample %d has seqno %ld", n, seqno);
+      fail_unless(!strcmp(label, labels[n]), "Sample %d is '%s' instead of '%s'", n, label, labels[n]);
+      n++;
+    }
+  }
+  fclose(f);
+  fail_unless(n == 3, "Only %d samples out of 3 output", n);
+
+  for (i = 0; i < 3; i++) {
+    omlc_reset_string(rows[i]);
+  }
+}
+END_TEST
+
+/** Check that each writer announces the lowest protocol version its encoding needs */
+START_TEST(test_api_protocol)
+{
+  OmlMP *mp;
+  OmlValueU value;
+  const char* argv[12] = {
+    __FUNCTION__,
+    "--oml-id", __FUNCTION__,
+    "--oml-domain", __FILE__,
+    "--oml-collect", "file:test_api_protocol",
+    "--oml-log-level", "2",
+    protocol_vector[_i].encoding };
+  int argc = 10;
+  char line[256];
+  int protocol = -1;
+  FILE* f;
+
+  o_set_log_level (2);
+  logdebug("%s\n", __FUNCTION__);
+
+  if (protocol_vector[_i].option) {
+    argv[argc++] = protocol_vector[_i].option;
+    argv[argc++] = protocol_vector[_i].value;
+  }
+  unlink("test_api_protocol");
+
+  omlc_zero(value);
+  omlc_set_string(value, "1337");
+
+  fail_if(omlc_init("app", &argc, argv, NULL), "Error initialising OML");
+  mp = omlc_add_mp("MP", mpdef);
+  fail_if(mp == NULL, "Failed to add MP");
+  fail_if(omlc_start(), "Error starting OML");
+  fail_if(omlc_inject(mp, &value), "Injection failed");
+  fail_if(omlc_close(), "Error closing OML");
+
+  fail_if((f = fopen("test_api_protocol", "r")) == NULL, "Cannot open output file");
+  fail_if(fgets(line, sizeof(line), f) == NULL, "No headers output");
+  fclose(f);
+  fail_unless(sscanf(line, "protocol: %d", &protocol) == 1, "Headers do not start with the protocol: '%s'", line);
+  fail_unless(protocol == protocol_vector[_i].protocol,
+      "Protocol %d announced with %s %s instead of %d", protocol, protocol_vector[_i].encoding,
+      protocol_vector[_i].option ? protocol_vector[_i].option : "", protocol_vector[_i].protocol);
+
+  omlc_reset_string(value);
+}
+END_TEST
+
+START_TEST(test_api_passthrough)
+{
+  OmlMP *mp;
+  OmlMPDef def[] = {
+    { "i", OML_INT32_VALUE },
+    { "s", OML_STRING_VALUE },
+    { "v", OML_VECTOR_DOUBLE_VALUE },
+    { NULL, (OmlValueT)0 }
+  };
+  OmlValueU rows[6];
+  const char* labels[] = { "a", "b" };
+  double vector[2][2] = { { 1.5, -2. }, { 42., 0.25 } };
+  char line[256], label[16];
+  double ts, v0, v1;
+  size_t nof_elts;
+  int r, i, index, msindex, n = 0;
+  long seqno;
+  FILE* f;
+
+  o_set_log_level (2);
+  logdebug("%s\n", __FUNCTION__);
+
+  MAKEOMLCMDLINE(argc, argv, "file:test_api_passthrough");
+  unlink("test_api_passthrough");
+
+  omlc_zero_array(rows, 6);
+  for (r = 0; r < 2; r++) {
+    omlc_set_int32(rows[3*r], r);
+    omlc_set_string(rows[3*r+1], labels[r]);
+    omlc_set_vector_double(rows[3*r+2], vector[r], 2);
+  }
+
+  fail_if(omlc_init("app", &argc, argv, NULL), "Error initialising OML");
+  mp = omlc_add_mp("MP", def);
+  fail_if(mp == NULL, "Failed to add MP");
+  fail_if(omlc_start(), "Error starting OML");
+
+  /* The default MS reports every sample as is */
+  fail_unless(mp->streams->passthrough, "Passthrough not enabled on the default MS");
+  msindex = mp->streams->index;
+
+  fail_if(omlc_inject(mp, &rows[0]), "omlc_inject() failed");
+  fail_if(omlc_inject(mp, &rows[3]), "omlc_inject() failed");
+  fail_if(omlc_inject_batch(mp, rows, 2), "omlc_inject_batch() failed");
+
+  fail_if(omlc_close(), "Error closing OML");
+
+  /* Every sample should have been output unchanged, in order */
+  fail_if((f = fopen("test_api_passthrough", "r")) == NULL, "Cannot open output file");
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "%lf\t%d\t%ld\t%d\t%15s\t%zu %lf %lf",
+          &ts, &index, &seqno, &i, label, &nof_elts, &v0, &v1) == 8 && index == msindex) {
+      r = n % 2;
+      fail_unless(n < 4, "Too many samples output");
+      fail_unless(seqno == n + 1, "Sample %d has seqno %ld", n, seqno);
+      fail_unless(i == r, "Sample %d has i=%d instead of %d", n, i, r);
+      fail_unless(!strcmp(label, labels[r]), "Sample %d is '%s' instead of '%s'", n, label, labels[r]);
+      fail_unless(nof_elts == 2 && v0 == vector[r][0] && v1 == vector[r][1],
+          "Sample %d has an unexpected vector: '%s'", n, line);
+      n++;
+    }
+  }
+  fclose(f);
+  fail_unless(n == 4, "Only %d samples out of 4 output", n);
+
+  for (r = 0; r < 2; r++) {
+    omlc_reset_string(rows[3*r+1]);
+    omlc_reset_vector(rows[3*r+2]);
+  }
+}
+END_TEST
+
+/** Data released by release_cb, in order */
+static void* released[8];
+/** Number of calls to release_cb */
+static int released_count;
+
+/** Record the release of data lent with omlc_set_*_borrowed */
+static void
+release_cb(void* data, void* arg)
+{
+  int* count = (int*)arg;
+
+  if (*count < (int)LENGTH(released)) {
+    released[*count] = data;
+  }
+  (*count)++;
+}
+
+START_TEST(test_api_borrowed)
+{
+  OmlMP *mp;
+  OmlMPDef def[] = {
+    { "b", OML_BLOB_VALUE },
+    { "v", OML_VECTOR_INT32_VALUE },
+    { NULL, (OmlValueT)0 }
+  };
+  OmlValueU rows[4];
+  char blob[2][4] = { "abc", "def" };
+  int32_t vector[2][3] = { { 1, 2, 3 }, { -4, 5, -6 } };
+  char line[256];
+  double ts;
+  int r, index, msindex, n = 0;
+  long seqno;
+  FILE* f;
+
+  o_set_log_level (2);
+  logdebug("%s\n", __FUNCTION__);
+
+  MAKEOMLCMDLINE(argc, argv, "file:test_api_borrowed");
+  unlink("test_api_borrowed");
+
+  omlc_zero_array(rows, 4);
+  released_count = 0;
+
+  fail_if(omlc_init("app", &argc, argv, NULL), "Error initialising OML");
+  mp = omlc_add_mp("MP", def);
+  fail_if(mp == NULL, "Failed to add MP");
+  fail_if(omlc_start(), "Error starting OML");
+  fail_unless(mp->streams->passthrough, "Passthrough not enabled on the default MS");
+  msindex = mp->streams->index;
+
+  fail_unless(omlc_set_blob_borrowed(&rows[0], NULL, 3, release_cb, &released_count),
+      "omlc_set_blob_borrowed() accepted a NULL blob");
+
+  for (r = 0; r < 2; r++) {
+    fail_if(omlc_set_blob_borrowed(&rows[2*r], blob[r], 3, release_cb, &released_count),
+        "omlc_set_blob_borrowed() failed");
+    fail_if(omlc_set_vector_borrowed(&rows[2*r+1], vector[r], 3, sizeof(int32_t), release_cb, &released_count),
+        "omlc_set_vector_borrowed() failed");
+    fail_unless(omlc_get_blob_ptr(rows[2*r]) == blob[r], "Lent blob was copied");
+    fail_unless(omlc_get_vector_ptr(rows[2*r+1]) == vector[r], "Lent vector was copied");
+  }
+
+  /* The data should be released as soon as it has been output */
+  fail_if(omlc_inject(mp, &rows[0]), "omlc_inject() failed");
+  fail_unless(released_count == 2, "%d lent values released instead of 2 after omlc_inject()", released_count);
+  fail_unless(released[0] == blob[0] && released[1] == vector[0], "Wrong data released");
+  fail_unless(omlc_get_blob_ptr(rows[0]) == NULL && omlc_get_blob_ref(rows[0]) == NULL,
+      "Lent blob not reset after omlc_inject()");
+  fail_unless(omlc_get_vector_ptr(rows[1]) == NULL && omlc_get_vector_ref(rows[1]) == NULL,
+      "Lent vector not reset after omlc_inject()");
+
+  fail_if(omlc_set_blob_borrowed(&rows[0], blob[0], 3, release_cb, &released_count),
+      "omlc_set_blob_borrowed() failed");
+  omlc_set_vector_int32(rows[1], vector[0], 3);
+  fail_if(omlc_inject_batch(mp, rows, 2), "omlc_inject_batch() failed");
+  fail_unless(released_count == 5, "%d lent values released instead of 5 after omlc_inject_batch()", released_count);
+  fail_if(omlc_get_vector_ptr(rows[1]) == NULL, "Copied vector reset after omlc_inject_batch()");
+
+  fail_if(omlc_close(), "Error closing OML");
+  fail_unless(released_count == 5, "%d lent values released instead of 5", released_count);
+
+  /* The lent data should have been output */
+  fail_if((f = fopen("test_api_borrowed", "r")) == NULL, "Cannot open output file");
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "%lf\t%d\t%ld\t", &ts, &index, &seqno) == 3 && index == msindex) {
+      r = (n == 2);
+      fail_unless(n < 3, "Too many samples output");
+      fail_unless(strstr(line, r ? "\t3 -4 5 -6" : "\t3 1 2 3") != NULL,
+          "Sample %d has an unexpected vector: '%s'", n, line);
+      n++;
+    }
+  }
+  fclose(f);
+  fail_unless(n == 3, "Only %d samples out of 3 output", n);
+
+  omlc_reset_vector(rows[1]);
+}
+END_TEST
+
+START_TEST(test_api_borrowed_filtered)
+{
+  OmlMP *mp;
+  OmlMPDef def[] = {
+    { "b", OML_BLOB_VALUE },
+    { NULL, (OmlValueT)0 }
+  };
+  OmlValueU value;
+  char blob[3][4] = { "abc", "def", "ghi" };
+  int i;
+  const char* argv[] = {
+    __FUNCTION__,
+    "--oml-id", __FUNCTION__,
+    "--oml-domain", __FILE__,
+    "--oml-collect", "file:test_api_borrowed_filtered",
+    "--oml-log-level", "2",
+    "--oml-samples", "2"};
+  int argc = 11;
+
+  o_set_log_level (2);
+  logdebug("%s\n", __FUNCTION__);
+  unlink("test_api_borrowed_filtered");
+
+  omlc_zero(value);
+  released_count = 0;
+
+  fail_if(omlc_init("app", &argc, argv, NULL), "Error initialising OML");
+  mp = omlc_add_mp("MP", def);
+  fail_if(mp == NULL, "Failed to add MP");
+  fail_if(omlc_start(), "Error starting OML");
+  fail_if(mp->streams->passthrough, "Passthrough enabled with --oml-samples 2");
+
+  /* The first filter keeps a reference on the first sample of each period,
+   * instead of a copy, until the next period starts; others are released
+   * straight away */
+  for (i = 0; i < 3; i++) {
+    fail_if(omlc_set_blob_borrowed(&value, blob[i], 3, release_cb, &released_count),
+        "omlc_set_blob_borrowed() failed");
+    fail_if(omlc_inject(mp, &value), "omlc_inject() failed");
+    fail_unless(released_count == i, "%d lent blobs released instead of %d after sample %d",
+        released_count, i, i);
+    fail_unless(omlc_get_blob_ref(value) == NULL, "Lent blob not reset after omlc_inject()");
+  }
+
+  fail_if(omlc_close(), "Error closing OML");
+  fail_unless(released_count == 3, "%d lent blobs released instead of 3", released_count);
+  fail_unless(released[0] == blob[1] && released[1] == blob[0] && released[2] == blob[2],
+      "Lent blobs released out of order");
+}
+END_TEST
+
+START_TEST(test_api_interval)
+{
+  OmlMP *mp[20];
+  OmlValueU value;
+  char name[20][16], line[256];
+  double ts;
+  int i, index, nrows[20];
+  long seqno;
+  FILE* f;
+  const char* argv[] = {
+    __FUNCTION__,
+    "--oml-id", __FUNCTION__,
+    "--oml-domain", __FILE__,
+    "--oml-collect", "file:test_api_interval",
+    "--oml-log-level", "2",
+    "--oml-interval", "0.05"};
+  int argc = 11;
+
+  o_set_log_level (2);
+  logdebug("%s\n", __FUNCTION__);
+  unlink("test_api_interval");
+
+  omlc_zero(value);
+  omlc_set_string(value, "1337");
+
+  fail_if(omlc_init("app", &argc, argv, NULL), "Error initialising OML");
+  for (i = 0; i < 20; i++) {
+    /* omlc_add_mp does not copy the name */
+    snprintf(name[i], sizeof(name[i]), "MP%d", i);
+    mp[i] = omlc_add_mp(name[i], mpdef);
+    fail_if(mp[i] == NULL, "Failed to add %s", name[i]);
+  }
+  fail_if(omlc_start(), "Error starting OML");
+
+  for (i = 0; i < 20; i++) {
+    nrows[i] = 0;
+    fail_if(omlc_inject(mp[i], &value), "omlc_inject() failed for MP%d", i);
+  }
+  usleep(500000);
+  fail_if(omlc_close(), "Error closing OML");
+
+  /* All MSs should have been reported periodically, by the same scheduler */
+  fail_if((f = fopen("test_api_interval", "r")) == NULL, "Cannot open output file");
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "%lf\t%d\t%ld\t", &ts, &index, &seqno) == 3 && index >= 2 && index < 22) {
+      nrows[index - 2]++;
+    }
+  }
+  fclose(f);
+  for (i = 0; i < 20; i++) {
+    fail_unless(nrows[i] >= 5, "MP%d was only reported %d times in 0.5s with a 0.05s interval", i, nrows[i]);
+    fail_unless(nrows[i] <= 12, "MP%d was reported %d times in 0.5s with a 0.05s interval", i, nrows[i]);
+  }
+
+  omlc_reset_string(value);
+}
+END_TEST
+
+#define STAGING_SAMPLES 100
+
+static OmlMPDef staging_mpdef [] = {
+  { "n", OML_INT32_VALUE },
+  { NULL, (OmlValueT)0 }
+};
+
+static void*
+staging_injector(void* arg)
+{
+  OmlMP* mp = (OmlMP*)arg;
+  OmlValueU value;
+  int i;
+
+  omlc_zero(value);
+  for (i = 0; i < STAGING_SAMPLES; i++) {
+    omlc_set_int32(value, i);
+    fail_if(omlc_inject(mp, &value), "omlc_inject() failed for sample %d", i);
+  }
+  return NULL;
+}
+
+/** Check that the samples staged by a thread are merged when it exits */
+START_TEST(test_api_staging_exit)
+{
+  OmlMP *mp;
+  OmlMStream *ms;
+  pthread_t thread;
+  struct OmlAvgFilterInstanceData *avg;
+  const char* argv[] = {
+    __FUNCTION__,
+    "--oml-id", __FUNCTION__,
+    "--oml-domain", __FILE__,
+    "--oml-collect", "file:test_api_staging_exit",
+    "--oml-log-level", "2",
+    "--oml-samples", "1000",
+    "--oml-thread-staging"};
+  int argc = 12;
+
+  o_set_log_level (2);
+  logdebug("%s\n", __FUNCTION__);
+  unlink("test_api_staging_exit");
+
+  fail_if(omlc_init("app", &argc, argv, NULL), "Error initialising OML");
+  mp = omlc_add_mp("MP", staging_mpdef);
+  fail_if(mp == NULL, "Failed to add MP");
+  fail_if(omlc_start(), "Error starting OML");
+  ms = mp->streams;
+  fail_if(ms->staging == NULL, "Staging not enabled");
+
+  fail_if(pthread_create(&thread, NULL, staging_injector, mp));
+  pthread_join(thread, NULL);
+
+  /* No sample has been output yet, but they are all in the MS's filter */
+  avg = (struct OmlAvgFilterInstanceData*)ms->filters->instance_data;
+  fail_unless(avg->sample_count == STAGING_SAMPLES,
+      "%d samples merged from the exited thread instead of %d", avg->sample_count, STAGING_SAMPLES);
+
+  fail_if(omlc_close(), "Error closing OML");
+}
+END_TEST
+
 Suite*
 api_suite (void)
 {
@@ -239,6 +708,13 @@ api_suite (void)
   TCase* tc_api_func = tcase_create("ApiFunctions");
   tcase_add_test(tc_api_func, test_api_basic);
   tcase_add_test(tc_api_func, test_api_metadata);
+  tcase_add_test(tc_api_func, test_api_batch);
+  tcase_add_loop_test(tc_api_func, test_api_protocol, 0, LENGTH(protocol_vector));
+  tcase_add_test(tc_api_func, test_api_passthrough);
+  tcase_add_test(tc_api_func, test_api_interval);
+  tcase_add_test(tc_api_func, test_api_staging_exit);
+  tcase_add_test(tc_api_func, test_api_borrowed);
+  tcase_add_test(tc_api_func, test_api_borrowed_filtered);
   suite_add_tcase (s, tc_api_func);
 
   return s;
@@ -21,6 +21,7 @@
  *
  */
 #include <stdio.h>
+#include <string.h>
 #include <check.h>
 
 #include "htonll.h"
@@ -100,6 +101,25 @@ START_TEST (test_bswap_64)
 }
 END_TEST
 
+START_TEST (test_htole)
+{
+  uint16_t v16 = htoles((uint16_t)0x1234);
+  uint32_t v32 = htolel((uint32_t)0x12345678);
+  uint64_t v64 = htolell((uint64_t)0x123456789ABCDEF1LL);
+  uint8_t ref16[] = { 0x34, 0x12 };
+  uint8_t ref32[] = { 0x78, 0x56, 0x34, 0x12 };
+  uint8_t ref64[] = { 0xF1, 0xDE, 0xBC, 0x9A, 0x78, 0x56, 0x34, 0x12 };
+
+  fail_unless (memcmp(&v16, ref16, sizeof(v16)) == 0);
+  fail_unless (memcmp(&v32, ref32, sizeof(v32)) == 0);
+  fail_unless (memcmp(&v64, ref64, sizeof(v64)) == 0);
+
+  fail_unless (letohs(v16) == 0x1234);
+  fail_unless (letohl(v32) == 0x12345678);
+  fail_unless (letohll(v64) == 0x123456789ABCDEF1LL);
+}
+END_TEST
+
 Suite*
 bswap_suite (void)
 {
@@ -112,6 +132,7 @@ bswap_suite (void)
   tcase_add_test (tc_bswap, test_bswap_16);
   tcase_add_test (tc_bswap, test_bswap_32);
   tcase_add_test (tc_bswap, test_bswap_64);
+  tcase_add_test (tc_bswap, test_htole);
 
   suite_add_tcase (s, tc_bswap);
 
@@ -221,6 +221,93 @@ START_TEST (test_config_multi_collect)
 }
 END_TEST
 
+/** Check that samples output on several writers are the same on each of them */
+START_TEST (test_config_fanout)
+{
+  OmlMP *mp;
+  OmlValueU v[2];
+  char buf[2][1024];
+  char *dests[3] = { "test_config_fanout1", "test_config_fanout2", "test_config_fanout3" };
+  char config[] = "<omlc domain='check_liboml2_config' id='test_config_fanout'>\n"
+                  "  <collect url='file:test_config_fanout1' encoding='text' />\n"
+                  "  <collect url='file:test_config_fanout2' encoding='text' />\n"
+                  "  <collect url='file:test_config_fanout3' encoding='binary' />\n"
+                  "</omlc>";
+  int i, index, msindex, nrows = 0;
+  long size;
+  FILE *fp[2];
+
+  logdebug("%s\n", __FUNCTION__);
+
+  MAKEOMLCMDLINE(argc, argv, "file:test_config_fanout");
+  argv[1] = "--oml-config";
+  argv[2] = "test_config_fanout.xml";
+  argv[3] = "--oml-samples";
+  argv[4] = "2";
+  argc = 5;
+
+  fp[0] = fopen (argv[2], "w");
+  fail_unless(fp[0] != NULL, "Could not create configuration file %s: %s", argv[2], strerror(errno));
+  fail_unless(fwrite(config, sizeof(config), 1, fp[0]) == 1,
+      "Could not write configuration in file %s: %s", argv[2], strerror(errno));
+  fclose(fp[0]);
+
+  for (i=0; i<3; i++) {
+    unlink(dests[i]);
+  }
+
+  fail_if(omlc_init(__FUNCTION__, &argc, argv, NULL),
+      "Could not initialise OML");
+  mp = omlc_add_mp(__FUNCTION__, mp_def);
+  fail_if(mp==NULL, "Could not add MP");
+  fail_if(omlc_start(), "Could not start OML");
+  fail_unless(mp->streams && mp->streams->nwriters == 3,
+      "MS does not have 3 writers (%d)", mp->streams ? mp->streams->nwriters : -1);
+  msindex = mp->streams->index;
+
+  for (i=0; i<4; i++) {
+    omlc_set_uint32(v[0], 2*i);
+    omlc_set_uint32(v[1], 2*i+1);
+    fail_if(omlc_inject(mp, v), "Injection %d failed", i);
+  }
+
+  omlc_close();
+
+  /* Both text outputs should be identical */
+  for (i=0; i<2; i++) {
+    fp[i] = fopen(dests[i], "r");
+    fail_unless(fp[i] != NULL, "Output file %s missing", dests[i]);
+  }
+  while(fgets(buf[0], sizeof(buf[0]), fp[0])) {
+    fail_unless(fgets(buf[1], sizeof(buf[1]), fp[1]) != NULL,
+        "%s is shorter than %s", dests[1], dests[0]);
+    if (strncmp(buf[0], "content:", 8)) {
+      fail_unless(!strcmp(buf[0], buf[1]), "Output differs: '%s' vs. '%s'", buf[0], buf[1]);
+    }
+    if (sscanf(buf[0], "%*f\t%d\t", &index) == 1 && index == msindex) {
+      nrows++;
+    }
+  }
+  fail_unless(fgets(buf[1], sizeof(buf[1]), fp[1]) == NULL,
+      "%s is longer than %s", dests[1], dests[0]);
+  fail_unless(nrows == 2, "%d samples output instead of 2", nrows);
+  for (i=0; i<2; i++) {
+    fclose(fp[i]);
+  }
+
+  /* The binary output should also have received the samples */
+  fp[0] = fopen(dests[2], "r");
+  fail_unless(fp[0] != NULL, "Output file %s missing", dests[2]);
+  fseek(fp[0], 0, SEEK_END);
+  size = ftell(fp[0]);
+  fclose(fp[0]);
+  fp[0] = fopen(dests[0], "r");
+  fseek(fp[0], 0, SEEK_END);
+  fail_unless(size > 0 && size != ftell(fp[0]), "Unexpected binary output size %ld", size);
+  fclose(fp[0]);
+}
+END_TEST
+
 Suite*
 config_suite (void)
 {
@@ -231,6 +318,7 @@ config_suite (void)
   tcase_add_test (tc_config, test_config_metadata);
   tcase_add_test (tc_config, test_config_empty_collect);
   tcase_add_test (tc_config, test_config_multi_collect);
+  tcase_add_test (tc_config, test_config_fanout);
 
   suite_add_tcase (s, tc_config);
 
@@ -24,6 +24,7 @@
 #define _GNU_SOURCE  /* For NAN */
 #include <math.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include <string.h>
 #include <check.h>
 
@@ -35,7 +36,11 @@
 #include "filter/stddev_filter.h"
 #include "filter/sum_filter.h"
 #include "filter/delta_filter.h"
+#include "filter/quantile_filter.h"
+#include "filter/topk_filter.h"
+#include "filter/vector_filter.h"
 #include "oml2/oml_writer.h"
+#include "oml_value.h"
 #include "check_utils.h"
 
 typedef struct OmlAvgFilterInstanceData AvgInstanceData;
@@ -44,6 +49,8 @@ typedef struct OmlHistFilterInstanceData HistInstanceData;
 typedef struct OmlStddevFilterInstanceData StddevInstanceData;
 typedef struct OmlSumFilterInstanceData SumInstanceData;
 typedef struct OmlDeltaFilterInstanceData DeltaInstanceData;
+typedef struct OmlQuantileFilterInstanceData QuantileInstanceData;
+typedef struct OmlTopKFilterInstanceData TopKInstanceData;
 
 
 /* Fixtures */
@@ -209,8 +216,63 @@ END_TEST
 /*                        HISTOGRAM FILTER TESTS                                */
 /********************************************************************************/
 
+static int
+hist_writer_out (OmlWriter* writer, OmlValue* values, int count)
+{
+  (void)writer;
+  fail_unless (count == 1);
+  fail_unless (oml_value_get_type(&values[0]) == OML_VECTOR_UINT64_VALUE);
+  return 0;
+}
+
+
+/* Set a string property on a filter */
+static int
+set_string_property (OmlFilter* f, const char* name, const char* value)
+{
+  OmlValue v;
+  int ret;
+
+  oml_value_init(&v);
+  oml_value_set_type(&v, OML_STRING_VALUE);
+  omlc_set_string_copy(*oml_value_get_value(&v), value, strlen(value));
+  ret = f->set(f, name, &v);
+  oml_value_reset(&v);
+
+  return ret;
+}
+
+/* Input doubles into f, and check the counts vector it outputs */
+static void
+check_hist (OmlFilter* f, const double* input, int n, const uint64_t* expected, int nexpected)
+{
+  OmlValue v;
+  OmlWriter w;
+  uint64_t* counts;
+  int i;
+
+  oml_value_init(&v);
+  for (i = 0; i < n; i++) {
+    omlc_set_double(*oml_value_get_value(&v), input[i]);
+    oml_value_set_type(&v, OML_DOUBLE_VALUE);
+    fail_unless (f->input(f, &v) == 0);
+  }
+  oml_value_reset(&v);
+
+  memset(&w, 0, sizeof(w));
+  w.out = hist_writer_out;
+  fail_unless (f->output(f, &w) == 0);
+  fail_unless (omlc_get_vector_nof_elts(*oml_value_get_value(&f->result[0])) == (size_t)nexpected,
+      "Histogram has %d buckets instead of %d",
+      omlc_get_vector_nof_elts(*oml_value_get_value(&f->result[0])), nexpected);
+  counts = (uint64_t*)omlc_get_vector_ptr(*oml_value_get_value(&f->result[0]));
+  for (i = 0; i < nexpected; i++) {
+    fail_unless (counts[i] == expected[i], "Bucket %d has %" PRIu64 " samples instead of %" PRIu64,
+        i, counts[i], expected[i]);
+  }
+  fail_unless (f->newwindow(f) == 0);
+}
 
-# if 0
 START_TEST (test_filter_hist_create)
 {
   /*
@@ -218,6 +280,7 @@ START_TEST (test_filter_hist_create)
    */
   OmlFilter* f = NULL;
   HistInstanceData* data = NULL;
+  int i;
 
   f = create_filter ("histogram", "histograminst", OML_INT32_VALUE, 2);
 
@@ -226,19 +289,120 @@ START_TEST (test_filter_hist_create)
 
   fail_unless (f->index == 2);
   fail_unless (f->input_type == OML_INT32_VALUE);
+  fail_unless (f->output_count == 1);
+  fail_unless (oml_value_get_type(&f->result[0]) == OML_VECTOR_UINT64_VALUE);
 
   data = (HistInstanceData*)f->instance_data;
 
-  /* Sample count should be 0; accumulator, min and max should NaN. */
-  fail_unless (isnan(instdata->sample_sum));
-  fail_unless (instdata->sample_count == 0);
-  fail_unless (isnan(instdata->sample_min), "Initial min val should be %f, but actually was %f", NAN, instdata->sample_min);
-  fail_unless (isnan(instdata->sample_max), "Initial min val should be %f, but actually was %f", NAN, instdata->sample_max);
+  /* Ten linear bins between 0 and 100, all empty */
+  fail_unless (data->sample_count == 0);
+  fail_unless (data->nedges == 11, "Default histogram has %d edges instead of 11", data->nedges);
+  for (i = 0; i < data->nedges; i++) {
+    fail_unless (data->edges[i] == 10. * i, "Edge %d is %f instead of %f", i, data->edges[i], 10. * i);
+  }
+  for (i = 0; i < data->nedges + 1; i++) {
+    fail_unless (data->counts[i] == 0);
+  }
+
+  /* Properties are not carried over to clones, so the filter cannot be merged */
+  fail_unless (f->merge == NULL);
 
   fail_unless (destroy_filter(f) == NULL);
 }
 END_TEST
-#endif
+
+START_TEST (test_filter_hist_linear)
+{
+  OmlFilter* f = create_filter ("histogram", "histograminst", OML_DOUBLE_VALUE, 0);
+  double input[] = { -1., 0., 0.5, 1., 1.999, 2., 3.5, 3.999, 4., 1e9, NAN };
+  uint64_t expected[] = { 1, 2, 2, 1, 2, 2 };
+  uint64_t empty[] = { 0, 0, 0, 0, 0, 0 };
+
+  fail_unless (set_string_property (f, "bins", "4") == 0);
+  fail_unless (set_string_property (f, "min", "0") == 0);
+  fail_unless (set_string_property (f, "max", "4") == 0);
+
+  check_hist (f, input, LENGTH(input), expected, LENGTH(expected));
+  /* Counts are reset with each new window */
+  check_hist (f, input, 0, empty, LENGTH(empty));
+
+  /* Invalid properties are rejected */
+  fail_unless (set_string_property (f, "bins", "0") == -1);
+  fail_unless (set_string_property (f, "bins", "two") == -1);
+  fail_unless (set_string_property (f, "scale", "cubic") == -1);
+  fail_unless (set_string_property (f, "colour", "blue") == -1);
+
+  /* Inconsistent ranges keep the previous bins */
+  fail_unless (set_string_property (f, "min", "10") == 0);
+  check_hist (f, input, LENGTH(input), expected, LENGTH(expected));
+
+  destroy_filter (f);
+}
+END_TEST
+
+START_TEST (test_filter_hist_log)
+{
+  OmlFilter* f = create_filter ("histogram", "histograminst", OML_UINT64_VALUE, 0);
+  HistInstanceData* data = (HistInstanceData*)f->instance_data;
+  OmlValueU values[8];
+  uint64_t input[] = { 0, 1, 9, 10, 99, 100, 999, 1000 };
+  uint64_t expected[] = { 1, 2, 2, 2, 1 };
+  OmlWriter w;
+  uint64_t* counts;
+  int i;
+
+  fail_unless (set_string_property (f, "scale", "log") == 0);
+  fail_unless (set_string_property (f, "bins", "3") == 0);
+  fail_unless (set_string_property (f, "min", "1") == 0);
+  fail_unless (set_string_property (f, "max", "1000") == 0);
+
+  /* Feed the samples as a batch */
+  omlc_zero_array(values, LENGTH(values));
+  for (i = 0; i < (int)LENGTH(input); i++) {
+    omlc_set_uint64(values[i], input[i]);
+  }
+  fail_if (f->input_batch == NULL);
+  fail_unless (f->input_batch (f, values, LENGTH(values), 1) == 0);
+
+  fail_unless (data->nedges == 4);
+  fail_unless (fabs(data->edges[1] - 10.) < 1e-9, "Second edge is %f instead of 10", data->edges[1]);
+  fail_unless (fabs(data->edges[2] - 100.) < 1e-9, "Third edge is %f instead of 100", data->edges[2]);
+
+  memset(&w, 0, sizeof(w));
+  w.out = hist_writer_out;
+  f->output (f, &w);
+  counts = (uint64_t*)omlc_get_vector_ptr(*oml_value_get_value(&f->result[0]));
+  for (i = 0; i < (int)LENGTH(expected); i++) {
+    fail_unless (counts[i] == expected[i], "Bucket %d has %" PRIu64 " samples instead of %" PRIu64,
+        i, counts[i], expected[i]);
+  }
+
+  destroy_filter (f);
+}
+END_TEST
+
+START_TEST (test_filter_hist_edges)
+{
+  OmlFilter* f = create_filter ("histogram", "histograminst", OML_DOUBLE_VALUE, 0);
+  double input[] = { -5., 0., 0.1, 0.5, 0.99, 1., 10., 99.9, 100., 250. };
+  uint64_t expected[] = { 1, 2, 2, 3, 1, 1 };
+  uint64_t linear[] = { 0, 2, 0 };
+
+  fail_unless (set_string_property (f, "edges", "0, 0.5 1,100  200") == 0);
+  check_hist (f, input, LENGTH(input), expected, LENGTH(expected));
+
+  fail_unless (set_string_property (f, "edges", "0, 2, 1") == -1);
+  fail_unless (set_string_property (f, "edges", "0") == -1);
+  fail_unless (set_string_property (f, "edges", "0 1 x") == -1);
+  check_hist (f, input, LENGTH(input), expected, LENGTH(expected));
+
+  /* Setting other properties goes back to computed edges */
+  fail_unless (set_string_property (f, "bins", "1") == 0);
+  check_hist (f, input + 6, 2, linear, LENGTH(linear));
+
+  destroy_filter (f);
+}
+END_TEST
 
 /********************************************************************************/
 /*                          STDDEV FILTER TESTS                                 */
@@ -437,6 +601,647 @@ END_TEST
 /*                         MAIN TEST SUITE                                      */
 /********************************************************************************/
 
+/********************************************************************************/
+/*                         QUANTILE FILTER TESTS                                */
+/********************************************************************************/
+
+static int
+quantile_writer_out (OmlWriter* writer, OmlValue* values, int count)
+{
+  (void)writer;
+  fail_unless (count == 2);
+  fail_unless (oml_value_get_type(&values[0]) == OML_UINT64_VALUE);
+  fail_unless (oml_value_get_type(&values[1]) == OML_VECTOR_DOUBLE_VALUE);
+  return 0;
+}
+
+/* Output the quantiles estimated by f, and check that there are n of them */
+static double*
+get_quantiles (OmlFilter* f, int n)
+{
+  OmlWriter w;
+
+  memset(&w, 0, sizeof(w));
+  w.out = quantile_writer_out;
+  fail_unless (f->output(f, &w) == 0);
+  fail_unless (omlc_get_vector_nof_elts(*oml_value_get_value(&f->result[1])) == (size_t)n,
+      "Got %d quantiles instead of %d", omlc_get_vector_nof_elts(*oml_value_get_value(&f->result[1])), n);
+
+  return (double*)omlc_get_vector_ptr(*oml_value_get_value(&f->result[1]));
+}
+
+START_TEST (test_filter_quantile_create)
+{
+  OmlFilter* f = NULL;
+  QuantileInstanceData* data = NULL;
+  double* q;
+  int i;
+
+  f = create_filter ("quantile", "quantileinst", OML_INT32_VALUE, 2);
+
+  fail_if (f == NULL, "Filter creation failed for `quantile' filter");
+  fail_if (f->instance_data == NULL, "Filter instance data is NULL");
+  fail_unless (f->index == 2);
+  fail_unless (f->output_count == 2);
+  fail_if (f->merge == NULL);
+  fail_if (f->input_batch == NULL);
+
+  data = (QuantileInstanceData*)f->instance_data;
+  fail_unless (data->sample_count == 0);
+  fail_unless (data->accuracy == 0.01);
+  fail_unless (data->nquantiles == 4);
+  fail_unless (data->quantiles[3] == 0.999);
+
+  /* No samples, no quantiles */
+  q = get_quantiles (f, 4);
+  for (i = 0; i < 4; i++) {
+    fail_unless (isnan(q[i]), "Quantile %d of an empty window is %f", i, q[i]);
+  }
+  fail_unless (oml_value_get_value(&f->result[0])->uint64Value == 0);
+
+  fail_unless (destroy_filter(f) == NULL);
+}
+END_TEST
+
+START_TEST (test_filter_quantile_accuracy)
+{
+  /*
+   * Input a permutation of 1..N, then of -N..-1, and check that the
+   * quantiles are within the relative accuracy of the exact ones.
+   */
+  const int N = 100000;
+  double qs[] = { 0., 0.5, 0.9, 0.99, 0.999, 1. };
+  OmlFilter* f = create_filter ("quantile", "quantileinst", OML_INT32_VALUE, 0);
+  OmlValue v;
+  double *q, exact;
+  int i, sign;
+
+  fail_unless (set_string_property (f, "quantiles", "0 0.5,0.9, 0.99 0.999 1") == 0);
+  fail_unless (set_string_property (f, "accuracy", "0.005") == 0);
+  fail_unless (set_string_property (f, "quantiles", "0.5 1.5") == -1);
+  fail_unless (set_string_property (f, "accuracy", "1") == -1);
+  fail_unless (set_string_property (f, "buckets", "8") == -1);
+
+  oml_value_init(&v);
+  for (sign = 1; sign >= -1; sign -= 2) {
+    for (i = 0; i < N; i++) {
+      oml_value_set_type(&v, OML_INT32_VALUE);
+      omlc_set_int32(*oml_value_get_value(&v), sign * ((i * 7919) % N + 1));
+      fail_unless (f->input(f, &v) == 0);
+    }
+
+    q = get_quantiles (f, LENGTH(qs));
+    fail_unless (oml_value_get_value(&f->result[0])->uint64Value == (uint64_t)N);
+    for (i = 0; i < (int)LENGTH(qs); i++) {
+      /* Value of rank qs[i] * (N - 1) */
+      exact = (sign > 0) ? 1 + floor(qs[i] * (N - 1)) : -N + floor(qs[i] * (N - 1));
+      fail_unless (fabs(q[i] - exact) <= 0.005 * fabs(exact) + 1e-9,
+          "Quantile %g is %f instead of %f", qs[i], q[i], exact);
+    }
+    f->newwindow(f);
+  }
+  oml_value_reset(&v);
+
+  destroy_filter (f);
+}
+END_TEST
+
+START_TEST (test_filter_quantile_collapse)
+{
+  /*
+   * Input samples spanning far more buckets than available, and check that
+   * the high quantiles are still accurate, and the low ones still bounded.
+   */
+  OmlFilter* f = create_filter ("quantile", "quantileinst", OML_DOUBLE_VALUE, 0);
+  QuantileInstanceData* data;
+  OmlValueU values[1000];
+  double* q;
+  int i;
+
+  fail_unless (set_string_property (f, "buckets", "16") == 0);
+  fail_unless (set_string_property (f, "quantiles", "0 0.999 1") == 0);
+  data = (QuantileInstanceData*)f->instance_data;
+  fail_unless (data->max_buckets == 16);
+
+  /* 1e-3 to 1e6, geometrically */
+  omlc_zero_array(values, LENGTH(values));
+  for (i = 0; i < (int)LENGTH(values); i++) {
+    omlc_set_double(values[i], 1e-3 * pow(1e9, i / 999.));
+  }
+  fail_unless (f->input_batch(f, values, LENGTH(values), 1) == 0);
+  data = (QuantileInstanceData*)f->instance_data;
+  fail_unless (data->pos.hi - data->pos.lo < 16);
+  fail_unless (data->pos.count == 1000);
+
+  q = get_quantiles (f, 3);
+  fail_unless (q[0] >= 1e-3 && q[0] < 1e6, "Minimum is %g", q[0]);
+  fail_unless (fabs(q[1] - values[998].doubleValue) <= 0.01 * values[998].doubleValue,
+      "Quantile 0.999 is %g instead of %g", q[1], values[998].doubleValue);
+  fail_unless (q[2] == 1e6, "Maximum is %g instead of 1e6", q[2]);
+
+  destroy_filter (f);
+}
+END_TEST
+
+/********************************************************************************/
+/*                           TOP-K FILTER TESTS                                 */
+/********************************************************************************/
+
+static int
+topk_writer_out (OmlWriter* writer, OmlValue* values, int count)
+{
+  (void)writer;
+  fail_unless (count == 2);
+  fail_unless (oml_value_get_type(&values[0]) == OML_STRING_VALUE);
+  fail_unless (oml_value_get_type(&values[1]) == OML_VECTOR_UINT64_VALUE);
+  return 0;
+}
+
+/* Input a string n times into f */
+static void
+input_string (OmlFilter* f, const char* str, int n)
+{
+  OmlValue v;
+
+  oml_value_init(&v);
+  oml_value_set_type(&v, OML_STRING_VALUE);
+  omlc_set_string_copy(*oml_value_get_value(&v), str, strlen(str));
+  while (n-- > 0) {
+    fail_unless (f->input(f, &v) == 0);
+  }
+  oml_value_reset(&v);
+}
+
+/* Output the top strings of f, and return their counts */
+static uint64_t*
+get_topk (OmlFilter* f, const char** keys, int* n)
+{
+  OmlWriter w;
+
+  memset(&w, 0, sizeof(w));
+  w.out = topk_writer_out;
+  fail_unless (f->output(f, &w) == 0);
+  *keys = omlc_get_string_ptr(*oml_value_get_value(&f->result[0]));
+  *n = omlc_get_vector_nof_elts(*oml_value_get_value(&f->result[1]));
+
+  return (uint64_t*)omlc_get_vector_ptr(*oml_value_get_value(&f->result[1]));
+}
+
+START_TEST (test_filter_topk_create)
+{
+  OmlFilter* f = NULL;
+  TopKInstanceData* data = NULL;
+
+  f = create_filter ("topk", "topkinst", OML_INT32_VALUE, 0);
+  fail_unless (f->instance_data == NULL, "`topk' filter accepted numeric input");
+  destroy_filter (f);
+
+  f = create_filter ("topk", "topkinst", OML_STRING_VALUE, 1);
+  fail_if (f == NULL, "Filter creation failed for `topk' filter");
+  fail_if (f->instance_data == NULL, "Filter instance data is NULL");
+  fail_unless (f->output_count == 2);
+  fail_if (f->merge == NULL);
+
+  data = (TopKInstanceData*)f->instance_data;
+  fail_unless (data->k == 10);
+  fail_unless (data->capacity == 100);
+  fail_unless (data->ncounters == 0);
+
+  fail_unless (set_string_property (f, "k", "0") == -1);
+  fail_unless (set_string_property (f, "k", "three") == -1);
+  fail_unless (set_string_property (f, "capacity", "100000") == -1);
+  fail_unless (set_string_property (f, "separator", "::") == -1);
+
+  fail_unless (destroy_filter(f) == NULL);
+}
+END_TEST
+
+START_TEST (test_filter_topk_exact)
+{
+  /* With enough counters, the counts are exact */
+  OmlFilter* f = create_filter ("topk", "topkinst", OML_STRING_VALUE, 0);
+  char long1[101], long2[101];
+  const char* keys;
+  uint64_t* counts;
+  int n;
+
+  fail_unless (set_string_property (f, "k", "3") == 0);
+  fail_unless (set_string_property (f, "separator", ",") == 0);
+
+  input_string (f, "10.0.0.2", 5);
+  input_string (f, "10.0.0.1", 7);
+  input_string (f, "10.0.0.3", 1);
+  input_string (f, "10.0.0.4", 2);
+  counts = get_topk (f, &keys, &n);
+  fail_unless (n == 3, "Got %d top strings instead of 3", n);
+  fail_unless (!strcmp(keys, "10.0.0.1,10.0.0.2,10.0.0.4"), "Got top strings '%s'", keys);
+  fail_unless (counts[0] == 7 && counts[1] == 5 && counts[2] == 2);
+
+  /* Empty window */
+  f->newwindow(f);
+  counts = get_topk (f, &keys, &n);
+  fail_unless (n == 0);
+  fail_unless (!strcmp(keys, ""));
+
+  /* Long strings are truncated */
+  memset(long1, 'a', 100); long1[100] = '\0';
+  memcpy(long2, long1, sizeof(long1)); long2[99] = 'b';
+  input_string (f, long1, 1);
+  input_string (f, long2, 1);
+  counts = get_topk (f, &keys, &n);
+  fail_unless (n == 1);
+  fail_unless (counts[0] == 2);
+  fail_unless (strlen(keys) == OMLF_TOPK_KEY_SIZE - 1);
+
+  destroy_filter (f);
+}
+END_TEST
+
+START_TEST (test_filter_topk_heavy)
+{
+  /*
+   * Interleave 5 frequent strings with many distinct ones, with far fewer
+   * counters than distinct strings, and check that the frequent ones are
+   * reported, with counts bounded by the Space-Saving guarantees.
+   */
+  OmlFilter* f = create_filter ("topk", "topkinst", OML_STRING_VALUE, 0);
+  OmlValueU values[10000];
+  char str[32], top[128], *tok, *saveptr;
+  const char* keys;
+  uint64_t* counts;
+  int i, n, heavy[5];
+
+  fail_unless (set_string_property (f, "k", "5") == 0);
+  fail_unless (set_string_property (f, "capacity", "20") == 0);
+
+  omlc_zero_array(values, LENGTH(values));
+  for (i = 0; i < (int)LENGTH(values); i++) {
+    if (i % 2) {
+      snprintf(str, sizeof(str), "heavy%d", (i / 2) % 5);
+    } else {
+      snprintf(str, sizeof(str), "noise%d", i);
+    }
+    omlc_set_string_copy(values[i], str, strlen(str));
+  }
+  fail_unless (f->input_batch(f, values, LENGTH(values), 1) == 0);
+  for (i = 0; i < (int)LENGTH(values); i++) {
+    omlc_reset_string(values[i]);
+  }
+
+  counts = get_topk (f, &keys, &n);
+  fail_unless (n == 5);
+  strncpy(top, keys, sizeof(top));
+  memset(heavy, 0, sizeof(heavy));
+  for (i = 0, tok = strtok_r(top, " ", &saveptr); tok; i++, tok = strtok_r(NULL, " ", &saveptr)) {
+    fail_unless (!strncmp(tok, "heavy", 5), "Top string %d is '%s'", i, tok);
+    heavy[atoi(tok + 5)] = 1;
+    fail_unless (counts[i] >= 1000 && counts[i] <= 1000 + 10000 / 20,
+        "Count of '%s' is %" PRIu64, tok, counts[i]);
+  }
+  fail_unless (i == 5);
+  for (i = 0; i < 5; i++) {
+    fail_unless (heavy[i], "heavy%d not reported", i);
+  }
+
+  destroy_filter (f);
+}
+END_TEST
+
+/********************************************************************************/
+/*                           VECTOR FILTER TESTS                                */
+/********************************************************************************/
+
+static int
+null_writer_out (OmlWriter* writer, OmlValue* values, int count)
+{
+  (void)writer;
+  (void)values;
+  (void)count;
+  return 0;
+}
+
+START_TEST (test_filter_vector)
+{
+  /*
+   * Input vectors into the vector filters, and the same values element by
+   * element into their scalar counterparts, and check that the outputs match.
+   */
+  const char* vtypes[] = { "vavg", "vsum", "vstddev" };
+  const char* types[] = { "avg", "sum", "stddev" };
+  OmlFilter *f, *ref[4];
+  OmlValue v, s;
+  OmlWriter w;
+  int32_t elts[4];
+  double* out;
+  int i, j, k, l;
+
+  memset(&w, 0, sizeof(w));
+  w.out = null_writer_out;
+  oml_value_init(&v);
+  oml_value_init(&s);
+
+  for (i = 0; i < (int)LENGTH(vtypes); i++) {
+    f = create_filter (vtypes[i], "vinst", OML_INT32_VALUE, 0);
+    fail_unless (f->instance_data == NULL, "`%s' filter accepted scalar input", vtypes[i]);
+    destroy_filter (f);
+
+    f = create_filter (vtypes[i], "vinst", OML_VECTOR_INT32_VALUE, 0);
+    fail_if (f->instance_data == NULL, "Filter creation failed for `%s' filter", vtypes[i]);
+    for (k = 0; k < 4; k++) {
+      ref[k] = create_filter (types[i], "inst", OML_INT32_VALUE, 0);
+    }
+
+    for (j = 0; j < 2; j++) {
+      for (l = 0; l < 100; l++) {
+        for (k = 0; k < 4; k++) {
+          elts[k] = ((l + 1) * 7919 * (k + 1)) % 1013 - 500 * (k % 2);
+          oml_value_set_type(&s, OML_INT32_VALUE);
+          omlc_set_int32(*oml_value_get_value(&s), elts[k]);
+          ref[k]->input(ref[k], &s);
+        }
+        oml_value_set_type(&v, OML_VECTOR_INT32_VALUE);
+        omlc_set_vector_int32(*oml_value_get_value(&v), elts, 4);
+        fail_unless (f->input(f, &v) == 0);
+      }
+      /* Samples of another length are rejected */
+      omlc_set_vector_int32(*oml_value_get_value(&v), elts, 3);
+      fail_unless (f->input(f, &v) == -1);
+
+      f->output(f, &w);
+      for (k = 0; k < 4; k++) {
+        ref[k]->output(ref[k], &w);
+        for (l = 0; l < f->output_count; l++) {
+          fail_unless (omlc_get_vector_nof_elts(*oml_value_get_value(&f->result[l])) == 4);
+          out = (double*)omlc_get_vector_ptr(*oml_value_get_value(&f->result[l]));
+          fail_unless (fabs(out[k] - oml_value_get_value(&ref[k]->result[l])->doubleValue) <=
+              1e-9 * fabs(out[k]),
+              "Element %d of output %d of `%s' is %f instead of %f", k, l, vtypes[i],
+              out[k], oml_value_get_value(&ref[k]->result[l])->doubleValue);
+        }
+        ref[k]->newwindow(ref[k]);
+      }
+      f->newwindow(f);
+    }
+
+    /* Empty periods output empty vectors */
+    f->output(f, &w);
+    fail_unless (omlc_get_vector_nof_elts(*oml_value_get_value(&f->result[0])) == 0);
+
+    destroy_filter (f);
+    for (k = 0; k < 4; k++) {
+      destroy_filter (ref[k]);
+    }
+  }
+
+  oml_value_reset(&v);
+  oml_value_reset(&s);
+}
+END_TEST
+
+/********************************************************************************/
+/*                          FILTER MERGE TESTS                                  */
+/********************************************************************************/
+
+/* Input samples 1..n into f, and every other one into partial if not NULL */
+static void
+input_samples (OmlFilter* f, OmlFilter* partial, int n)
+{
+  OmlValue v;
+  int i;
+
+  oml_value_init(&v);
+  for (i = 1; i <= n; i++) {
+    omlc_set_int32(*oml_value_get_value(&v), i);
+    oml_value_set_type(&v, OML_INT32_VALUE);
+    if (partial && i % 2) {
+      partial->input(partial, &v);
+    } else {
+      f->input(f, &v);
+    }
+  }
+  oml_value_reset(&v);
+}
+
+START_TEST (test_filter_merge)
+{
+  /*
+   * Split samples between a filter and its clone, and check that the merged
+   * state is the same as if all samples had been input into one filter.
+   */
+  OmlFilter *f, *clone, *ref;
+  AvgInstanceData *avg, *avgref;
+  StddevInstanceData *stddev, *stddevref;
+  SumInstanceData *sum, *sumref;
+  double *q, *qref, exact;
+  const char* keys;
+  uint64_t* counts;
+  double elts[2];
+  OmlValue v;
+  OmlWriter w;
+  int i, j, n;
+
+  f = create_filter ("avg", "avginst", OML_INT32_VALUE, 0);
+  ref = create_filter ("avg", "avginst", OML_INT32_VALUE, 0);
+  clone = clone_filter (f);
+  fail_if (clone == NULL, "Cannot clone `avg' filter");
+  fail_if (clone->instance_data == f->instance_data);
+  input_samples (f, clone, 11);
+  input_samples (ref, NULL, 11);
+  fail_unless (f->merge (f, clone) == 0);
+  avg = (AvgInstanceData*)f->instance_data;
+  avgref = (AvgInstanceData*)ref->instance_data;
+  fail_unless (avg->sample_count == avgref->sample_count, "Merged count %d instead of %d", avg->sample_count, avgref->sample_count);
+  fail_unless (avg->sample_sum == avgref->sample_sum, "Merged sum %f instead of %f", avg->sample_sum, avgref->sample_sum);
+  fail_unless (avg->sample_min == avgref->sample_min, "Merged min %f instead of %f", avg->sample_min, avgref->sample_min);
+  fail_unless (avg->sample_max == avgref->sample_max, "Merged max %f instead of %f", avg->sample_max, avgref->sample_max);
+  fail_unless (((AvgInstanceData*)clone->instance_data)->sample_count == 0, "Partial filter not reset after merge");
+  destroy_filter (f); destroy_filter (clone); destroy_filter (ref);
+
+  f = create_filter ("stddev", "stddevinst", OML_INT32_VALUE, 0);
+  ref = create_filter ("stddev", "stddevinst", OML_INT32_VALUE, 0);
+  clone = clone_filter (f);
+  fail_if (clone == NULL, "Cannot clone `stddev' filter");
+  input_samples (f, clone, 11);
+  input_samples (ref, NULL, 11);
+  fail_unless (f->merge (f, clone) == 0);
+  stddev = (StddevInstanceData*)f->instance_data;
+  stddevref = (StddevInstanceData*)ref->instance_data;
+  fail_unless (stddev->sample_count == stddevref->sample_count, "Merged count %d instead of %d", stddev->sample_count, stddevref->sample_count);
+  fail_unless (fabs(stddev->m - stddevref->m) < 1e-9, "Merged mean %f instead of %f", stddev->m, stddevref->m);
+  fail_unless (fabs(stddev->s - stddevref->s) < 1e-9, "Merged sum of squares %f instead of %f", stddev->s, stddevref->s);
+  destroy_filter (f); destroy_filter (clone); destroy_filter (ref);
+
+  f = create_filter ("sum", "suminst", OML_INT32_VALUE, 0);
+  ref = create_filter ("sum", "suminst", OML_INT32_VALUE, 0);
+  clone = clone_filter (f);
+  fail_if (clone == NULL, "Cannot clone `sum' filter");
+  input_samples (f, clone, 11);
+  input_samples (ref, NULL, 11);
+  fail_unless (f->merge (f, clone) == 0);
+  sum = (SumInstanceData*)f->instance_data;
+  sumref = (SumInstanceData*)ref->instance_data;
+  fail_unless (sum->sample_sum == sumref->sample_sum, "Merged sum %f instead of %f", sum->sample_sum, sumref->sample_sum);
+  destroy_filter (f); destroy_filter (clone); destroy_filter (ref);
+
+  /* Merging into a quantile filter with other properties re-bins the samples,
+   * then aligns the partial filter on the next merges */
+  f = create_filter ("quantile", "quantileinst", OML_INT32_VALUE, 0);
+  ref = create_filter ("quantile", "quantileinst", OML_INT32_VALUE, 0);
+  fail_unless (set_string_property (f, "accuracy", "0.05") == 0);
+  fail_unless (set_string_property (ref, "accuracy", "0.05") == 0);
+  clone = clone_filter (f);
+  fail_if (clone == NULL, "Cannot clone `quantile' filter");
+  for (i = 0; i < 2; i++) {
+    input_samples (f, clone, 1001);
+    input_samples (ref, NULL, 1001);
+    fail_unless (f->merge (f, clone) == 0);
+    q = get_quantiles (f, 4);
+    qref = get_quantiles (ref, 4);
+    fail_unless (((QuantileInstanceData*)f->instance_data)->sample_count == 1001);
+    for (j = 0; j < 4; j++) {
+      if (i == 0) {
+        /* Within the accuracy of both sketches of the exact quantile */
+        exact = 1 + floor(((QuantileInstanceData*)f->instance_data)->quantiles[j] * 1000);
+        fail_unless (fabs(q[j] - exact) <= 0.07 * exact, "Re-binned quantile %d is %f instead of %f", j, q[j], exact);
+      } else {
+        fail_unless (q[j] == qref[j], "Merged quantile %d is %f instead of %f", j, q[j], qref[j]);
+      }
+    }
+    fail_unless (((QuantileInstanceData*)clone->instance_data)->accuracy == 0.05);
+    fail_unless (((QuantileInstanceData*)clone->instance_data)->sample_count == 0);
+    f->newwindow (f);
+    ref->newwindow (ref);
+  }
+  destroy_filter (f); destroy_filter (clone); destroy_filter (ref);
+
+  /* Top-K filters merge their counters; clones are aligned on the first merge */
+  f = create_filter ("topk", "topkinst", OML_STRING_VALUE, 0);
+  fail_unless (set_string_property (f, "k", "2") == 0);
+  fail_unless (set_string_property (f, "capacity", "50") == 0);
+  clone = clone_filter (f);
+  fail_if (clone == NULL, "Cannot clone `topk' filter");
+  input_string (f, "a", 3);
+  input_string (clone, "a", 4);
+  input_string (clone, "b", 5);
+  input_string (f, "c", 6);
+  fail_unless (f->merge (f, clone) == 0);
+  fail_unless (((TopKInstanceData*)clone->instance_data)->capacity == 50);
+  fail_unless (((TopKInstanceData*)clone->instance_data)->ncounters == 0);
+  counts = get_topk (f, &keys, &n);
+  fail_unless (n == 2);
+  fail_unless (!strcmp(keys, "a c"), "Merged top strings are '%s'", keys);
+  fail_unless (counts[0] == 7 && counts[1] == 6);
+  destroy_filter (f); destroy_filter (clone);
+
+  /* Vector filters merge element by element */
+  f = create_filter ("vstddev", "vstddevinst", OML_VECTOR_DOUBLE_VALUE, 0);
+  ref = create_filter ("vstddev", "vstddevinst", OML_VECTOR_DOUBLE_VALUE, 0);
+  clone = clone_filter (f);
+  fail_if (clone == NULL, "Cannot clone `vstddev' filter");
+  oml_value_init(&v);
+  oml_value_set_type(&v, OML_VECTOR_DOUBLE_VALUE);
+  for (i = 1; i <= 11; i++) {
+    elts[0] = i;
+    elts[1] = -3. * i * i;
+    omlc_set_vector_double(*oml_value_get_value(&v), elts, 2);
+    if (i % 2) {
+      clone->input(clone, &v);
+    } else {
+      f->input(f, &v);
+    }
+    ref->input(ref, &v);
+  }
+  oml_value_reset(&v);
+  fail_unless (f->merge (f, clone) == 0);
+  memset(&w, 0, sizeof(w));
+  w.out = null_writer_out;
+  f->output (f, &w);
+  ref->output (ref, &w);
+  for (j = 0; j < 2; j++) {
+    q = (double*)omlc_get_vector_ptr(*oml_value_get_value(&f->result[1]));
+    qref = (double*)omlc_get_vector_ptr(*oml_value_get_value(&ref->result[1]));
+    fail_unless (fabs(q[j] - qref[j]) < 1e-9 * qref[j], "Merged variance %d is %f instead of %f", j, q[j], qref[j]);
+  }
+  destroy_filter (f); destroy_filter (clone); destroy_filter (ref);
+
+  /* Filters without a merge function cannot be cloned */
+  f = create_filter ("delta", "deltainst", OML_INT32_VALUE, 0);
+  fail_unless (f->merge == NULL);
+  fail_unless (clone_filter (f) == NULL);
+  destroy_filter (f);
+}
+END_TEST
+
+START_TEST (test_filter_batch)
+{
+  /*
+   * Input the same samples one by one, and as a batch interleaved with another
+   * field, and check that the filters end up in the same state.
+   */
+  OmlFilter *f, *ref;
+  OmlValueU values[2 * 1000];
+  OmlValue v;
+  const char* types[] = { "avg", "sum", "stddev", "first", "last" };
+  AvgInstanceData *avg, *avgref;
+  StddevInstanceData *stddev, *stddevref;
+  SumInstanceData *sum, *sumref;
+  int i, j;
+
+  oml_value_init(&v);
+  omlc_zero_array(values, 2 * 1000);
+  for (i = 0; i < 1000; i++) {
+    omlc_set_int32(values[2 * i], (i * 7919) % 1013 - 500);
+    omlc_set_int32(values[2 * i + 1], -1);
+  }
+
+  for (j = 0; j < (int)LENGTH(types); j++) {
+    f = create_filter (types[j], "inst", OML_INT32_VALUE, 0);
+    ref = create_filter (types[j], "inst", OML_INT32_VALUE, 0);
+    fail_if (f->input_batch == NULL, "`%s' filter has no batch input", types[j]);
+
+    fail_unless (f->input_batch (f, values, 1000, 2) == 0, "Batch input failed for `%s' filter", types[j]);
+    for (i = 0; i < 1000; i++) {
+      oml_value_set(&v, &values[2 * i], OML_INT32_VALUE);
+      ref->input(ref, &v);
+    }
+
+    switch (j) {
+    case 0:
+      avg = (AvgInstanceData*)f->instance_data;
+      avgref = (AvgInstanceData*)ref->instance_data;
+      fail_unless (avg->sample_count == avgref->sample_count);
+      fail_unless (avg->sample_sum == avgref->sample_sum, "Batch sum %f instead of %f", avg->sample_sum, avgref->sample_sum);
+      fail_unless (avg->sample_min == avgref->sample_min, "Batch min %f instead of %f", avg->sample_min, avgref->sample_min);
+      fail_unless (avg->sample_max == avgref->sample_max, "Batch max %f instead of %f", avg->sample_max, avgref->sample_max);
+      break;
+    case 1:
+      sum = (SumInstanceData*)f->instance_data;
+      sumref = (SumInstanceData*)ref->instance_data;
+      fail_unless (sum->sample_count == sumref->sample_count);
+      fail_unless (sum->sample_sum == sumref->sample_sum, "Batch sum %f instead of %f", sum->sample_sum, sumref->sample_sum);
+      break;
+    case 2:
+      stddev = (StddevInstanceData*)f->instance_data;
+      stddevref = (StddevInstanceData*)ref->instance_data;
+      fail_unless (stddev->sample_count == stddevref->sample_count);
+      fail_unless (fabs(stddev->m - stddevref->m) < 1e-9, "Batch mean %f instead of %f", stddev->m, stddevref->m);
+      fail_unless (fabs(stddev->s - stddevref->s) < 1e-6 * stddevref->s, "Batch sum of squares %f instead of %f", stddev->s, stddevref->s);
+      break;
+    default:
+      fail_unless (oml_value_get_value(&f->result[0])->int32Value == oml_value_get_value(&ref->result[0])->int32Value,
+          "Batch `%s' is %d instead of %d", types[j],
+          oml_value_get_value(&f->result[0])->int32Value, oml_value_get_value(&ref->result[0])->int32Value);
+      break;
+    }
+
+    destroy_filter (f);
+    destroy_filter (ref);
+  }
+
+  oml_value_reset(&v);
+}
+END_TEST
+
 Suite*
 filters_suite (void)
 {
@@ -446,19 +1251,29 @@ filters_suite (void)
   TCase* tc_filter = tcase_create ("FilterCore");
   TCase* tc_filter_avg = tcase_create ("FilterAverage");
   TCase* tc_filter_first = tcase_create ("FilterFirst");
-  //  TCase* tc_filter_hist = tcase_create ("FilterHistogram");
+  TCase* tc_filter_hist = tcase_create ("FilterHistogram");
   TCase* tc_filter_stddev = tcase_create ("FilterStddev");
   TCase* tc_filter_sum = tcase_create ("FilterSum");
   TCase* tc_filter_delta= tcase_create ("FilterDelta");
+  TCase* tc_filter_quantile = tcase_create ("FilterQuantile");
+  TCase* tc_filter_topk = tcase_create ("FilterTopK");
+  TCase* tc_filter_vector = tcase_create ("FilterVector");
+  TCase* tc_filter_merge = tcase_create ("FilterMerge");
+  TCase* tc_filter_batch = tcase_create ("FilterBatch");
 
   /* Setup fixtures */
   tcase_add_checked_fixture (tc_filter,       filter_setup, filter_teardown);
   tcase_add_checked_fixture (tc_filter_avg,   filter_setup, filter_teardown);
   tcase_add_checked_fixture (tc_filter_first, filter_setup, filter_teardown);
-  //tcase_add_checked_fixture (tc_filter_hist,  filter_setup, filter_teardown);
+  tcase_add_checked_fixture (tc_filter_hist,  filter_setup, filter_teardown);
   tcase_add_checked_fixture (tc_filter_stddev,filter_setup, filter_teardown);
   tcase_add_checked_fixture (tc_filter_sum,filter_setup, filter_teardown);
   tcase_add_checked_fixture (tc_filter_delta,filter_setup, filter_teardown);
+  tcase_add_checked_fixture (tc_filter_quantile,filter_setup, filter_teardown);
+  tcase_add_checked_fixture (tc_filter_topk,filter_setup, filter_teardown);
+  tcase_add_checked_fixture (tc_filter_vector,filter_setup, filter_teardown);
+  tcase_add_checked_fixture (tc_filter_merge,filter_setup, filter_teardown);
+  tcase_add_checked_fixture (tc_filter_batch,filter_setup, filter_teardown);
 
   /* Add tests to test case "FilterCore" */
   tcase_add_test (tc_filter, test_filter_create);
@@ -471,7 +1286,10 @@ filters_suite (void)
   tcase_add_test (tc_filter_first, test_filter_first_create);
 
   /* Add tests to test case "FilterHistogram" */
-  //tcase_add_test (tc_filter_hist, test_filter_hist_create);
+  tcase_add_test (tc_filter_hist, test_filter_hist_create);
+  tcase_add_test (tc_filter_hist, test_filter_hist_linear);
+  tcase_add_test (tc_filter_hist, test_filter_hist_log);
+  tcase_add_test (tc_filter_hist, test_filter_hist_edges);
 
   /* Add tests to test case "FilterStddev" */
   tcase_add_test (tc_filter_stddev, test_filter_stddev_create);
@@ -486,14 +1304,38 @@ filters_suite (void)
   tcase_add_test (tc_filter_delta, test_filter_delta_create);
   tcase_add_test (tc_filter_delta, test_filter_delta_output);
 
+  /* Add tests to test case "FilterQuantile" */
+  tcase_add_test (tc_filter_quantile, test_filter_quantile_create);
+  tcase_add_test (tc_filter_quantile, test_filter_quantile_accuracy);
+  tcase_add_test (tc_filter_quantile, test_filter_quantile_collapse);
+
+  /* Add tests to test case "FilterTopK" */
+  tcase_add_test (tc_filter_topk, test_filter_topk_create);
+  tcase_add_test (tc_filter_topk, test_filter_topk_exact);
+  tcase_add_test (tc_filter_topk, test_filter_topk_heavy);
+
+  /* Add tests to test case "FilterVector" */
+  tcase_add_test (tc_filter_vector, test_filter_vector);
+
+  /* Add tests to test case "FilterMerge" */
+  tcase_add_test (tc_filter_merge, test_filter_merge);
+
+  /* Add tests to test case "FilterBatch" */
+  tcase_add_test (tc_filter_batch, test_filter_batch);
+
   /* Add the test cases to this test suite */
   suite_add_tcase (s, tc_filter);
   suite_add_tcase (s, tc_filter_avg);
   suite_add_tcase (s, tc_filter_first);
-  //suite_add_tcase (s, tc_filter_hist);
+  suite_add_tcase (s, tc_filter_hist);
   suite_add_tcase (s, tc_filter_stddev);
   suite_add_tcase (s, tc_filter_sum);
   suite_add_tcase (s, tc_filter_delta);
+  suite_add_tcase (s, tc_filter_quantile);
+  suite_add_tcase (s, tc_filter_topk);
+  suite_add_tcase (s, tc_filter_vector);
+  suite_add_tcase (s, tc_filter_merge);
+  suite_add_tcase (s, tc_filter_batch);
 
   return s;
 }
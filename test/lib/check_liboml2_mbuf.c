@@ -243,6 +243,35 @@ START_TEST (test_mbuf_write_null)
 }
 END_TEST
 
+START_TEST (test_mbuf_write_advance)
+{
+  const char s[] = "0123456789";
+  MBuffer* mbuf = mbuf_create ();
+  size_t length;
+
+  fail_if (mbuf_write_advance (NULL, 1) != -1);
+
+  /* Fill the buffer directly, as read(2) would */
+  fail_if (mbuf_check_resize (mbuf, mbuf_length (mbuf) + 1) == -1);
+  length = mbuf_length (mbuf);
+  memcpy (mbuf_wrptr (mbuf), s, sizeof (s) - 1);
+  fail_if (mbuf_write_advance (mbuf, sizeof (s) - 1) == -1);
+
+  fail_if (mbuf->fill != sizeof (s) - 1);
+  fail_if (mbuf->wrptr - mbuf->base != sizeof (s) - 1);
+  fail_if (mbuf->rdptr != mbuf->base);
+  fail_if (mbuf->wr_remaining != length - (sizeof (s) - 1));
+  fail_if (mbuf->rd_remaining != sizeof (s) - 1);
+  fail_if (strncmp ((char*)mbuf_rdptr (mbuf), s, sizeof (s) - 1));
+
+  /* Advancing past the end of the buffer must not be possible */
+  fail_if (mbuf_write_advance (mbuf, mbuf_wr_remaining (mbuf) + 1) != -1);
+  fail_if (mbuf->fill != sizeof (s) - 1);
+
+  mbuf_destroy (mbuf);
+}
+END_TEST
+
 START_TEST (test_mbuf_read)
 {
   char s[8192];
@@ -632,6 +661,7 @@ mbuf_suite (void)
   tcase_add_test (tc_mbuf, test_mbuf_resize_contents);
   tcase_add_test (tc_mbuf, test_mbuf_write);
   tcase_add_test (tc_mbuf, test_mbuf_write_null);
+  tcase_add_test (tc_mbuf, test_mbuf_write_advance);
   tcase_add_test (tc_mbuf, test_mbuf_read);
   tcase_add_test (tc_mbuf, test_mbuf_read_null);
   tcase_add_test (tc_mbuf, test_mbuf_begin_read);
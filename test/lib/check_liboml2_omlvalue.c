@@ -28,7 +28,8 @@ START_TEST (test_stringU)
 {
   OmlValueU v, v2;
   char *test = "test";
-  char *const_test = "const test";
+  char *long_test = "test string too long to be stored inline";
+  char *const_test = "const test string too long to be stored inline";
   size_t size, alloc_diff, bcount = xmembytes();
 
   omlc_zero(v);
@@ -65,20 +66,20 @@ START_TEST (test_stringU)
       "Const test string should be constant");
 
   /* Duplicate pointer */
-  omlc_set_string_copy(v, test, strlen(test));
-  fail_if(omlc_get_string_ptr(v) == test,
+  omlc_set_string_copy(v, long_test, strlen(long_test));
+  fail_if(omlc_get_string_ptr(v) == long_test,
       "Copied test string pointer not allocated properly");
-  fail_if(strcmp(test, omlc_get_string_ptr(v)),
+  fail_if(strcmp(long_test, omlc_get_string_ptr(v)),
       "Copied test string mismatch ('%s' instead of '%s')",
-      omlc_get_string_ptr(v), test);
-  fail_unless(omlc_get_string_length(v) == strlen(test),
+      omlc_get_string_ptr(v), long_test);
+  fail_unless(omlc_get_string_length(v) == strlen(long_test),
       "Copied test string length not set properly (%d instead of %d)",
-      omlc_get_string_length(v), strlen(test));
+      omlc_get_string_length(v), strlen(long_test));
   alloc_diff = xmembytes() - bcount - sizeof(size_t);
   bcount = xmembytes();
-  fail_if(alloc_diff < strlen(test) + 1,
+  fail_if(alloc_diff < strlen(long_test) + 1,
       "Copied test string allocated memory not big enough (%d instead of at least %d)",
-      alloc_diff, strlen(test) + 1);
+      alloc_diff, strlen(long_test) + 1);
   fail_unless(omlc_get_string_size(v) == oml_malloc_usable_size(omlc_get_string_ptr(v)),
       "Copied test string allocated size not set properly (%d instead of %d)",
       omlc_get_string_size(v), oml_malloc_usable_size(omlc_get_string_ptr(v)));
@@ -165,6 +166,52 @@ START_TEST (test_stringU)
   fail_unless(omlc_get_string_is_const(v) == 0,
       "Const copy string should not be constant");
 
+  /* Copy short string inline, keeping the allocated storage */
+  size = omlc_get_string_size(v);
+  omlc_set_string_copy(v, test, strlen(test));
+  fail_unless(omlc_get_string_is_inline(v),
+      "Short copied string not stored inline");
+  fail_if(omlc_get_string_ptr(v) == test,
+      "Short copied string pointer not copied properly");
+  fail_if(strcmp(test, omlc_get_string_ptr(v)),
+      "Short copied string mismatch ('%s' instead of '%s')",
+      omlc_get_string_ptr(v), test);
+  fail_unless(omlc_get_string_length(v) == strlen(test),
+      "Short copied string length not set properly (%d instead of %d)",
+      omlc_get_string_length(v), strlen(test));
+  fail_unless(xmembytes() == bcount,
+      "Short copied string shouldn't have allocated memory, but the allocation changed");
+  fail_unless(omlc_get_string_size(v) == size,
+      "Short copied string should have kept the allocated storage (%d instead of %d)",
+      omlc_get_string_size(v), size);
+
+  /* Copy short string inline into another value */
+  omlc_copy_string(v2, v);
+  fail_unless(omlc_get_string_is_inline(v2),
+      "Copied short string not stored inline");
+  fail_if(strcmp(test, omlc_get_string_ptr(v2)),
+      "Copied short string mismatch ('%s' instead of '%s')",
+      omlc_get_string_ptr(v2), test);
+  fail_unless(xmembytes() == bcount,
+      "Copied short string shouldn't have allocated memory, but the allocation changed");
+
+  /* Copy long string back into the allocated storage */
+  omlc_set_string_copy(v, long_test, strlen(long_test));
+  fail_if(omlc_get_string_is_inline(v),
+      "Long copied string stored inline");
+  fail_if(strcmp(long_test, omlc_get_string_ptr(v)),
+      "Long copied string mismatch ('%s' instead of '%s')",
+      omlc_get_string_ptr(v), long_test);
+  fail_unless(xmembytes() == bcount,
+      "Long copied string should have reused the allocated storage, but the allocation changed");
+
+  /* Set pointer on inline string */
+  omlc_set_const_string(v2, const_test);
+  fail_if(omlc_get_string_is_inline(v2),
+      "Const string on inline string still stored inline");
+  fail_unless(omlc_get_string_ptr(v2) == const_test,
+      "Const string on inline string pointer not copied properly");
+
   omlc_reset_string(v);
   omlc_reset_string(v2);
 }
@@ -284,7 +331,8 @@ END_TEST
 
 START_TEST (test_string)
 {
-  char *test = "test";
+  char *test = "test string too long to be stored inline";
+  char *short_test = "test";
   OmlValue v, v2;
   OmlValueU vu;
   size_t bcount = xmembytes();
@@ -325,6 +373,15 @@ START_TEST (test_string)
   fail_unless(omlc_get_string_is_const(*oml_value_get_value(&v2)) == 0,
       "Copied OmlValue string should not be constant");
 
+  /* Short strings are copied inline */
+  omlc_set_const_string(vu, short_test);
+  oml_value_set(&v2, &vu, OML_STRING_VALUE);
+  fail_unless(xmembytes() == bcount,
+      "OmlValue short string copy shouldn't have allocated memory, but the allocation changed");
+  fail_if(strcmp(short_test, omlc_get_string_ptr(*oml_value_get_value(&v2))),
+      "OmlValue short string mismatch ('%s' instead of '%s')",
+      omlc_get_string_ptr(*oml_value_get_value(&v2)), short_test);
+
   oml_value_set_type(&v, OML_UINT64_VALUE);
   fail_unless(xmembytes() < bcount,
       "OmlValue string  was not freed after oml_value_set_type() (%d allocated, which is not less than %d)",
@@ -402,6 +459,80 @@ START_TEST (test_blob)
 }
 END_TEST
 
+/** Count calls to release_cb */
+static void
+release_cb(void *data, void *arg)
+{
+  (void)data;
+  (*(int*)arg)++;
+}
+
+START_TEST (test_blob_empty)
+{
+  OmlValueU v;
+  size_t bcount = xmembytes();
+  int i;
+
+  omlc_zero(v);
+
+  /* Copying empty blobs over each other must not leak their storage */
+  for (i = 0; i < 4; i++) {
+    omlc_set_blob(v, "", 0);
+    fail_if(omlc_get_blob_ptr(v) == NULL,
+        "Empty blob pointer not allocated properly");
+    fail_unless(omlc_get_blob_length(v) == 0,
+        "Empty blob length not set properly (%d instead of 0)",
+        omlc_get_blob_length(v));
+    fail_if(omlc_get_blob_size(v) == 0,
+        "Empty blob allocated size not set, it would not be freed");
+  }
+
+  omlc_reset_blob(v);
+  fail_unless(xmembytes() == bcount,
+      "Empty blob leaked memory (%d bytes used instead of %d)",
+      xmembytes(), bcount);
+}
+END_TEST
+
+START_TEST (test_blob_borrowed)
+{
+  char str[] = "this blob is only lent to OML";
+  OmlValue v, v2;
+  OmlValueU vu;
+  size_t len = strlen(str);
+  int released = 0;
+
+  oml_value_init(&v);
+  oml_value_init(&v2);
+  omlc_zero(vu);
+
+  fail_if(omlc_set_blob_borrowed(&vu, str, len, release_cb, &released),
+      "Could not lend blob");
+  fail_unless(omlc_get_blob_ptr(vu) == str && omlc_get_blob_length(vu) == len && omlc_get_blob_size(vu) == 0,
+      "Lent blob not set properly");
+
+  /* Copies share the reference rather than the data */
+  oml_value_set(&v, &vu, OML_BLOB_VALUE);
+  oml_value_duplicate(&v2, &v);
+  fail_unless(omlc_get_blob_ptr(*oml_value_get_value(&v2)) == str,
+      "Copied OmlValue blob does not point to the lent data");
+  fail_unless(omlc_get_blob_ref(*oml_value_get_value(&v2)) == omlc_get_blob_ref(vu),
+      "Copied OmlValue blob does not share the reference");
+
+  omlc_reset_blob(vu);
+  oml_value_reset(&v);
+  fail_unless(released == 0, "Lent blob released while still referenced");
+
+  /* Overwriting the last copy drops the last reference */
+  omlc_set_blob(*oml_value_get_value(&v2), "copy", 4);
+  fail_unless(released == 1, "Lent blob not released after last reference was dropped");
+  fail_if(omlc_get_blob_ptr(*oml_value_get_value(&v2)) == str, "Copied blob still points to the lent data");
+
+  oml_value_reset(&v2);
+  fail_unless(released == 1, "Lent blob released more than once");
+}
+END_TEST
+
 static struct {
   const char* str;
   uint8_t     b;
@@ -435,6 +566,8 @@ omlvalue_suite (void)
   tcase_add_test (tc_omlvalue, test_intrinsic);
   tcase_add_test (tc_omlvalue, test_string);
   tcase_add_test (tc_omlvalue, test_blob);
+  tcase_add_test (tc_omlvalue, test_blob_borrowed);
+  tcase_add_test (tc_omlvalue, test_blob_empty);
   tcase_add_loop_test (tc_omlvalue, test_bool_loop, 0, LENGTH(booltest));
 
   suite_add_tcase (s, tc_omlvalue);
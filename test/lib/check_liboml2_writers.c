@@ -27,12 +27,20 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <check.h>
 
 #include "mbuf.h"
 #include "client.h"
 #include "oml_utils.h"
 #include "file_stream.h"
+#include "buffered_writer.h"
+#include "udp_stream.h"
+#include "zlib_stream.h"
+#include "compress.h"
 
 /*
 START_TEST (test_bw_create)
@@ -107,6 +115,604 @@ START_TEST (test_fw_create_buffered)
 }
 END_TEST
 
+#define RING_FN       "test_bw_ring"
+#define RING_THREADS  4
+#define RING_MSGS     1000
+#define RING_HEADER   "header\n"
+
+static void*
+ring_producer(void* arg)
+{
+  BufferedWriter* bw = *(BufferedWriter**)arg;
+  char msg[16];
+  MBuffer* mbuf;
+  int i;
+
+  for (i = 0; i < RING_MSGS; i++) {
+    mbuf = bw_get_write_buf(bw);
+    fail_if(mbuf == NULL);
+    fail_unless(bw_current_write_buf(bw) == mbuf);
+    snprintf(msg, sizeof(msg), "%08d\n", i);
+    mbuf_write(mbuf, (uint8_t*)msg, strlen(msg));
+    mbuf_begin_write(mbuf);
+    bw_msgcount_add(bw, 1);
+    bw_release_write_buf(bw);
+    fail_unless(bw_current_write_buf(bw) == NULL);
+  }
+  return NULL;
+}
+
+START_TEST (test_bw_ring)
+{
+  OmlOutStream *os;
+  BufferedWriter *bw;
+  pthread_t threads[RING_THREADS];
+  char line[16];
+  int i, nlines = 0;
+  FILE *f;
+
+  unlink(RING_FN);
+  os = file_stream_new(RING_FN);
+  fail_if(os == NULL);
+
+  bw = bw_create2(os, 1 << 20, 0, BE_Ring);
+  fail_if(bw == NULL);
+  fail_unless(bw_push_meta(bw, (uint8_t*)RING_HEADER, strlen(RING_HEADER)));
+
+  for (i = 0; i < RING_THREADS; i++) {
+    fail_if(pthread_create(&threads[i], NULL, ring_producer, &bw));
+  }
+  for (i = 0; i < RING_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  fail_unless(bw_nlost_reset(bw) == 0);
+  bw_close(bw);
+
+  f = fopen(RING_FN, "r");
+  fail_if(f == NULL);
+  fail_if(fgets(line, sizeof(line), f) == NULL);
+  fail_unless(!strcmp(line, RING_HEADER), "Headers not written first, got '%s'", line);
+  while(fgets(line, sizeof(line), f)) {
+    fail_unless(strlen(line) == 9, "Message corrupted: '%s'", line);
+    nlines++;
+  }
+  fclose(f);
+  fail_unless(nlines == RING_THREADS * RING_MSGS,
+      "Read %d messages, expected %d", nlines, RING_THREADS * RING_MSGS);
+}
+END_TEST
+
+START_TEST (test_bw_ring_full)
+{
+  OmlOutStream *os;
+  BufferedWriter *bw;
+  MBuffer *mbuf;
+  uint8_t big[4096];
+
+  unlink(RING_FN);
+  os = file_stream_new(RING_FN);
+  bw = bw_create2(os, 1024, 512, BE_Ring);
+  fail_if(bw == NULL);
+
+  /* A message larger than the whole ring can never be queued */
+  memset(big, 'a', sizeof(big));
+  mbuf = bw_get_write_buf(bw);
+  mbuf_write(mbuf, big, sizeof(big));
+  mbuf_begin_write(mbuf);
+  bw_msgcount_add(bw, 3);
+  bw_release_write_buf(bw);
+  fail_unless(bw_nlost_reset(bw) == 3);
+  fail_unless(bw_nlost_reset(bw) == 0);
+
+  /* Aborted messages are not queued */
+  mbuf = bw_get_write_buf(bw);
+  mbuf_write(mbuf, big, 10);
+  bw_abort_write_buf(bw);
+  fail_unless(bw_current_write_buf(bw) == NULL);
+  bw_release_write_buf(bw);
+
+  bw_close(bw);
+}
+END_TEST
+
+/** Producer leaving a batch unfinished when its thread exits */
+static void*
+exiting_producer(void* arg)
+{
+  BufferedWriter* bw = (BufferedWriter*)arg;
+  char msg[16];
+  MBuffer* mbuf;
+  int i;
+
+  fail_if(bw_batch_begin(bw));
+  for (i = 0; i < RING_MSGS; i++) {
+    mbuf = bw_get_write_buf(bw);
+    fail_if(mbuf == NULL);
+    snprintf(msg, sizeof(msg), "%08d\n", i);
+    mbuf_write(mbuf, (uint8_t*)msg, strlen(msg));
+    mbuf_begin_write(mbuf);
+    bw_msgcount_add(bw, 1);
+    bw_release_write_buf(bw);
+  }
+  return NULL;
+}
+
+static enum BufferEngine exit_engines[] = { BE_Ring, BE_Chain };
+
+START_TEST (test_bw_thread_exit)
+{
+  OmlOutStream *os;
+  BufferedWriter *bw;
+  pthread_t thread;
+  char line[16];
+  int nlines = 0;
+  FILE *f;
+
+  unlink(RING_FN);
+  os = file_stream_new(RING_FN);
+  fail_if(os == NULL);
+
+  bw = bw_create2(os, 1 << 20, 0, exit_engines[_i]);
+  fail_if(bw == NULL);
+  fail_unless(bw_push_meta(bw, (uint8_t*)RING_HEADER, strlen(RING_HEADER)));
+
+  fail_if(pthread_create(&thread, NULL, exiting_producer, bw));
+  pthread_join(thread, NULL);
+
+  /* The exiting thread's slot queued its messages, and released the writer */
+  fail_unless(bw_get_write_buf(bw) != NULL, "Writer still held by the exited thread");
+  bw_release_write_buf(bw);
+  bw_close(bw);
+
+  f = fopen(RING_FN, "r");
+  fail_if(f == NULL);
+  fail_if(fgets(line, sizeof(line), f) == NULL);
+  fail_unless(!strcmp(line, RING_HEADER), "Headers not written first, got '%s'", line);
+  while(fgets(line, sizeof(line), f)) {
+    nlines++;
+  }
+  fclose(f);
+  fail_unless(nlines == RING_MSGS, "Read %d messages, expected %d", nlines, RING_MSGS);
+}
+END_TEST
+
+#define CHAIN_MSGS    200
+#define CHAIN_HEADER  "header\n"
+
+/** OmlOutStream recording the vectored writes it gets into memory */
+typedef struct {
+  OmlOutStream os;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int blocked;		/* The first writev waits until this is reset */
+  int ncalls;
+  int max_iovcnt;
+  char data[CHAIN_MSGS * 16];
+  size_t length;
+} VecOutStream;
+
+static ssize_t
+vec_stream_writev(OmlOutStream* hdl, const struct iovec* iov, int iovcnt, uint8_t* header, size_t header_length)
+{
+  VecOutStream* self = (VecOutStream*)hdl;
+  ssize_t count = 0;
+  int i;
+
+  pthread_mutex_lock(&self->lock);
+  while (self->blocked) {
+    pthread_cond_wait(&self->cond, &self->lock);
+  }
+  if (!hdl->header_written) {
+    memcpy(self->data + self->length, header, header_length);
+    self->length += header_length;
+    hdl->header_written = 1;
+  }
+  for (i = 0; i < iovcnt; i++) {
+    memcpy(self->data + self->length, iov[i].iov_base, iov[i].iov_len);
+    self->length += iov[i].iov_len;
+    count += iov[i].iov_len;
+  }
+  self->ncalls++;
+  if (iovcnt > self->max_iovcnt) {
+    self->max_iovcnt = iovcnt;
+  }
+  pthread_mutex_unlock(&self->lock);
+
+  return count;
+}
+
+static int
+vec_stream_close(OmlOutStream* hdl)
+{
+  (void)hdl;
+  return 0;
+}
+
+START_TEST (test_bw_chain_writev)
+{
+  VecOutStream vs;
+  BufferedWriter *bw;
+  MBuffer *mbuf;
+  char msg[16], *p;
+  int i;
+
+  memset(&vs, 0, sizeof(vs));
+  pthread_mutex_init(&vs.lock, NULL);
+  pthread_cond_init(&vs.cond, NULL);
+  vs.os.writev = vec_stream_writev;
+  vs.os.close = vec_stream_close;
+  vs.os.dest = "vec";
+  vs.blocked = 1;
+
+  /* Small chunks, so messages spread over many of them */
+  bw = bw_create2(&vs.os, 1 << 16, 64, BE_Chain);
+  fail_if(bw == NULL);
+  fail_unless(bw_push_meta(bw, (uint8_t*)CHAIN_HEADER, strlen(CHAIN_HEADER)));
+
+  for (i = 0; i < CHAIN_MSGS; i++) {
+    mbuf = bw_get_write_buf(bw);
+    fail_if(mbuf == NULL);
+    snprintf(msg, sizeof(msg), "%08d\n", i);
+    mbuf_write(mbuf, (uint8_t*)msg, strlen(msg));
+    mbuf_begin_write(mbuf);
+    bw_msgcount_add(bw, 1);
+    bw_release_write_buf(bw);
+  }
+
+  /* Let the reader thread go, and drain everything */
+  pthread_mutex_lock(&vs.lock);
+  vs.blocked = 0;
+  pthread_cond_broadcast(&vs.cond);
+  pthread_mutex_unlock(&vs.lock);
+  fail_unless(bw_nlost_reset(bw) == 0);
+  bw_close(bw);
+
+  fail_unless(vs.length == strlen(CHAIN_HEADER) + 9 * CHAIN_MSGS,
+      "Wrote %d bytes, expected %d", vs.length, strlen(CHAIN_HEADER) + 9 * CHAIN_MSGS);
+  fail_unless(!strncmp(vs.data, CHAIN_HEADER, strlen(CHAIN_HEADER)), "Headers not written first");
+  for (i = 0, p = vs.data + strlen(CHAIN_HEADER); i < CHAIN_MSGS; i++, p += 9) {
+    snprintf(msg, sizeof(msg), "%08d\n", i);
+    fail_unless(!strncmp(p, msg, 9), "Message %d out of order or corrupted: '%.9s'", i, p);
+  }
+  /* All the chunks filled while the reader was blocked went out together */
+  fail_unless(vs.max_iovcnt > 1, "Chunks were not gathered (max iovcnt %d)", vs.max_iovcnt);
+  fail_unless(vs.ncalls < CHAIN_MSGS * 9 / 64, "Too many writes (%d)", vs.ncalls);
+
+  pthread_cond_destroy(&vs.cond);
+  pthread_mutex_destroy(&vs.lock);
+}
+END_TEST
+
+START_TEST (test_bw_push)
+{
+  VecOutStream vs;
+  BufferedWriter *bw;
+  char msg[16], *p;
+  int i;
+
+  memset(&vs, 0, sizeof(vs));
+  pthread_mutex_init(&vs.lock, NULL);
+  pthread_cond_init(&vs.cond, NULL);
+  vs.os.writev = vec_stream_writev;
+  vs.os.close = vec_stream_close;
+  vs.os.dest = "vec";
+  vs.blocked = 1;
+
+  bw = bw_create2(&vs.os, 1 << 16, 64, BE_Chain);
+  fail_if(bw == NULL);
+  fail_unless(bw_push_meta(bw, (uint8_t*)CHAIN_HEADER, strlen(CHAIN_HEADER)));
+
+  /* Hold the writer chunk for the whole sequence, so only bw_push moves on */
+  fail_unless(bw_batch_begin(bw) == 0);
+  for (i = 0; i < CHAIN_MSGS; i++) {
+    snprintf(msg, sizeof(msg), "%08d\n", i);
+    fail_unless(bw_push(bw, (uint8_t*)msg, strlen(msg)), "Could not push message %d", i);
+  }
+  bw_batch_end(bw);
+
+  pthread_mutex_lock(&vs.lock);
+  vs.blocked = 0;
+  pthread_cond_broadcast(&vs.cond);
+  pthread_mutex_unlock(&vs.lock);
+  fail_unless(bw_nlost_reset(bw) == 0);
+  bw_close(bw);
+
+  fail_unless(vs.length == strlen(CHAIN_HEADER) + 9 * CHAIN_MSGS,
+      "Wrote %d bytes, expected %d", vs.length, strlen(CHAIN_HEADER) + 9 * CHAIN_MSGS);
+  fail_unless(!strncmp(vs.data, CHAIN_HEADER, strlen(CHAIN_HEADER)), "Headers not written first");
+  for (i = 0, p = vs.data + strlen(CHAIN_HEADER); i < CHAIN_MSGS; i++, p += 9) {
+    snprintf(msg, sizeof(msg), "%08d\n", i);
+    fail_unless(!strncmp(p, msg, 9), "Message %d out of order or corrupted: '%.9s'", i, p);
+  }
+  /* Full chunks were left behind, rather than one growing without bounds */
+  fail_unless(vs.max_iovcnt >= 8, "Chunks were not switched when full (max iovcnt %d)", vs.max_iovcnt);
+
+  pthread_cond_destroy(&vs.cond);
+  pthread_mutex_destroy(&vs.lock);
+}
+END_TEST
+
+START_TEST (test_bw_chain_spill)
+{
+  VecOutStream vs;
+  BufferedWriter *bw;
+  MBuffer *mbuf;
+  char msg[16], *p;
+  int i;
+
+  memset(&vs, 0, sizeof(vs));
+  pthread_mutex_init(&vs.lock, NULL);
+  pthread_cond_init(&vs.cond, NULL);
+  vs.os.writev = vec_stream_writev;
+  vs.os.close = vec_stream_close;
+  vs.os.dest = "vec";
+  vs.blocked = 1;
+
+  /* A queue much too small to hold all the messages */
+  bw = bw_create2(&vs.os, 256, 64, BE_Chain);
+  fail_if(bw == NULL);
+  fail_unless(bw_spill_enable(bw, "/nonexistent/directory") == -1);
+  fail_unless(bw_spill_enable(bw, ".") == 0);
+  fail_unless(bw_push_meta(bw, (uint8_t*)CHAIN_HEADER, strlen(CHAIN_HEADER)));
+
+  for (i = 0; i < CHAIN_MSGS; i++) {
+    mbuf = bw_get_write_buf(bw);
+    fail_if(mbuf == NULL);
+    snprintf(msg, sizeof(msg), "%08d\n", i);
+    mbuf_write(mbuf, (uint8_t*)msg, strlen(msg));
+    mbuf_begin_write(mbuf);
+    bw_msgcount_add(bw, 1);
+    bw_release_write_buf(bw);
+  }
+  fail_unless(bw_nlost_reset(bw) == 0, "Samples dropped despite spilling");
+
+  pthread_mutex_lock(&vs.lock);
+  vs.blocked = 0;
+  pthread_cond_broadcast(&vs.cond);
+  pthread_mutex_unlock(&vs.lock);
+  bw_close(bw);
+
+  fail_unless(vs.length == strlen(CHAIN_HEADER) + 9 * CHAIN_MSGS,
+      "Wrote %d bytes, expected %d", vs.length, strlen(CHAIN_HEADER) + 9 * CHAIN_MSGS);
+  fail_unless(!strncmp(vs.data, CHAIN_HEADER, strlen(CHAIN_HEADER)), "Headers not written first");
+  for (i = 0, p = vs.data + strlen(CHAIN_HEADER); i < CHAIN_MSGS; i++, p += 9) {
+    snprintf(msg, sizeof(msg), "%08d\n", i);
+    fail_unless(!strncmp(p, msg, 9), "Message %d out of order or corrupted: '%.9s'", i, p);
+  }
+
+  pthread_cond_destroy(&vs.cond);
+  pthread_mutex_destroy(&vs.lock);
+}
+END_TEST
+
+#define UDP_HEADER "protocol: 4\ncontent: text\n\n"
+#define UDP_MSGS 20
+#define UDP_PAYLOAD 64
+
+START_TEST (test_udp_stream_datagrams)
+{
+  OmlOutStream *os;
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  struct timeval tv = { 1, 0 };
+  struct iovec iov[3];
+  char uri[64], data[9 * UDP_MSGS + 1], dgram[2 * UDP_PAYLOAD], msg[16];
+  int sock, i, n, received = 0, datagrams = 0;
+
+  /* Receive the datagrams on an ephemeral port of the loopback interface */
+  sock = socket(AF_INET, SOCK_DGRAM, 0);
+  fail_if(sock < 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  fail_if(bind(sock, (struct sockaddr*)&addr, sizeof(addr)));
+  fail_if(getsockname(sock, (struct sockaddr*)&addr, &addr_len));
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  snprintf(uri, sizeof(uri), "udp://127.0.0.1:%d", ntohs(addr.sin_port));
+  os = create_out_stream(uri);
+  fail_if(os == NULL, "Could not create UDP stream to %s", uri);
+  fail_unless(udp_stream_set_mtu(os, UDP_HEADERS_SIZE) == -1, "MTU smaller than the headers accepted");
+  fail_if(udp_stream_set_mtu(os, UDP_HEADERS_SIZE + UDP_PAYLOAD));
+
+  for (i = 0; i < UDP_MSGS; i++) {
+    snprintf(data + 9 * i, sizeof(data) - 9 * i, "%08d\n", i);
+  }
+  /* Messages straddle the iovecs */
+  iov[0].iov_base = data;
+  iov[0].iov_len = 22;
+  iov[1].iov_base = data + 22;
+  iov[1].iov_len = 50;
+  iov[2].iov_base = data + 72;
+  iov[2].iov_len = 9 * UDP_MSGS - 72;
+
+  fail_unless(out_stream_writev(os, iov, 3, (uint8_t*)UDP_HEADER, strlen(UDP_HEADER)) == 9 * UDP_MSGS);
+
+  n = recv(sock, dgram, sizeof(dgram), 0);
+  fail_unless(n == strlen(UDP_HEADER) && !strncmp(dgram, UDP_HEADER, n),
+      "Headers not sent in their own datagram: '%.*s'", n, dgram);
+
+  while (received < 9 * UDP_MSGS) {
+    n = recv(sock, dgram, sizeof(dgram), 0);
+    fail_if(n <= 0, "Missing datagrams after %d bytes", received);
+    fail_unless(n <= UDP_PAYLOAD, "Datagram of %d bytes larger than the payload size", n);
+    fail_unless(n % 9 == 0, "Message split across datagrams (%d bytes)", n);
+    for (i = 0; i < n / 9; i++) {
+      snprintf(msg, sizeof(msg), "%08d\n", received / 9 + i);
+      fail_unless(!strncmp(dgram + 9 * i, msg, 9), "Message %d out of order or corrupted", received / 9 + i);
+    }
+    received += n;
+    datagrams++;
+  }
+  /* As many messages as possible are packed in each datagram */
+  fail_unless(datagrams == (UDP_MSGS + 6) / 7, "Sent %d datagrams, expected %d", datagrams, (UDP_MSGS + 6) / 7);
+
+  os->close(os);
+  close(sock);
+}
+END_TEST
+
+#define ZLIB_HEADER "protocol: 4\ncontent: text\n\n"
+#define ZLIB_HEADER_COMPRESSED "protocol: 4\ncompression: deflate\ncontent: text\n\n"
+
+/** Inflate a compressed frame
+ * \return the length of the inflated data
+ */
+static size_t
+inflate_frame(const char *frame, size_t length, char *out, size_t size)
+{
+  z_stream strm;
+  size_t n;
+
+  memset(&strm, 0, sizeof(strm));
+  fail_unless(inflateInit2(&strm, -MAX_WBITS) == Z_OK);
+  strm.next_in = (Bytef*)frame + COMPRESS_FRAME_HEADER_SIZE;
+  strm.avail_in = length - COMPRESS_FRAME_HEADER_SIZE;
+  strm.next_out = (Bytef*)out;
+  strm.avail_out = size;
+  fail_unless(inflate(&strm, Z_FINISH) == Z_STREAM_END, "Frame not a complete deflate stream");
+  fail_unless(strm.avail_in == 0, "Garbage after deflate stream");
+  n = strm.total_out;
+  inflateEnd(&strm);
+
+  return n;
+}
+
+START_TEST (test_zlib_stream_frames)
+{
+  VecOutStream vs;
+  OmlOutStream *os;
+  struct iovec iov[3];
+  char *msgs[] = { "1.0\t1\t1\t10\n", "2.0\t1\t2\t20\n", "3.0\t1\t3\t30\n", "4.0\t1\t4\t40\n" };
+  char out[256], *p;
+  ssize_t flen;
+  size_t n;
+  int i;
+
+  memset(&vs, 0, sizeof(vs));
+  pthread_mutex_init(&vs.lock, NULL);
+  pthread_cond_init(&vs.cond, NULL);
+  vs.os.writev = vec_stream_writev;
+  vs.os.close = vec_stream_close;
+  vs.os.dest = "vec";
+
+  os = zlib_stream_new(&vs.os);
+  fail_if(os == NULL);
+
+  for (i = 0; i < 3; i++) {
+    iov[i].iov_base = msgs[i];
+    iov[i].iov_len = strlen(msgs[i]);
+  }
+  fail_unless(out_stream_writev(os, iov, 3, (uint8_t*)ZLIB_HEADER, strlen(ZLIB_HEADER)) == 3 * strlen(msgs[0]));
+  fail_unless(out_stream_writev(os, &iov[0], 0, (uint8_t*)ZLIB_HEADER, strlen(ZLIB_HEADER)) == 0);
+  iov[0].iov_base = msgs[3];
+  fail_unless(out_stream_writev(os, iov, 1, (uint8_t*)ZLIB_HEADER, strlen(ZLIB_HEADER)) == strlen(msgs[3]));
+
+  fail_unless(vs.length > strlen(ZLIB_HEADER_COMPRESSED) &&
+      !strncmp(vs.data, ZLIB_HEADER_COMPRESSED, strlen(ZLIB_HEADER_COMPRESSED)),
+      "Compression not announced in the headers: '%.*s'", strlen(ZLIB_HEADER_COMPRESSED), vs.data);
+
+  /* One frame per write, each decompressing independently */
+  p = vs.data + strlen(ZLIB_HEADER_COMPRESSED);
+  flen = compress_frame_length((uint8_t*)p, vs.data + vs.length - p);
+  fail_unless(flen > 0, "Invalid first frame");
+  n = inflate_frame(p, flen, out, sizeof(out));
+  fail_unless(n == 3 * strlen(msgs[0]) && !strncmp(out, "1.0\t1\t1\t10\n2.0\t1\t2\t20\n3.0\t1\t3\t30\n", n),
+      "Invalid first frame content '%.*s'", n, out);
+
+  p += flen;
+  flen = compress_frame_length((uint8_t*)p, vs.data + vs.length - p);
+  fail_unless(flen > 0, "Invalid second frame");
+  n = inflate_frame(p, flen, out, sizeof(out));
+  fail_unless(n == strlen(msgs[3]) && !strncmp(out, msgs[3], n),
+      "Invalid second frame content '%.*s'", n, out);
+  fail_unless(p + flen == vs.data + vs.length, "Unexpected data after the frames");
+
+  os->close(os);
+  pthread_cond_destroy(&vs.cond);
+  pthread_mutex_destroy(&vs.lock);
+}
+END_TEST
+
+/** OmlOutStream losing its connection after writing the first few bytes */
+typedef struct {
+  OmlOutStream os;
+  int ncalls;
+  char data[1024];
+  size_t length;
+} FlakyOutStream;
+
+static ssize_t
+flaky_stream_writev(OmlOutStream* hdl, const struct iovec* iov, int iovcnt, uint8_t* header, size_t header_length)
+{
+  FlakyOutStream* self = (FlakyOutStream*)hdl;
+  size_t len = iov[0].iov_len;
+  (void)iovcnt;
+
+  switch(self->ncalls++) {
+  case 0:
+    len = 5;
+    break;
+  case 1:
+    /* Connection lost; the headers will be needed again */
+    hdl->header_written = 0;
+    return -1;
+  default:
+    break;
+  }
+
+  if (!hdl->header_written) {
+    memcpy(self->data + self->length, header, header_length);
+    self->length += header_length;
+    hdl->header_written = 1;
+  }
+  memcpy(self->data + self->length, iov[0].iov_base, len);
+  self->length += len;
+
+  return len;
+}
+
+START_TEST (test_zlib_stream_restart)
+{
+  FlakyOutStream fs;
+  OmlOutStream *os;
+  char msg[] = "1.0\t1\t1\t10\n", out[64], *p;
+  struct iovec iov;
+  ssize_t flen;
+  size_t n;
+
+  memset(&fs, 0, sizeof(fs));
+  fs.os.writev = flaky_stream_writev;
+  fs.os.close = vec_stream_close;
+  fs.os.dest = "flaky";
+
+  os = zlib_stream_new(&fs.os);
+  fail_if(os == NULL);
+  iov.iov_base = msg;
+  iov.iov_len = strlen(msg);
+
+  /* The frame is taken, even if only partly written */
+  fail_unless(out_stream_writev(os, &iov, 1, (uint8_t*)ZLIB_HEADER, strlen(ZLIB_HEADER)) == strlen(msg));
+  fail_unless(fs.ncalls == 1);
+  /* No new data is taken until the previous frame has been written */
+  fail_unless(out_stream_writev(os, &iov, 1, (uint8_t*)ZLIB_HEADER, strlen(ZLIB_HEADER)) == 0);
+  fail_unless(fs.ncalls == 2);
+  fail_unless(out_stream_writev(os, &iov, 0, (uint8_t*)ZLIB_HEADER, strlen(ZLIB_HEADER)) == 0);
+  fail_unless(fs.ncalls == 3);
+
+  /* After the new headers, the frame is written again from its start */
+  p = fs.data + strlen(ZLIB_HEADER_COMPRESSED) + 5;
+  fail_unless(!strncmp(p, ZLIB_HEADER_COMPRESSED, strlen(ZLIB_HEADER_COMPRESSED)), "Headers not written again");
+  p += strlen(ZLIB_HEADER_COMPRESSED);
+  flen = compress_frame_length((uint8_t*)p, fs.data + fs.length - p);
+  fail_unless(flen > 0 && p + flen == fs.data + fs.length, "Frame not written whole after reconnection");
+  n = inflate_frame(p, flen, out, sizeof(out));
+  fail_unless(n == strlen(msg) && !strncmp(out, msg, n), "Invalid frame content '%.*s'", n, out);
+
+  os->close(os);
+}
+END_TEST
+
 Suite*
 writers_suite (void)
 {
@@ -115,14 +721,35 @@ writers_suite (void)
   /* Test cases */
   /*TCase* tc_bw = tcase_create ("BfWr");*/
   TCase* tc_fw = tcase_create ("FileWr");
+  TCase* tc_bw_ring = tcase_create ("BfWrRing");
+  TCase* tc_bw_chain = tcase_create ("BfWrChain");
+  TCase* tc_udp = tcase_create ("UdpStream");
+  TCase* tc_zlib = tcase_create ("ZlibStream");
 
   /* Add tests */
   /*tcase_add_test (tc_bw, test_bw_create);*/
 
   tcase_add_test (tc_fw, test_fw_create_buffered);
 
+  tcase_add_test (tc_bw_ring, test_bw_ring);
+  tcase_add_test (tc_bw_ring, test_bw_ring_full);
+  tcase_add_loop_test (tc_bw_ring, test_bw_thread_exit, 0, LENGTH(exit_engines));
+
+  tcase_add_test (tc_bw_chain, test_bw_chain_writev);
+  tcase_add_test (tc_bw_chain, test_bw_push);
+  tcase_add_test (tc_bw_chain, test_bw_chain_spill);
+
+  tcase_add_test (tc_udp, test_udp_stream_datagrams);
+
+  tcase_add_test (tc_zlib, test_zlib_stream_frames);
+  tcase_add_test (tc_zlib, test_zlib_stream_restart);
+
   /*suite_add_tcase (s, tc_bw);*/
   suite_add_tcase (s, tc_fw);
+  suite_add_tcase (s, tc_bw_ring);
+  suite_add_tcase (s, tc_bw_chain);
+  suite_add_tcase (s, tc_udp);
+  suite_add_tcase (s, tc_zlib);
   return s;
 }
 
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include <check.h>
 #include <arpa/inet.h>
 
@@ -24,6 +25,7 @@ static struct {
   { "start_time", H_START_TIME },
   { "start-time", H_START_TIME },
   { "domain", H_DOMAIN },
+  { "compression", H_COMPRESSION },
 
   { "protocolx", H_NONE },
   { "experiment-idx", H_NONE },
@@ -34,6 +36,7 @@ static struct {
   { "start_timex", H_NONE },
   { "start-timex", H_NONE },
   { "domaine", H_NONE },
+  { "compressionx", H_NONE },
 
   /*
   { "protocol", H_NONE},
@@ -82,6 +85,7 @@ static struct {
   { "start_time: 123456690", { H_START_TIME, "123456690", NULL }, 0, 0 },
   { "start-time: 123456690", { H_START_TIME, "123456690", NULL }, 0, 0 },
   { "domain: abc", { H_DOMAIN, "abc", NULL }, 0, 0 },
+  { "compression: deflate", { H_COMPRESSION, "deflate", NULL }, 0, 0 },
   { "", { H_NONE, NULL, NULL }, 1, 1 },
   { " ", { H_NONE, NULL, NULL }, 1, 1 },
   { NULL, { H_NONE, NULL, NULL }, 1, 1 },
@@ -286,6 +290,56 @@ START_TEST (test_bin_read)
 }
 END_TEST
 
+START_TEST (test_bin_read_compact)
+{
+  /* CDATA_P, count=3, stream=3, seqno=50, ts=42.0, { 1111111, 0.1, "ABC" } */
+  uint8_t buf [] = { 0xAA, 0xAA, 0x03, 0x00, 0x00,
+                     0x3, 0x3, // count = 3, stream = 3
+                     0x32, 0x00, 0x00, 0x00, // seqno 50
+                     0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x45, 0x40, // ts 42.0
+                     0x47, 0xF4, 0x10, 0x00, // long 1111111
+                     0x9A, 0x99, 0x99, 0x99, 0x99, 0x99, 0xB9, 0x3F, // double 0.1
+                     0x03, 'A',  'B',  'C' // string "ABC"
+  };
+  char meta [] = "3 mympstrm id:long hitchhiker:double sesame:string";
+  MBuffer *mbuf = mbuf_create ();
+  struct oml_message msg;
+  struct schema *schema = schema_from_meta (meta);
+  OmlValue values [3];
+  int result;
+
+  oml_value_array_init(values, 3);
+
+  bzero(&msg, sizeof(msg));
+
+  int size = sizeof (buf) - 5;
+  uint16_t nv = htons (size);
+  memcpy (buf + 3, &nv, 2);
+
+  mbuf_write (mbuf, buf, sizeof (buf));
+
+  result = bin_read_msg_start (&msg, mbuf);
+
+  fail_unless(result == sizeof (buf), "Unable to start reading compact binary message (%d)", result);
+  fail_unless(msg.type == MSG_BINARY_COMPACT);
+  fail_unless(msg.stream == 3);
+  fail_unless(msg.seqno == 50);
+  fail_unless(msg.timestamp == 42.);
+  fail_unless(msg.count == 3);
+
+  result = bin_read_msg_values (&msg, mbuf, schema, values);
+
+  fail_unless(result == 0, "Unable to read compact binary values");
+  fail_unless(omlc_get_int32(*oml_value_get_value(&values[0])) == 1111111);
+  fail_unless(omlc_get_double(*oml_value_get_value(&values[1])) == 0.1);
+  fail_if(strcmp(omlc_get_string_ptr(*oml_value_get_value(&values[2])), "ABC"));
+
+  oml_value_array_reset(values, 3);
+  schema_free (schema);
+  mbuf_destroy (mbuf);
+}
+END_TEST
+
 Suite *
 headers_suite (void)
 {
@@ -307,6 +361,7 @@ headers_suite (void)
 
   tcase_add_test (tc_header_from_string, test_text_read);
   tcase_add_test (tc_header_from_string, test_bin_read);
+  tcase_add_test (tc_header_from_string, test_bin_read_compact);
 
   suite_add_tcase (s, tc_tag_from_string);
   suite_add_tcase (s, tc_header_from_string);
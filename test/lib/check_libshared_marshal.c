@@ -35,6 +35,7 @@
 #include "oml_utils.h"
 #include "htonll.h"
 #include "oml_value.h"
+#include "schema.h"
 #include "marshal.h"
 #include "check_utils.h"
 
@@ -1371,6 +1372,444 @@ END_TEST
     while (++_p < _m + mbuf_message_length(mbuf));                                                          \
   } while(0)
 
+/** Compare two OmlValue through their string representations */
+static int
+values_match(OmlValue *a, OmlValue *b)
+{
+  char sa[1024], sb[1024];
+
+  return oml_value_get_type(a) == oml_value_get_type(b) &&
+    !strcmp(oml_value_to_s(a, sa, sizeof(sa)), oml_value_to_s(b, sb, sizeof(sb)));
+}
+
+START_TEST (test_marshal_unmarshal_compact)
+{
+  MBuffer *mbuf;
+  OmlBinaryHeader h;
+  struct schema *schema, *schema2;
+  OmlValue v[12], r[12];
+  size_t compact_len, legacy_len;
+  double dv[] = { M_PI, -0.0, 1e300, NAN };
+  int32_t iv[] = { INT32_MIN, -1, 0, INT32_MAX };
+  bool bv[] = { true, false, true };
+  char s[300];
+  char blob[] = { 0xAA, 0xAA, 0x0, 0x3 }; /* Sync bytes should not matter */
+  double d = 1. / 3;
+  int i;
+
+  memset(s, 'x', sizeof(s) - 1);
+  s[sizeof(s) - 1] = '\0';
+
+  schema = schema_new("compact");
+  schema_add_field(schema, "d32", OML_INT32_VALUE);
+  schema_add_field(schema, "u32", OML_UINT32_VALUE);
+  schema_add_field(schema, "d64", OML_INT64_VALUE);
+  schema_add_field(schema, "u64", OML_UINT64_VALUE);
+  schema_add_field(schema, "d", OML_DOUBLE_VALUE);
+  schema_add_field(schema, "l", OML_LONG_VALUE);
+  schema_add_field(schema, "s", OML_STRING_VALUE);
+  schema_add_field(schema, "b", OML_BLOB_VALUE);
+  schema_add_field(schema, "g", OML_GUID_VALUE);
+  schema_add_field(schema, "t", OML_BOOL_VALUE);
+  schema_add_field(schema, "vd", OML_VECTOR_DOUBLE_VALUE);
+  schema_add_field(schema, "vi", OML_VECTOR_INT32_VALUE);
+  /* Vectors of bool are tested separately below */
+
+  oml_value_array_init(v, LENGTH(v));
+  oml_value_array_init(r, LENGTH(r));
+  oml_value_set_type(&v[0], OML_INT32_VALUE);
+  omlc_set_int32(*oml_value_get_value(&v[0]), -42);
+  oml_value_set_type(&v[1], OML_UINT32_VALUE);
+  omlc_set_uint32(*oml_value_get_value(&v[1]), UINT32_MAX);
+  oml_value_set_type(&v[2], OML_INT64_VALUE);
+  omlc_set_int64(*oml_value_get_value(&v[2]), INT64_MIN);
+  oml_value_set_type(&v[3], OML_UINT64_VALUE);
+  omlc_set_uint64(*oml_value_get_value(&v[3]), UINT64_MAX);
+  oml_value_set_type(&v[4], OML_DOUBLE_VALUE);
+  omlc_set_double(*oml_value_get_value(&v[4]), d);
+  oml_value_set_type(&v[5], OML_LONG_VALUE);
+  omlc_set_long(*oml_value_get_value(&v[5]), -1337);
+  oml_value_set_type(&v[6], OML_STRING_VALUE);
+  omlc_set_const_string(*oml_value_get_value(&v[6]), s);
+  oml_value_set_type(&v[7], OML_BLOB_VALUE);
+  omlc_set_blob(*oml_value_get_value(&v[7]), blob, sizeof(blob));
+  oml_value_set_type(&v[8], OML_GUID_VALUE);
+  omlc_set_guid(*oml_value_get_value(&v[8]), 0x0123456789abcdefULL);
+  oml_value_set_type(&v[9], OML_BOOL_VALUE);
+  omlc_set_bool(*oml_value_get_value(&v[9]), OMLC_BOOL_TRUE);
+  oml_value_set_type(&v[10], OML_VECTOR_DOUBLE_VALUE);
+  omlc_set_vector_double(*oml_value_get_value(&v[10]), dv, LENGTH(dv));
+  oml_value_set_type(&v[11], OML_VECTOR_INT32_VALUE);
+  omlc_set_vector_int32(*oml_value_get_value(&v[11]), iv, LENGTH(iv));
+
+  mbuf = mbuf_create();
+
+  /* Legacy encoding, for size comparison (without the string, too long for it) */
+  fail_if(marshal_init(mbuf, OMB_DATA_P));
+  fail_unless(marshal_measurements(mbuf, 1, 2, 3.) == 1);
+  fail_unless(marshal_values(mbuf, v, 6) == 1);
+  fail_unless(marshal_finalize(mbuf) == 1);
+  legacy_len = mbuf_message_length(mbuf);
+  mbuf_clear(mbuf);
+
+  fail_if(marshal_init(mbuf, OMB_CDATA_P));
+  fail_unless(marshal_measurements(mbuf, 1, 2, 3.) == 1);
+  fail_unless(marshal_values_compact(mbuf, v, 6) == 1);
+  fail_unless(marshal_finalize(mbuf) == 1);
+  compact_len = mbuf_message_length(mbuf);
+  fail_unless(compact_len < legacy_len,
+      "Compact encoding is not smaller than the legacy one (%zu >= %zu)",
+      compact_len, legacy_len);
+  mbuf_clear(mbuf);
+
+  /* Full row */
+  fail_if(marshal_init(mbuf, OMB_CDATA_P));
+  fail_unless(marshal_measurements(mbuf, 1, 2, d) == 1);
+  fail_unless(marshal_values_compact(mbuf, v, LENGTH(v)) == 1);
+  fail_unless(marshal_finalize(mbuf) == 1);
+  fail_unless(marshal_get_msgtype(mbuf) == OMB_CDATA_P);
+  fail_unless(marshal_get_message_length(mbuf_message(mbuf), mbuf_message_length(mbuf)) ==
+      (ssize_t)mbuf_message_length(mbuf));
+
+  fail_unless(unmarshal_init(mbuf, &h) == 1);
+  fail_unless(h.type == OMB_CDATA_P);
+  fail_unless(h.values == LENGTH(v), "Unexpected number of values %d", h.values);
+  fail_unless(h.stream == 1);
+  fail_unless(h.seqno == 2);
+  fail_unless(h.timestamp == d, "Timestamp %g is not exactly %g", h.timestamp, d);
+  fail_unless(unmarshal_values(mbuf, &h, r, LENGTH(r)) < -100,
+      "Compact values unmarshalled without a schema");
+  fail_unless(unmarshal_values_compact(mbuf, &h, schema, r, LENGTH(r)) == LENGTH(r));
+  fail_unless(mbuf_rd_remaining(mbuf) == 0, "%d bytes left unread", mbuf_rd_remaining(mbuf));
+
+  fail_unless(omlc_get_double(*oml_value_get_value(&r[4])) == d,
+      "Double not unmarshalled losslessly");
+  /* OML_LONG_VALUE are unmarshalled as OML_INT32_VALUE */
+  oml_value_set_type(&v[5], OML_INT32_VALUE);
+  omlc_set_int32(*oml_value_get_value(&v[5]), -1337);
+  for (i = 0; i < LENGTH(v); i++) {
+    fail_unless(oml_value_get_type(&r[i]) == oml_value_get_type(&v[i]),
+        "Value %d: type %s instead of %s", i,
+        oml_type_to_s(oml_value_get_type(&r[i])), oml_type_to_s(oml_value_get_type(&v[i])));
+    if (i == 10) {
+      /* NaN != NaN */
+      double *rv = omlc_get_vector_ptr(*oml_value_get_value(&r[i]));
+      fail_unless(omlc_get_vector_nof_elts(*oml_value_get_value(&r[i])) == LENGTH(dv));
+      fail_unless(!memcmp(rv, dv, 3 * sizeof(double)) && isnan(rv[3]),
+          "Vector of doubles not unmarshalled losslessly");
+    } else {
+      fail_unless(values_match(&r[i], &v[i]), "Value %d not unmarshalled properly", i);
+    }
+  }
+
+  /* Long packets and vectors of bool */
+  mbuf_clear(mbuf);
+  oml_value_set_type(&v[0], OML_VECTOR_BOOL_VALUE);
+  omlc_set_vector_bool(*oml_value_get_value(&v[0]), bv, LENGTH(bv));
+  schema2 = schema_new("compact2");
+  schema_add_field(schema2, "vb", OML_VECTOR_BOOL_VALUE);
+  fail_if(marshal_init(mbuf, OMB_LCDATA_P));
+  fail_unless(marshal_measurements(mbuf, 3, 4, 5.) == 1);
+  fail_unless(marshal_values_compact(mbuf, v, 1) == 1);
+  fail_unless(marshal_finalize(mbuf) == 1);
+  fail_unless(unmarshal_init(mbuf, &h) == 1);
+  fail_unless(h.type == OMB_LCDATA_P);
+  fail_unless(unmarshal_values_compact(mbuf, &h, schema2, r, LENGTH(r)) == 1);
+  fail_unless(values_match(&r[0], &v[0]), "Vector of bool not unmarshalled properly");
+
+  /* Truncated packets are detected */
+  mbuf_clear(mbuf);
+  fail_if(marshal_init(mbuf, OMB_CDATA_P));
+  fail_unless(marshal_measurements(mbuf, 3, 4, 5.) == 1);
+  fail_unless(marshal_values_compact(mbuf, v, 1) == 1);
+  mbuf_message(mbuf)[5] = 2; /* One more value than actually marshalled */
+  fail_unless(marshal_finalize(mbuf) == 1);
+  schema_add_field(schema2, "s", OML_STRING_VALUE);
+  fail_unless(unmarshal_init(mbuf, &h) == 1);
+  fail_unless(unmarshal_values_compact(mbuf, &h, schema2, r, LENGTH(r)) < -100);
+
+  oml_value_array_reset(v, LENGTH(v));
+  oml_value_array_reset(r, LENGTH(r));
+  schema_free(schema);
+  schema_free(schema2);
+  mbuf_destroy(mbuf);
+}
+END_TEST
+
+START_TEST (test_marshal_unmarshal_block)
+{
+#define NROWS 100
+#define NFIELDS 7
+  MBuffer *mbuf;
+  OmlBinaryHeader h;
+  struct schema *schema, *schema2;
+  OmlValue v[NROWS * NFIELDS], r[NROWS * NFIELDS], *row;
+  int32_t seqnos[NROWS], rseqnos[NROWS];
+  double timestamps[NROWS], rtimestamps[NROWS];
+  double d, rd;
+  size_t block_len, compact_len = 0;
+  char s[300], big[1000];
+  int i, j;
+
+  memset(s, 'x', sizeof(s) - 1);
+  s[sizeof(s) - 1] = '\0';
+  memset(big, 'y', sizeof(big) - 1);
+  big[sizeof(big) - 1] = '\0';
+
+  schema = schema_new("block");
+  schema_add_field(schema, "counter", OML_UINT32_VALUE);
+  schema_add_field(schema, "gauge", OML_DOUBLE_VALUE);
+  schema_add_field(schema, "d64", OML_INT64_VALUE);
+  schema_add_field(schema, "l", OML_LONG_VALUE);
+  schema_add_field(schema, "up", OML_BOOL_VALUE);
+  schema_add_field(schema, "g", OML_GUID_VALUE);
+  schema_add_field(schema, "label", OML_STRING_VALUE);
+
+  oml_value_array_init(v, LENGTH(v));
+  oml_value_array_init(r, LENGTH(r));
+  for (i = 0; i < NROWS; i++) {
+    /* Periodic samples, with some jitter, a gap, and a few outliers */
+    seqnos[i] = 1000 + i + (i >= 50 ? 3 : 0);
+    timestamps[i] = 12.5 + i * 0.1 + (i == 37 ? 0.0003 : 0) + (i >= 80 ? 100. : 0);
+
+    row = &v[i * NFIELDS];
+    oml_value_set_type(&row[0], OML_UINT32_VALUE);
+    omlc_set_uint32(*oml_value_get_value(&row[0]), UINT32_MAX - 50 + i); /* Wraps around */
+    oml_value_set_type(&row[1], OML_DOUBLE_VALUE);
+    omlc_set_double(*oml_value_get_value(&row[1]),
+        (i == 13) ? NAN : (i == 14) ? -1e300 : 20. + (i / 10) * 0.25);
+    oml_value_set_type(&row[2], OML_INT64_VALUE);
+    omlc_set_int64(*oml_value_get_value(&row[2]), (i % 7 == 0) ? INT64_MIN : (i % 7 == 1) ? INT64_MAX : -i);
+    oml_value_set_type(&row[3], OML_LONG_VALUE);
+    omlc_set_long(*oml_value_get_value(&row[3]), -1337 * i);
+    oml_value_set_type(&row[4], OML_BOOL_VALUE);
+    omlc_set_bool(*oml_value_get_value(&row[4]), (i % 3) ? OMLC_BOOL_TRUE : OMLC_BOOL_FALSE);
+    oml_value_set_type(&row[5], OML_GUID_VALUE);
+    omlc_set_guid(*oml_value_get_value(&row[5]), 0x0123456789abcdefULL);
+    oml_value_set_type(&row[6], OML_STRING_VALUE);
+    omlc_set_const_string(*oml_value_get_value(&row[6]), (i == 42) ? s : (i % 2) ? "up" : "down");
+  }
+
+  mbuf = mbuf_create();
+
+  /* Same samples in compact messages, for size comparison */
+  for (i = 0; i < NROWS; i++) {
+    fail_if(marshal_init(mbuf, OMB_CDATA_P));
+    fail_unless(marshal_measurements(mbuf, 2, seqnos[i], timestamps[i]) == 1);
+    fail_unless(marshal_values_compact(mbuf, &v[i * NFIELDS], NFIELDS) == 1);
+    fail_unless(marshal_finalize(mbuf) == 1);
+    compact_len += mbuf_message_length(mbuf);
+    mbuf_clear(mbuf);
+  }
+
+  fail_unless(marshal_block(mbuf, OMB_CDATA_P, 2, NROWS, seqnos, timestamps, v, NFIELDS) == -1,
+      "Block marshalled into a compact packet");
+  fail_unless(marshal_block(mbuf, OMB_BLOCK_P, 2, NROWS, seqnos, timestamps, v, NFIELDS) == 1);
+  fail_unless(marshal_get_msgtype(mbuf) == OMB_BLOCK_P);
+  block_len = mbuf_message_length(mbuf);
+  fail_unless(marshal_get_message_length(mbuf_message(mbuf), block_len) == (ssize_t)block_len);
+  fail_unless(2 * block_len < compact_len,
+      "Block encoding is not less than half the size of compact messages (%zu vs. %zu)",
+      block_len, compact_len);
+
+  fail_unless(unmarshal_init(mbuf, &h) == 1);
+  fail_unless(h.type == OMB_BLOCK_P);
+  fail_unless(h.values == NROWS, "Unexpected number of samples %d", h.values);
+  fail_unless(h.stream == 2);
+  fail_unless(h.seqno == seqnos[0]);
+  fail_unless(h.timestamp == timestamps[0]);
+  fail_unless(unmarshal_values(mbuf, &h, r, LENGTH(r)) < -100,
+      "Block unmarshalled as a single sample");
+  fail_unless(unmarshal_values_compact(mbuf, &h, schema, r, LENGTH(r)) < -100,
+      "Block unmarshalled as a compact sample");
+
+  fail_unless(unmarshal_block(mbuf, &h, schema, rseqnos, rtimestamps, r, LENGTH(r) - 1) < -100,
+      "Block unmarshalled into a too short array");
+  mbuf_reset_read(mbuf);
+  fail_unless(unmarshal_init(mbuf, &h) == 1);
+  fail_unless(unmarshal_block(mbuf, &h, schema, rseqnos, rtimestamps, r, LENGTH(r)) == NROWS);
+  fail_unless(mbuf_rd_remaining(mbuf) == 0, "%d bytes left unread", mbuf_rd_remaining(mbuf));
+
+  for (i = 0; i < NROWS; i++) {
+    fail_unless(rseqnos[i] == seqnos[i], "Sample %d: seqno %d instead of %d", i, rseqnos[i], seqnos[i]);
+    fail_unless(fabs(rtimestamps[i] - timestamps[i]) < 1e-6,
+        "Sample %d: timestamp %f instead of %f", i, rtimestamps[i], timestamps[i]);
+
+    for (j = 0; j < NFIELDS; j++) {
+      row = &v[i * NFIELDS];
+      if (j == 1) {
+        d = omlc_get_double(*oml_value_get_value(&row[j]));
+        rd = omlc_get_double(*oml_value_get_value(&r[i * NFIELDS + j]));
+        fail_unless(!memcmp(&d, &rd, sizeof(d)), "Sample %d: double %g not unmarshalled losslessly (%g)", i, d, rd);
+      } else if (j == 3) {
+        /* OML_LONG_VALUE are unmarshalled as OML_INT32_VALUE */
+        fail_unless(oml_value_get_type(&r[i * NFIELDS + j]) == OML_INT32_VALUE);
+        fail_unless(omlc_get_int32(*oml_value_get_value(&r[i * NFIELDS + j])) == -1337 * i);
+      } else {
+        fail_unless(values_match(&r[i * NFIELDS + j], &row[j]), "Sample %d: value %d not unmarshalled properly", i, j);
+      }
+    }
+  }
+
+  /* Fields must match the schema */
+  schema2 = schema_new("block2");
+  schema_add_field(schema2, "counter", OML_UINT32_VALUE);
+  mbuf_reset_read(mbuf);
+  fail_unless(unmarshal_init(mbuf, &h) == 1);
+  fail_unless(unmarshal_block(mbuf, &h, schema2, rseqnos, rtimestamps, r, LENGTH(r)) < -100,
+      "Block unmarshalled with the wrong schema");
+
+  /* Short packets too long for their length field become long packets */
+  mbuf_clear(mbuf);
+  oml_value_array_reset(r, LENGTH(r));
+  for (i = 0; i < NROWS; i++) {
+    omlc_set_const_string(*oml_value_get_value(&v[i * NFIELDS + 6]), big);
+  }
+  fail_unless(marshal_block(mbuf, OMB_BLOCK_P, 3, NROWS, seqnos, timestamps, v, NFIELDS) == 1);
+  fail_unless(marshal_get_msgtype(mbuf) == OMB_LBLOCK_P);
+  fail_unless(unmarshal_init(mbuf, &h) == 1);
+  fail_unless(h.type == OMB_LBLOCK_P);
+  fail_unless(h.stream == 3);
+  fail_unless(h.values == NROWS);
+  fail_unless(unmarshal_block(mbuf, &h, schema, rseqnos, rtimestamps, r, LENGTH(r)) == NROWS);
+  fail_unless(!strcmp(omlc_get_string_ptr(*oml_value_get_value(&r[(NROWS - 1) * NFIELDS + 6])), big));
+
+  oml_value_array_reset(v, LENGTH(v));
+  oml_value_array_reset(r, LENGTH(r));
+  schema_free(schema);
+  schema_free(schema2);
+  mbuf_destroy(mbuf);
+#undef NFIELDS
+#undef NROWS
+}
+END_TEST
+
+/** Marshal a sample of test_marshal_unmarshal_dict into mbuf */
+static void
+marshal_dict_row(MBuffer* mbuf, OmlStringDict* dict, OmlValue* v, int n, const char* iface, const char* state)
+{
+  omlc_set_int32(*oml_value_get_value(&v[0]), n);
+  omlc_set_const_string(*oml_value_get_value(&v[1]), iface);
+  omlc_set_const_string(*oml_value_get_value(&v[2]), state);
+
+  mbuf_clear(mbuf);
+  fail_if(marshal_init(mbuf, OMB_DDATA_P));
+  fail_unless(marshal_measurements(mbuf, 1, n, n) == 1);
+  fail_unless(marshal_values_dict(mbuf, v, 3, dict) == 1);
+  fail_unless(marshal_finalize(mbuf) == 1);
+}
+
+/** Unmarshal a sample marshalled by marshal_dict_row, and check it */
+static int
+unmarshal_dict_row(MBuffer* mbuf, OmlStringDict* dict, struct schema* schema, OmlValue* v, OmlValue* r)
+{
+  OmlBinaryHeader h;
+  int i, ret;
+
+  mbuf_reset_read(mbuf);
+  fail_unless(unmarshal_init(mbuf, &h) == 1);
+  fail_unless(h.type == OMB_DDATA_P);
+  if ((ret = unmarshal_values_dict(mbuf, &h, schema, dict, r, 3)) != 3) {
+    return ret;
+  }
+  for (i = 0; i < 3; i++) {
+    fail_unless(values_match(&r[i], &v[i]), "Value %d not unmarshalled properly", i);
+  }
+  fail_unless(mbuf_rd_remaining(mbuf) == 0, "%d bytes left unread", mbuf_rd_remaining(mbuf));
+  return ret;
+}
+
+START_TEST (test_marshal_unmarshal_dict)
+{
+  MBuffer *mbuf, *row, *defs;
+  OmlBinaryHeader h;
+  OmlStringDict *cdict, *sdict, *sdict2;
+  struct schema *schema;
+  OmlValue v[3], r[3];
+  char s[OMB_DICT_MAX_LENGTH + 2];
+  size_t first_len, len;
+
+  memset(s, 'x', sizeof(s) - 1);
+  s[sizeof(s) - 1] = '\0';
+
+  schema = schema_new("dict");
+  schema_add_field(schema, "n", OML_INT32_VALUE);
+  schema_add_field(schema, "iface", OML_STRING_VALUE);
+  schema_add_field(schema, "state", OML_STRING_VALUE);
+
+  oml_value_array_init(v, LENGTH(v));
+  oml_value_array_init(r, LENGTH(r));
+  oml_value_set_type(&v[0], OML_INT32_VALUE);
+  oml_value_set_type(&v[1], OML_STRING_VALUE);
+  oml_value_set_type(&v[2], OML_STRING_VALUE);
+
+  mbuf = mbuf_create();
+  row = mbuf_create();
+  defs = mbuf_create();
+  cdict = string_dict_new(4);
+  sdict = string_dict_new(0);
+  sdict2 = string_dict_new(0);
+
+  /* The first occurrence of strings defines them */
+  marshal_dict_row(mbuf, cdict, v, 0, "eth0", "up");
+  first_len = mbuf_message_length(mbuf);
+  fail_unless(unmarshal_dict_row(mbuf, sdict, schema, v, r) == 3);
+  mbuf_reset_read(mbuf);
+  fail_unless(unmarshal_init(mbuf, &h) == 1);
+  fail_unless(unmarshal_values_compact(mbuf, &h, schema, r, LENGTH(r)) < -100,
+      "Dictionary values unmarshalled without a dictionary");
+
+  /* Later ones only refer to them */
+  marshal_dict_row(row, cdict, v, 1, "eth0", "up");
+  len = mbuf_message_length(row);
+  fail_unless(len + 6 <= first_len, "Strings not replaced by identifiers (%zu vs. %zu bytes)", len, first_len);
+  fail_unless(unmarshal_dict_row(row, sdict, schema, v, r) == 3);
+
+  /* Too long strings are sent in full, as well as new ones when the dictionary is full */
+  marshal_dict_row(mbuf, cdict, v, 2, "wlan0", s);
+  fail_unless(unmarshal_dict_row(mbuf, sdict, schema, v, r) == 3);
+  marshal_dict_row(mbuf, cdict, v, 3, "eth1", "down");
+  marshal_dict_row(mbuf, cdict, v, 4, "eth1", "down");
+  fail_unless(mbuf_message_length(mbuf) >= len + 4, "String referred to beyond the size of the dictionary");
+
+  /* Unknown strings are rejected, until defined by replayed definitions */
+  fail_unless(unmarshal_dict_row(row, sdict2, schema, v, r) < -100,
+      "Unknown string unmarshalled");
+  fail_unless(marshal_dict(defs, cdict) == 4);
+  fail_unless(marshal_dict(defs, cdict) == 0, "Strings defined twice");
+  fail_unless(unmarshal_init(defs, &h) == 1);
+  fail_unless(h.type == OMB_DICT_P);
+  fail_unless(h.stream == 0);
+  fail_unless(unmarshal_values_dict(defs, &h, schema, sdict2, r, LENGTH(r)) < -100);
+  mbuf_reset_read(defs);
+  fail_unless(unmarshal_init(defs, &h) == 1);
+  fail_unless(unmarshal_dict(defs, &h, sdict2) == 4);
+  fail_unless(mbuf_rd_remaining(defs) == 0, "%d bytes left unread", mbuf_rd_remaining(defs));
+  marshal_dict_row(row, cdict, v, 1, "eth0", "up");
+  fail_unless(unmarshal_dict_row(row, sdict2, schema, v, r) == 3);
+
+  /* Forgotten strings are defined again, with new identifiers */
+  string_dict_forget(cdict);
+  fail_unless(marshal_dict(defs, cdict) == 0);
+  string_dict_destroy(cdict);
+  cdict = string_dict_new(3);
+  marshal_dict_row(mbuf, cdict, v, 5, "lo", "up");
+  string_dict_forget(cdict);
+  marshal_dict_row(mbuf, cdict, v, 6, "lo", "up");
+  fail_unless(unmarshal_dict_row(mbuf, sdict, schema, v, r) == 3);
+
+  oml_value_array_reset(v, LENGTH(v));
+  oml_value_array_reset(r, LENGTH(r));
+  string_dict_destroy(cdict);
+  string_dict_destroy(sdict);
+  string_dict_destroy(sdict2);
+  schema_free(schema);
+  mbuf_destroy(mbuf);
+  mbuf_destroy(row);
+  mbuf_destroy(defs);
+}
+END_TEST
+
 START_TEST (test_marshal_full)
 {
   MBuffer *mbuf;
@@ -1840,6 +2279,9 @@ marshal_suite (void)
   tcase_add_test (tc_marshal, test_marshal_unmarshal_vector_int32);
   tcase_add_test (tc_marshal, test_marshal_unmarshal_vector_int64);
   tcase_add_test (tc_marshal, test_marshal_unmarshal_vector_bool);
+  tcase_add_test (tc_marshal, test_marshal_unmarshal_compact);
+  tcase_add_test (tc_marshal, test_marshal_unmarshal_block);
+  tcase_add_test (tc_marshal, test_marshal_unmarshal_dict);
 
   /* Do the full marshalling/unmarshalling test, types above should also be tested there */
   tcase_add_test (tc_marshal, test_marshal_full);
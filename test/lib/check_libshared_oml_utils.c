@@ -34,6 +34,7 @@ static struct uri_scheme {
   { "flush://blah", OML_URI_FILE_FLUSH },
   { "tcp://blah", OML_URI_TCP },
   { "udp://blah", OML_URI_UDP },
+  { "zlib+tcp://blah", OML_URI_ZLIB_TCP },
 };
 
 START_TEST (test_util_uri_scheme)
@@ -74,6 +75,9 @@ static struct uri {
   { "[::1]:3004", 0, "tcp", "::1", "3004", NULL},
   { "tcp://[::1]", 0, "tcp", "::1", DEF_PORT_STRING, NULL},
   { "tcp://[::1]:3004", 0, "tcp", "::1", "3004", NULL},
+  { "udp://localhost:3004", 0, "udp", "localhost", "3004", NULL},
+  { "udp://[::1]", 0, "udp", "::1", DEF_PORT_STRING, NULL},
+  { "zlib+tcp://localhost:3004", 0, "zlib+tcp", "localhost", "3004", NULL},
 
   { "file:-", 0, "file", NULL, NULL, "-"},
 
@@ -26,6 +26,7 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <check.h>
 #include <sqlite3.h>
@@ -573,6 +574,375 @@ START_TEST(test_binary_metadata)
 }
 END_TEST
 
+START_TEST(test_binary_compact)
+{
+  ClientHandler *ch;
+  Database *db;
+  sqlite3_stmt *stmt;
+  SockEvtSource source;
+  MBuffer* mbuf = mbuf_create();
+
+  char domain[] = "binary-compact-test";
+  char dbname[sizeof(domain)+4];
+  char table[] = "compact_table";
+  double time1 = 1.096202;
+  uint32_t d1 = 3319660544U;
+  double d2 = 1. / 3;
+  char s[300];
+
+  char h[300];
+  char select[200];
+
+  OmlValue v[3];
+  oml_value_array_init(v, 3);
+
+  int rc = -1;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  /* Remove pre-existing databases */
+  *dbname=0;
+  snprintf(dbname, sizeof(dbname), "%s.sq3", domain);
+  unlink(dbname);
+
+  /* Longer than what OMB_DATA_P packets allow */
+  memset(s, 'c', sizeof(s) - 1);
+  s[sizeof(s) - 1] = '\0';
+
+  snprintf(h, sizeof(h),  "protocol: %d\ndomain: %s\nstart-time: 1332132092\nsender-id: %s\napp-name: %s\ncontent: binary\nschema: 1 %s size:uint32 ratio:double label:string\n\n",
+      OMB_COMPACT_PROTOCOL_VERSION, domain, basename(__FILE__), __FUNCTION__, table);
+  snprintf(select, sizeof(select), "select oml_ts_client, oml_seq, size, ratio, label from %s;", table);
+
+  memset(&source, 0, sizeof(SockEvtSource));
+  source.name = "binary compact socket";
+  ch = check_server_prepare_client_handler("test_binary_compact", &source);
+
+  logdebug("Sending header '%s'\n", h);
+  client_callback(&source, ch, h, strlen(h));
+  fail_unless(ch->state == C_BINARY_DATA, "Inconsistent state: expected %d, got %d", C_BINARY_DATA, ch->state);
+  fail_unless(ch->protocol == OMB_COMPACT_PROTOCOL_VERSION);
+
+  logdebug("Sending compact sample, in two steps\n");
+  oml_value_set_type(&v[0], OML_UINT32_VALUE);
+  omlc_set_uint32(*oml_value_get_value(&v[0]), d1);
+  oml_value_set_type(&v[1], OML_DOUBLE_VALUE);
+  omlc_set_double(*oml_value_get_value(&v[1]), d2);
+  oml_value_set_type(&v[2], OML_STRING_VALUE);
+  omlc_set_const_string(*oml_value_get_value(&v[2]), s);
+  marshal_init(mbuf, OMB_CDATA_P);
+  marshal_measurements(mbuf, 1, 1, time1);
+  marshal_values_compact(mbuf, v, 3);
+  marshal_finalize(mbuf);
+  printmbuf(mbuf);
+  client_callback(&source, ch, mbuf_buffer(mbuf), 10);
+  fail_if(ch->state == C_PROTOCOL_ERROR, "An incomplete compact sample confused the client_handler");
+  client_callback(&source, ch, mbuf_buffer(mbuf) + 10, mbuf_rd_remaining(mbuf) - 10);
+  fail_unless(ch->state == C_BINARY_DATA, "Compact sample not accepted");
+
+  database_release(ch->database);
+  check_server_destroy_client_handler(ch);
+
+  logdebug("Sending compact sample with an older protocol\n");
+  snprintf(h, sizeof(h),  "protocol: %d\ndomain: %s\nstart-time: 1332132092\nsender-id: %s\napp-name: %s\ncontent: binary\nschema: 1 %s size:uint32 ratio:double label:string\n\n",
+      OMB_COMPACT_PROTOCOL_VERSION - 1, domain, basename(__FILE__), __FUNCTION__, table);
+  ch = check_server_prepare_client_handler("test_binary_compact_old", &source);
+  /* Make it look like a datagram peer, so a protocol error does not free it */
+  ch->event = &ch->peer_event;
+  fail_unless(client_handler_datagram(ch, h, strlen(h)) == 0);
+  fail_unless(ch->state == C_BINARY_DATA, "Inconsistent state: expected %d, got %d", C_BINARY_DATA, ch->state);
+  fail_unless(client_handler_datagram(ch, mbuf_buffer(mbuf), mbuf_rd_remaining(mbuf)) == -1,
+      "Compact sample accepted from a protocol %d client", OMB_COMPACT_PROTOCOL_VERSION - 1);
+
+  database_release(ch->database);
+  check_server_destroy_client_handler(ch);
+  mbuf_destroy(mbuf);
+  oml_value_array_reset(v, 3);
+
+  logdebug("Checking recorded data in %s.sq3\n", domain);
+  /* Open database */
+  db = database_find(domain);
+  fail_if(db == NULL || ((Sq3DB*)(db->handle))->conn == NULL , "Cannot open SQLite3 database");
+  rc = sqlite3_prepare_v2(((Sq3DB*)(db->handle))->conn, select, -1, &stmt, 0);
+  fail_unless(rc == 0, "Preparation of statement `%s' failed; rc=%d", select, rc);
+
+  rc = sqlite3_step(stmt);
+  fail_unless(rc == 100, "First step of statement `%s' failed; rc=%d", select, rc);
+  fail_unless(sqlite3_column_double(stmt, 0) == time1,
+      "Invalid oml_ts_value: expected `%.17g', got `%.17g'",
+      time1, sqlite3_column_double(stmt, 0));
+  fail_unless((uint32_t)sqlite3_column_int64(stmt, 2) == d1,
+      "Invalid size: expected `%" PRIu32 "', got `%" PRId64 "'", d1, sqlite3_column_int64(stmt, 2));
+  fail_unless(sqlite3_column_double(stmt, 3) == d2,
+      "Invalid ratio: expected `%.17g', got `%.17g'", d2, sqlite3_column_double(stmt, 3));
+  fail_if(strcmp(s, (const char*)sqlite3_column_text(stmt, 4)),
+      "Invalid label: expected `%s', got `%s'", s, (const char*)sqlite3_column_text(stmt, 4));
+  rc = sqlite3_step(stmt);
+  fail_unless(rc == SQLITE_DONE, "Unexpected extra row in `%s'", select);
+
+  sqlite3_finalize(stmt);
+  database_release(db);
+}
+END_TEST
+
+START_TEST(test_binary_block)
+{
+#define NROWS 10
+  ClientHandler *ch;
+  Database *db;
+  sqlite3_stmt *stmt;
+  SockEvtSource source;
+  MBuffer* mbuf = mbuf_create();
+
+  char domain[] = "binary-block-test";
+  char dbname[sizeof(domain)+4];
+  char table[] = "block_table";
+  double time1 = 1.096202;
+  uint32_t d1 = 3319660544U;
+  double d2 = 1. / 3;
+  int32_t seqnos[NROWS];
+  double timestamps[NROWS];
+  char labels[NROWS][16];
+
+  char h[300];
+  char select[200];
+
+  OmlValue v[3 * NROWS];
+  oml_value_array_init(v, LENGTH(v));
+
+  int i, rc = -1;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  /* Remove pre-existing databases */
+  *dbname=0;
+  snprintf(dbname, sizeof(dbname), "%s.sq3", domain);
+  unlink(dbname);
+
+  for (i = 0; i < NROWS; i++) {
+    seqnos[i] = i + 1;
+    timestamps[i] = time1 + i * 0.5;
+    snprintf(labels[i], sizeof(labels[i]), "sample%d", i);
+    oml_value_set_type(&v[3 * i], OML_UINT32_VALUE);
+    omlc_set_uint32(*oml_value_get_value(&v[3 * i]), d1 + i);
+    oml_value_set_type(&v[3 * i + 1], OML_DOUBLE_VALUE);
+    omlc_set_double(*oml_value_get_value(&v[3 * i + 1]), d2 * i);
+    oml_value_set_type(&v[3 * i + 2], OML_STRING_VALUE);
+    omlc_set_const_string(*oml_value_get_value(&v[3 * i + 2]), labels[i]);
+  }
+
+  snprintf(h, sizeof(h),  "protocol: %d\ndomain: %s\nstart-time: 1332132092\nsender-id: %s\napp-name: %s\ncontent: binary\nschema: 1 %s size:uint32 ratio:double label:string\n\n",
+      OMB_BLOCK_PROTOCOL_VERSION, domain, basename(__FILE__), __FUNCTION__, table);
+  snprintf(select, sizeof(select), "select oml_ts_client, oml_seq, size, ratio, label from %s;", table);
+
+  memset(&source, 0, sizeof(SockEvtSource));
+  source.name = "binary block socket";
+  ch = check_server_prepare_client_handler("test_binary_block", &source);
+
+  logdebug("Sending header '%s'\n", h);
+  client_callback(&source, ch, h, strlen(h));
+  fail_unless(ch->state == C_BINARY_DATA, "Inconsistent state: expected %d, got %d", C_BINARY_DATA, ch->state);
+
+  logdebug("Sending block of %d samples, in two steps\n", NROWS);
+  fail_unless(marshal_block(mbuf, OMB_BLOCK_P, 1, NROWS, seqnos, timestamps, v, 3) == 1);
+  printmbuf(mbuf);
+  client_callback(&source, ch, mbuf_buffer(mbuf), 10);
+  fail_if(ch->state == C_PROTOCOL_ERROR, "An incomplete block confused the client_handler");
+  client_callback(&source, ch, mbuf_buffer(mbuf) + 10, mbuf_rd_remaining(mbuf) - 10);
+  fail_unless(ch->state == C_BINARY_DATA, "Block not accepted");
+
+  database_release(ch->database);
+  check_server_destroy_client_handler(ch);
+
+  logdebug("Sending block with an older protocol\n");
+  snprintf(h, sizeof(h),  "protocol: %d\ndomain: %s\nstart-time: 1332132092\nsender-id: %s\napp-name: %s\ncontent: binary\nschema: 1 %s size:uint32 ratio:double label:string\n\n",
+      OMB_BLOCK_PROTOCOL_VERSION - 1, domain, basename(__FILE__), __FUNCTION__, table);
+  ch = check_server_prepare_client_handler("test_binary_block_old", &source);
+  /* Make it look like a datagram peer, so a protocol error does not free it */
+  ch->event = &ch->peer_event;
+  fail_unless(client_handler_datagram(ch, h, strlen(h)) == 0);
+  fail_unless(ch->state == C_BINARY_DATA, "Inconsistent state: expected %d, got %d", C_BINARY_DATA, ch->state);
+  fail_unless(client_handler_datagram(ch, mbuf_buffer(mbuf), mbuf_rd_remaining(mbuf)) == -1,
+      "Block accepted from a protocol %d client", OMB_BLOCK_PROTOCOL_VERSION - 1);
+
+  database_release(ch->database);
+  check_server_destroy_client_handler(ch);
+  mbuf_destroy(mbuf);
+  oml_value_array_reset(v, LENGTH(v));
+
+  logdebug("Checking recorded data in %s.sq3\n", domain);
+  /* Open database */
+  db = database_find(domain);
+  fail_if(db == NULL || ((Sq3DB*)(db->handle))->conn == NULL , "Cannot open SQLite3 database");
+  rc = sqlite3_prepare_v2(((Sq3DB*)(db->handle))->conn, select, -1, &stmt, 0);
+  fail_unless(rc == 0, "Preparation of statement `%s' failed; rc=%d", select, rc);
+
+  for (i = 0; i < NROWS; i++) {
+    rc = sqlite3_step(stmt);
+    fail_unless(rc == 100, "Step %d of statement `%s' failed; rc=%d", i, select, rc);
+    fail_unless(fabs(sqlite3_column_double(stmt, 0) - timestamps[i]) < 1e-6,
+        "Invalid oml_ts_value: expected `%.17g', got `%.17g'",
+        timestamps[i], sqlite3_column_double(stmt, 0));
+    fail_unless(sqlite3_column_int(stmt, 1) == seqnos[i],
+        "Invalid oml_seq: expected `%d', got `%d'", seqnos[i], sqlite3_column_int(stmt, 1));
+    fail_unless((uint32_t)sqlite3_column_int64(stmt, 2) == d1 + i,
+        "Invalid size: expected `%" PRIu32 "', got `%" PRId64 "'", d1 + i, sqlite3_column_int64(stmt, 2));
+    fail_unless(sqlite3_column_double(stmt, 3) == d2 * i,
+        "Invalid ratio: expected `%.17g', got `%.17g'", d2 * i, sqlite3_column_double(stmt, 3));
+    fail_if(strcmp(labels[i], (const char*)sqlite3_column_text(stmt, 4)),
+        "Invalid label: expected `%s', got `%s'", labels[i], (const char*)sqlite3_column_text(stmt, 4));
+  }
+  rc = sqlite3_step(stmt);
+  fail_unless(rc == SQLITE_DONE, "Unexpected extra row in `%s'", select);
+
+  sqlite3_finalize(stmt);
+  database_release(db);
+#undef NROWS
+}
+END_TEST
+
+START_TEST(test_binary_dict)
+{
+#define NROWS 4
+  ClientHandler *ch;
+  Database *db;
+  sqlite3_stmt *stmt;
+  SockEvtSource source;
+  OmlStringDict* dict = string_dict_new(OMB_DICT_MAX_SIZE);
+  MBuffer* mbuf = mbuf_create();
+  MBuffer* defs = mbuf_create();
+
+  char domain[] = "binary-dict-test";
+  char dbname[sizeof(domain)+4];
+  char table[] = "dict_table";
+  const char* labels[NROWS] = { "eth0", "eth0", "wlan0", "eth0" };
+  const char* states[NROWS] = { "up", "up", "up", "down" };
+
+  char h[300];
+  char select[200];
+
+  OmlValue v[3];
+  oml_value_array_init(v, LENGTH(v));
+
+  int i, rc = -1;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  /* Remove pre-existing databases */
+  *dbname=0;
+  snprintf(dbname, sizeof(dbname), "%s.sq3", domain);
+  unlink(dbname);
+
+  oml_value_set_type(&v[0], OML_INT32_VALUE);
+  oml_value_set_type(&v[1], OML_STRING_VALUE);
+  oml_value_set_type(&v[2], OML_STRING_VALUE);
+
+  snprintf(h, sizeof(h),  "protocol: %d\ndomain: %s\nstart-time: 1332132092\nsender-id: %s\napp-name: %s\ncontent: binary\nschema: 1 %s n:int32 iface:string state:string\n\n",
+      OMB_DICT_PROTOCOL_VERSION, domain, basename(__FILE__), __FUNCTION__, table);
+  snprintf(select, sizeof(select), "select oml_seq, n, iface, state from %s;", table);
+
+  memset(&source, 0, sizeof(SockEvtSource));
+  source.name = "binary dict socket";
+  ch = check_server_prepare_client_handler("test_binary_dict", &source);
+
+  logdebug("Sending header '%s'\n", h);
+  client_callback(&source, ch, h, strlen(h));
+  fail_unless(ch->state == C_BINARY_DATA, "Inconsistent state: expected %d, got %d", C_BINARY_DATA, ch->state);
+
+  logdebug("Sending %d samples defining, then referring to, strings\n", NROWS - 1);
+  for (i = 0; i < NROWS - 1; i++) {
+    omlc_set_int32(*oml_value_get_value(&v[0]), i);
+    omlc_set_const_string(*oml_value_get_value(&v[1]), labels[i]);
+    omlc_set_const_string(*oml_value_get_value(&v[2]), states[i]);
+    mbuf_clear(mbuf);
+    fail_if(marshal_init(mbuf, OMB_DDATA_P));
+    fail_unless(marshal_measurements(mbuf, 1, i + 1, 1. + i) == 1);
+    fail_unless(marshal_values_dict(mbuf, v, 3, dict) == 1);
+    fail_unless(marshal_finalize(mbuf) == 1);
+    client_callback(&source, ch, mbuf_buffer(mbuf), mbuf_rd_remaining(mbuf));
+    fail_unless(ch->state == C_BINARY_DATA, "Sample %d not accepted", i);
+  }
+
+  database_release(ch->database);
+  check_server_destroy_client_handler(ch);
+
+  logdebug("Sending references to a new connection, after replayed definitions\n");
+  omlc_set_int32(*oml_value_get_value(&v[0]), i);
+  omlc_set_const_string(*oml_value_get_value(&v[1]), labels[i]);
+  omlc_set_const_string(*oml_value_get_value(&v[2]), states[i]);
+  mbuf_clear(mbuf);
+  fail_if(marshal_init(mbuf, OMB_DDATA_P));
+  fail_unless(marshal_measurements(mbuf, 1, i + 1, 1. + i) == 1);
+  fail_unless(marshal_values_dict(mbuf, v, 3, dict) == 1);
+  fail_unless(marshal_finalize(mbuf) == 1);
+  fail_unless(marshal_dict(defs, dict) == 4);
+
+  ch = check_server_prepare_client_handler("test_binary_dict_replay", &source);
+  /* Make it look like a datagram peer, so a protocol error does not free it */
+  ch->event = &ch->peer_event;
+  fail_unless(client_handler_datagram(ch, h, strlen(h)) == 0);
+  /* The sample is discarded, which the recorded data below checks */
+  client_handler_datagram(ch, mbuf_buffer(mbuf), mbuf_rd_remaining(mbuf));
+  database_release(ch->database);
+  check_server_destroy_client_handler(ch);
+
+  ch = check_server_prepare_client_handler("test_binary_dict_replay", &source);
+  client_callback(&source, ch, h, strlen(h));
+  client_callback(&source, ch, mbuf_buffer(defs), mbuf_rd_remaining(defs));
+  fail_unless(ch->state == C_BINARY_DATA, "Dictionary not accepted");
+  client_callback(&source, ch, mbuf_buffer(mbuf), mbuf_rd_remaining(mbuf));
+  fail_unless(ch->state == C_BINARY_DATA, "Sample %d not accepted after the dictionary", i);
+
+  database_release(ch->database);
+  check_server_destroy_client_handler(ch);
+
+  logdebug("Sending dictionary with an older protocol\n");
+  snprintf(h, sizeof(h),  "protocol: %d\ndomain: %s\nstart-time: 1332132092\nsender-id: %s\napp-name: %s\ncontent: binary\nschema: 1 %s n:int32 iface:string state:string\n\n",
+      OMB_DICT_PROTOCOL_VERSION - 1, domain, basename(__FILE__), __FUNCTION__, table);
+  ch = check_server_prepare_client_handler("test_binary_dict_old", &source);
+  ch->event = &ch->peer_event;
+  fail_unless(client_handler_datagram(ch, h, strlen(h)) == 0);
+  fail_unless(ch->state == C_BINARY_DATA, "Inconsistent state: expected %d, got %d", C_BINARY_DATA, ch->state);
+  fail_unless(client_handler_datagram(ch, mbuf_buffer(defs), mbuf_rd_remaining(defs)) == -1,
+      "Dictionary accepted from a protocol %d client", OMB_DICT_PROTOCOL_VERSION - 1);
+
+  database_release(ch->database);
+  check_server_destroy_client_handler(ch);
+  string_dict_destroy(dict);
+  mbuf_destroy(defs);
+  mbuf_destroy(mbuf);
+  oml_value_array_reset(v, LENGTH(v));
+
+  logdebug("Checking recorded data in %s.sq3\n", domain);
+  /* Open database */
+  db = database_find(domain);
+  fail_if(db == NULL || ((Sq3DB*)(db->handle))->conn == NULL , "Cannot open SQLite3 database");
+  rc = sqlite3_prepare_v2(((Sq3DB*)(db->handle))->conn, select, -1, &stmt, 0);
+  fail_unless(rc == 0, "Preparation of statement `%s' failed; rc=%d", select, rc);
+
+  for (i = 0; i < NROWS; i++) {
+    rc = sqlite3_step(stmt);
+    fail_unless(rc == 100, "Step %d of statement `%s' failed; rc=%d", i, select, rc);
+    fail_unless(sqlite3_column_int(stmt, 0) == i + 1,
+        "Invalid oml_seq: expected `%d', got `%d'", i + 1, sqlite3_column_int(stmt, 0));
+    fail_unless(sqlite3_column_int(stmt, 1) == i,
+        "Invalid n: expected `%d', got `%d'", i, sqlite3_column_int(stmt, 1));
+    fail_if(strcmp(labels[i], (const char*)sqlite3_column_text(stmt, 2)),
+        "Invalid iface: expected `%s', got `%s'", labels[i], (const char*)sqlite3_column_text(stmt, 2));
+    fail_if(strcmp(states[i], (const char*)sqlite3_column_text(stmt, 3)),
+        "Invalid state: expected `%s', got `%s'", states[i], (const char*)sqlite3_column_text(stmt, 3));
+  }
+  rc = sqlite3_step(stmt);
+  fail_unless(rc == SQLITE_DONE, "Unexpected extra row in `%s'", select);
+
+  sqlite3_finalize(stmt);
+  database_release(db);
+#undef NROWS
+}
+END_TEST
+
 Suite* binary_protocol_suite (void)
 {
   Suite* s = suite_create ("Binary protocol");
@@ -591,6 +961,12 @@ Suite* binary_protocol_suite (void)
   tcase_add_test (tc_bin_flex, test_binary_metadata);
   suite_add_tcase (s, tc_bin_flex);
 
+  TCase* tc_bin_compact = tcase_create ("Compact encoding");
+  tcase_add_test (tc_bin_compact, test_binary_compact);
+  tcase_add_test (tc_bin_compact, test_binary_block);
+  tcase_add_test (tc_bin_compact, test_binary_dict);
+  suite_add_tcase (s, tc_bin_compact);
+
   return s;
 }
 
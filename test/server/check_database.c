@@ -0,0 +1,432 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file check_database.c
+ * \brief Tests the opening of a Database by concurrent clients, the queue of
+ * samples inserted by its writer thread, including from clients which
+ * disconnect while it is full, and their batching by the SQLite3 adapter.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <check.h>
+#include <sqlite3.h>
+
+#include "ocomm/o_log.h"
+#include "ocomm/o_eventloop.h"
+#include "ocomm/o_socket.h"
+#include "oml_value.h"
+#include "oml_utils.h"
+#include "schema.h"
+#include "database.h"
+#include "sqlite_adapter.h"
+#include "client_handler.h"
+
+/** Numbers of samples inserted in test_database_batch, to exercise all
+ * combinations of batch sizes */
+static int batch_counts[] = { 1, 5, 64, 85, 1000 };
+
+/** Number of threads opening the same database in test_database_find */
+#define NFINDERS 8
+
+/** State of the waiter of test_database_queue */
+static struct {
+  Database* db;
+  int resumed;
+  int depth;
+} dq;
+
+/** Number of samples sent by the client of test_database_close; only half of
+ * them fit in the queue */
+#define CLOSE_SAMPLES 200
+
+/** State of test_database_close */
+static struct {
+  Database* db;
+  DbTable* filler;
+  int client;
+  int connected;
+  int filled;
+  int sent;
+  int ticks;
+} dc;
+
+static void
+on_resume(void* handle)
+{
+  (void)handle;
+  dq.resumed++;
+  dq.depth = database_queue_depth(dq.db);
+  eventloop_terminate(1);
+}
+
+static void
+on_timeout(TimerEvtSource* source, void* handle)
+{
+  (void)source;
+  (void)handle;
+  eventloop_terminate(2);
+}
+
+static void
+on_close_connect(Socket* sock, void* handle)
+{
+  (void)handle;
+  client_handler_new(sock);
+  /* Once the client has closed its end too, the EventLoop gets POLLHUP, and
+   * reads all the remaining data at once */
+  shutdown(socket_get_sockfd(sock), SHUT_WR);
+  dc.connected++;
+}
+
+/** Fill the queue of the database of test_database_close, but for half of
+ * the samples of its client, then send them all, and close the connection */
+static void
+close_fill_and_send(void)
+{
+  OmlValue v;
+  char buf[64];
+  int i, len;
+
+  oml_value_init(&v);
+  oml_value_set_type(&v, OML_UINT32_VALUE);
+  for (i = 0; i < DB_QUEUE_MAX_ROWS - CLOSE_SAMPLES / 2; i++) {
+    omlc_set_uint32(*oml_value_get_value(&v), i);
+    if (database_insert(dc.db, dc.filler, 1, i, (double)i, &v, 1)) {
+      break;
+    }
+    dc.filled++;
+  }
+  oml_value_reset(&v);
+
+  for (i = 0; i < CLOSE_SAMPLES; i++) {
+    len = snprintf(buf, sizeof(buf), "%d\t1\t%d\t%d\n", i, i, i);
+    if (send(dc.client, buf, len, 0) == len) {
+      dc.sent++;
+    }
+  }
+  close(dc.client);
+  dc.client = -1;
+}
+
+static void
+on_close_tick(TimerEvtSource* source, void* handle)
+{
+  (void)source;
+  (void)handle;
+  switch (++dc.ticks) {
+  case 1:
+    /* The headers have been processed; keep the writer from inserting anything */
+    pthread_mutex_lock(&dc.db->lock);
+    close_fill_and_send();
+    break;
+  case 2:
+    /* The client is gone by now; let the writer drain the queue */
+    pthread_mutex_unlock(&dc.db->lock);
+    break;
+  default:
+    if (dc.db->ref_count == 1) {
+      /* The ClientHandler has been freed */
+      eventloop_terminate(1);
+    } else if (dc.ticks > 10) {
+      eventloop_terminate(2);
+    }
+  }
+}
+
+static void*
+find_database(void* arg)
+{
+  return database_find((const char*)arg);
+}
+
+START_TEST(test_database_find)
+{
+  char domain[] = "database-find-test";
+  char dbname[sizeof(domain)+4];
+  pthread_t finders[NFINDERS];
+  Database* dbs[NFINDERS];
+  int i;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  snprintf(dbname, sizeof(dbname), "%s.sq3", domain);
+  unlink(dbname);
+
+  /* The first thread opens the database, the others wait until it is ready */
+  for (i = 0; i < NFINDERS; i++) {
+    fail_if(pthread_create(&finders[i], NULL, find_database, domain), "Cannot start thread %d", i);
+  }
+  for (i = 0; i < NFINDERS; i++) {
+    pthread_join(finders[i], (void**)&dbs[i]);
+    fail_if(dbs[i] == NULL, "Thread %d could not open the database", i);
+    fail_unless(dbs[i] == dbs[0], "Thread %d opened another instance of the database", i);
+  }
+  fail_unless(dbs[0]->ready == 1, "Database returned before it was ready");
+  fail_unless(dbs[0]->ref_count == NFINDERS, "Database has %d references instead of %d",
+      dbs[0]->ref_count, NFINDERS);
+  fail_unless(dbs[0]->queue != NULL, "Database returned before its writer was started");
+
+  for (i = 0; i < NFINDERS; i++) {
+    database_release(dbs[i]);
+  }
+}
+END_TEST
+
+START_TEST(test_database_queue)
+{
+  char domain[] = "database-queue-test";
+  char dbname[sizeof(domain)+4];
+  struct schema* schema;
+  DbTable* table;
+  DbQueueWaiter waiter;
+  TimerEvtSource* timer;
+  sqlite3_stmt *stmt;
+  OmlValue v, bad;
+  int i, rc;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  snprintf(dbname, sizeof(dbname), "%s.sq3", domain);
+  unlink(dbname);
+
+  memset(&dq, 0, sizeof(dq));
+  memset(&waiter, 0, sizeof(waiter));
+  eventloop_init();
+
+  dq.db = database_find(domain);
+  fail_if(dq.db == NULL, "Cannot open database");
+  schema = schema_from_meta("1 queue_table size:uint32");
+  table = database_find_or_create_table(dq.db, schema);
+  schema_free(schema);
+  fail_if(table == NULL, "Cannot create table");
+
+  oml_value_init(&v);
+  oml_value_set_type(&v, OML_UINT32_VALUE);
+  oml_value_init(&bad);
+  oml_value_set_type(&bad, OML_UNKNOWN_VALUE);
+
+  /* Keep the writer from inserting anything while the queue fills up */
+  pthread_mutex_lock(&dq.db->lock);
+
+  /* Samples whose values cannot be copied are not queued */
+  fail_unless(database_insert(dq.db, table, 1, 0, 0., &bad, 1) == -1,
+      "Sample with an uncopiable value not rejected");
+  fail_unless(database_queue_depth(dq.db) == 0,
+      "%d samples queued after a rejected one", database_queue_depth(dq.db));
+
+  for (i = 0; i < DB_QUEUE_MAX_ROWS; i++) {
+    omlc_set_uint32(*oml_value_get_value(&v), i);
+    rc = database_insert(dq.db, table, 1, i, (double)i, &v, 1);
+    if (rc) {
+      break;
+    }
+  }
+  fail_unless(rc == 1, "Queue not full after %d samples", i);
+  fail_unless(i == DB_QUEUE_MAX_ROWS - 1, "Queue full after %d samples instead of %d", i + 1, DB_QUEUE_MAX_ROWS);
+  fail_unless(database_queue_depth(dq.db) == DB_QUEUE_MAX_ROWS,
+      "%d samples queued instead of %d", database_queue_depth(dq.db), DB_QUEUE_MAX_ROWS);
+
+  fail_unless(database_queue_wait(dq.db, &waiter, on_resume, NULL) == 0, "Queue already drained");
+  fail_unless(database_queue_cancel(dq.db, &waiter) == 0, "Waiter not cancelled");
+  fail_unless(database_queue_wait(dq.db, &waiter, on_resume, NULL) == 0, "Queue already drained");
+  pthread_mutex_unlock(&dq.db->lock);
+
+  timer = eventloop_every("database queue test timeout", 5, on_timeout, NULL);
+  fail_unless(eventloop_run() == 1, "Client not resumed after the queue drained");
+  eventloop_timer_stop(timer);
+
+  fail_unless(dq.resumed == 1, "Client resumed %d times", dq.resumed);
+  fail_unless(dq.depth <= DB_QUEUE_MAX_ROWS / 2, "Client resumed with %d samples still queued", dq.depth);
+  fail_unless(database_queue_cancel(dq.db, &waiter) == 0, "Waiter still registered after resuming");
+
+  /* Releasing the database inserts all remaining samples */
+  database_release(dq.db);
+  oml_value_reset(&v);
+
+  dq.db = database_find(domain);
+  fail_if(dq.db == NULL || ((Sq3DB*)(dq.db->handle))->conn == NULL, "Cannot reopen database");
+  rc = sqlite3_prepare_v2(((Sq3DB*)(dq.db->handle))->conn,
+      "select count(*), min(oml_seq), max(oml_seq), sum(size = oml_seq) from queue_table;", -1, &stmt, 0);
+  fail_unless(rc == 0, "Preparation of statement failed; rc=%d", rc);
+  fail_unless(sqlite3_step(stmt) == SQLITE_ROW, "Cannot count samples");
+  fail_unless(sqlite3_column_int(stmt, 0) == DB_QUEUE_MAX_ROWS,
+      "%d samples inserted instead of %d", sqlite3_column_int(stmt, 0), DB_QUEUE_MAX_ROWS);
+  fail_unless(sqlite3_column_int(stmt, 1) == 0 && sqlite3_column_int(stmt, 2) == DB_QUEUE_MAX_ROWS - 1,
+      "Samples %d to %d inserted", sqlite3_column_int(stmt, 1), sqlite3_column_int(stmt, 2));
+  fail_unless(sqlite3_column_int(stmt, 3) == DB_QUEUE_MAX_ROWS, "%d samples corrupted",
+      DB_QUEUE_MAX_ROWS - sqlite3_column_int(stmt, 3));
+  sqlite3_finalize(stmt);
+  database_release(dq.db);
+}
+END_TEST
+
+START_TEST(test_database_close)
+{
+  char domain[] = "database-close-test";
+  char dbname[sizeof(domain)+4];
+  char buf[256];
+  struct schema* schema;
+  struct sockaddr_in sa;
+  Socket *server;
+  TimerEvtSource* timer;
+  sqlite3_stmt *stmt;
+  int len;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  snprintf(dbname, sizeof(dbname), "%s.sq3", domain);
+  unlink(dbname);
+
+  memset(&dc, 0, sizeof(dc));
+  eventloop_init();
+
+  dc.db = database_find(domain);
+  fail_if(dc.db == NULL, "Cannot open database");
+  schema = schema_from_meta("1 filler_table size:uint32");
+  dc.filler = database_find_or_create_table(dc.db, schema);
+  schema_free(schema);
+  fail_if(dc.filler == NULL, "Cannot create table");
+
+  server = socket_server_new("database close test server", "127.0.0.1", "10015", on_close_connect, NULL);
+  fail_if(server == NULL, "Cannot create listening socket");
+
+  /* Only send the headers for now; the samples are sent on the first tick */
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(10015);
+  sa.sin_addr.s_addr = inet_addr("127.0.0.1");
+  dc.client = socket(AF_INET, SOCK_STREAM, 0);
+  fail_if(dc.client < 0 || connect(dc.client, (struct sockaddr*)&sa, sizeof(sa)), "Cannot connect client");
+  len = snprintf(buf, sizeof(buf), "protocol: 4\ndomain: %s\nstart-time: 1332132092\n"
+      "sender-id: %s\napp-name: %s\nschema: 1 close_table size:uint32\n\n",
+      domain, "close-test", __FUNCTION__);
+  fail_unless(send(dc.client, buf, len, 0) == len, "Cannot send headers");
+
+  timer = eventloop_every("database close test timer", 1, on_close_tick, NULL);
+  fail_unless(eventloop_run() == 1, "ClientHandler not freed after the queue drained");
+  eventloop_timer_stop(timer);
+  fail_unless(dc.connected == 1, "%d connections accepted instead of 1", dc.connected);
+  fail_unless(dc.filled == DB_QUEUE_MAX_ROWS - CLOSE_SAMPLES / 2, "Queue full after %d samples", dc.filled);
+  fail_unless(dc.sent == CLOSE_SAMPLES, "%d samples sent instead of %d", dc.sent, CLOSE_SAMPLES);
+  socket_free(server);
+
+  /* Releasing the database inserts all remaining samples */
+  database_release(dc.db);
+
+  dc.db = database_find(domain);
+  fail_if(dc.db == NULL || ((Sq3DB*)(dc.db->handle))->conn == NULL, "Cannot reopen database");
+  fail_unless(sqlite3_prepare_v2(((Sq3DB*)(dc.db->handle))->conn,
+        "select count(*), sum(size = oml_seq) from close_table;", -1, &stmt, 0) == 0,
+      "Preparation of statement failed");
+  fail_unless(sqlite3_step(stmt) == SQLITE_ROW, "Cannot count samples");
+  fail_unless(sqlite3_column_int(stmt, 0) == CLOSE_SAMPLES,
+      "%d samples inserted instead of %d", sqlite3_column_int(stmt, 0), CLOSE_SAMPLES);
+  fail_unless(sqlite3_column_int(stmt, 1) == CLOSE_SAMPLES, "%d samples corrupted",
+      CLOSE_SAMPLES - sqlite3_column_int(stmt, 1));
+  sqlite3_finalize(stmt);
+  database_release(dc.db);
+}
+END_TEST
+
+START_TEST(test_database_batch)
+{
+  char domain[] = "database-batch-test";
+  char dbname[sizeof(domain)+4];
+  char label[64];
+  struct schema* schema;
+  DbTable* table;
+  Database* db;
+  sqlite3_stmt *stmt;
+  OmlValue v[2];
+  int i, rc;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  snprintf(dbname, sizeof(dbname), "%s.sq3", domain);
+  unlink(dbname);
+
+  db = database_find(domain);
+  fail_if(db == NULL, "Cannot open database");
+  schema = schema_from_meta("1 batch_table size:uint32 label:string");
+  table = database_find_or_create_table(db, schema);
+  schema_free(schema);
+  fail_if(table == NULL, "Cannot create table");
+
+  oml_value_array_init(v, 2);
+  oml_value_set_type(&v[0], OML_UINT32_VALUE);
+  oml_value_set_type(&v[1], OML_STRING_VALUE);
+  for (i = 0; i < batch_counts[_i]; i++) {
+    /* Alternate short and long strings, which are not stored the same way */
+    snprintf(label, sizeof(label), i % 2 ? "%d" : "%d with a label too long to be stored inline", i);
+    omlc_set_uint32(*oml_value_get_value(&v[0]), i);
+    omlc_set_const_string(*oml_value_get_value(&v[1]), label);
+    fail_if(database_insert(db, table, 1, i, (double)i, v, 2) < 0, "Cannot insert sample %d", i);
+  }
+  oml_value_array_reset(v, 2);
+
+  /* Releasing the database stores all remaining samples */
+  database_release(db);
+
+  db = database_find(domain);
+  fail_if(db == NULL || ((Sq3DB*)(db->handle))->conn == NULL, "Cannot reopen database");
+  rc = sqlite3_prepare_v2(((Sq3DB*)(db->handle))->conn,
+      "select oml_seq, size, label from batch_table order by oml_seq;", -1, &stmt, 0);
+  fail_unless(rc == 0, "Preparation of statement failed; rc=%d", rc);
+  for (i = 0; sqlite3_step(stmt) == SQLITE_ROW; i++) {
+    snprintf(label, sizeof(label), i % 2 ? "%d" : "%d with a label too long to be stored inline", i);
+    fail_unless(sqlite3_column_int(stmt, 0) == i && sqlite3_column_int(stmt, 1) == i,
+        "Sample %d stored instead of %d", sqlite3_column_int(stmt, 0), i);
+    fail_unless(!strcmp((const char*)sqlite3_column_text(stmt, 2), label),
+        "Sample %d stored with label '%s' instead of '%s'", i, sqlite3_column_text(stmt, 2), label);
+  }
+  fail_unless(i == batch_counts[_i], "%d samples stored instead of %d", i, batch_counts[_i]);
+  sqlite3_finalize(stmt);
+  database_release(db);
+}
+END_TEST
+
+Suite*
+database_suite (void)
+{
+  Suite* s = suite_create ("Database");
+
+  TCase* tc_database_find = tcase_create ("Find");
+  tcase_add_test (tc_database_find, test_database_find);
+  suite_add_tcase (s, tc_database_find);
+
+  TCase* tc_database_queue = tcase_create ("Queue");
+  tcase_add_test (tc_database_queue, test_database_queue);
+  tcase_add_test (tc_database_queue, test_database_close);
+  suite_add_tcase (s, tc_database_queue);
+
+  TCase* tc_database_batch = tcase_create ("Batch");
+  tcase_add_loop_test (tc_database_batch, test_database_batch, 0, LENGTH(batch_counts));
+  suite_add_tcase (s, tc_database_batch);
+
+  return s;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
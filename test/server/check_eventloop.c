@@ -0,0 +1,336 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file check_eventloop.c
+ * \brief Tests the behaviour of the EventLoop with its different backends.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <check.h>
+
+#include "ocomm/o_log.h"
+#include "ocomm/o_socket.h"
+#include "ocomm/o_eventloop.h"
+#include "oml_utils.h"
+#include "mbuf.h"
+
+/** Number of clients connecting in test_eventloop_clients, before the
+ * EventLoop runs (within the backlog of the listening socket) */
+#define NCLIENTS 4
+/** Number of records sent in test_eventloop_buffer, in several chunks */
+#define NRECORDS 8000
+/** Size of each record, chosen so that they straddle reads */
+#define RECORD_SIZE 7
+/** Number of tasks posted in test_eventloop_post */
+#define NTASKS 1000
+
+static EventLoopBackend backends[] = {
+  EVENTLOOP_BACKEND_POLL,
+  EVENTLOOP_BACKEND_EPOLL,
+};
+
+/** State of the connections accepted in test_eventloop_clients */
+static struct {
+  int connected;
+  int closed;
+  size_t received;
+} el;
+
+/** State of the connection accepted in test_eventloop_buffer */
+static struct {
+  MBuffer* mbuf;
+  int records;
+  int errors;
+  size_t received;
+} elb;
+
+/** State of the tasks posted in test_eventloop_post */
+static struct {
+  EventLoop* loop;
+  pthread_t thread;
+  int run;
+  int errors;
+} elp;
+
+static void
+on_read(SockEvtSource* source, void* handle, void* buf, int buf_size)
+{
+  (void)source;
+  (void)handle;
+  (void)buf;
+  el.received += buf_size;
+}
+
+static void
+on_status(SockEvtSource* source, SocketStatus status, int error, void* handle)
+{
+  (void)error;
+
+  if (status == SOCKET_CONN_CLOSED) {
+    eventloop_socket_release(source);
+    socket_free((Socket*)handle);
+    if (++el.closed == NCLIENTS) {
+      eventloop_terminate(1);
+    }
+  }
+}
+
+static void
+on_connect(Socket* sock, void* handle)
+{
+  (void)handle;
+  eventloop_on_read_in_channel(sock, on_read, on_status, sock);
+  el.connected++;
+}
+
+static void
+on_timeout(TimerEvtSource* source, void* handle)
+{
+  (void)source;
+  (void)handle;
+  eventloop_terminate(2);
+}
+
+static void
+on_buffer(SockEvtSource* source, void* handle, MBuffer* mbuf, size_t len)
+{
+  char record[RECORD_SIZE + 1];
+  (void)source;
+  (void)handle;
+
+  if (mbuf != elb.mbuf) {
+    elb.errors++;
+  }
+  elb.received += len;
+
+  /* Only consume complete records, and leave the rest for later */
+  while (mbuf_rd_remaining(mbuf) >= RECORD_SIZE) {
+    snprintf(record, sizeof(record), "%06d\n", elb.records);
+    if (strncmp((char*)mbuf_rdptr(mbuf), record, RECORD_SIZE)) {
+      elb.errors++;
+    }
+    elb.records++;
+    mbuf_read_skip(mbuf, RECORD_SIZE);
+    mbuf_consume_message(mbuf);
+  }
+}
+
+static void
+on_buffer_status(SockEvtSource* source, SocketStatus status, int error, void* handle)
+{
+  (void)error;
+
+  if (status == SOCKET_CONN_CLOSED) {
+    eventloop_socket_release(source);
+    socket_free((Socket*)handle);
+    eventloop_terminate(1);
+  }
+}
+
+static void
+on_buffer_connect(Socket* sock, void* handle)
+{
+  (void)handle;
+  eventloop_on_read_in_buffer(sock, elb.mbuf, on_buffer, on_buffer_status, sock);
+}
+
+static void
+on_task(void* handle)
+{
+  /* Tasks must run in order, in the thread of the EventLoop */
+  if ((long)handle != elp.run || !pthread_equal(pthread_self(), elp.thread)) {
+    elp.errors++;
+  }
+  if (++elp.run == NTASKS) {
+    eventloop_terminate(1);
+  }
+}
+
+static void*
+post_tasks(void* arg)
+{
+  long i;
+  (void)arg;
+
+  for (i = 0; i < NTASKS; i++) {
+    if (eventloop_post(elp.loop, on_task, (void*)i)) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+START_TEST(test_eventloop_clients)
+{
+  Socket *server, *clients[NCLIENTS];
+  TimerEvtSource* timer;
+  char buf[64];
+  size_t sent = 0;
+  int i, len;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  memset(&el, 0, sizeof(el));
+  eventloop_init();
+  if (eventloop_set_backend(backends[_i])) {
+    /* Not available on this system */
+    return;
+  }
+  fail_unless(eventloop_get_backend() == backends[_i], "EventLoop backend not set");
+
+  server = socket_server_new("eventloop test server", "127.0.0.1", "10013", on_connect, NULL);
+  fail_if(server == NULL, "Cannot create listening socket");
+  fail_unless(eventloop_set_backend(EVENTLOOP_BACKEND_POLL),
+      "EventLoop backend changed with channels registered");
+
+  /* Clients connect when first sending, which should not fail straight away */
+  socket_set_non_blocking_mode(0);
+  for (i = 0; i < NCLIENTS; i++) {
+    clients[i] = socket_tcp_out_new("eventloop test client", "127.0.0.1", "10013");
+    fail_if(clients[i] == NULL, "Cannot connect client %d", i);
+    len = snprintf(buf, sizeof(buf), "Hello from client %d\n", i);
+    fail_unless(socket_sendto(clients[i], buf, len) == len, "Cannot send from client %d", i);
+    sent += len;
+  }
+  for (i = 0; i < NCLIENTS; i++) {
+    socket_free(clients[i]);
+  }
+  socket_set_non_blocking_mode(1);
+
+  timer = eventloop_every("eventloop test timeout", 5, on_timeout, NULL);
+  fail_unless(eventloop_run() == 1, "EventLoop timed out");
+  eventloop_timer_stop(timer);
+
+  fail_unless(el.connected == NCLIENTS, "%d connections accepted instead of %d", el.connected, NCLIENTS);
+  fail_unless(el.closed == NCLIENTS, "%d connections closed instead of %d", el.closed, NCLIENTS);
+  fail_unless(el.received == sent, "%d bytes received instead of %d", el.received, sent);
+  fail_unless(eventloop_get_backend() == backends[_i], "EventLoop fell back to another backend");
+
+  socket_free(server);
+}
+END_TEST
+
+START_TEST(test_eventloop_buffer)
+{
+  Socket *server, *client;
+  TimerEvtSource* timer;
+  MBuffer* data = mbuf_create();
+  char record[RECORD_SIZE + 1];
+  int i, chunk;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  memset(&elb, 0, sizeof(elb));
+  elb.mbuf = mbuf_create();
+  for (i = 0; i < NRECORDS; i++) {
+    snprintf(record, sizeof(record), "%06d\n", i);
+    mbuf_write(data, (uint8_t*)record, RECORD_SIZE);
+  }
+
+  eventloop_init();
+  if (eventloop_set_backend(backends[_i])) {
+    /* Not available on this system */
+    return;
+  }
+
+  server = socket_server_new("eventloop test server", "127.0.0.1", "10014", on_buffer_connect, NULL);
+  fail_if(server == NULL, "Cannot create listening socket");
+
+  /* Send odd-sized chunks, all buffered by the kernel until the EventLoop runs */
+  socket_set_non_blocking_mode(0);
+  client = socket_tcp_out_new("eventloop test client", "127.0.0.1", "10014");
+  fail_if(client == NULL, "Cannot connect client");
+  while ((chunk = mbuf_rd_remaining(data)) > 0) {
+    if (chunk > 12345) {
+      chunk = 12345;
+    }
+    fail_unless(socket_sendto(client, (char*)mbuf_rdptr(data), chunk) == chunk, "Cannot send from client");
+    mbuf_read_skip(data, chunk);
+  }
+  socket_free(client);
+  socket_set_non_blocking_mode(1);
+
+  timer = eventloop_every("eventloop test timeout", 5, on_timeout, NULL);
+  fail_unless(eventloop_run() == 1, "EventLoop timed out");
+  eventloop_timer_stop(timer);
+
+  fail_unless(elb.received == mbuf_fill(data), "%d bytes received instead of %d", elb.received, mbuf_fill(data));
+  fail_unless(elb.records == NRECORDS, "%d records received instead of %d", elb.records, NRECORDS);
+  fail_unless(elb.errors == 0, "%d records corrupted", elb.errors);
+  fail_unless(mbuf_rd_remaining(elb.mbuf) == 0, "%d bytes left unprocessed", mbuf_rd_remaining(elb.mbuf));
+
+  socket_free(server);
+  mbuf_destroy(elb.mbuf);
+  mbuf_destroy(data);
+}
+END_TEST
+
+START_TEST(test_eventloop_post)
+{
+  TimerEvtSource* timer;
+  pthread_t poster;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  memset(&elp, 0, sizeof(elp));
+  eventloop_init();
+  if (eventloop_set_backend(backends[_i])) {
+    /* Not available on this system */
+    return;
+  }
+  elp.thread = pthread_self();
+  elp.loop = eventloop_self();
+  fail_if(elp.loop == NULL, "Cannot get a reference to the EventLoop");
+  fail_unless(eventloop_self() == elp.loop, "EventLoop reference changed");
+
+  fail_if(pthread_create(&poster, NULL, post_tasks, NULL), "Cannot start posting thread");
+
+  timer = eventloop_every("eventloop test timeout", 5, on_timeout, NULL);
+  fail_unless(eventloop_run() == 1, "EventLoop timed out after %d tasks", elp.run);
+  eventloop_timer_stop(timer);
+  pthread_join(poster, NULL);
+
+  fail_unless(elp.run == NTASKS, "%d tasks run instead of %d", elp.run, NTASKS);
+  fail_unless(elp.errors == 0, "%d tasks run out of order or in the wrong thread", elp.errors);
+}
+END_TEST
+
+Suite*
+eventloop_suite (void)
+{
+  Suite* s = suite_create ("EventLoop");
+
+  TCase* tc_eventloop_clients = tcase_create ("Clients");
+  tcase_add_loop_test (tc_eventloop_clients, test_eventloop_clients, 0, LENGTH(backends));
+  suite_add_tcase (s, tc_eventloop_clients);
+
+  TCase* tc_eventloop_buffer = tcase_create ("Buffer");
+  tcase_add_loop_test (tc_eventloop_buffer, test_eventloop_buffer, 0, LENGTH(backends));
+  suite_add_tcase (s, tc_eventloop_buffer);
+
+  TCase* tc_eventloop_post = tcase_create ("Post");
+  tcase_add_loop_test (tc_eventloop_post, test_eventloop_post, 0, LENGTH(backends));
+  suite_add_tcase (s, tc_eventloop_post);
+
+  return s;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
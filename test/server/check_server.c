@@ -31,6 +31,7 @@
 #include "ocomm/o_eventloop.h"
 #include "mem.h"
 #include "mbuf.h"
+#include "oml_value.h"
 #include "client_handler.h"
 #include "check_server.h"
 #include "check_server_suites.h"
@@ -48,6 +49,7 @@ check_server_prepare_client_handler(const char* name, SockEvtSource *source) {
 
   ch = (ClientHandler*) oml_malloc(sizeof(ClientHandler));
   fail_if(ch == NULL, "Problem allocating ClientHandler");
+  memset(ch, 0, sizeof(ClientHandler));
 
   ch->state = C_HEADER;
   ch->content = C_TEXT_DATA;
@@ -68,6 +70,17 @@ check_server_prepare_client_handler(const char* name, SockEvtSource *source) {
 void
 check_server_destroy_client_handler(ClientHandler* ch)
 {
+  if (ch->zstrm) {
+    inflateEnd(ch->zstrm);
+    oml_free(ch->zstrm);
+  }
+  if (ch->zbuf)
+    mbuf_destroy(ch->zbuf);
+  if (ch->block_values) {
+    oml_value_array_reset(ch->block_values, ch->block_value_count);
+    oml_free(ch->block_values);
+  }
+  string_dict_destroy(ch->dict);
   mbuf_destroy(ch->mbuf);
   oml_free(ch);
 }
@@ -80,7 +93,9 @@ main (void)
   o_set_log_file ("check_server.oml.log");
   SRunner *sr = srunner_create (text_protocol_suite ());
   srunner_add_suite (sr, binary_protocol_suite ());
-  //  srunner_add_suite (sr, database_suite ()); /* For example ... */
+  srunner_add_suite (sr, udp_protocol_suite ());
+  srunner_add_suite (sr, eventloop_suite ());
+  srunner_add_suite (sr, database_suite ());
 
   srunner_run_all (sr, CK_ENV);
   number_failed += srunner_ntests_failed (sr);
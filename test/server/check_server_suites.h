@@ -28,6 +28,9 @@
 
 extern Suite* text_protocol_suite (void);
 extern Suite* binary_protocol_suite (void);
+extern Suite* udp_protocol_suite (void);
+extern Suite* eventloop_suite (void);
+extern Suite* database_suite (void);
 
 #endif /* CHECK_LIBOML2_SUITES_H__ */
 
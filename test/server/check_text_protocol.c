@@ -19,11 +19,13 @@
 #include <check.h>
 #include <sqlite3.h>
 #include <libgen.h>
+#include <zlib.h>
 
 #include "ocomm/o_log.h"
 #include "oml_utils.h"
 #include "mem.h"
 #include "mbuf.h"
+#include "compress.h"
 #include "database.h"
 #include "client_handler.h"
 #include "sqlite_adapter.h"
@@ -530,6 +532,166 @@ START_TEST(test_text_metadata)
 }
 END_TEST
 
+/** Compress data into a frame as sent by the zlib+tcp transport
+ *
+ * \param frame buffer to fill with the frame
+ * \param size size of frame
+ * \param data data to compress
+ * \return the length of the frame
+ */
+static size_t
+make_compressed_frame(uint8_t *frame, size_t size, const char *data)
+{
+  z_stream strm;
+
+  memset(&strm, 0, sizeof(strm));
+  fail_unless(deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+  strm.next_in = (Bytef*)data;
+  strm.avail_in = strlen(data);
+  strm.next_out = frame + COMPRESS_FRAME_HEADER_SIZE;
+  strm.avail_out = size - COMPRESS_FRAME_HEADER_SIZE;
+  fail_unless(deflate(&strm, Z_FINISH) == Z_STREAM_END);
+  compress_frame_header(frame, strm.total_out);
+  deflateEnd(&strm);
+
+  return COMPRESS_FRAME_HEADER_SIZE + strm.total_out;
+}
+
+START_TEST(test_text_compressed)
+{
+  ClientHandler *ch;
+  Database *db;
+  sqlite3_stmt *stmt;
+  SockEvtSource source;
+
+  char domain[] = "text-compressed-test";
+  char dbname[sizeof(domain)+4];
+  char table[] = "text_table";
+  int exp_seq[] = { 1, 2, 3 };
+  int exp_size[] = { 10, 20, 30 };
+
+  char h[200];
+  char buf[600];
+  uint8_t f1[200], f2[200];
+  size_t l1, l2, hl;
+  char select[200];
+  int rc, i;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  snprintf(dbname, sizeof(dbname), "%s.sq3", domain);
+  unlink(dbname);
+
+  snprintf(h, sizeof(h),  "protocol: 4\ncompression: deflate\ndomain: %s\nstart-time: 1332132092\nsender-id: %s\napp-name: %s\nschema: 1 %s size:uint32\n\n",
+      domain, basename(__FILE__), __FUNCTION__, table);
+  snprintf(select, sizeof(select), "select oml_seq, size from %s;", table);
+
+  l1 = make_compressed_frame(f1, sizeof(f1), "1.0\t1\t1\t10\n2.0\t1\t2\t20\n");
+  l2 = make_compressed_frame(f2, sizeof(f2), "3.0\t1\t3\t30\n");
+
+  memset(&source, 0, sizeof(SockEvtSource));
+  source.name = "text compressed socket";
+  ch = check_server_prepare_client_handler("test_text_compressed", &source);
+
+  /* Headers and the start of the first frame arrive together */
+  hl = strlen(h);
+  memcpy(buf, h, hl);
+  memcpy(buf + hl, f1, 3);
+  client_callback(&source, ch, buf, hl + 3);
+  fail_unless(ch->state == C_TEXT_DATA, "Inconsistent state: expected %d, got %d", C_TEXT_DATA, ch->state);
+  fail_if(ch->zstrm == NULL, "Compression not enabled");
+
+  /* Then the end of the first frame with the second one */
+  memcpy(buf, f1 + 3, l1 - 3);
+  memcpy(buf + l1 - 3, f2, l2);
+  client_callback(&source, ch, buf, l1 - 3 + l2);
+  fail_unless(ch->state == C_TEXT_DATA, "Inconsistent state: expected %d, got %d", C_TEXT_DATA, ch->state);
+
+  database_release(ch->database);
+  check_server_destroy_client_handler(ch);
+
+  logdebug("Checking recorded data in %s.sq3\n", domain);
+  db = database_find(domain);
+  fail_if(db == NULL || ((Sq3DB*)(db->handle))->conn == NULL , "Cannot open SQLite3 database");
+  rc = sqlite3_prepare_v2(((Sq3DB*)(db->handle))->conn, select, -1, &stmt, 0);
+  fail_unless(rc == 0, "Preparation of statement `%s' failed; rc=%d", select, rc);
+
+  for (i = 0; i < LENGTH(exp_seq); i++) {
+    rc = sqlite3_step(stmt);
+    fail_unless(rc == SQLITE_ROW, "Step %d of statement `%s' failed; rc=%d", i, select, rc);
+    fail_unless(sqlite3_column_int(stmt, 0) == exp_seq[i],
+        "Invalid oml_seq in row %d: expected %d, got %d",
+        i, exp_seq[i], sqlite3_column_int(stmt, 0));
+    fail_unless(sqlite3_column_int(stmt, 1) == exp_size[i],
+        "Invalid size in row %d: expected %d, got %d",
+        i, exp_size[i], sqlite3_column_int(stmt, 1));
+  }
+  rc = sqlite3_step(stmt);
+  fail_unless(rc == SQLITE_DONE, "Unexpected extra row in `%s'; rc=%d", select, rc);
+
+  sqlite3_finalize(stmt);
+  database_release(db);
+}
+END_TEST
+
+START_TEST(test_text_compressed_overflow)
+{
+  ClientHandler *ch;
+  SockEvtSource source;
+  z_stream strm;
+
+  char h[200];
+  char *buf;
+  uint8_t in[16384];
+  size_t hl, n, left, size = 64 * 1024;
+  int ret = Z_OK;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  snprintf(h, sizeof(h),  "protocol: 4\ncompression: deflate\ndomain: text-compressed-overflow-test\nstart-time: 1332132092\nsender-id: %s\napp-name: %s\nschema: 1 overflow_table size:uint32\n\n",
+      basename(__FILE__), __FUNCTION__);
+  hl = strlen(h);
+  buf = malloc(hl + size);
+  fail_if(buf == NULL);
+  memcpy(buf, h, hl);
+
+  /* A small frame decompressing to one byte more than allowed */
+  memset(in, 'a', sizeof(in));
+  memset(&strm, 0, sizeof(strm));
+  fail_unless(deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+  strm.next_out = (Bytef*)buf + hl + COMPRESS_FRAME_HEADER_SIZE;
+  strm.avail_out = size - COMPRESS_FRAME_HEADER_SIZE;
+  for (left = COMPRESS_MAX_INFLATED_SIZE + 1; left > 0; left -= n) {
+    n = (left < sizeof(in)) ? left : sizeof(in);
+    strm.next_in = in;
+    strm.avail_in = n;
+    ret = deflate(&strm, (left == n) ? Z_FINISH : Z_NO_FLUSH);
+    fail_unless(ret != Z_STREAM_ERROR && strm.avail_in == 0, "Compressed frame larger than %dB", size);
+  }
+  fail_unless(ret == Z_STREAM_END, "Compressed frame larger than %dB", size);
+  compress_frame_header((uint8_t*)buf + hl, strm.total_out);
+
+  memset(&source, 0, sizeof(SockEvtSource));
+  source.name = "text compressed overflow socket";
+  ch = check_server_prepare_client_handler("test_text_compressed_overflow", &source);
+  /* Make it look like a datagram peer, so a protocol error does not free it */
+  ch->event = &ch->peer_event;
+  ch->peer_event.name = source.name;
+
+  client_callback(&source, ch, buf, hl + COMPRESS_FRAME_HEADER_SIZE + strm.total_out);
+  fail_unless(ch->state == C_PROTOCOL_ERROR, "Oversized frame accepted: expected state %d, got %d", C_PROTOCOL_ERROR, ch->state);
+  fail_unless(mbuf_fill(ch->mbuf) <= COMPRESS_MAX_INFLATED_SIZE,
+      "Decompressed %dB, more than the %dB allowed", mbuf_fill(ch->mbuf), COMPRESS_MAX_INFLATED_SIZE);
+
+  deflateEnd(&strm);
+  free(buf);
+  database_release(ch->database);
+  check_server_destroy_client_handler(ch);
+}
+END_TEST
+
 Suite*
 text_protocol_suite (void)
 {
@@ -548,6 +710,11 @@ text_protocol_suite (void)
   tcase_add_test (tc_text_flex, test_text_metadata);
   suite_add_tcase (s, tc_text_flex);
 
+  TCase* tc_text_compressed = tcase_create ("Text compression");
+  tcase_add_test (tc_text_compressed, test_text_compressed);
+  tcase_add_test (tc_text_compressed, test_text_compressed_overflow);
+  suite_add_tcase (s, tc_text_compressed);
+
   return s;
 }
 
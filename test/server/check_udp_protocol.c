@@ -0,0 +1,141 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file check_udp_protocol.c
+ * \brief Tests behaviour and issues related to the reception of datagrams.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <check.h>
+#include <sqlite3.h>
+#include <libgen.h>
+
+#include "ocomm/o_log.h"
+#include "ocomm/o_socket.h"
+#include "oml_utils.h"
+#include "database.h"
+#include "sqlite_adapter.h"
+#include "udp_listener.h"
+#include "check_server.h"
+
+extern char *dbbackend;
+extern char *sqlite_database_dir;
+
+/** Fill a sockaddr_t for a peer on the loopback interface */
+static socklen_t
+make_peer_addr(sockaddr_t* addr, int port)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sa_in.sin_family = AF_INET;
+  addr->sa_in.sin_port = htons(port);
+  addr->sa_in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  return sizeof(struct sockaddr_in);
+}
+
+START_TEST(test_udp_peers)
+{
+  Socket listener = { "udp test socket", NULL, NULL };
+  sockaddr_t a, b;
+  socklen_t a_len, b_len;
+  Database *db;
+  sqlite3_stmt *stmt;
+
+  char domain[] = "udp-test";
+  char dbname[sizeof(domain)+4];
+  char table[] = "udp_table";
+  /* Sequence number 3 is lost; 5 is sent by a peer without headers;
+   * the client is then restarted, sending sequence number 1 again */
+  int exp_seq[] = { 1, 2, 4, 1 };
+  int exp_size[] = { 10, 20, 40, 100 };
+
+  char h[200];
+  char s[100];
+  char select[200];
+  int rc, i;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  snprintf(dbname, sizeof(dbname), "%s.sq3", domain);
+  unlink(dbname);
+
+  a_len = make_peer_addr(&a, 10001);
+  b_len = make_peer_addr(&b, 10002);
+
+  snprintf(h, sizeof(h),  "protocol: 4\ndomain: %s\nstart-time: 1332132092\nsender-id: %s\napp-name: %s\nschema: 1 %s size:uint32\n\n",
+      domain, basename(__FILE__), __FUNCTION__, table);
+  snprintf(select, sizeof(select), "select oml_seq, size from %s;", table);
+
+  udp_listener_datagram(&listener, &a, a_len, h, strlen(h), NULL);
+
+  snprintf(s, sizeof(s), "1.0\t1\t1\t10\n2.0\t1\t2\t20\n");
+  udp_listener_datagram(&listener, &a, a_len, s, strlen(s), NULL);
+  snprintf(s, sizeof(s), "4.0\t1\t4\t40\n");
+  udp_listener_datagram(&listener, &a, a_len, s, strlen(s), NULL);
+
+  snprintf(s, sizeof(s), "5.0\t1\t5\t50\n");
+  udp_listener_datagram(&listener, &b, b_len, s, strlen(s), NULL);
+
+  udp_listener_datagram(&listener, &a, a_len, h, strlen(h), NULL);
+  snprintf(s, sizeof(s), "1.0\t1\t1\t100\n");
+  udp_listener_datagram(&listener, &a, a_len, s, strlen(s), NULL);
+
+  udp_listener_cleanup();
+
+  logdebug("Checking recorded data in %s.sq3\n", domain);
+  db = database_find(domain);
+  fail_if(db == NULL || ((Sq3DB*)(db->handle))->conn == NULL , "Cannot open SQLite3 database");
+  rc = sqlite3_prepare_v2(((Sq3DB*)(db->handle))->conn, select, -1, &stmt, 0);
+  fail_unless(rc == 0, "Preparation of statement `%s' failed; rc=%d", select, rc);
+
+  for (i = 0; i < LENGTH(exp_seq); i++) {
+    rc = sqlite3_step(stmt);
+    fail_unless(rc == SQLITE_ROW, "Step %d of statement `%s' failed; rc=%d", i, select, rc);
+    fail_unless(sqlite3_column_int(stmt, 0) == exp_seq[i],
+        "Invalid oml_seq in row %d: expected %d, got %d",
+        i, exp_seq[i], sqlite3_column_int(stmt, 0));
+    fail_unless(sqlite3_column_int(stmt, 1) == exp_size[i],
+        "Invalid size in row %d: expected %d, got %d",
+        i, exp_size[i], sqlite3_column_int(stmt, 1));
+  }
+  rc = sqlite3_step(stmt);
+  fail_unless(rc == SQLITE_DONE, "Unexpected extra row in `%s'; rc=%d", select, rc);
+
+  sqlite3_finalize(stmt);
+  database_release(db);
+}
+END_TEST
+
+Suite*
+udp_protocol_suite (void)
+{
+  Suite* s = suite_create ("UDP protocol");
+
+  dbbackend = "sqlite";
+  sqlite_database_dir = ".";
+
+  TCase* tc_udp_peers = tcase_create ("UDP peers");
+  tcase_add_test (tc_udp_peers, test_udp_peers);
+  suite_add_tcase (s, tc_udp_peers);
+
+  return s;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/